@@ -0,0 +1,548 @@
+#include "cnn.h"
+#include "inference_server.h"
+#include "simd.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <new>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+/* ======================
+    Allocation counter
+   ======================*/
+// 計測中に確保されたバイト数を数える
+namespace {
+std::atomic<bool> countingAllocation(false);
+std::atomic<size_t> numAllocatedBytes(0);
+}
+
+void* operator new(std::size_t size)
+{
+    if(countingAllocation.load(std::memory_order_relaxed)){
+        numAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if(void* ptr = std::malloc(size == 0 ? 1 : size)){
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace {
+
+/* ======================
+    Benchmark
+   ======================*/
+struct BenchResult
+{
+    std::string layerName;
+    std::string params;  // JSONのオブジェクト
+    std::string op;
+    long iterations;
+    double nsPerOp;
+    double gflops;
+    double bytesPerOp;
+    std::string extra;  // 追加のJSONフィールド(", \"key\": value"の形)
+};
+
+double minTime = 0.2;  // 1つの計測に使う秒数
+std::vector<BenchResult> results;
+
+// 1回あたりの時間と確保量を測る
+// 時間が短すぎないよう、minTime秒を超えるまで回数を倍にしていく
+void measure(const std::string& layerName, const std::string& params, const std::string& op,
+             double flop, const std::function<void()>& func)
+{
+    using Clock = std::chrono::steady_clock;
+    // ウォームアップ(作業領域の確保などを計測から除く)
+    func();
+
+    long iterations = 1;
+    double elapsed = 0;
+    size_t bytes = 0;
+    while(true){
+        numAllocatedBytes = 0;
+        countingAllocation = true;
+        auto begin = Clock::now();
+        for(long i = 0; i < iterations; i++){
+            func();
+        }
+        auto end = Clock::now();
+        countingAllocation = false;
+        bytes = numAllocatedBytes;
+        elapsed = std::chrono::duration<double>(end - begin).count();
+        if(minTime <= elapsed){
+            break;
+        }
+        iterations *= 2;
+    }
+
+    BenchResult result;
+    result.layerName = layerName;
+    result.params = params;
+    result.op = op;
+    result.iterations = iterations;
+    result.nsPerOp = elapsed * 1e9 / iterations;
+    result.gflops = flop * iterations / elapsed * 1e-9;
+    result.bytesPerOp = static_cast<double>(bytes) / iterations;
+    results.emplace_back(result);
+
+    std::cout << std::left << std::setw(12) << layerName << std::setw(18) << op
+              << std::setw(90) << params << std::right
+              << std::setw(14) << std::fixed << std::setprecision(1) << result.nsPerOp << " ns/op"
+              << std::setw(10) << std::setprecision(3) << result.gflops << " GFLOP/s"
+              << std::setw(12) << std::setprecision(0) << result.bytesPerOp << " B/op"
+              << std::endl;
+}
+
+std::vector<float> randomVector(size_t size, std::mt19937& mt)
+{
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> vec(size);
+    for(auto& elem : vec){
+        elem = rd(mt);
+    }
+    return vec;
+}
+
+std::string shapeParams(DataSize size, int numChannel, const std::string& extra = "")
+{
+    std::ostringstream oss;
+    oss << "{\"width\": " << size.first << ", \"height\": " << size.second
+        << ", \"channels\": " << numChannel << extra << "}";
+    return oss.str();
+}
+
+// apply, updateWeightを1サンプルずつ、batchSizeサンプルまとめての両方で測る
+void benchLayer(const std::string& layerName, Layer& layer, DataSize size, int numChannel,
+                const std::string& params, int batchSize = 8)
+{
+    layer.setInputInfo(size, numChannel);
+    layer.calcOutputSize();
+    layer.initWeight();
+
+    std::mt19937 mt(1);
+    auto input = randomVector(layer.getInputDataSize(), mt);
+    auto output = layer.apply(input);
+    // 勾配が大きくなりすぎないよう、小さな誤差を流す
+    auto propError = randomVector(output.size(), mt);
+    for(auto& elem : propError){
+        elem *= 1e-3;
+    }
+
+    measure(layerName, params, "apply", layer.getForwardFlop(), [&](){
+        layer.apply(input);
+    });
+    measure(layerName, params, "updateWeight", layer.getBackwardFlop(), [&](){
+        layer.updateWeight(input, output, propError);
+    });
+    layer.flush();
+
+    auto batchInput = randomVector(static_cast<size_t>(layer.getInputDataSize()) * batchSize, mt);
+    auto batchOutput = layer.applyBatch(batchInput, batchSize);
+    auto batchPropError = randomVector(batchOutput.size(), mt);
+    for(auto& elem : batchPropError){
+        elem *= 1e-3;
+    }
+    measure(layerName, params, "applyBatch", layer.getForwardFlop() * batchSize, [&](){
+        layer.applyBatch(batchInput, batchSize);
+    });
+    measure(layerName, params, "updateWeightBatch", layer.getBackwardFlop() * batchSize, [&](){
+        layer.updateWeightBatch(batchInput, batchOutput, batchPropError, batchSize);
+    });
+    layer.flush();
+
+    // int8に量子化した重みでの推論(入力は[-1, 1])
+    if(layer.isQuantizable()){
+        layer.quantize(1.0F);
+        measure(layerName, params, "applyInt8", layer.getForwardFlop(), [&](){
+            layer.forwardQuantized(input.data(), output.data());
+        });
+    }
+
+    // 16bitの重みでの推論(対応している層だけ)
+    layer.setWeightType(TensorType::BFLOAT16);
+    if(layer.getWeightType() == TensorType::BFLOAT16){
+        measure(layerName, params, "applyBf16", layer.getForwardFlop(), [&](){
+            layer.forward(input.data(), output.data());
+        });
+        layer.setWeightType(TensorType::FLOAT32);
+    }
+}
+
+void benchConvolution()
+{
+    for(int inSize : {8, 32, 64}){
+        for(int numChannel : {1, 8, 32}){
+            for(auto [windowSize, zeroPad] : {std::pair(1, 0), std::pair(3, 1), std::pair(5, 2)}){
+                const int numOutChannel = std::max(8, numChannel);
+                ConvolutionLayer layer(zeroPad, windowSize, numOutChannel);
+                std::ostringstream extra;
+                extra << ", \"windowSize\": " << windowSize << ", \"zeroPad\": " << zeroPad
+                      << ", \"outChannels\": " << numOutChannel;
+                benchLayer("Convolution", layer, DataSize(inSize, inSize), numChannel,
+                           shapeParams(DataSize(inSize, inSize), numChannel, extra.str()));
+            }
+        }
+    }
+}
+
+void benchPooling()
+{
+    for(int inSize : {8, 32, 64}){
+        for(int numChannel : {1, 16}){
+            for(auto [windowSize, zeroPad] : {std::pair(2, 0), std::pair(3, 1)}){
+                PoolingLayer layer(zeroPad, windowSize);
+                std::ostringstream extra;
+                extra << ", \"windowSize\": " << windowSize << ", \"zeroPad\": " << zeroPad;
+                benchLayer("Pooling", layer, DataSize(inSize, inSize), numChannel,
+                           shapeParams(DataSize(inSize, inSize), numChannel, extra.str()));
+            }
+        }
+    }
+}
+
+void benchReLU()
+{
+    for(int inSize : {8, 32, 64}){
+        for(int numChannel : {1, 16}){
+            ReLULayer layer;
+            benchLayer("ReLU", layer, DataSize(inSize, inSize), numChannel,
+                       shapeParams(DataSize(inSize, inSize), numChannel));
+        }
+    }
+}
+
+void benchFullConnect()
+{
+    for(int inSize : {8, 32}){
+        for(int numChannel : {1, 16}){
+            // 1024は重みがキャッシュに収まらず、メモリ帯域で律速する
+            for(int outSize : {10, 256, 1024}){
+                FullConnectLayer layer(DataSize(outSize, 1));
+                std::ostringstream extra;
+                extra << ", \"outSize\": " << outSize;
+                benchLayer("FullConnect", layer, DataSize(inSize, inSize), numChannel,
+                           shapeParams(DataSize(inSize, inSize), numChannel, extra.str()));
+            }
+        }
+    }
+}
+
+void benchSoftmax()
+{
+    for(int inSize : {10, 100, 1000}){
+        SoftmaxLayer layer;
+        benchLayer("Softmax", layer, DataSize(inSize, 1), 1,
+                   shapeParams(DataSize(inSize, 1), 1));
+    }
+}
+
+void benchSigmoid()
+{
+    for(int inSize : {10, 100, 1000}){
+        SigmoidLayer layer;
+        benchLayer("Sigmoid", layer, DataSize(inSize, 1), 1,
+                   shapeParams(DataSize(inSize, 1), 1));
+    }
+}
+
+void benchStandardize()
+{
+    for(int inSize : {8, 32}){
+        for(int numBatch : {1, 8}){
+            StandardizeLayer layer(numBatch);
+            std::ostringstream extra;
+            extra << ", \"numBatch\": " << numBatch;
+            benchLayer("Standardize", layer, DataSize(inSize, inSize), 8,
+                       shapeParams(DataSize(inSize, inSize), 8, extra.str()));
+        }
+    }
+}
+
+// 全結合層が中心のネットワークを、backPropagateParallelで学習する速さ
+// ミニバッチごとにflushする場合と、Hogwildで直接重みを更新する場合を比べる
+void benchTraining()
+{
+    constexpr int NUM_SAMPLE = 64;
+    const int numThread = std::max(1U, std::thread::hardware_concurrency());
+    for(auto mode : {UpdateMode::MINIBATCH, UpdateMode::HOGWILD}){
+        DeepNetwork net(8);
+        net.setInputInfo(DataSize(256, 1), 1);
+        std::vector<std::shared_ptr<Layer>> layers = {
+            std::make_shared<FullConnectLayer>(DataSize(256, 1)),
+            std::make_shared<ReLULayer>(),
+            std::make_shared<FullConnectLayer>(DataSize(256, 1)),
+            std::make_shared<ReLULayer>(),
+            std::make_shared<FullConnectLayer>(DataSize(10, 1)),
+            std::make_shared<SoftmaxLayer>()
+        };
+        for(auto& layer : layers){
+            net.addLayer(layer);
+        }
+        net.setNumThread(numThread);
+        net.setUpdateMode(mode);
+        double flop = 0;
+        for(const auto& layer : layers){
+            flop += layer->getForwardFlop() + layer->getBackwardFlop();
+        }
+
+        std::mt19937 mt(1);
+        std::vector<std::vector<float>> inputs, correctOutputs;
+        for(int i = 0; i < NUM_SAMPLE; i++){
+            inputs.emplace_back(randomVector(256, mt));
+            correctOutputs.emplace_back(10);
+            correctOutputs.back().at(i % 10) = 1;
+        }
+        std::ostringstream params;
+        params << "{\"inSize\": 256, \"hidden\": 256, \"threads\": " << numThread
+               << ", \"minibatchSize\": 8, \"samples\": " << NUM_SAMPLE << "}";
+        measure("Network", params.str(),
+                mode == UpdateMode::HOGWILD ? "trainHogwild" : "trainMinibatch",
+                flop * NUM_SAMPLE, [&](){
+            net.backPropagateParallel(inputs, correctOutputs, 0.1);
+        });
+    }
+}
+
+// 深い畳み込みの積み重ねを、勾配チェックポイントの有無で学習する
+// 1サンプルあたりの時間と、学習で1スレッドが使う作業領域の大きさ(workspaceBytes)を比べる
+void benchCheckpoint()
+{
+    constexpr int NUM_CONV = 16;
+    constexpr int NUM_CHANNEL = 16;
+    const DataSize size(32, 32);
+    for(bool checkpoint : {false, true}){
+        DeepNetwork net(8);
+        net.setInputInfo(size, NUM_CHANNEL);
+        std::vector<std::shared_ptr<Layer>> layers;
+        for(int i = 0; i < NUM_CONV; i++){
+            layers.emplace_back(std::make_shared<ConvolutionLayer>(1, 3, NUM_CHANNEL));
+            layers.emplace_back(std::make_shared<ReLULayer>());
+        }
+        layers.emplace_back(std::make_shared<FullConnectLayer>(DataSize(10, 1)));
+        layers.emplace_back(std::make_shared<SigmoidLayer>());
+        // 順伝播のやり直しは含めず、同じ学習に必要な演算の回数で比べる
+        double flop = 0;
+        for(auto& layer : layers){
+            net.addLayer(layer);
+            flop += layer->getForwardFlop() + layer->getBackwardFlop();
+        }
+        net.setCheckpointMode(checkpoint);
+        net.compile();
+
+        std::mt19937 mt(1);
+        const auto input = randomVector(size.first * size.second * NUM_CHANNEL, mt);
+        std::vector<float> correctOutput(10);
+        correctOutput.at(0) = 1;
+        std::ostringstream params;
+        params << "{\"width\": " << size.first << ", \"height\": " << size.second
+               << ", \"channels\": " << NUM_CHANNEL << ", \"convLayers\": " << NUM_CONV << "}";
+        measure("Network", params.str(), checkpoint ? "trainCheckpoint" : "trainFullStorage",
+                flop, [&](){
+            net.backPropagate(input, correctOutput, 0.1);
+        });
+        const size_t workspaceBytes = net.getTrainWorkspaceSize(1) * sizeof(float);
+        results.back().extra = ", \"workspaceBytes\": " + std::to_string(workspaceBytes);
+        std::cout << "    workspace: " << workspaceBytes << " B" << std::endl;
+    }
+}
+
+// flushで行う最適化手法の1ステップ(L2正則化込み)を、全結合層1つ分のパラメータで測る
+// パラメータと状態を1回ずつ読み書きするだけなので、メモリ帯域で律速する
+void benchOptimizer()
+{
+    constexpr size_t SIZE = 1024 * 1024;
+    std::mt19937 mt(1);
+    auto param = randomVector(SIZE, mt);
+    const auto grad = randomVector(SIZE, mt);
+    struct Case
+    {
+        OptimizerType type;
+        const char* name;
+        double flopPerParam;
+    };
+    for(const auto& c : {Case{OptimizerType::SGD, "sgd", 4},
+                         Case{OptimizerType::MOMENTUM, "momentum", 6},
+                         Case{OptimizerType::ADAM, "adam", 15}}){
+        OptimizerConfig config;
+        config.type = c.type;
+        // 計測中に重みが発散しないよう、小さな学習率にする
+        config.learningRate = 1e-6F;
+        OptimizerState state;
+        state.reset(config, SIZE);
+        std::ostringstream params;
+        params << "{\"size\": " << SIZE << ", \"optimizer\": \"" << c.name << "\"}";
+        measure("Optimizer", params.str(), "step", c.flopPerParam * SIZE, [&](){
+            state.step(config, param.data(), grad.data(), SIZE, 1.0F, 1.0F);
+        });
+    }
+}
+
+// numClient個のスレッドが、1要求ずつ投げては結果を待つことを繰り返す
+// 1要求あたりの時間(スループットの逆数)と、要求を投げてから結果を受け取るまでの時間の分布を測る
+void benchServer()
+{
+    constexpr int NUM_CLIENT = 16;
+    // モデルは1つだけ作り、コアごとのワーカーで共有する
+    const int numWorker = std::max(1U, std::thread::hardware_concurrency());
+    auto model = std::make_shared<DeepNetwork>();
+    auto& net = *model;
+    net.setInputInfo(DataSize(1024, 1), 1);
+    std::vector<std::shared_ptr<Layer>> layers = {
+        std::make_shared<FullConnectLayer>(DataSize(1024, 1)),
+        std::make_shared<ReLULayer>(),
+        std::make_shared<FullConnectLayer>(DataSize(1024, 1)),
+        std::make_shared<ReLULayer>(),
+        std::make_shared<FullConnectLayer>(DataSize(10, 1)),
+        std::make_shared<SoftmaxLayer>()
+    };
+    for(auto& layer : layers){
+        net.addLayer(layer);
+    }
+    net.compile();
+    double flop = 0;
+    for(const auto& layer : layers){
+        flop += layer->getForwardFlop();
+    }
+    std::mt19937 mt(1);
+    const auto input = randomVector(net.getInputDataSize(), mt);
+
+    // maxBatchSize = 1は1要求ずつ順に処理するのと同じ
+    for(auto [maxBatchSize, maxDelayUs] : {std::pair(1, 0), std::pair(8, 100), std::pair(8, 1000),
+                                           std::pair(32, 100), std::pair(32, 1000)}){
+        InferenceServer server(model, numWorker, maxBatchSize, std::chrono::microseconds(maxDelayUs));
+        std::vector<std::vector<double>> latencies(NUM_CLIENT);
+        std::atomic<bool> finished(false);
+        numAllocatedBytes = 0;
+        countingAllocation = true;
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> clients;
+        for(int c = 0; c < NUM_CLIENT; c++){
+            clients.emplace_back([&, c](){
+                while(!finished){
+                    auto submitTime = std::chrono::steady_clock::now();
+                    server.submit(input).get();
+                    auto end = std::chrono::steady_clock::now();
+                    latencies.at(c).push_back(std::chrono::duration<double>(end - submitTime).count());
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(minTime));
+        finished = true;
+        for(auto& client : clients){
+            client.join();
+        }
+        auto end = std::chrono::steady_clock::now();
+        countingAllocation = false;
+
+        std::vector<double> allLatencies;
+        for(const auto& latency : latencies){
+            allLatencies.insert(std::end(allLatencies), std::begin(latency), std::end(latency));
+        }
+        std::sort(std::begin(allLatencies), std::end(allLatencies));
+        auto percentile = [&](double p){
+            return allLatencies.at(std::min(allLatencies.size() - 1,
+                                            static_cast<size_t>(p * allLatencies.size()))) * 1e6;
+        };
+        const long numRequest = allLatencies.size();
+        const double elapsed = std::chrono::duration<double>(end - begin).count();
+
+        BenchResult result;
+        result.layerName = "Server";
+        std::ostringstream params;
+        params << "{\"inSize\": 1024, \"hidden\": 1024, \"clients\": " << NUM_CLIENT
+               << ", \"workers\": " << numWorker << ", \"maxBatchSize\": " << maxBatchSize << ", \"maxDelayUs\": " << maxDelayUs << "}";
+        result.params = params.str();
+        result.op = "submit";
+        result.iterations = numRequest;
+        result.nsPerOp = elapsed * 1e9 / numRequest;
+        result.gflops = flop * numRequest / elapsed * 1e-9;
+        result.bytesPerOp = static_cast<double>(numAllocatedBytes) / numRequest;
+        std::ostringstream extra;
+        extra << ", \"meanBatchSize\": " << static_cast<double>(server.getNumRequest()) / server.getNumBatch()
+              << ", \"p50LatencyUs\": " << percentile(0.5) << ", \"p99LatencyUs\": " << percentile(0.99);
+        result.extra = extra.str();
+        results.emplace_back(result);
+
+        std::cout << std::left << std::setw(12) << result.layerName << std::setw(18) << result.op
+                  << std::setw(90) << result.params << std::right
+                  << std::setw(14) << std::fixed << std::setprecision(1) << result.nsPerOp << " ns/op"
+                  << std::setw(10) << std::setprecision(3) << result.gflops << " GFLOP/s"
+                  << std::setw(12) << std::setprecision(0) << result.bytesPerOp << " B/op"
+                  << std::setw(10) << std::setprecision(1) << percentile(0.99) << " us p99"
+                  << std::endl;
+    }
+}
+
+bool writeJson(const std::string& filename)
+{
+    std::ofstream ofs(filename);
+    if(ofs.fail()){
+        std::cerr << "failed to open file " << filename << std::endl;
+        return false;
+    }
+    ofs << "{\n  \"simdLevel\": " << static_cast<int>(getSimdLevel()) << ",\n"
+        << "  \"minTime\": " << minTime << ",\n"
+        << "  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); i++){
+        const auto& result = results.at(i);
+        ofs << "    {\"layer\": \"" << result.layerName << "\", \"op\": \"" << result.op
+            << "\", \"params\": " << result.params
+            << ", \"iterations\": " << result.iterations
+            << ", \"nsPerOp\": " << result.nsPerOp
+            << ", \"gflops\": " << result.gflops
+            << ", \"bytesAllocatedPerOp\": " << result.bytesPerOp << result.extra << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    ofs << "  ]\n}\n";
+    return true;
+}
+
+}
+
+// 使い方: benchmark [出力するJSONファイル] [1つの計測に使う秒数]
+int main(int argc, char* argv[])
+{
+    std::string outputFile = "bench_result.json";
+    if(1 < argc){
+        outputFile = argv[1];
+    }
+    if(2 < argc){
+        minTime = std::stod(argv[2]);
+    }
+
+    benchConvolution();
+    benchPooling();
+    benchReLU();
+    benchFullConnect();
+    benchSoftmax();
+    benchSigmoid();
+    benchStandardize();
+    benchTraining();
+    benchCheckpoint();
+    benchOptimizer();
+    benchServer();
+
+    if(!writeJson(outputFile)){
+        return 1;
+    }
+    std::cout << "results are written to " << outputFile << std::endl;
+    return 0;
+}
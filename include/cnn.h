@@ -1,8 +1,13 @@
 #pragma once
 #include "layer.h"
-#include <list>
+#include "thread_pool.h"
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <ostream>
+#include <random>
 
 enum class LossFunction
 {
@@ -10,6 +15,68 @@ enum class LossFunction
     CRS_ENT  // クロスエントロピー
 };
 
+enum class InferenceMode
+{
+    FLOAT32,
+    INT8  // 量子化した層はint8の重みで計算する
+};
+
+// 学習で重みを更新する方法
+enum class UpdateMode
+{
+    MINIBATCH,  // 勾配をスレッドごとのシャードに蓄積し、ミニバッチごとにflushで重みに足す
+    // Hogwild: 各サンプルの逆伝播で、ロックを取らずに直接重みを更新する。ミニバッチの区切りはない
+    // スレッドが同時に同じ重みを書き換えると更新が失われることがあるが、
+    // 勾配が疎な(各サンプルが重みの一部しか大きく動かさない)モデルでは収束への影響が小さい
+    HOGWILD
+};
+
+// 層ごとのプロファイル
+// 時間は秒。FLOPとバイト数は、層の1サンプルあたりの見積もりに処理したサンプル数を掛けたもの
+// 畳み込み -> ReLU -> poolをまとめて計算した場合、時間は畳み込み層に計上する
+struct LayerProfile
+{
+    std::string typeName;
+    uint64_t numForward;  // 順伝播の呼び出し回数
+    uint64_t numForwardSample;
+    double forwardTime;
+    double forwardFlop;
+    double forwardByte;
+    uint64_t numBackward;  // 逆伝播の呼び出し回数
+    uint64_t numBackwardSample;
+    double backwardTime;
+    double backwardFlop;
+    double backwardByte;
+    uint64_t numFlush;
+    double flushTime;
+    // 勾配チェックポイントで、逆伝播の前に順伝播をやり直した回数(numForwardには含めない)
+    uint64_t numRecompute;
+    double recomputeTime;
+};
+
+// compileで作る実行計画の1ステップ
+// 層の並びと種類から、順伝播でどのカーネルを呼ぶかを前もって決めておく
+struct PlanStep
+{
+    enum class Kind
+    {
+        FORWARD,  // Layer::forward(Batch)
+        CONV,  // ConvolutionLayer::forwardBatch(algorithmで計算する)
+        FORWARD_QUANTIZED,  // Layer::forwardQuantized
+        POOL_ARGMAX,  // PoolingLayer::forwardArgmax(逆伝播のためにmaxの位置も記録する)
+        CONV_RELU_POOL  // ConvolutionLayer::forwardReLUPool(3層をまとめる)
+    };
+    Kind kind;
+    int index;  // 先頭の層の番号
+    int numLayer;  // まとめた層の数
+    Layer* layer;  // 先頭の層
+    const PoolingLayer* pool;  // POOL_ARGMAX, CONV_RELU_POOLのpool。それ以外はnullptr
+    int inputDataSize;  // 1サンプルあたりの入力と出力の大きさ
+    int outputDataSize;
+    // CONV, CONV_RELU_POOLの畳み込みの計算方法(ConvolutionLayer::selectAlgorithm)。それ以外はAUTO
+    ConvAlgorithm algorithm;
+};
+
 class DeepNetwork
 {
 public:
@@ -17,20 +84,194 @@ public:
     DeepNetwork(int mbSize);
     bool setInputInfo(DataSize size, int numChannel);
     void addLayer(std::shared_ptr<Layer> layer);
+    // 以降のaddLayerで、層の重みの初期値をseedから決まる乱数で作る(結果を再現させたい場合)
+    // 呼ばなければ層ごとにstd::random_deviceから取る
+    void setSeed(uint32_t seed);
+    // 最後のaddLayerの後に呼び、層の並びを実行計画に固める
+    // 各層の形を一度だけ確かめ、途中の出力などを置く位置と、順伝播で呼ぶカーネルを決める
+    // 形が不正ならstd::cerrに理由を出してfalseを返す
+    // 呼ばずにinferや学習を始めた場合は、その時にcompileする(不正なら終了する)
+    // setInputInfo, addLayerで層の並びを変えると、もう一度compileが必要になる
+    // (setUpdateModeでも、畳み込みの計算方法を選び直すためにもう一度compileする)
+    // 畳み込み層のsetAlgorithmで計算方法を変えた場合も、もう一度compileを呼ぶこと
+    bool compile();
+    bool isCompiled() const{return compiled;}
+    // 入力と各層の出力を返す。compile済みなら、層ごとの実行計画で計算する
     std::vector<std::vector<float>> feedInput(const std::vector<float>& input) const;
+    // 推論専用。途中の層の出力は保持せず、最終層の出力だけを返す
+    // 2つの作業領域を交互に使い回すので、ヒープ確保をしない
+    // 畳み込み -> ReLU -> poolの並びは1つのカーネルでまとめて計算する(FLOAT32モードのみ)
+    // 返り値は次にinferを呼ぶまで有効。複数のスレッドから同時に呼んではならない
+    const std::vector<float>& infer(const std::vector<float>& input);
+    // batchSize個のサンプル(NCHW)をまとめて推論し、最終層の出力をoutputに書く
+    // 途中の層の出力はスレッドごとのWorkspaceに置くので、一度広がればヒープ確保をしない
+    // FLOAT32モードでは全結合層などがforwardBatchで重みを1回読むだけで済む
+    void inferBatch(const float* input, int batchSize, float* output);
+    // compile済みのネットワークで、途中の層の出力をworkに置いて推論する
+    // ネットワークの状態を変えないので、workを分ければ複数のスレッドから同時に呼んでよい
+    // workの大きさはgetInferWorkSize(batchSize)以上
+    void inferBatch(const float* input, int batchSize, float* output, float* work) const;
+    size_t getInferWorkSize(int batchSize) const{return 2 * maxDataSize * batchSize;}
+    int getInputDataSize() const{return inputSize.first * inputSize.second * numInputChannel;}
+    int getOutputDataSize() const{return layers.empty() ? 0 : layers.back()->getOutputDataSize();}
+    // 学習時の途中の層の出力と誤差は、スレッドごとのWorkspaceから切り出す
+    // 一度必要な大きさまで広がれば、以降はヒープ確保をしない
     void backPropagate(const std::vector<float>& input, const std::vector<float>& correctOutput,
                        double reduceRate = 1.0, bool verbose = false);
+    // batchSize個のサンプルを連続に並べた(NCHW)入力をまとめて処理する
+    std::vector<std::vector<float>> feedInputBatch(const std::vector<float>& input, int batchSize) const;
+    void backPropagateBatch(const std::vector<float>& input, const std::vector<float>& correctOutput,
+                       int batchSize, double reduceRate = 1.0);
+    // サンプルをスレッドプールで並列に処理する
+    // 各スレッドは自分専用のシャードへ勾配を蓄積し、flush時にまとめる
+    void setNumThread(int numThread);
+    void backPropagateParallel(const std::vector<std::vector<float>>& inputs,
+                       const std::vector<std::vector<float>>& correctOutputs,
+                       double reduceRate = 1.0);
+    // HOGWILDにすると、蓄積済みの勾配を反映してから切り替える
+    // HOGWILDの間は、重みを16bitにしたり量子化したりできない
+    bool setUpdateMode(UpdateMode mode);
+    UpdateMode getUpdateMode() const{return updateMode;}
+    // 重みの更新に使う最適化手法と、学習率、L2正則化の係数(optimizer.h)
+    // 各層は蓄積済みの勾配を前の設定で反映してから切り替える
+    // 手法の状態(速度、モーメント)は各層が重みと一緒に持ち、flushのたびに1回のループで重みと一緒に更新する
+    // 学習率だけを変えた場合は状態を引き継ぐので、学習の途中で学習率を下げてよい
+    // 係数が不正ならstd::cerrに理由を出してfalseを返す
+    bool setOptimizer(const OptimizerConfig& config);
+    const OptimizerConfig& getOptimizer() const{return optimizer;}
     void saveWeight(std::string filename) const;
     void loadWeight(std::string filename);
+    // バイナリ形式(weight_file.h)で保存する。テキスト形式と違い、値は丸められない
+    bool saveWeightBinary(std::string filename) const;
+    // ファイルをmmapし、各層は重みをコピーせずファイル上の領域を直接参照する
+    // 学習で重みが更新される時に、初めて層が自分の領域にコピーする
+    bool loadWeightBinary(std::string filename);
+    // calibrationInputsを順伝播して各層の入力の範囲を調べ、畳み込み層と全結合層の重みを
+    // 出力チャネルごとのスケールでint8に量子化し、inferをINT8モードにする
+    // 量子化した重みはsaveWeightBinaryで一緒に保存され、loadWeightBinaryで読み込むとINT8モードになる
+    // (INT8モードのinferはfloatの重みを読まないので、mmapしたfloatの重みはメモリに載らない)
+    // 学習で重みを更新した層は量子化を破棄し、floatで計算する
+    bool quantize(const std::vector<std::vector<float>>& calibrationInputs);
+    void setInferenceMode(InferenceMode mode);
+    InferenceMode getInferenceMode() const{return inferenceMode;}
+    // 全結合層が順伝播で読む重みの型(FLOAT32, FLOAT16, BFLOAT16)
+    // 16bitにすると重みのメモリと読むバイト数が半分になる
+    // 勾配はfloatの重み(マスター)に蓄積し、flushのたびに丸め直すので、小さな更新も失われない
+    // 16bitの重みはsaveWeightBinaryで一緒に保存し、loadWeightBinaryで読み込むとその型になる
+    // (mmapしたfloatの重みは学習で更新するまで読まないので、推論だけならメモリに載らない)
+    bool setWeightType(TensorType type);
+    // 学習時に逆伝播まで保持する各層の出力の型(FLOAT32, FLOAT16, BFLOAT16)
+    // 16bitにすると保持する出力のメモリが半分になる
+    // 順伝播はfloatで計算し、保持する時だけ丸めるので、丸めの誤差は逆伝播にだけ入る
+    bool setActivationType(TensorType type);
+    TensorType getActivationType() const{return activationType;}
+    // 勾配チェックポイント
+    // 有効にすると、学習時の実行計画をsegmentLengthステップずつの区間に分け、
+    // 各区間の入力(前の区間の最後の層の出力)だけを逆伝播まで保持する
+    // 逆伝播では区間ごとに、保持した入力から順伝播をやり直してから誤差を伝える
+    // 保持する出力は、区間の数 + 最大の区間の大きさ程度になり、順伝播の計算は最大で2倍になる
+    // (最後の区間はやり直さない)
+    // segmentLengthが0なら、sqrt(ステップ数)にする。負ならstd::cerrに理由を出してfalseを返す
+    // 層の並びと同じく、次のcompileで反映される
+    bool setCheckpointMode(bool mode, int segmentLength = 0);
+    bool getCheckpointMode() const{return checkpointMode;}
+    // 学習時に1スレッドがWorkspaceから切り出す大きさ(float単位)。compile済みであること
+    size_t getTrainWorkspaceSize(int batchSize) const;
     void setVerboseMode(bool mode);
     void setLossFunction(LossFunction lf);
     void flush();
+    // 層ごとの処理時間、呼び出し回数などを記録する
+    // 無効にしている間は、層を呼ぶたびにフラグを1回見るだけで済む
+    void setProfileMode(bool mode);
+    std::vector<LayerProfile> getProfile() const;
+    void resetProfile();
+    void printProfile(std::ostream& os) const;
 private:
+    using ProfileClock = std::chrono::steady_clock;
+    struct ProfileCounter
+    {
+        std::atomic<uint64_t> numForward{0};
+        std::atomic<uint64_t> numForwardSample{0};
+        std::atomic<uint64_t> forwardNs{0};
+        std::atomic<uint64_t> numBackward{0};
+        std::atomic<uint64_t> numBackwardSample{0};
+        std::atomic<uint64_t> backwardNs{0};
+        std::atomic<uint64_t> numFlush{0};
+        std::atomic<uint64_t> flushNs{0};
+        std::atomic<uint64_t> numRecompute{0};
+        std::atomic<uint64_t> recomputeNs{0};
+    };
+    // 無効な時は時刻を取らない
+    ProfileClock::time_point startProfile() const
+    {
+        return profileMode.load(std::memory_order_relaxed) ? ProfileClock::now() : ProfileClock::time_point();
+    }
+    void recordForward(int index, ProfileClock::time_point begin, int numSample) const;
+    void recordBackward(int index, ProfileClock::time_point begin, int numSample) const;
+    // シャードの足し合わせだけを行った場合は、numFlushを0にして時間だけを足す
+    void recordFlush(int index, ProfileClock::time_point begin, int numFlush) const;
+    void recordRecompute(int index, ProfileClock::time_point begin) const;
+    // compileしていなければcompileする。形が不正なら続けられないので終了する
+    void ensureCompiled();
+    // 層の並びをstepsに固める。fuseなら畳み込み -> ReLU -> poolを1ステップにまとめる
+    // quantizedなら量子化した重みで、argmaxならpoolのmaxの位置も記録して順伝播する
+    void buildPlan(bool fuse, bool quantized, bool argmax, std::vector<PlanStep>& steps) const;
+    // FORWARD, CONVのステップで、batchSize個のサンプルを順伝播する
+    void forwardStep(const PlanStep& step, const float* input, float* output, int batchSize) const;
+    void calcPropError(const float* output, const float* correctOutput,
+                       int dataSize, float* propError) const;
+    // batchSize個のサンプルの順伝播と逆伝播を行い、勾配をshardに蓄積する
+    void trainStep(const float* input, const float* correctOutput, int batchSize,
+                   double reduceRate, int shard, bool verbose);
+    // 学習時に各層の出力を保持する領域の大きさ(float単位)
+    size_t getActivationStorageSize(int batchSize) const;
+    void backPropagateSample(const std::vector<float>& input, const std::vector<float>& correctOutput,
+                       double reduceRate, int shard);
     DataSize inputSize;
     int numInputChannel;
     int minibatchSize;
-    int inputCount;
+    std::atomic<int> inputCount;
     LossFunction lossFunc;
-    std::list<std::shared_ptr<Layer>> layers;
+    InferenceMode inferenceMode;
+    UpdateMode updateMode;
+    OptimizerConfig optimizer;
+    TensorType activationType;
+    bool checkpointMode;
+    int checkpointSegmentLength;
+    std::vector<std::shared_ptr<Layer>> layers;
+    std::unique_ptr<ThreadPool> threadPool;
+    // setSeedで設定した、重みの初期値のseedを作る乱数
+    std::unique_ptr<std::mt19937> initRng;
+
+    /* compileで決めるもの */
+    bool compiled;
+    // inferの実行計画(FLOAT32モード, INT8モード)
+    std::vector<PlanStep> inferPlan;
+    std::vector<PlanStep> quantizedInferPlan;
+    // 学習時の順伝播の実行計画。verbose時は層ごとの出力を表示するため、まとめない方を使う
+    std::vector<PlanStep> trainPlan;
+    std::vector<PlanStep> layerwiseTrainPlan;
+    // feedInput(Batch)の実行計画。各層の出力を返すので、まとめない
+    std::vector<PlanStep> feedPlan;
+    // infer用の作業領域
+    std::vector<float> inferWork;
+    std::vector<float> inferOutput;
+    // 学習時の区間(勾配チェックポイント)の先頭の層の番号。末尾はlayers.size()
+    // 区間の境目はtrainPlanのステップの境目に揃える。無効なら区間は1つ
+    std::vector<int> segmentBegins;
+    // 学習時に各層の出力を置く位置(1サンプルあたり)
+    // activationOffsets[i]が i番目の層の出力の先頭で、末尾は出力を置く領域の合計
+    // 区間の最後の層(次の区間の入力)は専用の位置に置き、それ以外の層は区間どうしで同じ領域を使い回す
+    // trainPlanで書かない出力(融合したステップの畳み込み)はNO_ACTIVATION
+    static constexpr size_t NO_ACTIVATION = SIZE_MAX;
+    std::vector<size_t> activationOffsets;
+    // 学習時にpoolのargmaxを置く位置(1サンプルあたり)。区間どうしで同じ領域を使い回す
+    // pool以外の層はNO_ARGMAXで、末尾はargmaxを置く領域の合計
+    static constexpr size_t NO_ARGMAX = SIZE_MAX;
+    std::vector<size_t> argmaxOffsets;
+    // 入力と各層の出力のうち最大のもの(1サンプルあたり)
+    size_t maxDataSize;
+    std::atomic<bool> profileMode;
+    std::vector<std::unique_ptr<ProfileCounter>> profileCounters;
 };
 
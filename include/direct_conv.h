@@ -0,0 +1,28 @@
+#pragma once
+
+/* ======================
+    Direct convolution
+   ======================*/
+// 直接法の畳み込みのカーネル
+// よく使う(windowSize, zeroPad)の組はテンプレートで特殊化し、窓のループを展開する
+// 出力の各行は、窓が入力からはみ出す両端と、はみ出さない内部に分けて計算し、
+// 内部は分岐のないループにしてベクトル化させる
+struct DirectConvKernel
+{
+    // input(numInChannel x height x width)をweight(numOutChannel x numInChannel x windowSize x windowSize)で
+    // 畳み込み、output(numOutChannel x outHeight x outWidth)に書く。biasは足さない
+    void (*forward)(const float* input, int width, int height, int numInChannel,
+                    const float* weight, int numOutChannel, int windowSize, int zeroPad,
+                    float* output);
+    // propError(numOutChannel x outHeight x outWidth)とinputの相関を、dEdwに足し込む
+    void (*weightGradient)(const float* input, int width, int height, int numInChannel,
+                           const float* propError, int numOutChannel, int windowSize, int zeroPad,
+                           float* dEdw);
+    // (windowSize, zeroPad)に特殊化したカーネルならtrue
+    bool specialized;
+};
+
+// (windowSize, zeroPad)用のカーネルを返す
+// 特殊化したものがなければ、窓の大きさを実行時に扱う汎用のカーネルを返す
+// zeroPadはwindowSize - 1以下であること
+DirectConvKernel getDirectConvKernel(int windowSize, int zeroPad);
@@ -0,0 +1,81 @@
+#pragma once
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+/* ======================
+    FFT
+   ======================*/
+// n以上で最小の2のべき
+int getFftSize(int n);
+
+// 長さsize(2のべき)の複素FFT
+class Fft
+{
+public:
+    explicit Fft(int size);
+    int getSize() const{return size;}
+    // dataをその場で変換する。inverseが真なら逆変換(1 / sizeは掛けない)
+    void transform(std::complex<float>* data, bool inverse) const;
+
+private:
+    int size;
+    std::vector<int> bitReverse;
+    // exp(-2πik / size), k < size / 2
+    std::vector<std::complex<float>> twiddle;
+};
+
+// rows x colsの実数の2次元FFT
+// 実数の変換は共役対称になるので、各行の先頭cols / 2 + 1個だけを持つ
+class Fft2d
+{
+public:
+    Fft2d(int rows, int cols);
+    int getRows() const{return colFft.getSize();}
+    int getCols() const{return rowFft.getSize();}
+    int getSpectrumSize() const{return getRows() * (getCols() / 2 + 1);}
+    // src(height x width)を(offsetY, offsetX)に置き、残りを0で埋めて変換する
+    void forward(const float* src, int width, int height, int offsetX, int offsetY,
+                 std::complex<float>* spectrum) const;
+    // spectrumを逆変換し、(offsetY, offsetX)から始まるheight x widthの部分をdstに書く
+    // spectrumは作業に使うので壊れる
+    void inverse(std::complex<float>* spectrum, int offsetX, int offsetY, int width, int height,
+                 float* dst) const;
+    // forward, inverseが作業領域から確保するfloatの個数
+    static size_t getWorkspaceSize(int rows, int cols);
+
+private:
+    // 行方向(長さcols)と列方向(長さrows)の変換
+    Fft rowFft;
+    Fft colFft;
+};
+
+/* ======================
+    FFT convolution
+   ======================*/
+// 入力を(zeroPad, zeroPad)にずらしてrows x colsに置き、周波数領域で窓との相関を取る
+// rows, colsはゼロパディング込みの入力の大きさ以上の2のべき
+// 1画素あたりの積和は窓の大きさによらず O(入出力チャネル数 + log(rows * cols))
+// 誤差はFFTの丸めの分だけで、出力の最大絶対値の1e-6程度
+
+// weight(numOutChannel x numInChannel x windowSize x windowSize)の窓ごとのスペクトルを
+// spectrum(numOutChannel x numInChannel x fft.getSpectrumSize())に書く
+void fftWeightSpectrum(const Fft2d& fft, const float* weight, int windowSize,
+                       int numInChannel, int numOutChannel, std::complex<float>* spectrum);
+
+// input(batch x numInChannel x height x width)を畳み込み、
+// output(batch x numOutChannel x outHeight x outWidth)に書く。biasは足さない
+void fftConvolution(const Fft2d& fft, const float* input, int width, int height, int numInChannel,
+                    const std::complex<float>* weightSpectrum, int numOutChannel,
+                    int windowSize, int zeroPad, float* output, int batchSize);
+
+// 重みの勾配をdEdwに足し込み、nextPropError(batch x numInChannel x height x width)を書く
+void fftConvolutionBackward(const Fft2d& fft, const float* input, int width, int height,
+                            int numInChannel, const float* propError,
+                            const std::complex<float>* weightSpectrum, int numOutChannel,
+                            int windowSize, int zeroPad, float* dEdw, float* nextPropError,
+                            int batchSize);
+
+// 上の2つが作業領域から確保するfloatの個数
+size_t getFftConvolutionWorkspaceSize(int rows, int cols, int numInChannel, int numOutChannel,
+                                      int windowSize, bool backward);
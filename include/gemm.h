@@ -0,0 +1,32 @@
+#pragma once
+
+/* ======================
+    GEMM
+   ======================*/
+// C(M x N) += op(A)(M x K) * op(B)(K x N)
+// 行列はすべてrow-major。transA/transBが真なら転置して使う。
+// kBlockが正のとき、K方向をkBlockごとに区切り、
+// 区間ごとに0から部分和を取ってからCへ足し込む。
+// (畳み込みで入力チャネルごとに和を取っていた従来の計算順序を再現するため)
+void sgemm(bool transA, bool transB, int M, int N, int K,
+           const float* A, int lda, const float* B, int ldb,
+           float* C, int ldc, int kBlock = 0);
+
+// 入力(numChannel x height x width)を、ゼロパディング込みで
+// (numChannel * windowSize * windowSize) x (outHeight * outWidth)の行列に展開する
+// 窓はstrideずつずらす。outWidth = (width + 2 * zeroPad - windowSize) / stride + 1
+// ldColはcolの行の間隔で、0なら outHeight * outWidth とする
+// (バッチの各サンプルを横に並べた行列を作るときに指定する)
+void im2col(const float* input, int width, int height, int numChannel,
+            int windowSize, int zeroPad, int stride, float* col, int ldCol = 0);
+
+// im2colのうち、出力のy座標が[outYBegin, outYEnd)の範囲だけを展開する
+// ldColが0なら (outYEnd - outYBegin) * outWidth とする
+void im2colRows(const float* input, int width, int height, int numChannel,
+                int windowSize, int zeroPad, int stride, int outYBegin, int outYEnd,
+                float* col, int ldCol = 0);
+
+// im2colの逆操作。colの各要素を対応する入力位置へ足し込む
+// outputはあらかじめ0で初期化しておくこと
+void col2im(const float* col, int width, int height, int numChannel,
+            int windowSize, int zeroPad, int stride, float* output, int ldCol = 0);
@@ -0,0 +1,43 @@
+#pragma once
+#include "weight_file.h"
+#include "simd.h"
+#include <cstdint>
+#include <vector>
+
+/* ======================
+    Half precision storage
+   ======================*/
+// 重みや学習時の途中の出力を16bit浮動小数点(FLOAT16, BFLOAT16)で持つ
+// 計算はfloatに戻してから行う(simd.hのfromHalf, hgemv)
+// BFLOAT16はfloatと同じ指数の範囲を持つが、仮数部は7bit(相対誤差2^-9)
+// FLOAT16は仮数部が10bit(相対誤差2^-12)だが、絶対値が65504を超えると無限大になる
+
+// 16bit浮動小数点の型ならtrue
+bool isHalfTensorType(TensorType type);
+// isHalfTensorType(type)であること
+HalfType getHalfType(TensorType type);
+
+// floatの重み(マスター)を丸めた16bitの写し
+class HalfWeight
+{
+public:
+    HalfWeight() = default;
+    // weightをtypeに丸めて持つ。typeはisHalfTensorTypeであること
+    // 大きさが変わらなければ領域を使い回す
+    void assign(const float* weight, size_t size, TensorType type);
+    bool empty() const{return size == 0;}
+    TensorType getType() const{return type;}
+    const uint16_t* getData() const{return mapped.data != nullptr ? mapped.get<uint16_t>() : data.data();}
+    // saveWeightBinaryで保存するテンソル
+    TensorView getTensor() const;
+    // getTensorで保存したテンソルを受け取る。値はファイル上の領域をそのまま使う
+    // 型や大きさが合わなければfalseを返す
+    bool setTensor(const MappedTensor& tensor, size_t size);
+
+private:
+    size_t size = 0;
+    TensorType type = TensorType::FLOAT32;
+    std::vector<uint16_t> data;
+    // loadWeightBinaryで読み込んだ値。読み込んでいなければdataはnullptr
+    MappedTensor mapped;
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include "cnn.h"
+#include <vector>
+#include <memory>
+
+/* ======================
+    InferenceExecutor
+   ======================*/
+// 重みを読み込んでcompileしたDeepNetworkを読み取り専用で共有し、推論する
+// executorが持つのは途中の層の出力を置く領域と出力だけで、重みはコピーしない
+// (層の中で使う一時領域は、スレッドごとのWorkspaceから取る)
+// スレッドごとにexecutorを作れば、メモリは1モデル分 + スレッドごとの途中の出力で済む
+//
+//   auto model = std::make_shared<DeepNetwork>();
+//   (setInputInfo, addLayer, loadWeightBinary, compile)
+//   InferenceExecutor executor(model);  // スレッドごとに作る
+//
+// modelは最後のexecutorが破棄されるまで残る。共有している間、modelを学習したり層を変えたりしてはならない
+// 1つのexecutorを複数のスレッドから同時に使ってはならない
+class InferenceExecutor
+{
+public:
+    // modelはcompile済みであること(でなければ終了する)
+    explicit InferenceExecutor(std::shared_ptr<const DeepNetwork> model);
+    // 返り値は次にinfer, inferBatchを呼ぶまで有効
+    const std::vector<float>& infer(const std::vector<float>& input);
+    // batchSize個のサンプル(NCHW)をまとめて推論し、最終層の出力をoutputに書く
+    // これまでより大きなbatchSizeの時だけ、作業領域を広げる
+    void inferBatch(const float* input, int batchSize, float* output);
+    const DeepNetwork& getModel() const{return *model;}
+private:
+    std::shared_ptr<const DeepNetwork> model;
+    std::vector<float> work;
+    std::vector<float> output;
+};
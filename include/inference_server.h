@@ -0,0 +1,64 @@
+#pragma once
+#include "inference_executor.h"
+#include <vector>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/* ======================
+    InferenceServer
+   ======================*/
+// 複数のスレッドから1サンプルずつ推論の要求を受け付け、まとめてDeepNetwork::inferBatchで処理する
+// 全結合層の重みをサンプルごとに読み直さずに済むので、要求が多い時ほどスループットが上がる
+// キューの先頭の要求が届いてからmaxDelay経つか、maxBatchSize個溜まった時点でバッチを実行する
+// (実行中に届いた要求は次のバッチに入る。要求1つの待ち時間はおよそmaxDelay + バッチ1つの処理時間)
+// バッチはnumWorker個のワーカーが、共有したモデルと自分のInferenceExecutorで並列に処理する
+// 動いている間、networkを学習したり、他のスレッドからinferしたりしてはならない
+class InferenceServer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    // networkをcompileしていなければcompileする(不正なら終了する)。ワーカーは1つ
+    InferenceServer(DeepNetwork& network, int maxBatchSize, std::chrono::microseconds maxDelay);
+    // compile済みのmodelをnumWorker個のワーカーで共有する
+    InferenceServer(std::shared_ptr<const DeepNetwork> model, int numWorker, int maxBatchSize,
+                    std::chrono::microseconds maxDelay);
+    // 受け付け済みの要求をすべて処理してから止まる
+    ~InferenceServer();
+    InferenceServer(const InferenceServer&) = delete;
+    InferenceServer& operator=(const InferenceServer&) = delete;
+    // 複数のスレッドから同時に呼んでよい。最終層の出力がfutureに入る
+    std::future<std::vector<float>> submit(std::vector<float> input);
+    int getMaxBatchSize() const{return maxBatchSize;}
+    // これまでに実行したバッチの数と、処理した要求の数
+    uint64_t getNumBatch() const{return numBatch;}
+    uint64_t getNumRequest() const{return numRequest;}
+
+private:
+    struct Request
+    {
+        std::vector<float> input;
+        std::promise<std::vector<float>> output;
+        Clock::time_point arrival;
+    };
+    void start(std::shared_ptr<const DeepNetwork> model, int numWorker);
+    void serveLoop(InferenceExecutor& executor);
+    const int maxBatchSize;
+    const std::chrono::microseconds maxDelay;
+    int inputDataSize;
+    int outputDataSize;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Request> queue;
+    bool stop;
+    std::atomic<uint64_t> numBatch;
+    std::atomic<uint64_t> numRequest;
+    std::vector<std::unique_ptr<InferenceExecutor>> executors;
+    std::vector<std::thread> workers;
+};
@@ -3,13 +3,33 @@
 #include <fstream>
 #include <mutex>
 #include <shared_mutex>
+#include <memory>
+#include <cstdint>
+#include "weight_file.h"
+#include "fft.h"
+#include "direct_conv.h"
+#include "quantize.h"
+#include "half_weight.h"
+#include "optimizer.h"
 
 typedef std::pair<int, int> DataSize;
 
-const float GAMMA = 0.02;  // 学習率
-const float LAMBDA = 0.001;  // L2正則化の係数
-
 class ConvolutionLayerTest;
+class PoolingLayer;
+
+// 勾配の蓄積先
+// スレッドごとに別のシャードへ蓄積し、flush時にまとめて最適化手法で重みを更新する
+struct GradientShard
+{
+    // reduceRateを掛けた勾配の和
+    std::vector<float> weight;
+    std::vector<float> bias;
+    // L2正則化の項に掛ける係数(batchSize * reduceRateの和)
+    float decayScale = 0;
+    // 勾配を他のシャードに足し終え、flushで空にするだけのもの(Layer::reduceGradientSlice)
+    bool reduced = false;
+    std::mutex mtx;
+};
 
 class Layer
 {
@@ -20,16 +40,97 @@ public:
     virtual void calcOutputSize() = 0;
     DataSize getOutputSize() const{return outputSize;}
     int getNumOutputChannel() const{return numOutputChannel;}
-    virtual std::vector<float> apply(const std::vector<float>& input) const = 0;
-    virtual void initWeight(){};
-    virtual std::vector<float> updateWeight(const std::vector<float>& input,
+    DataSize getInputSize() const{return inputSize;}
+    int getNumInputChannel() const{return numInputChannel;}
+    int getInputDataSize() const{return inputSize.first * inputSize.second * numInputChannel;}
+    int getOutputDataSize() const{return outputSize.first * outputSize.second * numOutputChannel;}
+    std::vector<float> apply(const std::vector<float>& input) const;
+    // batchSize個のサンプルを連続に並べた(NCHW)データをまとめて処理する
+    std::vector<float> applyBatch(const std::vector<float>& input, int batchSize) const;
+    // inputの順伝播の結果をoutputに書き込む
+    // outputにはgetOutputDataSize()個分の領域を用意しておくこと
+    // 作業領域はスレッドごとのWorkspaceから切り出すので、定常状態ではヒープ確保をしない
+    virtual void forward(const float* input, float* output) const = 0;
+    // デフォルトではサンプルごとにforwardを呼ぶ
+    virtual void forwardBatch(const float* input, float* output, int batchSize) const;
+    // 重みを乱数で初期化する。seedを省くとstd::random_deviceから取る
+    void initWeight();
+    virtual void initWeight(uint32_t seed){};
+    std::vector<float> updateWeight(const std::vector<float>& input,
+                const std::vector<float>& output,
+                const std::vector<float>& propError,
+                double reduceRate = 1.0, int shard = 0);
+    std::vector<float> updateWeightBatch(const std::vector<float>& input,
                 const std::vector<float>& output,
                 const std::vector<float>& propError,
-                double reduceRate) = 0;
+                int batchSize, double reduceRate = 1.0, int shard = 0);
+    // 重みの勾配をシャードに蓄積し、前の層へ伝える誤差をnextPropErrorに書き込む
+    // nextPropErrorにはgetInputDataSize()個分の領域を用意しておくこと
+    virtual void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) = 0;
+    // デフォルトではサンプルごとにbackwardを呼ぶ
+    virtual void backwardBatch(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                int batchSize, double reduceRate, int shard);
+    // forward/backwardがbatchSize個のサンプルに対して
+    // Workspaceから切り出す領域の大きさ(float単位)
+    virtual size_t getWorkspaceSize(int batchSize) const{return 0;};
+    // 1サンプルあたりの浮動小数点演算の回数(比較も1回と数える)
+    // 性能の計測に使う
+    virtual double getForwardFlop() const = 0;
+    virtual double getBackwardFlop() const = 0;
+    // 1サンプルあたりに読み書きするバイト数の見積もり
+    // デフォルトでは入出力と誤差だけを数える
+    virtual double getForwardByte() const;
+    virtual double getBackwardByte() const;
+    // 層の種類の名前(プロファイルの表示などに使う)
+    virtual const char* getTypeName() const = 0;
+    // 窓をずらす間隔。窓を持たない層は1
+    virtual int getStride() const{return 1;}
+    // 入出力の形がこの層で計算できるものか確かめる(DeepNetwork::compileで一度だけ呼ぶ)
+    // デフォルトでは大きさが正であることだけを見る。不正ならstd::cerrに理由を出してfalseを返す
+    virtual bool checkShape() const;
     virtual void saveWeight(std::ofstream& ofs) const{};
     virtual void loadWeight(std::ifstream& ifs){};
+    // バイナリ形式の重みファイル用
+    // 保存するテンソル(重み、バイアスなど)を順に返す
+    virtual std::vector<TensorView> getTensors() const{return {};};
+    // ファイル上のテンソルを受け取る。数や大きさが合わなければfalseを返す
+    // 大きなテンソルはコピーせず、ファイル上の領域をそのまま参照してよい
+    virtual bool setTensors(const std::vector<MappedTensor>& tensors){return tensors.empty();};
     void setVerboseMode(bool mode){verbose = mode;};
+    // 勾配を蓄積するシャードの数を設定する
+    // updateWeightのshardには[0, numShard)を渡す
+    virtual void setNumShard(int numShard){};
     virtual void flush(){};
+    // flushの前に、シャードに蓄積した勾配の和を要素の範囲ごとに分けて求める(DeepNetwork::flush)
+    // [0, numSlice)の各sliceは並列に呼んでよいが、逆伝播やflushと同時に呼んではならない
+    // すべてのsliceを終えたら、続けてflushを呼ぶこと
+    virtual void reduceGradientSlice(int slice, int numSlice){};
+    // int8での推論(DeepNetwork::quantize)
+    // 重みをint8に量子化できる層はtrueを返す
+    virtual bool isQuantizable() const{return false;}
+    // 入力の絶対値の最大をinputMaxAbsとして、重みを量子化する
+    virtual void quantize(float inputMaxAbs){};
+    virtual bool isQuantized() const{return false;}
+    // 量子化した重みで順伝播する。量子化していなければforwardと同じ
+    virtual void forwardQuantized(const float* input, float* output) const{forward(input, output);}
+    // 順伝播で読む重みの型(DeepNetwork::setWeightType)
+    // FLOAT16/BFLOAT16にすると、順伝播は16bitに丸めた重みを読む
+    // 勾配はfloatの重み(マスター)に足し込み、flushのたびに丸め直す
+    // 対応していない層は何もしない(畳み込み層は重みが小さく、順伝播は演算で律速するので対応しない)
+    virtual void setWeightType(TensorType type){};
+    virtual TensorType getWeightType() const{return TensorType::FLOAT32;}
+    // Hogwild(DeepNetwork::setUpdateMode)
+    // trueにすると、backwardは勾配をシャードに蓄積せず、ロックを取らずに直接重みを更新する
+    // 蓄積済みの勾配は切り替える前に反映する。重みは16bitにしていないこと
+    // 畳み込み層のFFTは、HogwildのあいだGEMMで計算する
+    virtual void setHogwild(bool mode){};
+    // 重みの更新に使う最適化手法(DeepNetwork::setOptimizer)
+    // 蓄積済みの勾配は前の設定で反映する。手法の種類が変われば状態(速度など)は0から始める
+    // 学習率などだけを変えた場合は状態を引き継ぐ
+    virtual void setOptimizer(const OptimizerConfig& config){};
 
 protected:
     DataSize inputSize;
@@ -39,48 +140,132 @@ protected:
     bool verbose;
 };
 
+// 畳み込みの計算方法
+// AUTOは窓が3x3ならWinograd(出力が小さければF(2x2, 3x3)、そうでなければF(4x4, 3x3))、
+// 特殊化した直接法のカーネルがあればDIRECT、それ以外はGEMMを選ぶ
+// Winogradを指定しても窓が3x3でなければGEMMで計算する
+// strideが1でなければ、指定によらずGEMMで計算する
+// FFTは窓の大きさによらない計算量になるので、大きな窓の層で指定する
+// DIRECTは(windowSize, zeroPad)ごとに特殊化した直接法のカーネルを使う(direct_conv.h)
+// Winograd, FFTの誤差はwinograd.h, fft.hを参照
+enum class ConvAlgorithm
+{
+    AUTO,
+    GEMM,
+    WINOGRAD_2X2,
+    WINOGRAD_4X4,
+    FFT,
+    DIRECT
+};
+
 class ConvolutionLayer : public Layer
 {
 friend class ConvolutionLayerTest;
 public:
-    ConvolutionLayer(int zeroPad, int windowSize, int numOutputChannel);
+    // 出力の大きさは (入力 + 2 * zeroPad - windowSize) / stride + 1
+    ConvolutionLayer(int zeroPad, int windowSize, int numOutputChannel, int stride = 1,
+                     ConvAlgorithm algorithm = ConvAlgorithm::AUTO);
 
     void calcOutputSize() override;
-    std::vector<float> apply(const std::vector<float>& input) const override;
-    void initWeight() override;
-    std::vector<float> updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate = 1.0) override;
+    void forward(const float* input, float* output) const override;
+    double getForwardFlop() const override;
+    double getBackwardFlop() const override;
+    double getForwardByte() const override;
+    double getBackwardByte() const override;
+    const char* getTypeName() const override{return "Convolution";}
+    int getStride() const override{return stride;}
+    void forwardBatch(const float* input, float* output, int batchSize) const override;
+    // selectedで計算する。AUTOならselectAlgorithmで選ぶ
+    void forwardBatch(const float* input, float* output, int batchSize, ConvAlgorithm selected) const;
+    using Layer::initWeight;
+    void initWeight(uint32_t seed) override;
+    void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) override;
+    void backwardBatch(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                int batchSize, double reduceRate, int shard) override;
+    size_t getWorkspaceSize(int batchSize) const override;
+    // 畳み込み -> ReLU -> poolの順伝播を1サンプル分まとめて行う
+    // 畳み込みの出力は数行ずつ求めてキャッシュ上にあるうちにpoolし、outputにはpoolの出力だけを書く
+    // reluOutputを渡すと、逆伝播のためにReLUの出力も書き込む
+    // (畳み込みの逆伝播は出力を参照しないので、畳み込みの出力は書かない)
+    // argmaxを渡すと、PoolingLayer::forwardArgmaxと同じ形式でmaxの位置も書き込む
+    // ただしReLUで0に切られた要素は選ばないので、窓内の出力がすべて0なら-1になる
+    // (ReLUの逆伝播でその位置の誤差は0になるので、逆伝播の結果は変わらない)
+    // 畳み込みはselectedで計算する。AUTOならselectAlgorithmで選ぶ
+    void forwardReLUPool(const float* input, const PoolingLayer& pool,
+                float* output, float* reluOutput = nullptr, int32_t* argmax = nullptr,
+                ConvAlgorithm selected = ConvAlgorithm::AUTO) const;
     void dumpWeight() const;
     void saveWeight(std::ofstream& ofs) const override;
     void loadWeight(std::ifstream& ifs) override;
+    std::vector<TensorView> getTensors() const override;
+    bool setTensors(const std::vector<MappedTensor>& tensors) override;
+    void setNumShard(int numShard) override;
     void flush() override;
+    void reduceGradientSlice(int slice, int numSlice) override;
+    bool isQuantizable() const override{return true;}
+    void quantize(float inputMaxAbs) override;
+    bool isQuantized() const override{return !quantizedWeight.empty();}
+    void forwardQuantized(const float* input, float* output) const override;
+    void setHogwild(bool mode) override;
+    void setOptimizer(const OptimizerConfig& config) override;
+    void setAlgorithm(ConvAlgorithm algorithm){this->algorithm = algorithm;}
+    ConvAlgorithm getAlgorithm() const{return algorithm;}
+    // AUTOや、この層では使えない指定を解決した、実際に使う計算方法
+    // 指定、Hogwildか、入力の大きさで決まる
+    ConvAlgorithm selectAlgorithm() const;
 
 private:
+    // FFTで計算する時の重みのスペクトル。なければ作る
+    const std::complex<float>* getWeightSpectrum() const;
+    // 重みを書き換えたら呼び、スペクトルを作り直させる
+    void invalidateWeightSpectrum();
+    const float* getWeightData() const{return mappedWeight.data != nullptr ? mappedWeight.get<float>() : weight.data();}
+    // mmap上の重みをweightにコピーし、書き換えられるようにする
+    void detachWeight();
+    // 重みを初期化、読み込みした時に、最適化手法の状態を0に戻す
+    void resetOptimizerState();
     std::vector<float> weight;
+    // loadWeightBinaryで読み込んだ重み。読み込んでいなければdataはnullptr
+    MappedTensor mappedWeight;
+    // quantizeで作った重み。重みを書き換えたら破棄する
+    QuantizedWeight quantizedWeight;
     std::vector<float> bias;
-    std::vector<float> diffWeight;
-    std::vector<float> diffBias;
+    std::vector<std::unique_ptr<GradientShard>> gradShards;
+    OptimizerConfig optimizer;
+    OptimizerState weightState;
+    OptimizerState biasState;
     int zeroPad;
     int windowSize;
+    int stride;
+    ConvAlgorithm algorithm;
+    // 順伝播とnextPropErrorに使う直接法のカーネル
+    DirectConvKernel directKernel = {};
+    DirectConvKernel directBackKernel = {};
+    bool hogwild = false;
+    // FFTの変換と重みのスペクトル。重みが変わるまで使い回す
+    mutable std::mutex mtxSpectrum;
+    mutable std::unique_ptr<Fft2d> fft;
+    mutable std::vector<std::complex<float>> weightSpectrum;
     // weight, bias両方のロックを取る場合、
     // weight -> biasの順に取ること
     std::shared_mutex mtxWeight;
     std::shared_mutex mtxBias;
-    std::mutex mtxDiffWeight;
-    std::mutex mtxDiffBias;
 };
 
 class ReLULayer : public Layer
 {
 public:
     void calcOutputSize() override;
-    std::vector<float> apply(const std::vector<float>& input) const override;
-    std::vector<float> updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate = 1.0) override;
+    void forward(const float* input, float* output) const override;
+    double getForwardFlop() const override;
+    double getBackwardFlop() const override;
+    const char* getTypeName() const override{return "ReLU";}
+    void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) override;
 
 private:
 
@@ -89,20 +274,40 @@ private:
 class PoolingLayer : public Layer
 {
 public:
-    PoolingLayer(int zeroPad, int windowSize) :
-        zeroPad(zeroPad), windowSize(windowSize){}
+    // 出力の大きさは (入力 + 2 * zeroPad - windowSize) / stride + 1
+    // strideをwindowSizeと同じにすれば、窓が重ならずに縮小する
+    PoolingLayer(int zeroPad, int windowSize, int stride = 1);
 
     void calcOutputSize() override;
-    std::vector<float> apply(const std::vector<float>& input) const override;
-    std::vector<float> updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate = 1.0) override;
-
+    void forward(const float* input, float* output) const override;
+    double getForwardFlop() const override;
+    double getBackwardFlop() const override;
+    const char* getTypeName() const override{return "Pooling";}
+    int getStride() const override{return stride;}
+    // forwardに加えて、出力ごとにmaxを取った入力の添字(チャネル込み)をargmaxに書く
+    // 窓内の最大値が同じ要素が複数あれば最後のもの、すべて負(出力は0)なら-1
+    void forwardArgmax(const float* input, float* output, int32_t* argmax) const;
+    // forwardArgmaxで得たargmaxの位置にだけpropErrorを書き戻す。窓を走査し直さない
+    void backwardArgmax(const int32_t* argmax, const float* propError, float* nextPropError) const;
+    // argmaxを保持していない場合は、inputから求め直してからbackwardArgmaxする
+    void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) override;
+    size_t getWorkspaceSize(int batchSize) const override;
+    int getZeroPad() const{return zeroPad;}
+    int getWindowSize() const{return windowSize;}
 
 private:
+    // 窓がこれ以上の大きさで重なる場合は、行方向と列方向に分けて最大値を求める
+    // 1出力あたりのコストが窓の大きさによらない
+    static constexpr int SEPARABLE_MIN_WINDOW_SIZE = 3;
+    bool useSeparable() const;
+    void forwardSeparable(const float* input, float* output, int32_t* argmax) const;
+    template<bool WITH_INDEX>
+    void forwardSeparableImpl(const float* input, float* output, int32_t* argmax) const;
     int zeroPad;
     int windowSize;
+    int stride;
 };
 
 class FullConnectLayer : public Layer
@@ -112,27 +317,69 @@ public:
     FullConnectLayer(DataSize size);
 
     void calcOutputSize() override;
-    std::vector<float> apply(const std::vector<float>& input) const override;
-    void initWeight() override;
-    std::vector<float> updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate = 1.0) override;
+    void forward(const float* input, float* output) const override;
+    double getForwardFlop() const override;
+    double getBackwardFlop() const override;
+    double getForwardByte() const override;
+    double getBackwardByte() const override;
+    const char* getTypeName() const override{return "FullConnect";}
+    bool checkShape() const override;
+    void forwardBatch(const float* input, float* output, int batchSize) const override;
+    // selectedで計算する。AUTOならselectAlgorithmで選ぶ
+    void forwardBatch(const float* input, float* output, int batchSize, ConvAlgorithm selected) const;
+    using Layer::initWeight;
+    void initWeight(uint32_t seed) override;
+    void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) override;
+    void backwardBatch(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                int batchSize, double reduceRate, int shard) override;
+    size_t getWorkspaceSize(int batchSize) const override;
     void saveWeight(std::ofstream& ofs) const override;
     void loadWeight(std::ifstream& ifs) override;
+    std::vector<TensorView> getTensors() const override;
+    bool setTensors(const std::vector<MappedTensor>& tensors) override;
+    void setNumShard(int numShard) override;
     void flush() override;
+    void reduceGradientSlice(int slice, int numSlice) override;
+    bool isQuantizable() const override{return true;}
+    void quantize(float inputMaxAbs) override;
+    bool isQuantized() const override{return !quantizedWeight.empty();}
+    void forwardQuantized(const float* input, float* output) const override;
+    void setWeightType(TensorType type) override;
+    TensorType getWeightType() const override{return weightType;}
+    void setHogwild(bool mode) override;
+    void setOptimizer(const OptimizerConfig& config) override;
 
 private:
+    // forwardBatchで16bitの重みをfloatに戻す時の、1回あたりの要素数の目安
+    static constexpr size_t HALF_WEIGHT_BLOCK_SIZE = 16384;
+    const float* getWeightData() const{return mappedWeight.data != nullptr ? mappedWeight.get<float>() : weight.data();}
+    // mmap上の重みをweightにコピーし、書き換えられるようにする
+    void detachWeight();
+    // weightTypeが16bitなら、今の重みを丸めてhalfWeightを作り直す
+    void updateHalfWeight();
+    // 重みを初期化、読み込みした時に、最適化手法の状態を0に戻す
+    void resetOptimizerState();
     std::vector<float> weight;
+    // loadWeightBinaryで読み込んだ重み。読み込んでいなければdataはnullptr
+    MappedTensor mappedWeight;
+    // quantizeで作った重み。重みを書き換えたら破棄する
+    QuantizedWeight quantizedWeight;
+    TensorType weightType = TensorType::FLOAT32;
+    // weightTypeが16bitの時に順伝播で読む重み。FLOAT32なら空
+    HalfWeight halfWeight;
     float bias;
-    std::vector<float> diffWeight;
-    float diffBias;
+    bool hogwild = false;
+    std::vector<std::unique_ptr<GradientShard>> gradShards;
+    OptimizerConfig optimizer;
+    OptimizerState weightState;
+    OptimizerState biasState;
     // weight, bias両方のロックを取る場合、
     // weight -> biasの順に取ること
     std::shared_mutex mtxWeight;
     std::shared_mutex mtxBias;
-    std::mutex mtxDiffWeight;
-    std::mutex mtxDiffBias;
 };
 
 class SoftmaxLayer : public Layer
@@ -141,20 +388,21 @@ public:
     SoftmaxLayer(){};
     SoftmaxLayer(const std::vector<uint32_t>& sp);
     void calcOutputSize() override;
-    std::vector<float> apply(const std::vector<float>& input) const override;
-    std::vector<float> updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate = 1.0) override;
+    void forward(const float* input, float* output) const override;
+    double getForwardFlop() const override;
+    double getBackwardFlop() const override;
+    const char* getTypeName() const override{return "Softmax";}
+    bool checkShape() const override;
+    void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) override;
 
 private:
     std::vector<uint32_t> split;
     void updateWeightHelper(uint32_t beginIdx, uint32_t endIdx,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                std::vector<float>& nextPropError) const;
-    void softmax(std::vector<float>::iterator leftItr,
-                 std::vector<float>::iterator rightItr) const;
+                const float* output, const float* propError,
+                float* nextPropError) const;
+    void softmax(float* left, float* right) const;
 
 };
 
@@ -162,14 +410,15 @@ class SigmoidLayer : public Layer
 {
 public:
     void calcOutputSize() override;
-    std::vector<float> apply(const std::vector<float>& input) const override;
-    std::vector<float> updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate = 1.0) override;
+    void forward(const float* input, float* output) const override;
+    double getForwardFlop() const override;
+    double getBackwardFlop() const override;
+    const char* getTypeName() const override{return "Sigmoid";}
+    void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) override;
 
 private:
-    std::vector<float> sigmoid(const std::vector<float>& input) const;
 
 };
 
@@ -178,17 +427,17 @@ class StandardizeLayer : public Layer
 public:
     StandardizeLayer(int nb);
     void calcOutputSize() override;
-    std::vector<float> apply(const std::vector<float>& input) const override;
-    std::vector<float> updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate = 1.0) override;
-    void standardize(std::vector<float>::iterator leftItr,
-        std::vector<float>::iterator rightItr) const;
-    float getMean(std::vector<float>::const_iterator leftItr,
-        std::vector<float>::const_iterator rightItr) const;
-    float getStddev(std::vector<float>::const_iterator leftItr,
-        std::vector<float>::const_iterator rightItr, float mean) const;
+    void forward(const float* input, float* output) const override;
+    double getForwardFlop() const override;
+    double getBackwardFlop() const override;
+    const char* getTypeName() const override{return "Standardize";}
+    bool checkShape() const override;
+    void backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard) override;
+    void standardize(float* leftItr, float* rightItr) const;
+    float getMean(const float* leftItr, const float* rightItr) const;
+    float getStddev(const float* leftItr, const float* rightItr, float mean) const;
 private:
     int numBatch;
 };
@@ -0,0 +1,68 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/* ======================
+    Optimizer
+   ======================*/
+// 重みの更新に使う最適化手法(DeepNetwork::setOptimizer)
+// 勾配はL2正則化の項(weightDecay * param)を足してから各手法に渡す
+enum class OptimizerType
+{
+    SGD,  // param -= learningRate * g
+    MOMENTUM,  // 勾配の移動平均(速度)の方向に進む
+    ADAM  // 勾配の1次、2次のモーメントで要素ごとに歩幅を変える
+};
+
+struct OptimizerConfig
+{
+    OptimizerType type = OptimizerType::SGD;
+    float learningRate = 0.02F;
+    float weightDecay = 0.001F;  // L2正則化の係数
+    float momentum = 0.9F;  // MOMENTUMのみ
+    float beta1 = 0.9F;  // ADAMのみ
+    float beta2 = 0.999F;
+    float epsilon = 1e-8F;
+};
+
+struct OptimizerStepParam;  // simd.h
+
+// 係数が範囲外ならstd::cerrに理由を出してfalseを返す
+bool checkOptimizerConfig(const OptimizerConfig& config);
+
+// 1つのパラメータ(重み、バイアスなど)に対する最適化手法の状態
+// MOMENTUMは速度、ADAMは1次と2次のモーメントをパラメータと同じ大きさで持つ
+class OptimizerState
+{
+public:
+    OptimizerState() = default;
+    OptimizerState(const OptimizerState&) = delete;
+    OptimizerState& operator=(const OptimizerState&) = delete;
+    // 状態をsize個分の0にし、ステップ数を0に戻す(重みを初期化した時や、手法を変えた時)
+    void reset(const OptimizerConfig& config, size_t size);
+    // gradScale * grad + config.weightDecay * decayScale * paramを勾配として、
+    // paramを1ステップ更新する(simd.hのsgdStepなど)
+    // 状態の大きさがsizeと違えば、先にresetする
+    // Hogwildでは複数のスレッドから同時に呼ばれるので、その前にresetで大きさを合わせておくこと
+    void step(const OptimizerConfig& config, float* param, const float* grad, size_t size,
+              float gradScale, float decayScale);
+    // sizeをrowSizeずつの行に分け、勾配が0でない行だけをstepと同じく更新する(Hogwild)
+    // 勾配の来ない行はL2正則化の減衰も状態の更新も行わないので、他のスレッドとの書き込みの衝突が減る
+    void stepTouchedRows(const OptimizerConfig& config, float* param, const float* grad, size_t size,
+                         size_t rowSize, float gradScale, float decayScale);
+    // 状態として持っているfloatの数
+    size_t getStateSize() const{return first.size() + second.size();}
+
+private:
+    static size_t getNumStateVector(OptimizerType type);
+    // 状態の大きさを合わせ、1ステップ分の係数を求める(ADAMはステップ数を進める)
+    OptimizerStepParam beginStep(const OptimizerConfig& config, size_t size, float gradScale, float decayScale);
+    // [offset, offset + n)の要素を更新する
+    void stepRange(const OptimizerConfig& config, const OptimizerStepParam& p,
+                   float* param, const float* grad, size_t offset, size_t n);
+    std::vector<float> first;  // MOMENTUMの速度、ADAMの1次のモーメント
+    std::vector<float> second;  // ADAMの2次のモーメント
+    std::atomic<uint64_t> numStep{0};  // ADAMのバイアス補正に使う
+};
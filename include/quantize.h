@@ -0,0 +1,60 @@
+#pragma once
+#include "weight_file.h"
+#include <cstdint>
+#include <vector>
+
+/* ======================
+    Int8 quantization
+   ======================*/
+// 学習後の量子化(post-training quantization)
+// 重みは出力チャネル(行)ごとのスケール、入力は層ごとのスケールで、0を中心に対称にint8へ丸める
+//   weight ≈ q_w * weightScale[row], input ≈ q_x * inputScale
+// 積和はint8 x int8 -> int32で正確に求め、最後にweightScale[row] * inputScaleを掛けてfloatに戻す
+// 入力のスケールは、キャリブレーション用の入力で調べた絶対値の最大から決める
+// 重みのメモリと、推論時に重みを読むバイト数はfloatの1/4になる
+constexpr int QUANTIZE_MAX = 127;
+
+// 絶対値の最大がmaxAbsの値を[-127, 127]に写すスケール
+float getQuantizeScale(float maxAbs);
+// x / scaleを最も近い整数に丸め、[-127, 127]に収めてqに書く
+void quantize(const float* x, int n, float scale, int8_t* q);
+
+// input(numChannel x height x width)の、outY行目の出力に対応する窓を並べ、
+// rows(outWidth x (numChannel * windowSize * windowSize))に書く
+// 1行が出力1画素分の窓で、並びは重み(inCh x windowSize x windowSize)と同じ
+// ゼロパディングの部分は0(量子化しても0のまま)
+void im2rowS8(const int8_t* input, int width, int height, int numChannel,
+              int windowSize, int zeroPad, int stride, int outY, int8_t* rows);
+
+// 行ごとに量子化した重み(rows x cols, row-major)
+class QuantizedWeight
+{
+public:
+    QuantizedWeight() = default;
+    // weightを行ごとに量子化する。inputScaleは入力を量子化する時のスケール
+    QuantizedWeight(const float* weight, int rows, int cols, float inputScale);
+    bool empty() const{return rows == 0;}
+    float getInputScale() const{return inputScale;}
+    // saveWeightBinaryで保存するテンソル(int8の重み, 行ごとのスケール, 入力のスケール)
+    std::vector<TensorView> getTensors() const;
+    // getTensorsで保存したテンソルを受け取る。int8の重みはファイル上の領域をそのまま使う
+    // 数や大きさが合わなければfalseを返す
+    bool setTensors(const MappedTensor& weight, const MappedTensor& scale,
+                    const MappedTensor& inputScale, int rows, int cols);
+    // y[row * yStride] = (weight * x)[row]
+    // xはgetInputScale()で量子化した入力。accはrows個分の作業領域
+    void apply(const int8_t* x, int32_t* acc, float* y, int yStride) const;
+
+private:
+    const int8_t* getData() const{return mapped.data != nullptr ? mapped.get<int8_t>() : data.data();}
+    // VNNIの補正に使う行ごとの和を求める
+    void calcRowSum();
+    int rows = 0;
+    int cols = 0;
+    std::vector<int8_t> data;
+    // loadWeightBinaryで読み込んだ重み。読み込んでいなければdataはnullptr
+    MappedTensor mapped;
+    std::vector<float> scale;
+    std::vector<int32_t> rowSum;
+    float inputScale = 0;
+};
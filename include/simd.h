@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+
+/* ======================
+    SIMD kernels
+   ======================*/
+// 全結合層で使うベクトル演算
+// 実行時にCPUの対応状況を調べ、使える中で最も速い実装を選ぶ
+// int8の演算は、VNNI(AVX512_VNNI, AVX-VNNI)があればそれを使う
+enum class SimdLevel
+{
+    SCALAR,
+    AVX2,  // AVX2 + FMA
+    AVX512  // AVX-512F
+};
+
+// このCPUで使える最も速い実装
+SimdLevel getSupportedSimdLevel();
+SimdLevel getSimdLevel();
+// 使う実装を切り替える(テストや性能比較用)
+// CPUが対応していない実装は選べない
+bool setSimdLevel(SimdLevel level);
+
+// x . y
+float sdot(int n, const float* x, const float* y);
+// y += alpha * x
+void saxpy(int n, float alpha, const float* x, float* y);
+// y(M) = A(M x N) * x(N)。Aはrow-major
+void sgemv(int M, int N, const float* A, int lda, const float* x, float* y);
+// numX本のxについてまとめてsgemvを行う。Yのk行目 = A(M x N) * (Xのk行目)
+// Aの数行をキャッシュに載せたまますべてのxに使うので、Aをメモリから読むのは1回で済む
+void sgemvBatch(int M, int N, const float* A, int lda, int numX, const float* X, int ldx,
+                float* Y, int ldy);
+// y(N) += A(M x N)^T * x(M)。Aはrow-major
+void sgemvTrans(int M, int N, const float* A, int lda, const float* x, float* y);
+
+// y(M) = A(M x N) * x(N)をint32で正確に求める。Aはrow-major
+// rowSum[m]はAのm行目の和(VNNIでxを符号なしにずらした分の補正に使う)
+// Aの値は[-127, 127]であること
+void s8gemv(int M, int N, const int8_t* A, int lda, const int32_t* rowSum,
+            const int8_t* x, int32_t* y);
+// q = round(x * invScale)を[-127, 127]に収めたもの
+void s8quantize(int n, float invScale, const float* x, int8_t* q);
+// 16bit浮動小数点の形式
+enum class HalfType
+{
+    FP16,  // IEEE 754 binary16
+    BF16  // bfloat16(floatの上位16bit)
+};
+
+// y = xを16bitに丸めたもの(最近接偶数丸め)。FP16の範囲を超える値は無限大になる
+// F16Cがあればそれを使う
+void toHalf(HalfType type, int n, const float* x, uint16_t* y);
+// y = xをfloatに戻したもの(誤差なし)
+void fromHalf(HalfType type, int n, const uint16_t* x, float* y);
+// y(M) = A(M x N) * x(N)。Aはrow-majorの16bitで、読みながらfloatに戻す
+void hgemv(HalfType type, int M, int N, const uint16_t* A, int lda, const float* x, float* y);
+
+// 最適化手法の1ステップ(optimizer.h)の係数
+// 各要素について g = gradScale * grad + decay * param を勾配とし、
+// SGD:      param -= lr * g
+// Momentum: velocity = momentum * velocity + g, param -= lr * velocity
+// Adam:     m = beta1 * m + (1 - beta1) * g, v = beta2 * v + (1 - beta2) * g^2,
+//           param -= lr * m / (sqrt(v) + epsilon)
+//           (バイアス補正は呼ぶ側でlrとepsilonに含めておく)
+// 状態とparamを1回ずつ読み書きするだけで済むよう、1つのループでまとめて計算する
+struct OptimizerStepParam
+{
+    float lr;
+    float gradScale;
+    float decay;
+    float momentum;
+    float beta1;
+    float beta2;
+    float epsilon;
+};
+void sgdStep(int n, const OptimizerStepParam& p, const float* grad, float* param);
+void momentumStep(int n, const OptimizerStepParam& p, const float* grad, float* velocity, float* param);
+void adamStep(int n, const OptimizerStepParam& p, const float* grad, float* m, float* v, float* param);
+
+// このCPUでint8の演算にVNNIを使えるか
+bool hasVnni();
@@ -0,0 +1,39 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+/* ======================
+    ThreadPool
+   ======================*/
+// 固定数のワーカースレッドでタスクを並列に処理する
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numThread);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    int getNumThread() const{return workers.size();}
+    // [0, numTask)の各タスクをワーカーに割り振り、すべて終わるまで待つ
+    // funcには(タスク番号, ワーカー番号)が渡される
+    // 複数のスレッドから同時に呼んではならない
+    void parallelFor(int numTask, const std::function<void(int, int)>& func);
+
+private:
+    void workerLoop(int workerId);
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable cvStart;
+    std::condition_variable cvDone;
+    const std::function<void(int, int)>* job;
+    int numTask;
+    std::atomic<int> nextTask;
+    int numRunning;
+    uint64_t generation;
+    bool stop;
+};
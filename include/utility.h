@@ -13,4 +13,13 @@ void printVector(const std::vector<X>& vec)
     std::cout << std::endl;
 }
 
+template <class X>
+void printVector(const X* data, size_t size)
+{
+    for(size_t i = 0; i < size; i++){
+        std::cout << data[i] << ", ";
+    }
+    std::cout << std::endl;
+    std::cout << std::endl;
+}
 
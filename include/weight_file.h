@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* ======================
+    Binary weight file
+   ======================*/
+// バイナリ形式の重みファイル
+// 値はすべて書き込んだマシンのバイトオーダーで格納する
+//
+// WeightFileHeader
+// 層ごとに: WeightLayerHeader, WeightTensorHeader x numTensor
+// テンソルの中身(ファイル先頭からTENSOR_ALIGNMENTバイト境界に揃える)
+constexpr char WEIGHT_FILE_MAGIC[8] = {'C', 'N', 'N', 'W', 'G', 'H', 'T', '\0'};
+// version 2: WeightLayerHeaderにstrideを追加(version 1の値は0で、strideは1とみなす)
+// version 3: WeightTensorHeaderに要素の型を追加(version 2まではすべてfloat)
+constexpr uint32_t WEIGHT_FILE_VERSION = 3;
+constexpr size_t TENSOR_ALIGNMENT = 64;
+
+enum class TensorType : uint32_t
+{
+    FLOAT32,
+    INT8,
+    FLOAT16,  // IEEE 754 binary16
+    BFLOAT16
+};
+
+// 要素1つのバイト数。未知の型なら0
+size_t getTensorTypeSize(TensorType type);
+
+struct WeightFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numLayer;
+    uint64_t fileSize;
+};
+
+struct WeightLayerHeader
+{
+    int32_t inputWidth;
+    int32_t inputHeight;
+    int32_t numInputChannel;
+    int32_t outputWidth;
+    int32_t outputHeight;
+    int32_t numOutputChannel;
+    uint32_t numTensor;
+    int32_t stride;
+};
+
+struct WeightTensorHeader
+{
+    uint64_t offset;  // ファイル先頭からのバイト数
+    uint64_t size;  // 要素数
+    uint32_t type;  // TensorType
+    uint32_t reserved;
+};
+// version 2までのWeightTensorHeaderの大きさ(offsetとsizeだけ)
+constexpr size_t WEIGHT_TENSOR_HEADER_SIZE_V2 = 16;
+
+// 層が持つテンソルの一部を指す
+struct TensorView
+{
+    const void* data;
+    size_t size;  // 要素数
+    TensorType type = TensorType::FLOAT32;
+};
+
+// ファイル全体を読み込み専用でmmapする
+// 層はファイル上の重みを直接参照するので、参照している間はshared_ptrで保持しておく
+class MappedFile
+{
+public:
+    static std::shared_ptr<const MappedFile> open(const std::string& filename);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+    const char* data() const{return addr;}
+    size_t size() const{return length;}
+
+private:
+    MappedFile(const char* addr, size_t length) : addr(addr), length(length){}
+    const char* addr;
+    size_t length;
+};
+
+// mmapしたファイル上のテンソル
+// 書き換える時は、層が自分の領域にコピーしてから書き換える(copy-on-write)
+struct MappedTensor
+{
+    const void* data = nullptr;
+    size_t size = 0;  // 要素数
+    TensorType type = TensorType::FLOAT32;
+    std::shared_ptr<const MappedFile> file;
+    template<class T>
+    const T* get() const{return static_cast<const T*>(data);}
+};
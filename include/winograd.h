@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+
+/* ======================
+    Winograd
+   ======================*/
+// 3x3の窓の畳み込みを、Winogradの最小フィルタリング F(m x m, 3 x 3) で計算する
+// 出力をm x mのタイルに分け、タイルごとに(m+2)x(m+2)の入力と重みを変換して要素積を取る
+// 要素積はタイルの画素位置ごとに (outCh x inCh) * (inCh x タイル数) のGEMMにまとめる
+// 積和の回数は直接法の 9m^2/(m+2)^2 分の1 (F(2x2, 3x3)で1/2.25, F(4x4, 3x3)で1/4)
+//
+// 誤差: 変換で足し引きする分だけ直接法と丸め方が変わる
+// 入力と重みが[-1, 1]程度のとき、直接法との差は出力の最大絶対値の
+// F(2x2, 3x3)で1e-6以下、F(4x4, 3x3)で1e-5以下(変換行列の係数が大きい分、誤差も大きい)
+constexpr int WINOGRAD_WINDOW_SIZE = 3;
+
+// input(batch x numInChannel x height x width)をweight(numOutChannel x numInChannel x 3 x 3)で畳み込み、
+// output(batch x numOutChannel x outHeight x outWidth)に書き込む。biasは足さない
+// tileSizeは出力タイルの一辺(2か4)
+void winogradConvolution(int tileSize, const float* input, int width, int height,
+                         int numInChannel, const float* weight, int numOutChannel,
+                         int zeroPad, float* output, int batchSize);
+
+// propError(batch x numOutChannel x outHeight x outWidth)とinputから求めた重みの勾配を、
+// dEdw(numOutChannel x numInChannel x 3 x 3)に足し込む
+// dEdw = G^T [(A propError A^T) ∘ (B^T input B)] G をタイルについて足し合わせる
+void winogradWeightGradient(int tileSize, const float* input, int width, int height,
+                            int numInChannel, const float* propError, int numOutChannel,
+                            int zeroPad, float* dEdw, int batchSize);
+
+// 上の2つが作業領域から確保するfloatの個数
+size_t getWinogradWorkspaceSize(int tileSize, int width, int height, int numInChannel,
+                                int numOutChannel, int zeroPad, int batchSize);
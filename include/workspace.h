@@ -0,0 +1,58 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+/* ======================
+    Workspace
+   ======================*/
+// 一時領域を切り出すためのアリーナ
+// 切り出した領域はスタックのように後から順に解放する(WorkspaceScopeを使う)
+// 容量が足りない場合は別に確保してしのぎ、すべて解放された時点で
+// それまでの最大使用量に合わせて領域を確保し直す
+class Workspace
+{
+public:
+    Workspace();
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+    // 少なくともsize個分のfloatを使えるようにしておく
+    // 切り出し中の領域がない時にのみ呼べる
+    void reserve(size_t size);
+    // size個分の領域を切り出す。先頭は64バイト境界に揃える
+    float* allocate(size_t size);
+    size_t getMarker() const{return offset;}
+    // getMarkerで得た位置まで巻き戻す
+    void release(size_t marker);
+    size_t getCapacity() const{return capacity;}
+    size_t getPeakUsage() const{return peak;}
+    // 呼び出したスレッド専用のWorkspace
+    static Workspace& getThreadLocal();
+    // allocate(size)が実際に消費する大きさ
+    // 必要な容量を見積もる時は、切り出す領域ごとにこれを足し合わせる
+    static size_t getAlignedSize(size_t size){return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;}
+
+private:
+    static constexpr size_t ALIGNMENT = 64 / sizeof(float);
+    std::vector<float> buffer;
+    float* base;
+    size_t capacity;
+    size_t offset;
+    size_t peak;
+    // 容量を超えて切り出した領域と、その切り出し位置
+    std::vector<std::pair<size_t, std::vector<float>>> overflow;
+};
+
+// スコープを抜ける時に、スコープ内で切り出した領域をまとめて解放する
+class WorkspaceScope
+{
+public:
+    explicit WorkspaceScope(Workspace& ws) : ws(ws), marker(ws.getMarker()){}
+    ~WorkspaceScope(){ws.release(marker);}
+    WorkspaceScope(const WorkspaceScope&) = delete;
+    WorkspaceScope& operator=(const WorkspaceScope&) = delete;
+    float* allocate(size_t size){return ws.allocate(size);}
+
+private:
+    Workspace& ws;
+    size_t marker;
+};
@@ -1,19 +1,31 @@
 #include "cnn.h"
 #include "utility.h"
+#include "workspace.h"
 #include <iostream>
 #include <cassert>
 #include <iterator>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
 
 /* ======================
     DeepNetwork
    ======================*/
 DeepNetwork::DeepNetwork()
-    : minibatchSize(1), inputCount(0), lossFunc(LossFunction::MSE)
+    : minibatchSize(1), inputCount(0), lossFunc(LossFunction::MSE),
+      inferenceMode(InferenceMode::FLOAT32), updateMode(UpdateMode::MINIBATCH),
+      activationType(TensorType::FLOAT32), checkpointMode(false), checkpointSegmentLength(0),
+      compiled(false), activationOffsets(1, 0), argmaxOffsets(1, 0), maxDataSize(0),
+      profileMode(false)
 {
 }
 
 DeepNetwork::DeepNetwork(int mbSize)
-    : minibatchSize(mbSize), inputCount(0), lossFunc(LossFunction::MSE)
+    : minibatchSize(mbSize), inputCount(0), lossFunc(LossFunction::MSE),
+      inferenceMode(InferenceMode::FLOAT32), updateMode(UpdateMode::MINIBATCH),
+      activationType(TensorType::FLOAT32), checkpointMode(false), checkpointSegmentLength(0),
+      compiled(false), activationOffsets(1, 0), argmaxOffsets(1, 0), maxDataSize(0),
+      profileMode(false)
 {
 }
 
@@ -26,6 +38,7 @@ bool DeepNetwork::setInputInfo(DataSize size, int numChannel)
 
     inputSize = size;
     numInputChannel = numChannel;
+    compiled = false;
 
     return true;
 }
@@ -38,52 +51,624 @@ void DeepNetwork::addLayer(std::shared_ptr<Layer> layer)
         layer->setInputInfo(layers.back()->getOutputSize(), layers.back()->getNumOutputChannel());
     }
     layer->calcOutputSize();
-    layer->initWeight();
+    if(initRng){
+        layer->initWeight((*initRng)());
+    }else{
+        layer->initWeight();
+    }
+    if(threadPool){
+        layer->setNumShard(threadPool->getNumThread());
+    }
+    layer->setOptimizer(optimizer);
+    if(updateMode == UpdateMode::HOGWILD){
+        layer->setHogwild(true);
+    }
     layers.emplace_back(layer);
+    profileCounters.emplace_back(std::make_unique<ProfileCounter>());
+    compiled = false;
+}
+
+void DeepNetwork::setSeed(uint32_t seed)
+{
+    initRng = std::make_unique<std::mt19937>(seed);
+}
+
+bool DeepNetwork::compile()
+{
+    compiled = false;
+    if(layers.empty()){
+        std::cerr << "ERROR: no layer" << std::endl;
+        return false;
+    }
+    if(inputSize.first <= 0 || inputSize.second <= 0 || numInputChannel <= 0){
+        std::cerr << "ERROR: input info is not set" << std::endl;
+        return false;
+    }
+
+    // 入力から順に、各層の入力が前の層の出力と一致し、層が計算できる形か確かめる
+    // (addLayerの後にsetInputInfoで入力を変えた場合などを捕まえる)
+    DataSize size = inputSize;
+    int numChannel = numInputChannel;
+    int index = 0;
+    for(const auto& layer : layers){
+        if(layer->getInputSize() != size || layer->getNumInputChannel() != numChannel){
+            std::cerr << "ERROR: layer " << index << " (" << layer->getTypeName()
+                      << "): input shape does not match the previous output" << std::endl;
+            return false;
+        }
+        if(!layer->checkShape()){
+            std::cerr << "ERROR: layer " << index << " (" << layer->getTypeName()
+                      << "): invalid shape" << std::endl;
+            return false;
+        }
+        size = layer->getOutputSize();
+        numChannel = layer->getNumOutputChannel();
+        index++;
+    }
+
+    maxDataSize = getInputDataSize();
+    for(const auto& layer : layers){
+        maxDataSize = std::max(maxDataSize, static_cast<size_t>(layer->getOutputDataSize()));
+    }
+
+    // 途中の層の出力のうち最大のものに合わせて、infer用の作業領域を確保しておく
+    inferWork.resize(getInferWorkSize(1));
+    inferOutput.resize(layers.back()->getOutputDataSize());
+
+    buildPlan(true, false, false, inferPlan);
+    buildPlan(false, true, false, quantizedInferPlan);
+    buildPlan(true, false, true, trainPlan);
+    buildPlan(false, false, true, layerwiseTrainPlan);
+    buildPlan(false, false, false, feedPlan);
+
+    // 学習時の区間
+    const int numStep = trainPlan.size();
+    int segmentLength = numStep;
+    if(checkpointMode){
+        segmentLength = 0 < checkpointSegmentLength ? checkpointSegmentLength
+            : std::max(1, static_cast<int>(std::lround(std::sqrt(numStep))));
+    }
+    segmentBegins.clear();
+    for(int step = 0; step < numStep; step += segmentLength){
+        segmentBegins.emplace_back(trainPlan.at(step).index);
+    }
+    segmentBegins.emplace_back(layers.size());
+
+    // 学習時に各層の出力とpoolのargmaxを置く位置
+    // 区間の途中の層の出力を先頭から詰めて置き、その後ろに区間の最後の層の出力を並べる
+    // 融合したステップの畳み込みの出力は書かないので、位置を取らない
+    activationOffsets.assign(layers.size() + 1, 0);
+    for(const auto& step : trainPlan){
+        if(step.kind == PlanStep::Kind::CONV_RELU_POOL){
+            activationOffsets.at(step.index) = NO_ACTIVATION;
+        }
+    }
+    argmaxOffsets.assign(layers.size() + 1, NO_ARGMAX);
+    size_t segmentSize = 0;
+    size_t argmaxSize = 0;
+    for(size_t segment = 0; segment + 1 < segmentBegins.size(); segment++){
+        const bool last = segment + 2 == segmentBegins.size();
+        size_t offset = 0;
+        size_t argmaxOffset = 0;
+        for(int index = segmentBegins.at(segment); index < segmentBegins.at(segment + 1); index++){
+            const auto& layer = layers.at(index);
+            if(dynamic_cast<PoolingLayer*>(layer.get()) != nullptr){
+                argmaxOffsets.at(index) = argmaxOffset;
+                argmaxOffset += layer->getOutputDataSize();
+            }
+            if(activationOffsets.at(index) == NO_ACTIVATION){
+                continue;
+            }
+            if(last || index + 1 < segmentBegins.at(segment + 1)){
+                activationOffsets.at(index) = offset;
+                offset += layer->getOutputDataSize();
+            }
+        }
+        segmentSize = std::max(segmentSize, offset);
+        argmaxSize = std::max(argmaxSize, argmaxOffset);
+    }
+    size_t checkpointOffset = segmentSize;
+    for(size_t segment = 1; segment + 1 < segmentBegins.size(); segment++){
+        const int index = segmentBegins.at(segment) - 1;
+        activationOffsets.at(index) = checkpointOffset;
+        checkpointOffset += layers.at(index)->getOutputDataSize();
+    }
+    activationOffsets.back() = checkpointOffset;
+    argmaxOffsets.back() = argmaxSize;
+    compiled = true;
+    return true;
+}
+
+void DeepNetwork::ensureCompiled()
+{
+    if(!compiled && !compile()){
+        std::cerr << "ERROR: failed to compile the network" << std::endl;
+        std::exit(1);
+    }
+}
+
+void DeepNetwork::buildPlan(bool fuse, bool quantized, bool argmax, std::vector<PlanStep>& steps) const
+{
+    steps.clear();
+    for(size_t index = 0; index < layers.size(); index++){
+        Layer* layer = layers.at(index).get();
+        PlanStep step = {PlanStep::Kind::FORWARD, static_cast<int>(index), 1, layer, nullptr,
+                         layer->getInputDataSize(), layer->getOutputDataSize(), ConvAlgorithm::AUTO};
+        auto pool = dynamic_cast<const PoolingLayer*>(layer);
+        auto conv = dynamic_cast<const ConvolutionLayer*>(layer);
+        if(conv != nullptr){
+            step.algorithm = conv->selectAlgorithm();
+        }
+        if(fuse && index + 2 < layers.size() && conv != nullptr
+            && dynamic_cast<ReLULayer*>(layers.at(index + 1).get()) != nullptr
+            && dynamic_cast<PoolingLayer*>(layers.at(index + 2).get()) != nullptr){
+            step.kind = PlanStep::Kind::CONV_RELU_POOL;
+            step.numLayer = 3;
+            step.pool = static_cast<const PoolingLayer*>(layers.at(index + 2).get());
+            step.outputDataSize = step.pool->getOutputDataSize();
+        }else if(argmax && pool != nullptr){
+            step.kind = PlanStep::Kind::POOL_ARGMAX;
+            step.pool = pool;
+        }else if(quantized){
+            step.kind = PlanStep::Kind::FORWARD_QUANTIZED;
+        }else if(conv != nullptr){
+            step.kind = PlanStep::Kind::CONV;
+        }
+        steps.emplace_back(step);
+        index += step.numLayer - 1;
+    }
+}
+
+void DeepNetwork::forwardStep(const PlanStep& step, const float* input, float* output, int batchSize) const
+{
+    if(step.kind == PlanStep::Kind::CONV){
+        static_cast<const ConvolutionLayer&>(*step.layer).forwardBatch(input, output, batchSize,
+                                                                      step.algorithm);
+    }else if(batchSize == 1){
+        step.layer->forward(input, output);
+    }else{
+        step.layer->forwardBatch(input, output, batchSize);
+    }
 }
 
 std::vector<std::vector<float>> DeepNetwork::feedInput(const std::vector<float>& input) const
 {
+    assert(input.size() == static_cast<size_t>(getInputDataSize()));
+    return feedInputBatch(input, 1);
+}
+
+const std::vector<float>& DeepNetwork::infer(const std::vector<float>& input)
+{
+    ensureCompiled();
+    assert(input.size() == static_cast<size_t>(getInputDataSize()));
+    inferBatch(input.data(), 1, inferOutput.data(), inferWork.data());
+    return inferOutput;
+}
+
+void DeepNetwork::inferBatch(const float* input, int batchSize, float* output)
+{
+    ensureCompiled();
+    assert(0 < batchSize);
+    auto& ws = Workspace::getThreadLocal();
+    if(ws.getMarker() == 0){
+        size_t layerWorkspaceSize = 0;
+        for(const auto& layer : layers){
+            layerWorkspaceSize = std::max(layerWorkspaceSize, layer->getWorkspaceSize(batchSize));
+        }
+        ws.reserve(Workspace::getAlignedSize(getInferWorkSize(batchSize)) + layerWorkspaceSize);
+    }
+    WorkspaceScope scope(ws);
+    inferBatch(input, batchSize, output, scope.allocate(getInferWorkSize(batchSize)));
+}
+
+void DeepNetwork::inferBatch(const float* input, int batchSize, float* output, float* work) const
+{
+    assert(compiled);
+    assert(0 < batchSize);
+    const auto& plan = inferenceMode == InferenceMode::INT8 ? quantizedInferPlan : inferPlan;
+    // 途中の層の出力は、workの前半と後半を交互に使う
+    float* buffers[2] = {work, work + maxDataSize * batchSize};
+    const float* src = input;
+    int bufIndex = 0;
+    for(const auto& step : plan){
+        float* dst = &step == &plan.back() ? output : buffers[bufIndex];
+        auto begin = startProfile();
+        switch(step.kind) {
+        case PlanStep::Kind::CONV_RELU_POOL:{
+            const auto& conv = static_cast<const ConvolutionLayer&>(*step.layer);
+            for(int n = 0; n < batchSize; n++){
+                conv.forwardReLUPool(src + n * step.inputDataSize, *step.pool,
+                                     dst + n * step.outputDataSize, nullptr, nullptr, step.algorithm);
+            }
+            break;
+        }
+        case PlanStep::Kind::FORWARD_QUANTIZED:
+            for(int n = 0; n < batchSize; n++){
+                step.layer->forwardQuantized(src + n * step.inputDataSize,
+                                             dst + n * step.outputDataSize);
+            }
+            break;
+        default:
+            forwardStep(step, src, dst, batchSize);
+            break;
+        }
+        recordForward(step.index, begin, batchSize);
+        // まとめた層の時間は先頭の層に計上する
+        auto end = startProfile();
+        for(int i = 1; i < step.numLayer; i++){
+            recordForward(step.index + i, end, batchSize);
+        }
+        src = dst;
+        bufIndex ^= 1;
+    }
+}
+
+void DeepNetwork::backPropagate(const std::vector<float>& input, const std::vector<float>& correctOutput, double reduceRate, bool verbose)
+{
+    ensureCompiled();
+    assert(0 < reduceRate && reduceRate <= 1.0);
+    assert(inputCount < minibatchSize);
+    assert(input.size() == static_cast<size_t>(getInputDataSize()));
+    assert(correctOutput.size() == static_cast<size_t>(layers.back()->getOutputDataSize()));
+
+    trainStep(input.data(), correctOutput.data(), 1, reduceRate, 0, verbose);
+
+    if(updateMode == UpdateMode::MINIBATCH && ++inputCount == minibatchSize) {
+        inputCount = 0;
+        flush();
+    }
+}
+
+std::vector<std::vector<float>> DeepNetwork::feedInputBatch(const std::vector<float>& input, int batchSize) const
+{
+    assert(0 < batchSize);
     std::vector<std::vector<float>> outputs;
     outputs.reserve(layers.size() + 1);
     outputs.emplace_back(input);
-    for(auto& layer : layers){
-        outputs.emplace_back(layer->apply(outputs.back()));
+    // constなのでcompileできない。compileしていなければ層を順に呼ぶ
+    if(!compiled){
+        int index = 0;
+        for(auto& layer : layers){
+            auto begin = startProfile();
+            outputs.emplace_back(batchSize == 1 ? layer->apply(outputs.back())
+                                 : layer->applyBatch(outputs.back(), batchSize));
+            recordForward(index++, begin, batchSize);
+        }
+        return outputs;
+    }
+    assert(input.size() == static_cast<size_t>(getInputDataSize()) * batchSize);
+    for(const auto& step : feedPlan){
+        auto begin = startProfile();
+        outputs.emplace_back(static_cast<size_t>(step.outputDataSize) * batchSize);
+        forwardStep(step, outputs.at(outputs.size() - 2).data(), outputs.back().data(), batchSize);
+        recordForward(step.index, begin, batchSize);
     }
     return outputs;
 }
 
-void DeepNetwork::backPropagate(const std::vector<float>& input, const std::vector<float>& correctOutput, double reduceRate, bool verbose)
+void DeepNetwork::backPropagateBatch(const std::vector<float>& input, const std::vector<float>& correctOutput,
+                                     int batchSize, double reduceRate)
 {
+    ensureCompiled();
     assert(0 < reduceRate && reduceRate <= 1.0);
-    assert(inputCount < minibatchSize);
+    assert(0 < batchSize);
+    assert(inputCount + batchSize <= minibatchSize);
+
+    assert(input.size() == static_cast<size_t>(getInputDataSize()) * batchSize);
+    assert(correctOutput.size() == static_cast<size_t>(layers.back()->getOutputDataSize()) * batchSize);
+
+    trainStep(input.data(), correctOutput.data(), batchSize, reduceRate, 0, false);
+
+    if(updateMode == UpdateMode::MINIBATCH && (inputCount += batchSize) == minibatchSize) {
+        inputCount = 0;
+        flush();
+    }
+}
+
+void DeepNetwork::setNumThread(int numThread)
+{
+    assert(0 < numThread);
+    threadPool = std::make_unique<ThreadPool>(numThread);
+    for(const auto& layer : layers){
+        layer->setNumShard(numThread);
+    }
+}
+
+void DeepNetwork::backPropagateParallel(const std::vector<std::vector<float>>& inputs,
+                                        const std::vector<std::vector<float>>& correctOutputs,
+                                        double reduceRate)
+{
+    assert(0 < reduceRate && reduceRate <= 1.0);
+    assert(inputs.size() == correctOutputs.size());
+    // 各スレッドが使う前に、呼び出したスレッドで済ませておく
+    ensureCompiled();
+    if(!threadPool){
+        setNumThread(1);
+    }
+
+    // Hogwildでは区切らず、すべてのサンプルを一度に割り振る
+    if(updateMode == UpdateMode::HOGWILD){
+        threadPool->parallelFor(inputs.size(), [&](int task, int worker){
+            backPropagateSample(inputs.at(task), correctOutputs.at(task), reduceRate, worker);
+        });
+        return;
+    }
+
+    // ミニバッチの区切りごとにflushする
+    int begin = 0;
+    while(static_cast<size_t>(begin) < inputs.size()){
+        assert(inputCount < minibatchSize);
+        const int numSample = std::min(static_cast<int>(inputs.size()) - begin,
+                                       minibatchSize - inputCount);
+        threadPool->parallelFor(numSample, [&](int task, int worker){
+            backPropagateSample(inputs.at(begin + task), correctOutputs.at(begin + task),
+                                reduceRate, worker);
+        });
+        begin += numSample;
+        if((inputCount += numSample) == minibatchSize) {
+            inputCount = 0;
+            flush();
+        }
+    }
+}
+
+void DeepNetwork::backPropagateSample(const std::vector<float>& input, const std::vector<float>& correctOutput,
+                                      double reduceRate, int shard)
+{
+    assert(input.size() == static_cast<size_t>(getInputDataSize()));
+    assert(correctOutput.size() == static_cast<size_t>(layers.back()->getOutputDataSize()));
+    trainStep(input.data(), correctOutput.data(), 1, reduceRate, shard, false);
+}
+
+size_t DeepNetwork::getTrainWorkspaceSize(int batchSize) const
+{
+    // 各層の出力、poolのargmax、誤差2つ分、各層の一時領域のうち最大のもの
+    // 出力を16bitで持つ場合は、floatで計算するための領域3つ分を加える
+    size_t layerWorkspaceSize = 0;
+    for(const auto& layer : layers){
+        layerWorkspaceSize = std::max(layerWorkspaceSize, layer->getWorkspaceSize(batchSize));
+    }
+    const bool halfActivation = activationType != TensorType::FLOAT32;
+    return Workspace::getAlignedSize(getActivationStorageSize(batchSize))
+        + Workspace::getAlignedSize(argmaxOffsets.back() * batchSize)
+        + (halfActivation ? 5 : 2) * Workspace::getAlignedSize(maxDataSize * batchSize)
+        + layerWorkspaceSize;
+}
+
+size_t DeepNetwork::getActivationStorageSize(int batchSize) const
+{
+    const size_t numActivation = activationOffsets.back() * batchSize;
+    if(activationType == TensorType::FLOAT32){
+        return numActivation;
+    }
+    static_assert(2 * sizeof(uint16_t) == sizeof(float));
+    return (numActivation + 1) / 2;
+}
+
+void DeepNetwork::trainStep(const float* input, const float* correctOutput, int batchSize,
+                            double reduceRate, int shard, bool verbose)
+{
+    assert(compiled);
+    assert(activationOffsets.size() == layers.size() + 1);
+    auto& ws = Workspace::getThreadLocal();
+    if(ws.getMarker() == 0){
+        ws.reserve(getTrainWorkspaceSize(batchSize));
+    }
+    WorkspaceScope scope(ws);
+    // 16bitの場合、各層の出力はactivationsに丸めて保持し、計算はfloatのscratchで行う
+    const bool halfActivation = activationType != TensorType::FLOAT32;
+    float* activations = scope.allocate(getActivationStorageSize(batchSize));
+    auto halfActivations = reinterpret_cast<uint16_t*>(activations);
+    static_assert(sizeof(int32_t) == sizeof(float));
+    auto argmaxes = reinterpret_cast<int32_t*>(scope.allocate(argmaxOffsets.back() * batchSize));
+    float* propError = scope.allocate(maxDataSize * batchSize);
+    float* nextPropError = scope.allocate(maxDataSize * batchSize);
+    float* scratch[3] = {};
+    if(halfActivation){
+        for(auto& buf : scratch){
+            buf = scope.allocate(maxDataSize * batchSize);
+        }
+    }
+    auto getOutput = [&](int index){
+        return activations + activationOffsets.at(index) * batchSize;
+    };
+    auto getOutputSize = [&](int index){
+        return layers.at(index)->getOutputDataSize() * batchSize;
+    };
+    // 順伝播で層の出力を書く先
+    // 16bitの場合はscratchを順に使う(融合時も入力、ReLUの出力、poolの出力が重ならない)
+    int scratchIndex = 0;
+    // 保持しない出力(verbose時に1層ずつ計算する、融合する畳み込みの出力)は、
+    // 順伝播の間は使わないnextPropErrorに置く
+    auto getForwardOutput = [&](int index){
+        if(!halfActivation){
+            return activationOffsets.at(index) == NO_ACTIVATION ? nextPropError : getOutput(index);
+        }
+        float* buf = scratch[scratchIndex];
+        scratchIndex = (scratchIndex + 1) % 3;
+        return buf;
+    };
+    auto saveOutput = [&](int index, const float* output){
+        if(halfActivation && activationOffsets.at(index) != NO_ACTIVATION){
+            toHalf(getHalfType(activationType), getOutputSize(index), output,
+                   halfActivations + activationOffsets.at(index) * batchSize);
+        }
+    };
+    // 保持した出力をfloatで返す。16bitの場合はbufに戻す
+    // 保持しない出力はnullptr(ReLUと畳み込みの逆伝播は、それぞれ入力と出力を読まない)
+    auto loadOutput = [&](int index, float* buf) -> const float*{
+        if(activationOffsets.at(index) == NO_ACTIVATION){
+            return nullptr;
+        }
+        if(!halfActivation){
+            return getOutput(index);
+        }
+        fromHalf(getHalfType(activationType), getOutputSize(index),
+                 halfActivations + activationOffsets.at(index) * batchSize, buf);
+        return buf;
+    };
+    // poolでなければnullptr
+    auto getArgmax = [&](int index) -> int32_t*{
+        if(argmaxOffsets.at(index) == NO_ARGMAX){
+            return nullptr;
+        }
+        return argmaxes + argmaxOffsets.at(index) * batchSize;
+    };
+
+    /* Forward */
+    // 融合する場合、逆伝播で参照するReLUとpoolの出力だけを書き込む
+    // 畳み込みの出力は書かないので、verbose時は融合しない
+    // poolはmaxを取った位置も記録し、逆伝播では窓を走査し直さずにそこへ誤差を戻す
+    const auto& plan = verbose ? layerwiseTrainPlan : trainPlan;
+    std::vector<float> printBuf;
+    if(verbose) {
+        std::cout << "outputs" << std::endl;
+        printVector(input, getInputDataSize() * batchSize);
+        printBuf.resize(maxDataSize * batchSize);
+    }
+    // segment番目の区間を、その入力srcから順伝播し、区間の最後の層の出力を返す
+    // recomputeなら、逆伝播のための順伝播のやり直しとして記録する
+    auto forwardSegment = [&](int segment, const float* src, bool print, bool recompute){
+        for(const auto& step : plan){
+            const int index = step.index;
+            if(index < segmentBegins.at(segment) || segmentBegins.at(segment + 1) <= index){
+                continue;
+            }
+            float* dst;
+            auto begin = startProfile();
+            switch(step.kind) {
+            case PlanStep::Kind::CONV_RELU_POOL:{
+                const auto& conv = static_cast<const ConvolutionLayer&>(*step.layer);
+                float* reluOutput = getForwardOutput(index + 1);
+                dst = getForwardOutput(index + 2);
+                int32_t* argmax = getArgmax(index + 2);
+                for(int n = 0; n < batchSize; n++){
+                    conv.forwardReLUPool(src + n * step.inputDataSize, *step.pool,
+                                         dst + n * step.outputDataSize,
+                                         reluOutput + n * conv.getOutputDataSize(),
+                                         argmax + n * step.outputDataSize, step.algorithm);
+                }
+                saveOutput(index + 1, reluOutput);
+                break;
+            }
+            case PlanStep::Kind::POOL_ARGMAX:{
+                dst = getForwardOutput(index);
+                int32_t* argmax = getArgmax(index);
+                for(int n = 0; n < batchSize; n++){
+                    step.pool->forwardArgmax(src + n * step.inputDataSize,
+                                             dst + n * step.outputDataSize,
+                                             argmax + n * step.outputDataSize);
+                }
+                break;
+            }
+            default:
+                dst = getForwardOutput(index);
+                forwardStep(step, src, dst, batchSize);
+                break;
+            }
+            auto end = startProfile();
+            for(int i = 0; i < step.numLayer; i++){
+                // まとめた層の時間は先頭の層に付ける
+                const auto layerBegin = i == 0 ? begin : end;
+                if(recompute){
+                    recordRecompute(index + i, layerBegin);
+                }else{
+                    recordForward(index + i, layerBegin, batchSize);
+                }
+            }
+            saveOutput(index + step.numLayer - 1, dst);
+            // verbose時は層ごとのステップなので、各層の出力を1回ずつ表示する
+            if(print) {
+                const float* output = loadOutput(index, printBuf.data());
+                printVector(output != nullptr ? output : dst, getOutputSize(index));
+            }
+            src = dst;
+        }
+        return src;
+    };
+    const int numSegment = segmentBegins.size() - 1;
+    const float* src = input;
+    for(int segment = 0; segment < numSegment; segment++){
+        src = forwardSegment(segment, src, verbose, false);
+    }
+    const int outputDataSize = layers.back()->getOutputDataSize() * batchSize;
+    calcPropError(src, correctOutput, outputDataSize, propError);
+
+    if(verbose) {
+        std::cout << "Initial propError:" << std::endl;
+        printVector(propError, outputDataSize);
+    }
 
-    auto outputs = feedInput(input);
-    std::vector<float> propError(outputs.back().size());
-    assert(outputs.back().size() == correctOutput.size());
+    /* Backward */
+    // 最終層の出力は、順伝播で計算したfloatの値をそのまま使う
+    // 16bitの場合、ある層の入力として戻した値を、次に処理する前の層の出力として使い回す
+    const float* layerOutput = src;
+    for(int segment = numSegment - 1; 0 <= segment; segment--){
+        const int segmentBegin = segmentBegins.at(segment);
+        const int segmentEnd = segmentBegins.at(segment + 1);
+        if(segment != numSegment - 1){
+            // 途中の層の出力は後の区間に上書きされているので、区間の入力から作り直す
+            // 区間の最後の層の出力も書き直すが、後の区間の逆伝播は済んでいる
+            // 16bitの場合、入力をscratch[2]に戻し、順伝播はscratch[0]から使う
+            const float* segmentInput = segmentBegin == 0 ? input : loadOutput(segmentBegin - 1, scratch[2]);
+            scratchIndex = 0;
+            forwardSegment(segment, segmentInput, false, true);
+            layerOutput = loadOutput(segmentEnd - 1, scratch[2]);
+        }
+        for(int index = segmentEnd - 1; segmentBegin <= index; index--){
+            Layer& layer = *layers[index];
+            const float* layerInput = index == 0 ? input
+                : loadOutput(index - 1, layerOutput == scratch[0] ? scratch[1] : scratch[0]);
+            auto begin = startProfile();
+            if(const int32_t* argmax = getArgmax(index); argmax != nullptr){
+                const auto& pool = static_cast<const PoolingLayer&>(layer);
+                for(int n = 0; n < batchSize; n++){
+                    pool.backwardArgmax(argmax + n * pool.getOutputDataSize(),
+                                        propError + n * pool.getOutputDataSize(),
+                                        nextPropError + n * pool.getInputDataSize());
+                }
+            }else if(batchSize == 1){
+                layer.backward(layerInput, layerOutput, propError, nextPropError,
+                               reduceRate, shard);
+            }else{
+                layer.backwardBatch(layerInput, layerOutput, propError, nextPropError,
+                                    batchSize, reduceRate, shard);
+            }
+            recordBackward(index, begin, batchSize);
+            std::swap(propError, nextPropError);
+            if(verbose) {
+                std::cout << "Next propError:" << std::endl;
+                printVector(propError, layer.getInputDataSize() * batchSize);
+            }
+            layerOutput = layerInput;
+        }
+    }
+}
 
+void DeepNetwork::calcPropError(const float* output, const float* correctOutput,
+                                int dataSize, float* propError) const
+{
     switch(lossFunc) {
     case LossFunction::MSE:
-        for(int i = 0; static_cast<size_t>(i) < outputs.back().size();
-                i++){
-            propError.at(i) = outputs.back().at(i) - correctOutput.at(i);
+        for(int i = 0; i < dataSize; i++){
+            propError[i] = output[i] - correctOutput[i];
         }
         break;
     case LossFunction::CRS_ENT:
         // 損失関数: -y_c log(y) - (1-y_c)log(1-y)
         // 微分: -y_c/y + (1-y_c)/(1-y)
-        for(int i = 0; static_cast<size_t>(i) < outputs.back().size();
-                i++){
+        for(int i = 0; i < dataSize; i++){
             float divisor1, divisor2;
-            assert(0 <= outputs.back().at(i)
-                && outputs.back().at(i) <= 1.0);
-            if(correctOutput.at(i) != 0.0) {
-                divisor1 = std::max(1e-5F, outputs.back().at(i));
-                propError.at(i) -= correctOutput.at(i) / divisor1;
+            assert(0 <= output[i]
+                && output[i] <= 1.0);
+            propError[i] = 0;
+            if(correctOutput[i] != 0.0) {
+                divisor1 = std::max(1e-5F, output[i]);
+                propError[i] -= correctOutput[i] / divisor1;
             }
-            if(correctOutput.at(i) != 1.0) {
-                divisor2 = std::max(1e-5F, 1 - outputs.back().at(i));
-                propError.at(i) += (1.0 - correctOutput.at(i)) / divisor2;
+            if(correctOutput[i] != 1.0) {
+                divisor2 = std::max(1e-5F, 1 - output[i]);
+                propError[i] += (1.0 - correctOutput[i]) / divisor2;
             }
         }
         break;
@@ -91,38 +676,8 @@ void DeepNetwork::backPropagate(const std::vector<float>& input, const std::vect
         std::cerr << "Invalid loss function." << std::endl;
         std::exit(1);
     }
-
-    if(verbose) {
-        std::cout << "outputs" << std::endl;
-        for(auto output : outputs){
-            assert(!output.empty());
-            printVector(output);
-        }
-
-        std::cout << "Initial propError:" << std::endl;
-        printVector(propError);
-    }
-
-    int index = outputs.size() - 1;
-    assert(outputs.size() - 1 == layers.size());
-
-    for(auto layer = std::rbegin(layers); layer != std::rend(layers); layer++){
-        propError = (*layer)->updateWeight(outputs.at(index - 1), outputs.at(index), propError, reduceRate);
-        if(verbose) {
-            std::cout << "Next propError:" << std::endl;
-            printVector(propError);
-        }
-        index--;
-    }
-
-    inputCount++;
-    if(inputCount == minibatchSize) {
-        inputCount = 0;
-        flush();
-    }
 }
 
-
 void DeepNetwork::saveWeight(std::string filename) const
 {
     std::ofstream ofs(filename);
@@ -150,6 +705,296 @@ void DeepNetwork::loadWeight(std::string filename)
 }
 
 
+namespace {
+uint64_t alignOffset(uint64_t offset)
+{
+    return (offset + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+}
+}
+
+bool DeepNetwork::saveWeightBinary(std::string filename) const
+{
+    std::ofstream ofs(filename, std::ios::binary);
+    if(ofs.fail()){
+        std::cerr << "failed to open file " << filename << std::endl;
+        return false;
+    }
+
+    // ヘッダの大きさを求めてから、各テンソルの位置を決める
+    std::vector<std::vector<TensorView>> tensors;
+    uint64_t offset = sizeof(WeightFileHeader);
+    for(const auto& layer : layers){
+        tensors.emplace_back(layer->getTensors());
+        offset += sizeof(WeightLayerHeader) + sizeof(WeightTensorHeader) * tensors.back().size();
+    }
+    std::vector<uint64_t> tensorOffsets;
+    for(const auto& layerTensors : tensors){
+        for(const auto& tensor : layerTensors){
+            offset = alignOffset(offset);
+            tensorOffsets.emplace_back(offset);
+            offset += getTensorTypeSize(tensor.type) * tensor.size;
+        }
+    }
+
+    WeightFileHeader fileHeader;
+    std::memcpy(fileHeader.magic, WEIGHT_FILE_MAGIC, sizeof(fileHeader.magic));
+    fileHeader.version = WEIGHT_FILE_VERSION;
+    fileHeader.numLayer = layers.size();
+    fileHeader.fileSize = offset;
+    ofs.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+
+    auto offsetItr = std::begin(tensorOffsets);
+    auto tensorsItr = std::begin(tensors);
+    for(const auto& layer : layers){
+        WeightLayerHeader layerHeader = {};
+        layerHeader.inputWidth = layer->getInputSize().first;
+        layerHeader.inputHeight = layer->getInputSize().second;
+        layerHeader.numInputChannel = layer->getNumInputChannel();
+        layerHeader.outputWidth = layer->getOutputSize().first;
+        layerHeader.outputHeight = layer->getOutputSize().second;
+        layerHeader.numOutputChannel = layer->getNumOutputChannel();
+        layerHeader.numTensor = tensorsItr->size();
+        layerHeader.stride = layer->getStride();
+        ofs.write(reinterpret_cast<const char*>(&layerHeader), sizeof(layerHeader));
+        for(const auto& tensor : *tensorsItr){
+            WeightTensorHeader tensorHeader = {*offsetItr++, tensor.size,
+                                               static_cast<uint32_t>(tensor.type), 0};
+            ofs.write(reinterpret_cast<const char*>(&tensorHeader), sizeof(tensorHeader));
+        }
+        tensorsItr++;
+    }
+
+    offsetItr = std::begin(tensorOffsets);
+    for(const auto& layerTensors : tensors){
+        for(const auto& tensor : layerTensors){
+            // 境界に揃えるまで0で埋める
+            while(static_cast<uint64_t>(ofs.tellp()) < *offsetItr){
+                ofs.put(0);
+            }
+            offsetItr++;
+            ofs.write(static_cast<const char*>(tensor.data), getTensorTypeSize(tensor.type) * tensor.size);
+        }
+    }
+    if(ofs.fail()){
+        std::cerr << "failed to write file " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool DeepNetwork::loadWeightBinary(std::string filename)
+{
+    auto file = MappedFile::open(filename);
+    if(!file){
+        return false;
+    }
+
+    const char* data = file->data();
+    const size_t fileSize = file->size();
+    WeightFileHeader fileHeader;
+    if(fileSize < sizeof(fileHeader)){
+        std::cerr << "invalid weight file " << filename << std::endl;
+        return false;
+    }
+    std::memcpy(&fileHeader, data, sizeof(fileHeader));
+    if(std::memcmp(fileHeader.magic, WEIGHT_FILE_MAGIC, sizeof(fileHeader.magic)) != 0
+        || fileHeader.fileSize != fileSize){
+        std::cerr << "invalid weight file " << filename << std::endl;
+        return false;
+    }
+    if(fileHeader.version < 1 || WEIGHT_FILE_VERSION < fileHeader.version){
+        std::cerr << "unsupported weight file version " << fileHeader.version << std::endl;
+        return false;
+    }
+    if(fileHeader.numLayer != layers.size()){
+        std::cerr << "number of layers mismatch" << std::endl;
+        return false;
+    }
+
+    // すべての層のヘッダを確かめてから、層に渡す
+    size_t pos = sizeof(fileHeader);
+    // version 2まではtypeがなく、すべてfloat
+    const size_t tensorHeaderSize = fileHeader.version < 3 ?
+        WEIGHT_TENSOR_HEADER_SIZE_V2 : sizeof(WeightTensorHeader);
+    std::vector<std::vector<MappedTensor>> tensors;
+    for(const auto& layer : layers){
+        WeightLayerHeader layerHeader;
+        if(fileSize < pos + sizeof(layerHeader)){
+            std::cerr << "invalid weight file " << filename << std::endl;
+            return false;
+        }
+        std::memcpy(&layerHeader, data + pos, sizeof(layerHeader));
+        pos += sizeof(layerHeader);
+        if(layerHeader.inputWidth != layer->getInputSize().first
+            || layerHeader.inputHeight != layer->getInputSize().second
+            || layerHeader.numInputChannel != layer->getNumInputChannel()
+            || layerHeader.outputWidth != layer->getOutputSize().first
+            || layerHeader.outputHeight != layer->getOutputSize().second
+            || layerHeader.numOutputChannel != layer->getNumOutputChannel()
+            || (fileHeader.version < 2 ? 1 : layerHeader.stride) != layer->getStride()){
+            std::cerr << "layer shape mismatch" << std::endl;
+            return false;
+        }
+
+        tensors.emplace_back();
+        for(uint32_t i = 0; i < layerHeader.numTensor; i++){
+            WeightTensorHeader tensorHeader = {};
+            if(fileSize < pos + tensorHeaderSize){
+                std::cerr << "invalid weight file " << filename << std::endl;
+                return false;
+            }
+            std::memcpy(&tensorHeader, data + pos, tensorHeaderSize);
+            pos += tensorHeaderSize;
+            const size_t typeSize = getTensorTypeSize(static_cast<TensorType>(tensorHeader.type));
+            if(typeSize == 0
+                || tensorHeader.offset % TENSOR_ALIGNMENT != 0
+                || fileSize < tensorHeader.offset
+                || (fileSize - tensorHeader.offset) / typeSize < tensorHeader.size){
+                std::cerr << "invalid tensor in weight file " << filename << std::endl;
+                return false;
+            }
+            MappedTensor tensor;
+            tensor.data = data + tensorHeader.offset;
+            tensor.size = tensorHeader.size;
+            tensor.type = static_cast<TensorType>(tensorHeader.type);
+            tensor.file = file;
+            tensors.back().emplace_back(tensor);
+        }
+    }
+
+    auto tensorsItr = std::begin(tensors);
+    for(const auto& layer : layers){
+        if(!layer->setTensors(*tensorsItr++)){
+            return false;
+        }
+        // Hogwildでは直接書き換えるので、floatの重みを自分の領域に持たせる
+        if(updateMode == UpdateMode::HOGWILD){
+            layer->setWeightType(TensorType::FLOAT32);
+            layer->setHogwild(true);
+        }
+    }
+    // 量子化した重みを含んでいれば、int8で推論する
+    if(std::any_of(std::begin(layers), std::end(layers),
+                   [](const auto& layer){return layer->isQuantized();})){
+        inferenceMode = InferenceMode::INT8;
+    }
+    return true;
+}
+
+bool DeepNetwork::quantize(const std::vector<std::vector<float>>& calibrationInputs)
+{
+    if(layers.empty() || calibrationInputs.empty()){
+        std::cerr << "ERROR: no layer or calibration input" << std::endl;
+        return false;
+    }
+    if(updateMode == UpdateMode::HOGWILD){
+        std::cerr << "ERROR: cannot quantize in HOGWILD mode" << std::endl;
+        return false;
+    }
+    // 各層の入力の絶対値の最大
+    std::vector<float> inputMaxAbs(layers.size());
+    for(const auto& input : calibrationInputs){
+        if(input.size() != static_cast<size_t>(getInputDataSize())){
+            std::cerr << "ERROR: invalid calibration input size" << std::endl;
+            return false;
+        }
+        auto outputs = feedInput(input);
+        for(size_t i = 0; i < layers.size(); i++){
+            for(auto elem : outputs.at(i)){
+                inputMaxAbs.at(i) = std::max(inputMaxAbs.at(i), std::abs(elem));
+            }
+        }
+    }
+
+    int index = 0;
+    for(const auto& layer : layers){
+        if(layer->isQuantizable()){
+            layer->quantize(inputMaxAbs.at(index));
+        }
+        index++;
+    }
+    inferenceMode = InferenceMode::INT8;
+    return true;
+}
+
+bool DeepNetwork::setUpdateMode(UpdateMode mode)
+{
+    if(mode == UpdateMode::HOGWILD){
+        for(const auto& layer : layers){
+            if(layer->getWeightType() != TensorType::FLOAT32){
+                std::cerr << "ERROR: HOGWILD requires FLOAT32 weights" << std::endl;
+                return false;
+            }
+        }
+    }
+    // 途中まで蓄積したミニバッチは、ここで反映される
+    inputCount = 0;
+    updateMode = mode;
+    for(const auto& layer : layers){
+        layer->setHogwild(mode == UpdateMode::HOGWILD);
+    }
+    // Hogwildかどうかで畳み込みの計算方法が変わる
+    compiled = false;
+    return true;
+}
+
+bool DeepNetwork::setOptimizer(const OptimizerConfig& config)
+{
+    if(!checkOptimizerConfig(config)){
+        return false;
+    }
+    // 途中まで蓄積したミニバッチは、前の設定で反映される
+    inputCount = 0;
+    optimizer = config;
+    for(const auto& layer : layers){
+        layer->setOptimizer(config);
+    }
+    return true;
+}
+
+void DeepNetwork::setInferenceMode(InferenceMode mode)
+{
+    inferenceMode = mode;
+}
+
+bool DeepNetwork::setWeightType(TensorType type)
+{
+    if(type != TensorType::FLOAT32 && !isHalfTensorType(type)){
+        std::cerr << "ERROR: unsupported weight type" << std::endl;
+        return false;
+    }
+    if(type != TensorType::FLOAT32 && updateMode == UpdateMode::HOGWILD){
+        std::cerr << "ERROR: 16-bit weights are not supported in HOGWILD mode" << std::endl;
+        return false;
+    }
+    for(const auto& layer : layers){
+        layer->setWeightType(type);
+    }
+    return true;
+}
+
+bool DeepNetwork::setActivationType(TensorType type)
+{
+    if(type != TensorType::FLOAT32 && !isHalfTensorType(type)){
+        std::cerr << "ERROR: unsupported activation type" << std::endl;
+        return false;
+    }
+    activationType = type;
+    return true;
+}
+
+bool DeepNetwork::setCheckpointMode(bool mode, int segmentLength)
+{
+    if(segmentLength < 0){
+        std::cerr << "ERROR: segment length must not be negative" << std::endl;
+        return false;
+    }
+    checkpointMode = mode;
+    checkpointSegmentLength = segmentLength;
+    compiled = false;
+    return true;
+}
+
 void DeepNetwork::setVerboseMode(bool mode)
 {
     for(const auto& layer : layers){
@@ -164,8 +1009,153 @@ void DeepNetwork::setLossFunction(LossFunction lf)
 
 void DeepNetwork::flush()
 {
+    if(!threadPool){
+        int index = 0;
+        for(const auto& layer : layers){
+            auto begin = startProfile();
+            layer->flush();
+            recordFlush(index++, begin, 1);
+        }
+        return;
+    }
+
+    // 各層のflushは独立しているので並列に行う
+    std::vector<Layer*> layerPtrs;
+    layerPtrs.reserve(layers.size());
     for(const auto& layer : layers){
-        layer->flush();
+        layerPtrs.emplace_back(layer.get());
+    }
+    // 重い層が1つだけでも全スレッドを使えるよう、シャードの足し合わせは層の中の要素の範囲でも分ける
+    const int numSlice = threadPool->getNumThread();
+    threadPool->parallelFor(layerPtrs.size() * numSlice, [&](int task, int worker){
+        auto begin = startProfile();
+        layerPtrs.at(task / numSlice)->reduceGradientSlice(task % numSlice, numSlice);
+        recordFlush(task / numSlice, begin, 0);
+    });
+    threadPool->parallelFor(layerPtrs.size(), [&](int task, int worker){
+        auto begin = startProfile();
+        layerPtrs.at(task)->flush();
+        recordFlush(task, begin, 1);
+    });
+}
+
+void DeepNetwork::setProfileMode(bool mode)
+{
+    profileMode = mode;
+}
+
+namespace {
+uint64_t getElapsedNs(std::chrono::steady_clock::time_point begin)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+}
+}
+
+void DeepNetwork::recordForward(int index, ProfileClock::time_point begin, int numSample) const
+{
+    // 計測の途中で有効にした場合は記録しない
+    if(!profileMode.load(std::memory_order_relaxed) || begin == ProfileClock::time_point()){
+        return;
+    }
+    auto& counter = *profileCounters.at(index);
+    counter.numForward.fetch_add(1, std::memory_order_relaxed);
+    counter.numForwardSample.fetch_add(numSample, std::memory_order_relaxed);
+    counter.forwardNs.fetch_add(getElapsedNs(begin), std::memory_order_relaxed);
+}
+
+void DeepNetwork::recordBackward(int index, ProfileClock::time_point begin, int numSample) const
+{
+    if(!profileMode.load(std::memory_order_relaxed) || begin == ProfileClock::time_point()){
+        return;
+    }
+    auto& counter = *profileCounters.at(index);
+    counter.numBackward.fetch_add(1, std::memory_order_relaxed);
+    counter.numBackwardSample.fetch_add(numSample, std::memory_order_relaxed);
+    counter.backwardNs.fetch_add(getElapsedNs(begin), std::memory_order_relaxed);
+}
+
+void DeepNetwork::recordRecompute(int index, ProfileClock::time_point begin) const
+{
+    if(!profileMode.load(std::memory_order_relaxed) || begin == ProfileClock::time_point()){
+        return;
+    }
+    auto& counter = *profileCounters.at(index);
+    counter.numRecompute.fetch_add(1, std::memory_order_relaxed);
+    counter.recomputeNs.fetch_add(getElapsedNs(begin), std::memory_order_relaxed);
+}
+
+void DeepNetwork::recordFlush(int index, ProfileClock::time_point begin, int numFlush) const
+{
+    if(!profileMode.load(std::memory_order_relaxed) || begin == ProfileClock::time_point()){
+        return;
+    }
+    auto& counter = *profileCounters.at(index);
+    counter.numFlush.fetch_add(numFlush, std::memory_order_relaxed);
+    counter.flushNs.fetch_add(getElapsedNs(begin), std::memory_order_relaxed);
+}
+
+std::vector<LayerProfile> DeepNetwork::getProfile() const
+{
+    std::vector<LayerProfile> profiles;
+    int index = 0;
+    for(const auto& layer : layers){
+        const auto& counter = *profileCounters.at(index++);
+        LayerProfile profile;
+        profile.typeName = layer->getTypeName();
+        profile.numForward = counter.numForward;
+        profile.numForwardSample = counter.numForwardSample;
+        profile.forwardTime = counter.forwardNs * 1e-9;
+        profile.forwardFlop = layer->getForwardFlop() * profile.numForwardSample;
+        profile.forwardByte = layer->getForwardByte() * profile.numForwardSample;
+        profile.numBackward = counter.numBackward;
+        profile.numBackwardSample = counter.numBackwardSample;
+        profile.backwardTime = counter.backwardNs * 1e-9;
+        profile.backwardFlop = layer->getBackwardFlop() * profile.numBackwardSample;
+        profile.backwardByte = layer->getBackwardByte() * profile.numBackwardSample;
+        profile.numFlush = counter.numFlush;
+        profile.flushTime = counter.flushNs * 1e-9;
+        profile.numRecompute = counter.numRecompute;
+        profile.recomputeTime = counter.recomputeNs * 1e-9;
+        profiles.emplace_back(profile);
+    }
+    return profiles;
+}
+
+void DeepNetwork::resetProfile()
+{
+    for(auto& counter : profileCounters){
+        counter->numForward = 0;
+        counter->numForwardSample = 0;
+        counter->forwardNs = 0;
+        counter->numBackward = 0;
+        counter->numBackwardSample = 0;
+        counter->backwardNs = 0;
+        counter->numFlush = 0;
+        counter->flushNs = 0;
+        counter->numRecompute = 0;
+        counter->recomputeNs = 0;
+    }
+}
+
+void DeepNetwork::printProfile(std::ostream& os) const
+{
+    auto getGflops = [](double flop, double time){
+        return time == 0 ? 0 : flop / time * 1e-9;
+    };
+    int index = 0;
+    for(const auto& profile : getProfile()){
+        os << "==== layer " << index++ << ": " << profile.typeName << " ====" << std::endl;
+        os << "forward:  " << profile.numForward << " calls, " << profile.numForwardSample << " samples, "
+           << profile.forwardTime << " s, "
+           << getGflops(profile.forwardFlop, profile.forwardTime) << " GFLOP/s" << std::endl;
+        os << "backward: " << profile.numBackward << " calls, " << profile.numBackwardSample << " samples, "
+           << profile.backwardTime << " s, "
+           << getGflops(profile.backwardFlop, profile.backwardTime) << " GFLOP/s" << std::endl;
+        os << "flush:    " << profile.numFlush << " calls, " << profile.flushTime << " s" << std::endl;
+        if(0 < profile.numRecompute){
+            os << "recompute: " << profile.numRecompute << " calls, " << profile.recomputeTime << " s" << std::endl;
+        }
     }
 }
 
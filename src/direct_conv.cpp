@@ -0,0 +1,133 @@
+#include "direct_conv.h"
+#include "simd.h"
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+// FIXED_WINDOW_SIZEが0なら汎用のカーネルで、窓の大きさは引数で受け取る
+template<int FIXED_WINDOW_SIZE, int FIXED_ZERO_PAD>
+void forwardKernel(const float* input, int width, int height, int numInChannel,
+                   const float* weight, int numOutChannel, int windowSize, int zeroPad,
+                   float* output)
+{
+    constexpr bool FIXED = 0 < FIXED_WINDOW_SIZE;
+    const int ws = FIXED ? FIXED_WINDOW_SIZE : windowSize;
+    const int zp = FIXED ? FIXED_ZERO_PAD : zeroPad;
+    assert(ws == windowSize && zp == zeroPad);
+    const int outWidth = width + 2 * zp - ws + 1;
+    const int outHeight = height + 2 * zp - ws + 1;
+    // 窓が入力の幅に収まる出力のx座標 [interiorBegin, interiorEnd)
+    const int interiorBegin = std::min(zp, outWidth);
+    const int interiorEnd = std::max(interiorBegin, std::min(outWidth, width + zp - ws + 1));
+
+    for(int outCh = 0; outCh < numOutChannel; outCh++){
+        float* out = output + outCh * outWidth * outHeight;
+        std::fill(out, out + outWidth * outHeight, 0.0F);
+        for(int inCh = 0; inCh < numInChannel; inCh++){
+            const float* in = input + inCh * width * height;
+            const float* w = weight + (outCh * numInChannel + inCh) * ws * ws;
+            for(int outY = 0; outY < outHeight; outY++){
+                float* dst = out + outY * outWidth;
+                for(int winY = 0; winY < ws; winY++){
+                    const int inY = outY + winY - zp;
+                    if(inY < 0 || height <= inY){
+                        continue;
+                    }
+                    // row[x]は入力の(inY, x - zp)
+                    const float* row = in + inY * width - zp;
+                    const float* wRow = w + winY * ws;
+                    // 入力が窓より狭いと、左端の出力でも右側がはみ出す
+                    for(int outX = 0; outX < interiorBegin; outX++){
+                        float sumVal = 0;
+                        const int numWinX = std::min(ws, width + zp - outX);
+                        for(int winX = std::max(0, zp - outX); winX < numWinX; winX++){
+                            sumVal += wRow[winX] * row[outX + winX];
+                        }
+                        dst[outX] += sumVal;
+                    }
+                    for(int outX = interiorBegin; outX < interiorEnd; outX++){
+                        float sumVal = 0;
+                        for(int winX = 0; winX < ws; winX++){
+                            sumVal += wRow[winX] * row[outX + winX];
+                        }
+                        dst[outX] += sumVal;
+                    }
+                    for(int outX = interiorEnd; outX < outWidth; outX++){
+                        float sumVal = 0;
+                        const int numWinX = std::min(ws, width + zp - outX);
+                        for(int winX = std::max(0, zp - outX); winX < numWinX; winX++){
+                            sumVal += wRow[winX] * row[outX + winX];
+                        }
+                        dst[outX] += sumVal;
+                    }
+                }
+            }
+        }
+    }
+}
+
+template<int FIXED_WINDOW_SIZE, int FIXED_ZERO_PAD>
+void weightGradientKernel(const float* input, int width, int height, int numInChannel,
+                          const float* propError, int numOutChannel, int windowSize, int zeroPad,
+                          float* dEdw)
+{
+    constexpr bool FIXED = 0 < FIXED_WINDOW_SIZE;
+    const int ws = FIXED ? FIXED_WINDOW_SIZE : windowSize;
+    const int zp = FIXED ? FIXED_ZERO_PAD : zeroPad;
+    assert(ws == windowSize && zp == zeroPad);
+    const int outWidth = width + 2 * zp - ws + 1;
+    const int outHeight = height + 2 * zp - ws + 1;
+
+    for(int outCh = 0; outCh < numOutChannel; outCh++){
+        const float* pe = propError + outCh * outWidth * outHeight;
+        for(int inCh = 0; inCh < numInChannel; inCh++){
+            const float* in = input + inCh * width * height;
+            float* dw = dEdw + (outCh * numInChannel + inCh) * ws * ws;
+            for(int outY = 0; outY < outHeight; outY++){
+                const float* peRow = pe + outY * outWidth;
+                for(int winY = 0; winY < ws; winY++){
+                    const int inY = outY + winY - zp;
+                    if(inY < 0 || height <= inY){
+                        continue;
+                    }
+                    const float* row = in + inY * width - zp;
+                    // 窓の位置ごとに、入力の範囲に収まる区間の内積を取る
+                    for(int winX = 0; winX < ws; winX++){
+                        const int beginX = std::max(0, zp - winX);
+                        const int endX = std::min(outWidth, width + zp - winX);
+                        if(beginX < endX){
+                            dw[winY * ws + winX] += sdot(endX - beginX, peRow + beginX,
+                                                         row + beginX + winX);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+template<int FIXED_WINDOW_SIZE, int FIXED_ZERO_PAD>
+constexpr DirectConvKernel makeKernel()
+{
+    return {forwardKernel<FIXED_WINDOW_SIZE, FIXED_ZERO_PAD>,
+            weightGradientKernel<FIXED_WINDOW_SIZE, FIXED_ZERO_PAD>,
+            0 < FIXED_WINDOW_SIZE};
+}
+
+}
+
+DirectConvKernel getDirectConvKernel(int windowSize, int zeroPad)
+{
+    assert(0 <= zeroPad && zeroPad < windowSize);
+    if(windowSize == 1 && zeroPad == 0){
+        return makeKernel<1, 0>();
+    }
+    if(windowSize == 3 && zeroPad == 1){
+        return makeKernel<3, 1>();
+    }
+    if(windowSize == 5 && zeroPad == 2){
+        return makeKernel<5, 2>();
+    }
+    return makeKernel<0, 0>();
+}
@@ -0,0 +1,288 @@
+#include "fft.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using Complex = std::complex<float>;
+
+/* ======================
+    FFT
+   ======================*/
+int getFftSize(int n)
+{
+    int size = 1;
+    while(size < n){
+        size <<= 1;
+    }
+    return size;
+}
+
+Fft::Fft(int size) : size(size), bitReverse(size), twiddle(size / 2)
+{
+    assert(0 < size && (size & (size - 1)) == 0);
+    int numBit = 0;
+    while((1 << numBit) < size){
+        numBit++;
+    }
+    for(int i = 0; i < size; i++){
+        int rev = 0;
+        for(int bit = 0; bit < numBit; bit++){
+            rev |= ((i >> bit) & 1) << (numBit - 1 - bit);
+        }
+        bitReverse[i] = rev;
+    }
+    // 回転因子はdoubleで求めてから丸める
+    for(int k = 0; k < size / 2; k++){
+        twiddle[k] = Complex(std::polar(1.0, -2.0 * M_PI * k / size));
+    }
+}
+
+void Fft::transform(Complex* data, bool inverse) const
+{
+    for(int i = 0; i < size; i++){
+        if(i < bitReverse[i]){
+            std::swap(data[i], data[bitReverse[i]]);
+        }
+    }
+    // 反復型のradix-2 Cooley-Tukey
+    for(int len = 2; len <= size; len <<= 1){
+        const int half = len / 2;
+        const int step = size / len;
+        for(int i = 0; i < size; i += len){
+            for(int k = 0; k < half; k++){
+                const Complex w = inverse ? std::conj(twiddle[k * step]) : twiddle[k * step];
+                const Complex u = data[i + k];
+                const Complex x = data[i + k + half];
+                const Complex v(x.real() * w.real() - x.imag() * w.imag(),
+                                x.real() * w.imag() + x.imag() * w.real());
+                data[i + k] = u + v;
+                data[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+Fft2d::Fft2d(int rows, int cols) : rowFft(cols), colFft(rows)
+{
+}
+
+size_t Fft2d::getWorkspaceSize(int rows, int cols)
+{
+    return Workspace::getAlignedSize(2 * static_cast<size_t>(std::max(rows, cols)));
+}
+
+void Fft2d::forward(const float* src, int width, int height, int offsetX, int offsetY,
+                    Complex* spectrum) const
+{
+    const int rows = getRows();
+    const int cols = getCols();
+    const int half = cols / 2 + 1;
+    assert(0 <= offsetX && offsetX + width <= cols);
+    assert(0 <= offsetY && offsetY + height <= rows);
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    Complex* work = reinterpret_cast<Complex*>(scope.allocate(2 * static_cast<size_t>(std::max(rows, cols))));
+
+    // 行ごとに変換する。値のない行は変換しても0
+    std::fill(spectrum, spectrum + getSpectrumSize(), Complex(0));
+    for(int y = 0; y < height; y++){
+        std::fill(work, work + cols, Complex(0));
+        const float* row = src + y * width;
+        for(int x = 0; x < width; x++){
+            work[offsetX + x] = Complex(row[x]);
+        }
+        rowFft.transform(work, false);
+        std::copy_n(work, half, spectrum + (offsetY + y) * half);
+    }
+    // 列ごとに変換する
+    for(int x = 0; x < half; x++){
+        for(int y = 0; y < rows; y++){
+            work[y] = spectrum[y * half + x];
+        }
+        colFft.transform(work, false);
+        for(int y = 0; y < rows; y++){
+            spectrum[y * half + x] = work[y];
+        }
+    }
+}
+
+void Fft2d::inverse(Complex* spectrum, int offsetX, int offsetY, int width, int height,
+                    float* dst) const
+{
+    const int rows = getRows();
+    const int cols = getCols();
+    const int half = cols / 2 + 1;
+    assert(0 <= offsetX && offsetX + width <= cols);
+    assert(0 <= offsetY && offsetY + height <= rows);
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    Complex* work = reinterpret_cast<Complex*>(scope.allocate(2 * static_cast<size_t>(std::max(rows, cols))));
+
+    for(int x = 0; x < half; x++){
+        for(int y = 0; y < rows; y++){
+            work[y] = spectrum[y * half + x];
+        }
+        colFft.transform(work, true);
+        for(int y = 0; y < rows; y++){
+            spectrum[y * half + x] = work[y];
+        }
+    }
+    // 必要な行だけ、共役対称性で残りの半分を補ってから逆変換する
+    const float scale = 1.0F / (static_cast<float>(rows) * cols);
+    for(int y = 0; y < height; y++){
+        const Complex* row = spectrum + (offsetY + y) * half;
+        std::copy_n(row, half, work);
+        for(int x = half; x < cols; x++){
+            work[x] = std::conj(row[cols - x]);
+        }
+        rowFft.transform(work, true);
+        for(int x = 0; x < width; x++){
+            dst[y * width + x] = work[offsetX + x].real() * scale;
+        }
+    }
+}
+
+/* ======================
+    FFT convolution
+   ======================*/
+namespace {
+
+// acc += a * b (CONJが真ならa * conj(b))
+template<bool CONJ>
+void multiplyAccumulate(int n, const Complex* a, const Complex* b, Complex* acc)
+{
+    const float* pa = reinterpret_cast<const float*>(a);
+    const float* pb = reinterpret_cast<const float*>(b);
+    float* pc = reinterpret_cast<float*>(acc);
+    for(int i = 0; i < 2 * n; i += 2){
+        const float bIm = CONJ ? -pb[i + 1] : pb[i + 1];
+        pc[i] += pa[i] * pb[i] - pa[i + 1] * bIm;
+        pc[i + 1] += pa[i] * bIm + pa[i + 1] * pb[i];
+    }
+}
+
+Complex* allocateSpectrum(WorkspaceScope& scope, size_t numSpectrum, int spectrumSize)
+{
+    return reinterpret_cast<Complex*>(scope.allocate(2 * numSpectrum * spectrumSize));
+}
+
+}
+
+void fftWeightSpectrum(const Fft2d& fft, const float* weight, int windowSize,
+                       int numInChannel, int numOutChannel, Complex* spectrum)
+{
+    const int spectrumSize = fft.getSpectrumSize();
+    const int windowArea = windowSize * windowSize;
+    for(int i = 0; i < numOutChannel * numInChannel; i++){
+        fft.forward(weight + i * windowArea, windowSize, windowSize, 0, 0,
+                    spectrum + static_cast<size_t>(i) * spectrumSize);
+    }
+}
+
+void fftConvolution(const Fft2d& fft, const float* input, int width, int height, int numInChannel,
+                    const Complex* weightSpectrum, int numOutChannel,
+                    int windowSize, int zeroPad, float* output, int batchSize)
+{
+    const int outWidth = width + 2 * zeroPad - windowSize + 1;
+    const int outHeight = height + 2 * zeroPad - windowSize + 1;
+    assert(width + 2 * zeroPad <= fft.getCols() && height + 2 * zeroPad <= fft.getRows());
+    const int spectrumSize = fft.getSpectrumSize();
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    Complex* X = allocateSpectrum(scope, numInChannel, spectrumSize);
+    Complex* acc = allocateSpectrum(scope, 1, spectrumSize);
+    for(int n = 0; n < batchSize; n++){
+        const float* in = input + static_cast<size_t>(n) * numInChannel * width * height;
+        for(int inCh = 0; inCh < numInChannel; inCh++){
+            fft.forward(in + inCh * width * height, width, height, zeroPad, zeroPad,
+                        X + static_cast<size_t>(inCh) * spectrumSize);
+        }
+        // 相関なので、窓のスペクトルは共役を取って掛ける
+        for(int outCh = 0; outCh < numOutChannel; outCh++){
+            std::fill(acc, acc + spectrumSize, Complex(0));
+            for(int inCh = 0; inCh < numInChannel; inCh++){
+                multiplyAccumulate<true>(spectrumSize, X + static_cast<size_t>(inCh) * spectrumSize,
+                    weightSpectrum + static_cast<size_t>(outCh * numInChannel + inCh) * spectrumSize, acc);
+            }
+            fft.inverse(acc, 0, 0, outWidth, outHeight,
+                        output + (static_cast<size_t>(n) * numOutChannel + outCh) * outWidth * outHeight);
+        }
+    }
+}
+
+void fftConvolutionBackward(const Fft2d& fft, const float* input, int width, int height,
+                            int numInChannel, const float* propError,
+                            const Complex* weightSpectrum, int numOutChannel,
+                            int windowSize, int zeroPad, float* dEdw, float* nextPropError,
+                            int batchSize)
+{
+    const int outWidth = width + 2 * zeroPad - windowSize + 1;
+    const int outHeight = height + 2 * zeroPad - windowSize + 1;
+    assert(width + 2 * zeroPad <= fft.getCols() && height + 2 * zeroPad <= fft.getRows());
+    const int spectrumSize = fft.getSpectrumSize();
+    const int windowArea = windowSize * windowSize;
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    Complex* X = allocateSpectrum(scope, numInChannel, spectrumSize);
+    Complex* E = allocateSpectrum(scope, numOutChannel, spectrumSize);
+    Complex* D = allocateSpectrum(scope, static_cast<size_t>(numOutChannel) * numInChannel, spectrumSize);
+    Complex* acc = allocateSpectrum(scope, 1, spectrumSize);
+    float* dw = scope.allocate(windowArea);
+    std::fill(D, D + static_cast<size_t>(numOutChannel) * numInChannel * spectrumSize, Complex(0));
+
+    for(int n = 0; n < batchSize; n++){
+        const float* in = input + static_cast<size_t>(n) * numInChannel * width * height;
+        const float* pe = propError + static_cast<size_t>(n) * numOutChannel * outWidth * outHeight;
+        for(int inCh = 0; inCh < numInChannel; inCh++){
+            fft.forward(in + inCh * width * height, width, height, zeroPad, zeroPad,
+                        X + static_cast<size_t>(inCh) * spectrumSize);
+        }
+        for(int outCh = 0; outCh < numOutChannel; outCh++){
+            fft.forward(pe + outCh * outWidth * outHeight, outWidth, outHeight, 0, 0,
+                        E + static_cast<size_t>(outCh) * spectrumSize);
+        }
+
+        // dEdwは入力とpropErrorの相関。スペクトルのままバッチについて足し合わせる
+        for(int outCh = 0; outCh < numOutChannel; outCh++){
+            for(int inCh = 0; inCh < numInChannel; inCh++){
+                multiplyAccumulate<true>(spectrumSize, X + static_cast<size_t>(inCh) * spectrumSize,
+                    E + static_cast<size_t>(outCh) * spectrumSize,
+                    D + static_cast<size_t>(outCh * numInChannel + inCh) * spectrumSize);
+            }
+        }
+
+        // nextPropErrorはpropErrorと窓の畳み込み(相関ではない)
+        // ゼロパディング込みの入力の大きさで求め、パディングを除いた部分を取り出す
+        float* npe = nextPropError + static_cast<size_t>(n) * numInChannel * width * height;
+        for(int inCh = 0; inCh < numInChannel; inCh++){
+            std::fill(acc, acc + spectrumSize, Complex(0));
+            for(int outCh = 0; outCh < numOutChannel; outCh++){
+                multiplyAccumulate<false>(spectrumSize, E + static_cast<size_t>(outCh) * spectrumSize,
+                    weightSpectrum + static_cast<size_t>(outCh * numInChannel + inCh) * spectrumSize, acc);
+            }
+            fft.inverse(acc, zeroPad, zeroPad, width, height, npe + inCh * width * height);
+        }
+    }
+
+    for(int i = 0; i < numOutChannel * numInChannel; i++){
+        fft.inverse(D + static_cast<size_t>(i) * spectrumSize, 0, 0, windowSize, windowSize, dw);
+        for(int j = 0; j < windowArea; j++){
+            dEdw[i * windowArea + j] += dw[j];
+        }
+    }
+}
+
+size_t getFftConvolutionWorkspaceSize(int rows, int cols, int numInChannel, int numOutChannel,
+                                      int windowSize, bool backward)
+{
+    const size_t spectrumSize = 2 * static_cast<size_t>(rows) * (cols / 2 + 1);
+    const size_t fftSize = Fft2d::getWorkspaceSize(rows, cols);
+    if(!backward){
+        // X, acc, FFTの作業領域
+        return Workspace::getAlignedSize(spectrumSize * numInChannel)
+            + Workspace::getAlignedSize(spectrumSize) + fftSize;
+    }
+    // X, E, D, acc, dw, FFTの作業領域
+    return Workspace::getAlignedSize(spectrumSize * numInChannel)
+        + Workspace::getAlignedSize(spectrumSize * numOutChannel)
+        + Workspace::getAlignedSize(spectrumSize * numOutChannel * numInChannel)
+        + Workspace::getAlignedSize(spectrumSize)
+        + Workspace::getAlignedSize(static_cast<size_t>(windowSize) * windowSize) + fftSize;
+}
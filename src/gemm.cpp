@@ -0,0 +1,224 @@
+#include "gemm.h"
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+// レジスタタイルの大きさ
+constexpr int MR = 4;
+constexpr int NR = 16;
+// キャッシュブロックの大きさ
+// packedAがL2に、packedBのNRパネル1本がL1に収まる程度にする
+constexpr int MC = 128;
+constexpr int KC = 256;
+constexpr int NC = 2048;
+
+inline float getElem(bool trans, const float* X, int ld, int row, int col)
+{
+    return trans ? X[col * ld + row] : X[row * ld + col];
+}
+
+// op(A)のmc x kcの部分行列を、MR行ずつのパネルに詰める
+// 端数の行は0で埋める
+void packA(bool transA, const float* A, int lda, int row0, int col0,
+           int mc, int kc, float* buf)
+{
+    for(int i = 0; i < mc; i += MR){
+        for(int p = 0; p < kc; p++){
+            for(int ii = 0; ii < MR; ii++){
+                *buf++ = i + ii < mc ?
+                    getElem(transA, A, lda, row0 + i + ii, col0 + p) : 0;
+            }
+        }
+    }
+}
+
+// op(B)のkc x ncの部分行列を、NR列ずつのパネルに詰める
+// 端数の列は0で埋める
+void packB(bool transB, const float* B, int ldb, int row0, int col0,
+           int kc, int nc, float* buf)
+{
+    for(int j = 0; j < nc; j += NR){
+        int nr = std::min(NR, nc - j);
+        for(int p = 0; p < kc; p++){
+            int jj = 0;
+            if(!transB){
+                const float* src = B + (row0 + p) * ldb + col0 + j;
+                for(; jj < nr; jj++){
+                    *buf++ = src[jj];
+                }
+            }else{
+                for(; jj < nr; jj++){
+                    *buf++ = B[(col0 + j + jj) * ldb + row0 + p];
+                }
+            }
+            for(; jj < NR; jj++){
+                *buf++ = 0;
+            }
+        }
+    }
+}
+
+// MR x NRのタイルをレジスタ上で計算し、Cに足し込む
+void microKernel(int kc, const float* a, const float* b,
+                 float* C, int ldc, int mr, int nr)
+{
+    float acc[MR][NR] = {};
+    for(int p = 0; p < kc; p++){
+        for(int i = 0; i < MR; i++){
+            const float aVal = a[p * MR + i];
+            for(int j = 0; j < NR; j++){
+                acc[i][j] += aVal * b[p * NR + j];
+            }
+        }
+    }
+    for(int i = 0; i < mr; i++){
+        for(int j = 0; j < nr; j++){
+            C[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+}
+
+void sgemm(bool transA, bool transB, int M, int N, int K,
+           const float* A, int lda, const float* B, int ldb,
+           float* C, int ldc, int kBlock)
+{
+    assert(0 <= M && 0 <= N && 0 <= K);
+    if(M == 0 || N == 0 || K == 0){
+        return;
+    }
+    const int kcMax = 0 < kBlock ? kBlock : KC;
+    // スレッドごとに使い回し、定常状態ではヒープ確保をしない
+    thread_local std::vector<float> packedA;
+    thread_local std::vector<float> packedB;
+    const size_t packedASize = static_cast<size_t>((std::min(MC, M) + MR - 1) / MR * MR)
+                                * std::min(kcMax, K);
+    const size_t packedBSize = static_cast<size_t>((std::min(NC, N) + NR - 1) / NR * NR)
+                                * std::min(kcMax, K);
+    if(packedA.size() < packedASize){
+        packedA.resize(packedASize);
+    }
+    if(packedB.size() < packedBSize){
+        packedB.resize(packedBSize);
+    }
+
+    for(int jc = 0; jc < N; jc += NC){
+        const int nc = std::min(NC, N - jc);
+        for(int pc = 0; pc < K; pc += kcMax){
+            const int kc = std::min(kcMax, K - pc);
+            packB(transB, B, ldb, pc, jc, kc, nc, packedB.data());
+            for(int ic = 0; ic < M; ic += MC){
+                const int mc = std::min(MC, M - ic);
+                packA(transA, A, lda, ic, pc, mc, kc, packedA.data());
+                for(int jr = 0; jr < nc; jr += NR){
+                    const int nr = std::min(NR, nc - jr);
+                    for(int ir = 0; ir < mc; ir += MR){
+                        const int mr = std::min(MR, mc - ir);
+                        microKernel(kc, packedA.data() + ir * kc,
+                                    packedB.data() + jr * kc,
+                                    C + (ic + ir) * ldc + jc + jr, ldc, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+namespace {
+// 出力のx座標のうち、窓の位置winXで入力の範囲内を指すもの [beginX, endX)
+void getValidRange(int width, int windowOffset, int zeroPad, int stride, int outWidth,
+                   int& beginX, int& endX)
+{
+    // outX * stride + windowOffset - zeroPad が [0, width) に入る範囲
+    const int lower = zeroPad - windowOffset;
+    const int upper = width + zeroPad - windowOffset;
+    // 入力が窓より狭いと、beginXがoutWidthを超えることがある
+    beginX = lower <= 0 ? 0 : std::min(outWidth, (lower + stride - 1) / stride);
+    endX = upper <= 0 ? 0 : std::min(outWidth, (upper + stride - 1) / stride);
+    endX = std::max(beginX, endX);
+}
+}
+
+void im2col(const float* input, int width, int height, int numChannel,
+            int windowSize, int zeroPad, int stride, float* col, int ldCol)
+{
+    const int outHeight = (height + 2 * zeroPad - windowSize) / stride + 1;
+    im2colRows(input, width, height, numChannel, windowSize, zeroPad, stride,
+               0, outHeight, col, ldCol);
+}
+
+void im2colRows(const float* input, int width, int height, int numChannel,
+                int windowSize, int zeroPad, int stride, int outYBegin, int outYEnd,
+                float* col, int ldCol)
+{
+    assert(0 < stride);
+    const int outWidth = (width + 2 * zeroPad - windowSize) / stride + 1;
+    assert(0 <= outYBegin && outYBegin <= outYEnd);
+    assert(outYEnd <= (height + 2 * zeroPad - windowSize) / stride + 1);
+    if(ldCol <= 0){
+        ldCol = outWidth * (outYEnd - outYBegin);
+    }
+    for(int ch = 0; ch < numChannel; ch++){
+        const float* inCh = input + width * height * ch;
+        for(int winY = 0; winY < windowSize; winY++){
+            for(int winX = 0; winX < windowSize; winX++){
+                float* colRow = col + static_cast<size_t>((ch * windowSize + winY) * windowSize + winX) * ldCol;
+                // 出力のx座標のうち、入力の範囲内に収まるもの
+                int beginX, endX;
+                getValidRange(width, winX, zeroPad, stride, outWidth, beginX, endX);
+                for(int outY = outYBegin; outY < outYEnd; outY++){
+                    const int inY = winY - zeroPad + outY * stride;
+                    if(inY < 0 || height <= inY){
+                        std::fill(colRow, colRow + outWidth, 0.0F);
+                    }else{
+                        const float* src = inCh + inY * width + winX - zeroPad;
+                        std::fill(colRow, colRow + beginX, 0.0F);
+                        if(stride == 1){
+                            std::copy(src + beginX, src + endX, colRow + beginX);
+                        }else{
+                            for(int outX = beginX; outX < endX; outX++){
+                                colRow[outX] = src[outX * stride];
+                            }
+                        }
+                        std::fill(colRow + endX, colRow + outWidth, 0.0F);
+                    }
+                    colRow += outWidth;
+                }
+            }
+        }
+    }
+}
+
+void col2im(const float* col, int width, int height, int numChannel,
+            int windowSize, int zeroPad, int stride, float* output, int ldCol)
+{
+    assert(0 < stride);
+    const int outWidth = (width + 2 * zeroPad - windowSize) / stride + 1;
+    const int outHeight = (height + 2 * zeroPad - windowSize) / stride + 1;
+    if(ldCol <= 0){
+        ldCol = outWidth * outHeight;
+    }
+    for(int ch = 0; ch < numChannel; ch++){
+        float* outCh = output + width * height * ch;
+        for(int winY = 0; winY < windowSize; winY++){
+            for(int winX = 0; winX < windowSize; winX++){
+                const float* colRow = col + static_cast<size_t>((ch * windowSize + winY) * windowSize + winX) * ldCol;
+                int beginX, endX;
+                getValidRange(width, winX, zeroPad, stride, outWidth, beginX, endX);
+                for(int outY = 0; outY < outHeight; outY++){
+                    const int inY = winY - zeroPad + outY * stride;
+                    if(0 <= inY && inY < height){
+                        float* dst = outCh + inY * width + winX - zeroPad;
+                        for(int outX = beginX; outX < endX; outX++){
+                            dst[outX * stride] += colRow[outX];
+                        }
+                    }
+                    colRow += outWidth;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#include "half_weight.h"
+#include <cassert>
+#include <iostream>
+
+/* ======================
+    Half precision storage
+   ======================*/
+bool isHalfTensorType(TensorType type)
+{
+    return type == TensorType::FLOAT16 || type == TensorType::BFLOAT16;
+}
+
+HalfType getHalfType(TensorType type)
+{
+    assert(isHalfTensorType(type));
+    return type == TensorType::FLOAT16 ? HalfType::FP16 : HalfType::BF16;
+}
+
+/* ======================
+    HalfWeight
+   ======================*/
+void HalfWeight::assign(const float* weight, size_t size, TensorType type)
+{
+    assert(isHalfTensorType(type));
+    this->size = size;
+    this->type = type;
+    mapped = MappedTensor();
+    data.resize(size);
+    toHalf(getHalfType(type), static_cast<int>(size), weight, data.data());
+}
+
+TensorView HalfWeight::getTensor() const
+{
+    assert(!empty());
+    return TensorView{getData(), size, type};
+}
+
+bool HalfWeight::setTensor(const MappedTensor& tensor, size_t size)
+{
+    if(!isHalfTensorType(tensor.type) || tensor.size != size){
+        std::cerr << "invalid half precision tensor" << std::endl;
+        return false;
+    }
+    this->size = size;
+    type = tensor.type;
+    data.clear();
+    mapped = tensor;
+    return true;
+}
@@ -0,0 +1,36 @@
+#include "inference_executor.h"
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+
+/* ======================
+    InferenceExecutor
+   ======================*/
+InferenceExecutor::InferenceExecutor(std::shared_ptr<const DeepNetwork> model)
+    : model(std::move(model))
+{
+    assert(this->model != nullptr);
+    if(!this->model->isCompiled()){
+        std::cerr << "ERROR: the shared network must be compiled" << std::endl;
+        std::exit(1);
+    }
+    work.resize(this->model->getInferWorkSize(1));
+    output.resize(this->model->getOutputDataSize());
+}
+
+const std::vector<float>& InferenceExecutor::infer(const std::vector<float>& input)
+{
+    assert(input.size() == static_cast<size_t>(model->getInputDataSize()));
+    model->inferBatch(input.data(), 1, output.data(), work.data());
+    return output;
+}
+
+void InferenceExecutor::inferBatch(const float* input, int batchSize, float* output)
+{
+    assert(0 < batchSize);
+    const size_t workSize = model->getInferWorkSize(batchSize);
+    if(work.size() < workSize){
+        work.resize(workSize);
+    }
+    model->inferBatch(input, batchSize, output, work.data());
+}
@@ -0,0 +1,118 @@
+#include "inference_server.h"
+#include <iostream>
+#include <cassert>
+#include <algorithm>
+#include <cstdlib>
+
+/* ======================
+    InferenceServer
+   ======================*/
+InferenceServer::InferenceServer(DeepNetwork& network, int maxBatchSize, std::chrono::microseconds maxDelay)
+    : maxBatchSize(maxBatchSize), maxDelay(maxDelay), stop(false), numBatch(0), numRequest(0)
+{
+    if(!network.isCompiled() && !network.compile()){
+        std::cerr << "ERROR: failed to compile the network" << std::endl;
+        std::exit(1);
+    }
+    // networkは呼び出し側が持っているので、所有しないshared_ptrで包む
+    start(std::shared_ptr<const DeepNetwork>(&network, [](const DeepNetwork*){}), 1);
+}
+
+InferenceServer::InferenceServer(std::shared_ptr<const DeepNetwork> model, int numWorker, int maxBatchSize,
+                                 std::chrono::microseconds maxDelay)
+    : maxBatchSize(maxBatchSize), maxDelay(maxDelay), stop(false), numBatch(0), numRequest(0)
+{
+    start(std::move(model), numWorker);
+}
+
+void InferenceServer::start(std::shared_ptr<const DeepNetwork> model, int numWorker)
+{
+    assert(0 < maxBatchSize);
+    assert(0 < numWorker);
+    inputDataSize = model->getInputDataSize();
+    outputDataSize = model->getOutputDataSize();
+    for(int i = 0; i < numWorker; i++){
+        executors.emplace_back(std::make_unique<InferenceExecutor>(model));
+    }
+    for(auto& executor : executors){
+        workers.emplace_back(&InferenceServer::serveLoop, this, std::ref(*executor));
+    }
+}
+
+InferenceServer::~InferenceServer()
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    for(auto& worker : workers){
+        worker.join();
+    }
+}
+
+std::future<std::vector<float>> InferenceServer::submit(std::vector<float> input)
+{
+    assert(input.size() == static_cast<size_t>(inputDataSize));
+    Request request;
+    request.input = std::move(input);
+    auto result = request.output.get_future();
+    size_t queueSize;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        assert(!stop);
+        request.arrival = Clock::now();
+        queue.emplace_back(std::move(request));
+        queueSize = queue.size();
+    }
+    // サーバが待っているのは、キューが空でなくなるかバッチが埋まる時だけ
+    if(queueSize == 1 || queueSize == static_cast<size_t>(maxBatchSize)){
+        cv.notify_one();
+    }
+    return result;
+}
+
+void InferenceServer::serveLoop(InferenceExecutor& executor)
+{
+    std::vector<Request> batch;
+    batch.reserve(maxBatchSize);
+    std::vector<float> batchInput(static_cast<size_t>(inputDataSize) * maxBatchSize);
+    std::vector<float> batchOutput(static_cast<size_t>(outputDataSize) * maxBatchSize);
+    while(true){
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            cv.wait(lk, [this]{return stop || !queue.empty();});
+            if(queue.empty()){
+                return;
+            }
+            // 止める時は待たずに残りを処理する
+            const auto deadline = queue.front().arrival + maxDelay;
+            cv.wait_until(lk, deadline, [this]{
+                return stop || static_cast<size_t>(maxBatchSize) <= queue.size();
+            });
+            // 待っている間に、他のワーカーが持って行っていることがある
+            const int batchSize = std::min(queue.size(), static_cast<size_t>(maxBatchSize));
+            for(int n = 0; n < batchSize; n++){
+                batch.emplace_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+        }
+
+        const int batchSize = batch.size();
+        if(batchSize == 0){
+            continue;
+        }
+        for(int n = 0; n < batchSize; n++){
+            std::copy(std::begin(batch.at(n).input), std::end(batch.at(n).input),
+                      std::begin(batchInput) + n * inputDataSize);
+        }
+        executor.inferBatch(batchInput.data(), batchSize, batchOutput.data());
+        numBatch++;
+        numRequest += batchSize;
+        for(int n = 0; n < batchSize; n++){
+            auto begin = std::begin(batchOutput) + n * outputDataSize;
+            batch.at(n).output.set_value(std::vector<float>(begin, begin + outputDataSize));
+        }
+        batch.clear();
+    }
+}
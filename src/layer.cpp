@@ -1,10 +1,18 @@
 #include "layer.h"
 #include "utility.h"
+#include "gemm.h"
+#include "workspace.h"
+#include "simd.h"
+#include "winograd.h"
+#include "fft.h"
+#include "direct_conv.h"
 #include <iostream>
 #include <cassert>
 #include <random>
 #include <cmath>
 #include <algorithm>
+#include <iomanip>
+#include <limits>
 
 /* ======================
     Utility functions
@@ -50,16 +58,140 @@ float getValFromVecMap(const std::vector<float>& vec, int x, int y, int width, i
     return vec[x + y * width + (width * height) * channel];
 }
 
+float getValFromVecMap(const float* vec, int x, int y, int width, int height, int channel)
+{
+    return vec[x + y * width + (width * height) * channel];
+}
+
 void setValToVecMap(std::vector<float>& vec, int x, int y, int width, int height, int channel, float val)
 {
     vec[x + y * width + (width * height) * channel] = val;
 }
 
-void addValToVecMap(std::vector<float>& vec, int x, int y, int width, int height, int channel, float val)
+void setValToVecMap(float* vec, int x, int y, int width, int height, int channel, float val)
+{
+    vec[x + y * width + (width * height) * channel] = val;
+}
+
+void addValToVecMap(float* vec, int x, int y, int width, int height, int channel, float val)
 {
     vec[x + y * width + (width * height) * channel] += val;
 }
 
+// シャードに蓄積された勾配を2つずつ木構造に足し合わせ、shards[0]にまとめる
+// 勾配が蓄積されていないシャードは空になっている
+void reduceGradShards(std::vector<std::unique_ptr<GradientShard>>& shards)
+{
+    // reduceGradShardsSliceで足し終えたシャードは、係数だけを足し先に移して空にする
+    auto first = std::find_if(shards.begin(), shards.end(), [](const auto& shard){
+        return !shard->weight.empty() && !shard->reduced;
+    });
+    for(auto& shard : shards){
+        if(!shard->reduced){
+            continue;
+        }
+        assert(first != shards.end());
+        (*first)->decayScale += shard->decayScale;
+        shard->decayScale = 0;
+        shard->weight.clear();
+        shard->bias.clear();
+        shard->reduced = false;
+    }
+
+    for(size_t stride = 1; stride < shards.size(); stride *= 2){
+        for(size_t i = 0; i + stride < shards.size(); i += 2 * stride){
+            auto& dst = *shards[i];
+            auto& src = *shards[i + stride];
+            std::scoped_lock lk(dst.mtx, src.mtx);
+            if(src.weight.empty()){
+                continue;
+            }
+            if(dst.weight.empty()){
+                std::swap(dst.weight, src.weight);
+                std::swap(dst.bias, src.bias);
+                std::swap(dst.decayScale, src.decayScale);
+                continue;
+            }
+            assert(dst.weight.size() == src.weight.size());
+            assert(dst.bias.size() == src.bias.size());
+            for(size_t j = 0; j < dst.weight.size(); j++){
+                dst.weight[j] += src.weight[j];
+            }
+            for(size_t j = 0; j < dst.bias.size(); j++){
+                dst.bias[j] += src.bias[j];
+            }
+            dst.decayScale += src.decayScale;
+            src.decayScale = 0;
+            // clearは領域を解放しないので、次回のresizeで再確保は起きない
+            src.weight.clear();
+            src.bias.clear();
+        }
+    }
+}
+
+// 勾配の要素を[0, numSlice)のsliceに分け、sliceの範囲だけ、他のシャードの勾配を最初の空でないシャードに足す
+// 範囲が重ならないので、sliceの違う呼び出しは並列に行ってよい
+// 足し終えたシャードにはreducedの印を付け、後始末は続くreduceGradShards(flush)で行う
+void reduceGradShardsSlice(std::vector<std::unique_ptr<GradientShard>>& shards, int slice, int numSlice)
+{
+    assert(0 <= slice && slice < numSlice);
+    auto first = std::find_if(shards.begin(), shards.end(), [](const auto& shard){
+        return !shard->weight.empty();
+    });
+    if(first == shards.end()){
+        return;
+    }
+    auto& dst = **first;
+    auto getRange = [&](size_t size){
+        return std::pair(size * slice / numSlice, size * (slice + 1) / numSlice);
+    };
+    const auto [weightBegin, weightEnd] = getRange(dst.weight.size());
+    const auto [biasBegin, biasEnd] = getRange(dst.bias.size());
+    for(auto itr = std::next(first); itr != shards.end(); itr++){
+        auto& src = **itr;
+        if(src.weight.empty()){
+            continue;
+        }
+        assert(dst.weight.size() == src.weight.size());
+        assert(dst.bias.size() == src.bias.size());
+        saxpy(static_cast<int>(weightEnd - weightBegin), 1.0F,
+              src.weight.data() + weightBegin, dst.weight.data() + weightBegin);
+        saxpy(static_cast<int>(biasEnd - biasBegin), 1.0F,
+              src.bias.data() + biasBegin, dst.bias.data() + biasBegin);
+        // 印はslice 0だけが付ける(他のsliceはreducedを読まない)
+        if(slice == 0){
+            src.reduced = true;
+        }
+    }
+}
+
+// reduceRateを掛けた勾配をシャードに足す
+// 重みはflushで最適化手法を通して更新するので、ここでは読まない
+void accumulateGradient(GradientShard& shard, const float* dEdw, size_t weightSize,
+                        const float* dEdb, size_t biasSize, int batchSize, double reduceRate)
+{
+    if(shard.weight.empty()) {
+        shard.weight.resize(weightSize);
+        shard.bias.resize(biasSize);
+    }
+    assert(shard.weight.size() == weightSize && shard.bias.size() == biasSize);
+    saxpy(static_cast<int>(weightSize), reduceRate, dEdw, shard.weight.data());
+    saxpy(static_cast<int>(biasSize), reduceRate, dEdb, shard.bias.data());
+    shard.decayScale += batchSize * reduceRate;
+}
+
+// シャードの数を変更する。蓄積済みの勾配はshards[0]にまとめて残す
+void resizeGradShards(std::vector<std::unique_ptr<GradientShard>>& shards, int numShard)
+{
+    assert(0 < numShard);
+    reduceGradShards(shards);
+    shards.resize(numShard);
+    for(auto& shard : shards){
+        if(!shard){
+            shard = std::make_unique<GradientShard>();
+        }
+    }
+}
 
 /* ======================
     Layer
@@ -68,69 +200,462 @@ Layer::Layer() : verbose(false)
 {
 }
 
+void Layer::initWeight()
+{
+    std::random_device seedGen;
+    initWeight(seedGen());
+}
+
 void Layer::setInputInfo(const DataSize& size, int numInputChannel)
 {
     inputSize = size;
     this->numInputChannel = numInputChannel;
 }
 
+std::vector<float> Layer::apply(const std::vector<float>& input) const
+{
+    assert(input.size() == static_cast<size_t>(getInputDataSize()));
+    std::vector<float> output(getOutputDataSize());
+    forward(input.data(), output.data());
+    return output;
+}
+
+std::vector<float> Layer::applyBatch(const std::vector<float>& input, int batchSize) const
+{
+    assert(0 < batchSize);
+    assert(input.size() == static_cast<size_t>(getInputDataSize()) * batchSize);
+    std::vector<float> output(static_cast<size_t>(getOutputDataSize()) * batchSize);
+    forwardBatch(input.data(), output.data(), batchSize);
+    return output;
+}
+
+void Layer::forwardBatch(const float* input, float* output, int batchSize) const
+{
+    const int inDataSize = getInputDataSize();
+    const int outDataSize = getOutputDataSize();
+    for(int n = 0; n < batchSize; n++){
+        forward(input + n * inDataSize, output + n * outDataSize);
+    }
+}
+
+std::vector<float> Layer::updateWeight(const std::vector<float>& input,
+                const std::vector<float>& output,
+                const std::vector<float>& propError,
+                double reduceRate, int shard)
+{
+    return updateWeightBatch(input, output, propError, 1, reduceRate, shard);
+}
+
+std::vector<float> Layer::updateWeightBatch(const std::vector<float>& input,
+                const std::vector<float>& output,
+                const std::vector<float>& propError,
+                int batchSize, double reduceRate, int shard)
+{
+    assert(0 < batchSize);
+    assert(!propError.empty());
+    assert(input.size() == static_cast<size_t>(getInputDataSize()) * batchSize);
+    assert(output.size() == static_cast<size_t>(getOutputDataSize()) * batchSize);
+    assert(propError.size() == output.size());
+    std::vector<float> nextPropError(input.size());
+    if(batchSize == 1){
+        backward(input.data(), output.data(), propError.data(), nextPropError.data(),
+                 reduceRate, shard);
+    }else{
+        backwardBatch(input.data(), output.data(), propError.data(), nextPropError.data(),
+                      batchSize, reduceRate, shard);
+    }
+    return nextPropError;
+}
+
+void Layer::backwardBatch(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                int batchSize, double reduceRate, int shard)
+{
+    const int inDataSize = getInputDataSize();
+    const int outDataSize = getOutputDataSize();
+    for(int n = 0; n < batchSize; n++){
+        backward(input + n * inDataSize, output + n * outDataSize,
+                 propError + n * outDataSize, nextPropError + n * inDataSize,
+                 reduceRate, shard);
+    }
+}
+
+double Layer::getForwardByte() const
+{
+    return sizeof(float) * (static_cast<double>(getInputDataSize()) + getOutputDataSize());
+}
+
+double Layer::getBackwardByte() const
+{
+    // input, output, propErrorを読み、nextPropErrorを書く
+    return sizeof(float) * 2.0 * (static_cast<double>(getInputDataSize()) + getOutputDataSize());
+}
+
+bool Layer::checkShape() const
+{
+    if(inputSize.first <= 0 || inputSize.second <= 0 || numInputChannel <= 0
+        || outputSize.first <= 0 || outputSize.second <= 0 || numOutputChannel <= 0){
+        std::cerr << getTypeName() << " layer: input or output is empty" << std::endl;
+        return false;
+    }
+    return true;
+}
+
 /* ======================
     ConvolutionLayer
    ======================*/
-ConvolutionLayer::ConvolutionLayer(int zeroPad, int windowSize, int numOutputChannel) : 
-    zeroPad(zeroPad), windowSize(windowSize)
+ConvolutionLayer::ConvolutionLayer(int zeroPad, int windowSize, int numOutputChannel,
+                                   int stride, ConvAlgorithm algorithm) : 
+    zeroPad(zeroPad), windowSize(windowSize), stride(stride), algorithm(algorithm)
 {
+    assert(0 < stride);
     this->numOutputChannel = numOutputChannel;
+    // 直接法のカーネルは窓の大きさとzeroPadで決まるので、ここで選んでおく
+    // nextPropErrorは窓を反転させてzeroPadが(windowSize - 1 - zeroPad)の畳み込みとして求める
+    if(zeroPad < windowSize){
+        directKernel = getDirectConvKernel(windowSize, zeroPad);
+        directBackKernel = getDirectConvKernel(windowSize, windowSize - 1 - zeroPad);
+    }
     bias.resize(numOutputChannel);
+    resizeGradShards(gradShards, 1);
 }
 
 void ConvolutionLayer::calcOutputSize()
 {
-    outputSize = DataSize(inputSize.first + 2 * zeroPad - windowSize + 1,
-                        inputSize.second + 2 * zeroPad - windowSize + 1);
+    outputSize = DataSize((inputSize.first + 2 * zeroPad - windowSize) / stride + 1,
+                        (inputSize.second + 2 * zeroPad - windowSize) / stride + 1);
 }
 
-std::vector<float> ConvolutionLayer::apply(const std::vector<float>& input) const
+void ConvolutionLayer::forward(const float* input, float* output) const
 {
-    assert(windowSize <= inputSize.first + 2 * zeroPad);
-    assert(windowSize <= inputSize.second + 2 * zeroPad);
-    assert(input.size() == static_cast<size_t>(inputSize.first * inputSize.second * numInputChannel));
-    std::vector<float> output(outputSize.first * outputSize.second * numOutputChannel);
+    forwardBatch(input, output, 1);
+}
+
+ConvAlgorithm ConvolutionLayer::selectAlgorithm() const
+{
+    // Winograd, FFT, 直接法はstrideが1の場合だけ
+    if(stride != 1){
+        return ConvAlgorithm::GEMM;
+    }
+    // Winograd, 直接法はnextPropErrorを窓を反転させた畳み込みとして求めるので、
+    // zeroPadはwindowSize - 1以下に限る
+    const bool canFlip = zeroPad <= windowSize - 1;
+    const bool canWinograd = windowSize == WINOGRAD_WINDOW_SIZE && canFlip;
+    switch(algorithm) {
+    case ConvAlgorithm::AUTO:
+        if(!canWinograd){
+            // 特殊化した直接法のカーネルがあれば、im2colの展開がない分GEMMより速い
+            return (directKernel.specialized && directBackKernel.specialized)
+                ? ConvAlgorithm::DIRECT : ConvAlgorithm::GEMM;
+        }
+        // 出力が小さいと、はみ出したタイルの無駄な計算が増える
+        return (8 <= outputSize.first && 8 <= outputSize.second)
+            ? ConvAlgorithm::WINOGRAD_4X4 : ConvAlgorithm::WINOGRAD_2X2;
+    case ConvAlgorithm::WINOGRAD_2X2:
+    case ConvAlgorithm::WINOGRAD_4X4:
+        return canWinograd ? algorithm : ConvAlgorithm::GEMM;
+    case ConvAlgorithm::DIRECT:
+        return canFlip ? algorithm : ConvAlgorithm::GEMM;
+    case ConvAlgorithm::FFT:
+        // Hogwildでは重みが常に書き換わり、重みのスペクトルを安全に作り直せない
+        return hogwild ? ConvAlgorithm::GEMM : algorithm;
+    default:
+        return algorithm;
+    }
+}
+
+namespace {
+int getWinogradTileSize(ConvAlgorithm algorithm)
+{
+    return algorithm == ConvAlgorithm::WINOGRAD_4X4 ? 4 : 2;
+}
+
+// 窓を180度回し、入出力チャネルを入れ替えた重みをflippedに書く
+void flipWeight(const float* weight, int windowSize, int numInputChannel, int numOutputChannel,
+                float* flipped)
+{
+    const int windowArea = windowSize * windowSize;
     for(int outCh = 0; outCh < numOutputChannel; outCh++){
         for(int inCh = 0; inCh < numInputChannel; inCh++){
-            for(int outY = 0; outY < outputSize.second; outY++){
-                for(int outX = 0; outX < outputSize.first; outX++){
-                    float convVal = 0;
-                    int numWinYLoop = std::min(windowSize, inputSize.second + zeroPad - outY);
-                    for(int winY = std::max(0, zeroPad - outY); winY < numWinYLoop; winY++){
-                        int numWinXLoop = std::min(windowSize, inputSize.first + zeroPad - outX);
-                        for(int winX = std::max(0, zeroPad - outX); winX < numWinXLoop; winX++){
-                            auto w = getValFromVecMap(weight, winX, winY, windowSize, windowSize, inCh + numInputChannel * outCh);
-                            auto inVal = getValFromVecMap(input, winX - zeroPad + outX, winY - zeroPad + outY, 
-                                            inputSize.first, inputSize.second, inCh);
-                            convVal += w * inVal;
+            const float* src = weight + (outCh * numInputChannel + inCh) * windowArea;
+            float* dst = flipped + (inCh * numOutputChannel + outCh) * windowArea;
+            for(int i = 0; i < windowArea; i++){
+                dst[i] = src[windowArea - 1 - i];
+            }
+        }
+    }
+}
+}
+
+const std::complex<float>* ConvolutionLayer::getWeightSpectrum() const
+{
+    std::lock_guard<std::mutex> lk(mtxSpectrum);
+    const int rows = getFftSize(inputSize.second + 2 * zeroPad);
+    const int cols = getFftSize(inputSize.first + 2 * zeroPad);
+    if(!fft || fft->getRows() != rows || fft->getCols() != cols){
+        fft = std::make_unique<Fft2d>(rows, cols);
+        weightSpectrum.clear();
+    }
+    if(weightSpectrum.empty()){
+        weightSpectrum.resize(static_cast<size_t>(numOutputChannel) * numInputChannel
+                              * fft->getSpectrumSize());
+        fftWeightSpectrum(*fft, getWeightData(), windowSize, numInputChannel, numOutputChannel,
+                          weightSpectrum.data());
+    }
+    return weightSpectrum.data();
+}
+
+void ConvolutionLayer::invalidateWeightSpectrum()
+{
+    std::lock_guard<std::mutex> lk(mtxSpectrum);
+    weightSpectrum.clear();
+}
+
+double ConvolutionLayer::getForwardFlop() const
+{
+    // 出力1画素あたり、窓の大きさ x 入力チャネル数の積和
+    return 2.0 * getOutputDataSize() * windowSize * windowSize * numInputChannel;
+}
+
+double ConvolutionLayer::getBackwardFlop() const
+{
+    // dEdwとnextPropErrorで、それぞれ順伝播と同じだけの積和
+    return 2 * getForwardFlop();
+}
+
+double ConvolutionLayer::getForwardByte() const
+{
+    const double weightSize = windowSize * windowSize * numInputChannel * numOutputChannel;
+    return Layer::getForwardByte() + sizeof(float) * weightSize;
+}
+
+double ConvolutionLayer::getBackwardByte() const
+{
+    // 重みを読み、シャードの勾配を読み書きする
+    const double weightSize = windowSize * windowSize * numInputChannel * numOutputChannel;
+    return Layer::getBackwardByte() + sizeof(float) * 3 * weightSize;
+}
+
+void ConvolutionLayer::forwardBatch(const float* input, float* output, int batchSize) const
+{
+    forwardBatch(input, output, batchSize, selectAlgorithm());
+}
+
+void ConvolutionLayer::forwardBatch(const float* input, float* output, int batchSize,
+                                    ConvAlgorithm selected) const
+{
+    assert(windowSize <= inputSize.first + 2 * zeroPad);
+    assert(windowSize <= inputSize.second + 2 * zeroPad);
+    const int numOutPixel = outputSize.first * outputSize.second;
+    if(selected == ConvAlgorithm::AUTO){
+        selected = selectAlgorithm();
+    }
+    if(selected != ConvAlgorithm::GEMM){
+        if(selected == ConvAlgorithm::FFT){
+            const auto* spectrum = getWeightSpectrum();
+            fftConvolution(*fft, input, inputSize.first, inputSize.second, numInputChannel,
+                           spectrum, numOutputChannel, windowSize, zeroPad, output, batchSize);
+        }else if(selected == ConvAlgorithm::DIRECT){
+            for(int n = 0; n < batchSize; n++){
+                directKernel.forward(input + n * getInputDataSize(), inputSize.first, inputSize.second,
+                                     numInputChannel, getWeightData(), numOutputChannel,
+                                     windowSize, zeroPad, output + n * getOutputDataSize());
+            }
+        }else{
+            winogradConvolution(getWinogradTileSize(selected), input, inputSize.first, inputSize.second,
+                                numInputChannel, getWeightData(), numOutputChannel, zeroPad,
+                                output, batchSize);
+        }
+        for(int n = 0; n < batchSize; n++){
+            for(int outCh = 0; outCh < numOutputChannel; outCh++){
+                float* out = output + (n * numOutputChannel + outCh) * numOutPixel;
+                for(int pixel = 0; pixel < numOutPixel; pixel++){
+                    out[pixel] += bias[outCh];
+                }
+            }
+        }
+        return;
+    }
+    const int batchPixel = numOutPixel * batchSize;
+    const int colSize = windowSize * windowSize * numInputChannel;
+
+    // 入力を行列に展開し、weight(outCh x (inCh, winY, winX))との積を取る
+    // バッチの各サンプルは列方向に並べ、バッチ全体を1回のGEMMで計算する
+    // 入力チャネルごとに部分和を取ることで、従来の計算順序と一致させる
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    float* col = scope.allocate(static_cast<size_t>(colSize) * batchPixel);
+    for(int n = 0; n < batchSize; n++){
+        im2col(input + n * getInputDataSize(), inputSize.first, inputSize.second,
+               numInputChannel, windowSize, zeroPad, stride, col + n * numOutPixel, batchPixel);
+    }
+    // サンプルが1つなら(outCh, pixel)の並びがそのまま出力の並びになる
+    const size_t outputDataSize = static_cast<size_t>(getOutputDataSize()) * batchSize;
+    float* dst = batchSize == 1 ? output : scope.allocate(outputDataSize);
+    std::fill(dst, dst + outputDataSize, 0.0F);
+    sgemm(false, false, numOutputChannel, batchPixel, colSize,
+          getWeightData(), colSize, col, batchPixel,
+          dst, batchPixel, windowSize * windowSize);
+
+    // (outCh, sample, pixel)の並びを(sample, outCh, pixel)に直しつつ、biasを足す
+    for(int n = 0; n < batchSize; n++){
+        for(int outCh = 0; outCh < numOutputChannel; outCh++){
+            const float* src = dst + outCh * batchPixel + n * numOutPixel;
+            float* out = output + (n * numOutputChannel + outCh) * numOutPixel;
+            for(int pixel = 0; pixel < numOutPixel; pixel++){
+                out[pixel] = src[pixel] + bias[outCh];
+            }
+        }
+    }
+}
+
+void ConvolutionLayer::forwardReLUPool(const float* input, const PoolingLayer& pool,
+                float* output, float* reluOutput, int32_t* argmax, ConvAlgorithm selected) const
+{
+    assert(pool.getInputDataSize() == getOutputDataSize());
+    if(selected == ConvAlgorithm::AUTO){
+        selected = selectAlgorithm();
+    }
+    const int convWidth = outputSize.first;
+    const int convHeight = outputSize.second;
+    const int poolWidth = pool.getOutputSize().first;
+    const int poolHeight = pool.getOutputSize().second;
+    const int poolZeroPad = pool.getZeroPad();
+    const int poolWindowSize = pool.getWindowSize();
+    const int poolStride = pool.getStride();
+    const int numConvPixel = convWidth * convHeight;
+    const int numPoolPixel = poolWidth * poolHeight;
+    const int colSize = windowSize * windowSize * numInputChannel;
+
+    // 畳み込みの出力のうちy座標がconvY0から始まるbandPixel画素分から、poolの出力の[poolY0, poolY1)行を求める
+    // addBiasが真なら、畳み込みの出力にbiasを足してから使う
+    auto reluPool = [&](const float* conv, int convY0, int bandPixel, int poolY0, int poolY1, bool addBias){
+        for(int ch = 0; ch < numOutputChannel; ch++){
+            const float* convCh = conv + ch * bandPixel;
+            const float b = addBias ? bias[ch] : 0;
+            if(reluOutput != nullptr){
+                float* dst = reluOutput + ch * numConvPixel + convY0 * convWidth;
+                for(int i = 0; i < bandPixel; i++){
+                    const float val = convCh[i] + b;
+                    dst[i] = val >= 0 ? val : 0;
+                }
+            }
+            // ReLUとmaxは入れ替えられるので、窓内の最大値を0と比べればよい
+            for(int outY = poolY0; outY < poolY1; outY++){
+                const int y0 = outY * poolStride;
+                for(int outX = 0; outX < poolWidth; outX++){
+                    const int x0 = outX * poolStride;
+                    float maxVal = 0;
+                    int maxIndex = -1;
+                    int numWinYLoop = std::min(poolWindowSize, convHeight + poolZeroPad - y0);
+                    for(int winY = std::max(0, poolZeroPad - y0); winY < numWinYLoop; winY++){
+                        // 畳み込みの出力1チャネル分の中での、行の先頭(x = x0 - poolZeroPad)の添字
+                        const int rowIndex = (winY - poolZeroPad + y0) * convWidth - poolZeroPad + x0;
+                        const float* row = convCh + rowIndex - convY0 * convWidth;
+                        int numWinXLoop = std::min(poolWindowSize, convWidth + poolZeroPad - x0);
+                        for(int winX = std::max(0, poolZeroPad - x0); winX < numWinXLoop; winX++){
+                            const float val = row[winX] + b;
+                            if(maxVal <= val){
+                                maxVal = val;
+                                maxIndex = rowIndex + winX;
+                            }
                         }
                     }
-                    addValToVecMap(output, outX, outY, outputSize.first, outputSize.second, outCh, convVal);
+                    const int out = ch * numPoolPixel + outY * poolWidth + outX;
+                    output[out] = maxVal;
+                    if(argmax != nullptr){
+                        argmax[out] = maxIndex < 0 ? -1 : ch * numConvPixel + maxIndex;
+                    }
                 }
             }
         }
-        // Add bias to all entries
-        for(int outY = 0; outY < outputSize.second; outY++){
-            for(int outX = 0; outX < outputSize.first; outX++){
-                addValToVecMap(output, outX, outY, outputSize.first, outputSize.second, outCh, bias[outCh]);
-            }
+    };
+
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    if(selected != ConvAlgorithm::GEMM){
+        // GEMM以外は畳み込みの出力をすべて求めてからpoolする
+        float* conv = scope.allocate(static_cast<size_t>(numOutputChannel) * numConvPixel);
+        forwardBatch(input, conv, 1, selected);
+        reluPool(conv, 0, numConvPixel, 0, poolHeight, false);
+        return;
+    }
+
+    // colと畳み込みの出力がL2に収まるように、1度に処理するpoolの出力の行数を決める
+    // 窓が重なる分の畳み込みの行は、隣のバンドと重複して計算する
+    constexpr int BAND_SIZE = 32 * 1024;
+    const int bandRows = std::max(1, (BAND_SIZE / ((colSize + numOutputChannel) * convWidth)
+                                      - poolWindowSize) / poolStride + 1);
+    const int maxConvRows = std::min(convHeight, (bandRows - 1) * poolStride + poolWindowSize);
+    float* col = scope.allocate(static_cast<size_t>(colSize) * maxConvRows * convWidth);
+    float* conv = scope.allocate(static_cast<size_t>(numOutputChannel) * maxConvRows * convWidth);
+
+    for(int poolY0 = 0; poolY0 < poolHeight; poolY0 += bandRows){
+        const int poolY1 = std::min(poolHeight, poolY0 + bandRows);
+        const int convY0 = std::max(0, poolY0 * poolStride - poolZeroPad);
+        const int convY1 = std::min(convHeight, (poolY1 - 1) * poolStride - poolZeroPad + poolWindowSize);
+        const int bandPixel = std::max(0, convY1 - convY0) * convWidth;
+        if(0 < bandPixel){
+            im2colRows(input, inputSize.first, inputSize.second, numInputChannel,
+                       windowSize, zeroPad, stride, convY0, convY1, col, bandPixel);
+            std::fill(conv, conv + numOutputChannel * bandPixel, 0.0F);
+            sgemm(false, false, numOutputChannel, bandPixel, colSize,
+                  getWeightData(), colSize, col, bandPixel,
+                  conv, bandPixel, windowSize * windowSize);
         }
+        reluPool(conv, convY0, bandPixel, poolY0, poolY1, true);
     }
-    return output;
 }
 
-void ConvolutionLayer::initWeight()
+void ConvolutionLayer::quantize(float inputMaxAbs)
 {
+    // 重みは (outCh) x (inCh x windowSize x windowSize) の行列として、出力チャネルごとに量子化する
+    const int colSize = windowSize * windowSize * numInputChannel;
+    quantizedWeight = QuantizedWeight(getWeightData(), numOutputChannel, colSize,
+                                      getQuantizeScale(inputMaxAbs));
+}
+
+void ConvolutionLayer::forwardQuantized(const float* input, float* output) const
+{
+    if(!isQuantized()){
+        forward(input, output);
+        return;
+    }
+    const int outWidth = outputSize.first;
+    const int numOutPixel = outputSize.first * outputSize.second;
+    const int colSize = windowSize * windowSize * numInputChannel;
+
+    // 入力を量子化し、出力1行分ずつ窓を並べてint8の積和を取る
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    auto allocateS8 = [&](size_t size){
+        return reinterpret_cast<int8_t*>(scope.allocate((size + sizeof(float) - 1) / sizeof(float)));
+    };
+    int8_t* qInput = allocateS8(getInputDataSize());
+    int8_t* rows = allocateS8(static_cast<size_t>(outWidth) * colSize);
+    auto acc = reinterpret_cast<int32_t*>(scope.allocate(numOutputChannel));
+    ::quantize(input, getInputDataSize(), quantizedWeight.getInputScale(), qInput);
+    for(int outY = 0; outY < outputSize.second; outY++){
+        im2rowS8(qInput, inputSize.first, inputSize.second, numInputChannel,
+                 windowSize, zeroPad, stride, outY, rows);
+        for(int outX = 0; outX < outWidth; outX++){
+            quantizedWeight.apply(rows + outX * colSize, acc,
+                                  output + outY * outWidth + outX, numOutPixel);
+        }
+    }
+    for(int outCh = 0; outCh < numOutputChannel; outCh++){
+        float* out = output + outCh * numOutPixel;
+        for(int pixel = 0; pixel < numOutPixel; pixel++){
+            out[pixel] += bias[outCh];
+        }
+    }
+}
+
+void ConvolutionLayer::initWeight(uint32_t seed)
+{
+    invalidateWeightSpectrum();
+    quantizedWeight = QuantizedWeight();
+    mappedWeight = MappedTensor();
     weight.resize(windowSize * windowSize * numInputChannel * numOutputChannel);
 
-    std::random_device seedGen;
-    std::mt19937 mt(seedGen());
+    std::mt19937 mt(seed);
     std::uniform_real_distribution<double> rd(-1.0, 1.0);
     for(auto& elem : weight){
         elem = rd(mt);
@@ -138,109 +663,211 @@ void ConvolutionLayer::initWeight()
     for(auto& elem : bias){
         elem = rd(mt);
     }
+    resetOptimizerState();
 }
 
-std::vector<float> ConvolutionLayer::updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate)
+size_t ConvolutionLayer::getWorkspaceSize(int batchSize) const
 {
-    assert(!propError.empty());
-    assert(propError.size() == output.size());
-    std::shared_lock<std::shared_mutex> lkWeight(mtxWeight);
+    const size_t batchPixel = static_cast<size_t>(outputSize.first) * outputSize.second * batchSize;
+    const size_t colSize = static_cast<size_t>(windowSize) * windowSize * numInputChannel;
+    const ConvAlgorithm selected = selectAlgorithm();
+    // backward: どの計算方法でもdEdbを置く
+    const size_t biasSize = Workspace::getAlignedSize(numOutputChannel);
+    if(selected == ConvAlgorithm::DIRECT){
+        // forward: (forwardReLUPoolなら)畳み込みの出力
+        // backward: dEdw, 反転した重み
+        return std::max(Workspace::getAlignedSize(numOutputChannel * batchPixel),
+                        2 * Workspace::getAlignedSize(colSize * numOutputChannel) + biasSize);
+    }
+    if(selected == ConvAlgorithm::FFT){
+        const int rows = getFftSize(inputSize.second + 2 * zeroPad);
+        const int cols = getFftSize(inputSize.first + 2 * zeroPad);
+        // forward: (forwardReLUPoolなら)畳み込みの出力, FFTの作業領域
+        const size_t forwardSize = Workspace::getAlignedSize(numOutputChannel * batchPixel)
+            + getFftConvolutionWorkspaceSize(rows, cols, numInputChannel, numOutputChannel,
+                                             windowSize, false);
+        // backward: dEdw, FFTの作業領域
+        const size_t backwardSize = Workspace::getAlignedSize(colSize * numOutputChannel)
+            + getFftConvolutionWorkspaceSize(rows, cols, numInputChannel, numOutputChannel,
+                                             windowSize, true) + biasSize;
+        return std::max(forwardSize, backwardSize);
+    }
+    if(selected != ConvAlgorithm::GEMM){
+        const int tileSize = getWinogradTileSize(selected);
+        // forward: (forwardReLUPoolなら)畳み込みの出力, Winogradの作業領域
+        const size_t forwardSize = Workspace::getAlignedSize(numOutputChannel * batchPixel)
+            + getWinogradWorkspaceSize(tileSize, inputSize.first, inputSize.second,
+                                       numInputChannel, numOutputChannel, zeroPad, batchSize);
+        // backward: dEdw, 重みの勾配の作業領域 / 反転した重み, nextPropErrorの作業領域
+        const size_t weightSize = Workspace::getAlignedSize(colSize * numOutputChannel);
+        const size_t backwardSize = weightSize + biasSize + std::max(
+            getWinogradWorkspaceSize(tileSize, inputSize.first, inputSize.second,
+                                     numInputChannel, numOutputChannel, zeroPad, batchSize),
+            weightSize + getWinogradWorkspaceSize(tileSize, outputSize.first, outputSize.second,
+                                                  numOutputChannel, numInputChannel,
+                                                  windowSize - 1 - zeroPad, batchSize));
+        return std::max(forwardSize, backwardSize);
+    }
+    const size_t colMatSize = Workspace::getAlignedSize(colSize * batchPixel);
+    // forward: col, (バッチなら)並べ替え前の出力
+    // forwardReLUPoolで使う、数行分のcolと畳み込みの出力もここに収まる
+    const size_t forwardSize = colMatSize
+        + Workspace::getAlignedSize(numOutputChannel * batchPixel);
+    // backward: col, (バッチなら)並べ替えたpropError, dEdw
+    const size_t backwardSize = colMatSize
+        + (batchSize == 1 ? 0 : Workspace::getAlignedSize(numOutputChannel * batchPixel))
+        + Workspace::getAlignedSize(colSize * numOutputChannel) + biasSize;
+    return std::max(forwardSize, backwardSize);
+}
+
+void ConvolutionLayer::backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard)
+{
+    backwardBatch(input, output, propError, nextPropError, 1, reduceRate, shard);
+}
+
+void ConvolutionLayer::backwardBatch(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                int batchSize, double reduceRate, int shard)
+{
+    assert(0 < batchSize);
+    // Hogwildではロックを取らない
+    std::shared_lock<std::shared_mutex> lkWeight(mtxWeight, std::defer_lock);
+    std::shared_lock<std::shared_mutex> lkBias(mtxBias, std::defer_lock);
+    if(!hogwild){
+        lkWeight.lock();
+        lkBias.lock();
+    }
+    const int numOutPixel = outputSize.first * outputSize.second;
+    const int batchPixel = numOutPixel * batchSize;
+    const int colSize = windowSize * windowSize * numInputChannel;
+    const int weightSize = colSize * numOutputChannel;
+    const ConvAlgorithm selected = selectAlgorithm();
+    WorkspaceScope scope(Workspace::getThreadLocal());
+
     /* Update weight */
-    std::vector<float> dEdw(windowSize * windowSize * numInputChannel * numOutputChannel);
-    for(int outCh = 0; outCh < numOutputChannel; outCh++){
-        for(int inCh = 0; inCh < numInputChannel; inCh++){
-            for(int winY = 0; winY < windowSize; winY++){
-                for(int winX = 0; winX < windowSize; winX++){
-                    float sumVal = 0;
-                    int numOutYLoop = std::min(outputSize.second, inputSize.second + zeroPad - winY);
-                    for(int outY = std::max(0, zeroPad - winY); outY < numOutYLoop; outY++){
-                        int numOutXLoop = std::min(outputSize.first, inputSize.first + zeroPad - winX);
-                        for(int outX = std::max(0, zeroPad - winX); outX < numOutXLoop; outX++){
-                            auto pe = getValFromVecMap(propError, outX, outY,
-                                        outputSize.first, outputSize.second, outCh);
-                            auto inVal = getValFromVecMap(input, winX - zeroPad + outX, winY -zeroPad + outY,
-                                        inputSize.first, inputSize.second, inCh);
-                            sumVal += pe * inVal;
-                        }
-                    }
-                    setValToVecMap(dEdw, winX, winY, windowSize, windowSize, inCh + numInputChannel * outCh, sumVal);
+    float* dEdw = scope.allocate(weightSize);
+    std::fill(dEdw, dEdw + weightSize, 0.0F);
+    float* col = nullptr;
+    const float* pe = propError;
+    if(selected == ConvAlgorithm::FFT){
+        // nextPropErrorも、propErrorのスペクトルを使い回して一緒に求める
+        const auto* spectrum = getWeightSpectrum();
+        fftConvolutionBackward(*fft, input, inputSize.first, inputSize.second, numInputChannel,
+                               propError, spectrum, numOutputChannel, windowSize, zeroPad,
+                               dEdw, nextPropError, batchSize);
+    }else if(selected == ConvAlgorithm::DIRECT){
+        for(int n = 0; n < batchSize; n++){
+            directKernel.weightGradient(input + n * getInputDataSize(), inputSize.first, inputSize.second,
+                                        numInputChannel, propError + n * getOutputDataSize(),
+                                        numOutputChannel, windowSize, zeroPad, dEdw);
+        }
+    }else if(selected != ConvAlgorithm::GEMM){
+        winogradWeightGradient(getWinogradTileSize(selected), input, inputSize.first, inputSize.second, numInputChannel,
+                               propError, numOutputChannel, zeroPad, dEdw, batchSize);
+    }else{
+        col = scope.allocate(static_cast<size_t>(colSize) * batchPixel);
+        for(int n = 0; n < batchSize; n++){
+            im2col(input + n * getInputDataSize(), inputSize.first, inputSize.second,
+                   numInputChannel, windowSize, zeroPad, stride, col + n * numOutPixel, batchPixel);
+        }
+        // propErrorを(outCh, sample, pixel)の並びに直す
+        if(1 < batchSize){
+            float* peMat = scope.allocate(static_cast<size_t>(numOutputChannel) * batchPixel);
+            for(int n = 0; n < batchSize; n++){
+                for(int outCh = 0; outCh < numOutputChannel; outCh++){
+                    std::copy_n(propError + (n * numOutputChannel + outCh) * numOutPixel,
+                                numOutPixel, peMat + outCh * batchPixel + n * numOutPixel);
                 }
             }
+            pe = peMat;
         }
+        // dEdw(outCh x col) = propError(outCh x pixel) * col^T
+        sgemm(false, true, numOutputChannel, colSize, batchPixel,
+              pe, batchPixel, col, batchPixel,
+              dEdw, colSize);
     }
 
     if(verbose) {
         std::cout << "Conv layer before weight:" << std::endl;
-        printVector(weight);
+        printVector(getWeightData(), weightSize);
         std::cout << "Conv layer dEdw:" << std::endl;
-        printVector(dEdw);
-        printVector(weight);
-    }
-
-    std::lock_guard<std::mutex> lkDiffWeight(mtxDiffWeight);
-    std::lock_guard<std::mutex> lkDiffBias(mtxDiffBias);
-    if(diffWeight.empty()) {
-        diffWeight.resize(weight.size());
-        diffBias.resize(bias.size());
-    }
-    for(int i = 0; i < windowSize * windowSize * numInputChannel * numOutputChannel; i++){
-        diffWeight.at(i) -= reduceRate * GAMMA * dEdw.at(i);
-        diffWeight.at(i) -= LAMBDA * reduceRate * GAMMA * weight.at(i);
-    }
-
-    if(verbose) {
-        std::cout << "Conv layer after weight:" << std::endl;
-        printVector(weight);
+        printVector(dEdw, weightSize);
+        printVector(getWeightData(), weightSize);
     }
 
     /* Update bias */
-    std::shared_lock<std::shared_mutex> lkBias(mtxBias);
     if(verbose) {
         std::cout << "Conv layer before bias:" << std::endl;
         printVector(bias);
     }
-    std::vector<float> dEdb(numOutputChannel);
+    float* dEdb = scope.allocate(numOutputChannel);
     for(int outCh = 0; outCh < numOutputChannel; outCh++){
-        for(int out = 0; out < outputSize.first * outputSize.second; out++){
-            auto pe = getValFromVecMap(propError, out, 0, outputSize.first * outputSize.second, 1, outCh);
-            dEdb.at(outCh) += pe;
+        dEdb[outCh] = 0;
+        for(int n = 0; n < batchSize; n++){
+            const float* peCh = propError + (n * numOutputChannel + outCh) * numOutPixel;
+            for(int pixel = 0; pixel < numOutPixel; pixel++){
+                dEdb[outCh] += peCh[pixel];
+            }
         }
-        diffBias.at(outCh) -= reduceRate * GAMMA * dEdb.at(outCh);
-        diffBias.at(outCh) -= LAMBDA * reduceRate * GAMMA * bias.at(outCh);
     }
-    if(verbose) {
-        std::cout << "Conv layer after bias:" << std::endl;
-        printVector(bias);
+    if(!hogwild){
+        assert(0 <= shard && static_cast<size_t>(shard) < gradShards.size());
+        auto& grad = *gradShards[shard];
+        std::lock_guard<std::mutex> lkGrad(grad.mtx);
+        accumulateGradient(grad, dEdw, weightSize, dEdb, bias.size(), batchSize, reduceRate);
     }
+    const float* w = getWeightData();
 
     /* Next propError */
-    std::vector<float> nextPropError(input.size());
-    for(int inCh = 0; inCh < numInputChannel; inCh++){
-        for(int inY = 0; inY < inputSize.second; inY++){
-            for(int inX = 0; inX < inputSize.first; inX++){
-                float sumVal = 0;
-                for(int outCh = 0; outCh < numOutputChannel; outCh++){
-                    int numWinYLoop = std::min(windowSize, inY + zeroPad + 1);
-                    for(int winY = std::max(0, inY + zeroPad - outputSize.second + 1); winY < numWinYLoop; winY++){
-                        int numWinXLoop = std::min(windowSize, inX + zeroPad + 1);
-                        for(int winX = std::max(0, inX + zeroPad - outputSize.first + 1); winX < numWinXLoop; winX++){
-                            auto pe = getValFromVecMap(propError,
-                                        inX - winX + zeroPad, inY - winY + zeroPad,
-                                        outputSize.first, outputSize.second, outCh);
-                            auto w = getValFromVecMap(weight, winX, winY, windowSize, windowSize, inCh + numInputChannel * outCh);
-                            sumVal += pe * w;
-                        }
-                    }
-                }
-                setValToVecMap(nextPropError, inX, inY, inputSize.first, inputSize.second, inCh, sumVal);
+    if(selected == ConvAlgorithm::FFT){
+        // dEdwと一緒に求めてある
+    }else if(selected != ConvAlgorithm::GEMM){
+        // 窓を180度回して入出力チャネルを入れ替えた重みで、propErrorを畳み込む
+        float* flipped = scope.allocate(weightSize);
+        flipWeight(w, windowSize, numInputChannel, numOutputChannel, flipped);
+        const int backZeroPad = windowSize - 1 - zeroPad;
+        if(selected == ConvAlgorithm::DIRECT){
+            for(int n = 0; n < batchSize; n++){
+                directBackKernel.forward(propError + n * getOutputDataSize(),
+                                         outputSize.first, outputSize.second, numOutputChannel,
+                                         flipped, numInputChannel, windowSize, backZeroPad,
+                                         nextPropError + n * getInputDataSize());
             }
+        }else{
+            winogradConvolution(getWinogradTileSize(selected), propError,
+                                outputSize.first, outputSize.second, numOutputChannel,
+                                flipped, numInputChannel, backZeroPad, nextPropError, batchSize);
+        }
+    }else{
+        // weight^T * propErrorで列ごとの誤差を求め、入力の位置へ足し戻す
+        std::fill(col, col + static_cast<size_t>(colSize) * batchPixel, 0.0F);
+        sgemm(true, false, colSize, batchPixel, numOutputChannel,
+              getWeightData(), colSize, pe, batchPixel,
+              col, batchPixel);
+        std::fill(nextPropError, nextPropError + static_cast<size_t>(getInputDataSize()) * batchSize, 0.0F);
+        for(int n = 0; n < batchSize; n++){
+            col2im(col + n * numOutPixel, inputSize.first, inputSize.second,
+                   numInputChannel, windowSize, zeroPad, stride,
+                   nextPropError + n * getInputDataSize(), batchPixel);
         }
     }
 
-    return nextPropError;
+    // 誤差を伝えた後で、直接重みを更新する(ロックを取る場合と同じく、更新前の重みで誤差を伝える)
+    // 誤差が来なかった出力チャネルの重みには書き込まない
+    if(hogwild){
+        weightState.stepTouchedRows(optimizer, weight.data(), dEdw, weightSize, colSize,
+                                    reduceRate, batchSize * reduceRate);
+        biasState.stepTouchedRows(optimizer, bias.data(), dEdb, bias.size(), 1,
+                                  reduceRate, batchSize * reduceRate);
+    }
+    if(verbose) {
+        std::cout << "Conv layer after weight:" << std::endl;
+        printVector(getWeightData(), weightSize);
+        std::cout << "Conv layer after bias:" << std::endl;
+        printVector(bias);
+    }
 }
 
 void ConvolutionLayer::dumpWeight() const
@@ -252,7 +879,7 @@ void ConvolutionLayer::dumpWeight() const
             std::cout << "weight:" << std::endl;
             for(int winY = 0; winY < windowSize; winY++){
                 for(int winX = 0; winX < windowSize; winX++){
-                    std::cout << getValFromVecMap(weight, winX, winY, windowSize, windowSize, inCh + numInputChannel * outCh) << ", ";
+                    std::cout << getValFromVecMap(getWeightData(), winX, winY, windowSize, windowSize, inCh + numInputChannel * outCh) << ", ";
                 }
                 std::cout << std::endl;
             }
@@ -267,19 +894,26 @@ void ConvolutionLayer::saveWeight(std::ofstream& ofs) const
     if(verbose){
         dumpWeight();
     }
-    ofs << weight.size() << std::endl;
-    for(auto w : weight){
-        ofs << w << std::endl;
+    const size_t weightSize = windowSize * windowSize * numInputChannel * numOutputChannel;
+    const float* w = getWeightData();
+    // 読み込んだ時に元の値に戻るだけの桁数で書く
+    ofs << std::setprecision(std::numeric_limits<float>::max_digits10);
+    ofs << weightSize << '\n';
+    for(size_t i = 0; i < weightSize; i++){
+        ofs << w[i] << '\n';
     }
-    ofs << bias.size() << std::endl;
+    ofs << bias.size() << '\n';
     for(auto b : bias){
-        ofs << b << std::endl;
+        ofs << b << '\n';
     }
 }
 
 void ConvolutionLayer::loadWeight(std::ifstream& ifs)
 {
     std::string buf;
+    invalidateWeightSpectrum();
+    quantizedWeight = QuantizedWeight();
+    mappedWeight = MappedTensor();
     if(std::getline(ifs, buf)){
         weight.resize(std::stof(buf));
     }else{
@@ -309,35 +943,134 @@ void ConvolutionLayer::loadWeight(std::ifstream& ifs)
             return;
         }
     }
+    resetOptimizerState();
     if(verbose) {
         dumpWeight();
     }
 }
 
+std::vector<TensorView> ConvolutionLayer::getTensors() const
+{
+    const size_t weightSize = windowSize * windowSize * numInputChannel * numOutputChannel;
+    std::vector<TensorView> tensors = {TensorView{getWeightData(), weightSize},
+                                       TensorView{bias.data(), bias.size()}};
+    // 量子化していれば、量子化した重みも続けて保存する
+    if(isQuantized()){
+        auto quantized = quantizedWeight.getTensors();
+        tensors.insert(std::end(tensors), std::begin(quantized), std::end(quantized));
+    }
+    return tensors;
+}
+
+bool ConvolutionLayer::setTensors(const std::vector<MappedTensor>& tensors)
+{
+    const size_t weightSize = windowSize * windowSize * numInputChannel * numOutputChannel;
+    if((tensors.size() != 2 && tensors.size() != 5)
+        || tensors.at(0).type != TensorType::FLOAT32 || tensors.at(0).size != weightSize
+        || tensors.at(1).type != TensorType::FLOAT32
+        || tensors.at(1).size != static_cast<size_t>(numOutputChannel)){
+        std::cerr << "invalid tensors for convolution layer" << std::endl;
+        return false;
+    }
+    QuantizedWeight quantized;
+    if(tensors.size() == 5 && !quantized.setTensors(tensors.at(2), tensors.at(3), tensors.at(4),
+                                                    numOutputChannel, weightSize / numOutputChannel)){
+        return false;
+    }
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    // 重みはファイル上の領域をそのまま使い、biasは小さいのでコピーする
+    invalidateWeightSpectrum();
+    mappedWeight = tensors.at(0);
+    weight.clear();
+    bias.assign(tensors.at(1).get<float>(), tensors.at(1).get<float>() + tensors.at(1).size);
+    quantizedWeight = std::move(quantized);
+    resetOptimizerState();
+    if(verbose) {
+        dumpWeight();
+    }
+    return true;
+}
+
+void ConvolutionLayer::detachWeight()
+{
+    if(mappedWeight.data == nullptr){
+        return;
+    }
+    weight.assign(mappedWeight.get<float>(), mappedWeight.get<float>() + mappedWeight.size);
+    mappedWeight = MappedTensor();
+}
+
+void ConvolutionLayer::reduceGradientSlice(int slice, int numSlice)
+{
+    reduceGradShardsSlice(gradShards, slice, numSlice);
+}
+
 void ConvolutionLayer::flush()
 {
     std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
     std::lock_guard<std::shared_mutex> lkBias(mtxBias);
-    std::lock_guard<std::mutex> lkDiffWeight(mtxDiffWeight);
-    std::lock_guard<std::mutex> lkDiffBias(mtxDiffBias);
-    assert((diffWeight.empty() && diffBias.empty())
-        || (!diffWeight.empty() && !diffBias.empty()));
-    if(!diffWeight.empty()) {
-        for(int i = 0; static_cast<size_t>(i) < weight.size(); i++) {
-            weight.at(i) += diffWeight.at(i);
-            assert(std::isfinite(weight.at(i)));
-        }
+    reduceGradShards(gradShards);
+    auto& grad = *gradShards.front();
+    std::lock_guard<std::mutex> lkGrad(grad.mtx);
+    assert((grad.weight.empty() && grad.bias.empty())
+        || (!grad.weight.empty() && !grad.bias.empty()));
+    if(!grad.weight.empty()) {
+        detachWeight();
+        invalidateWeightSpectrum();
+        quantizedWeight = QuantizedWeight();
+        assert(grad.weight.size() == weight.size() && grad.bias.size() == bias.size());
+        // 最適化手法の1ステップ(L2正則化込み)を、パラメータごとに1回のループで行う
+        weightState.step(optimizer, weight.data(), grad.weight.data(), weight.size(), 1.0F, grad.decayScale);
+        biasState.step(optimizer, bias.data(), grad.bias.data(), bias.size(), 1.0F, grad.decayScale);
+        assert(std::all_of(bias.begin(), bias.end(), [](float b){return std::isfinite(b);}));
+
+        grad.weight.clear();
+        grad.bias.clear();
+        grad.decayScale = 0;
+    }
+}
 
-        for(int i = 0; static_cast<size_t>(i) < bias.size(); i++) {
-            bias.at(i) += diffBias.at(i);
-            assert(std::isfinite(bias.at(i)));
-        }
+void ConvolutionLayer::setNumShard(int numShard)
+{
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    resizeGradShards(gradShards, numShard);
+}
+
+void ConvolutionLayer::setHogwild(bool mode)
+{
+    flush();
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    hogwild = mode;
+    if(hogwild){
+        // 直接書き換えるので、mmap上の重みはコピーし、量子化した重みは破棄する
+        // FFTはGEMMに切り替わるので、重みのスペクトルはHogwildを止めるまで作り直されない
+        detachWeight();
+        invalidateWeightSpectrum();
+        quantizedWeight = QuantizedWeight();
+    }
+}
 
-        diffWeight.clear();
-        diffBias.clear();
+void ConvolutionLayer::setOptimizer(const OptimizerConfig& config)
+{
+    flush();
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    const bool typeChanged = config.type != optimizer.type;
+    optimizer = config;
+    if(typeChanged){
+        resetOptimizerState();
     }
 }
 
+void ConvolutionLayer::resetOptimizerState()
+{
+    weightState.reset(optimizer, static_cast<size_t>(windowSize) * windowSize * numInputChannel * numOutputChannel);
+    biasState.reset(optimizer, bias.size());
+}
+
 /* ======================
     ReLULayer
    ======================*/
@@ -347,102 +1080,317 @@ void ReLULayer::calcOutputSize()
     numOutputChannel = numInputChannel;
 }
 
-std::vector<float> ReLULayer::apply(const std::vector<float>& input) const
+void ReLULayer::forward(const float* input, float* output) const
+{
+    for(int i = 0; i < getInputDataSize(); i++){
+        output[i] = input[i] >= 0 ? input[i] : 0;
+    }
+}
+
+double ReLULayer::getForwardFlop() const
+{
+    return getInputDataSize();
+}
+
+double ReLULayer::getBackwardFlop() const
+{
+    return getInputDataSize();
+}
+
+void ReLULayer::backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard)
 {
-    assert(input.size() == static_cast<size_t>(inputSize.first * inputSize.second * numInputChannel));
-    auto output = input;
-    for(auto& elem : output){
-        elem = elem >= 0 ? elem : 0;
+    /* Next propError */
+    for(int out = 0; out < getOutputDataSize(); out++){
+        nextPropError[out] = output[out] == 0 ? 0 : propError[out];
     }
-    return output;
 }
 
-std::vector<float> ReLULayer::updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate)
+namespace {
+// van Herk/Gil-Wermanの方法で、窓の最大値を窓の大きさによらないコストで求める
+// 系列の要素src[i]はそれぞれnumLane個の値の並び(src + i * numLane)で、レーンごとに独立に計算する
+// 系列をwindowSizeごとのブロックに分け、ブロック内の前からの累積(prefix)と後ろからの累積(suffix)を
+// 求めておけば、src[k * stride]から始まる窓の最大値はsuffixとprefixの2つの比較で求まる
+// 値が等しければ系列の後ろの要素を選ぶので、indexは窓を先頭から走査して最後の最大値を取った結果と一致する
+// WITH_INDEXが偽ならindexは扱わない
+template<bool WITH_INDEX>
+void slidingMax(const float* srcVal, const int32_t* srcIndex, int numLane,
+                int windowSize, int stride, int numOut,
+                float* prefixVal, int32_t* prefixIndex, float* suffixVal, int32_t* suffixIndex,
+                float* dstVal, int32_t* dstIndex)
 {
-    assert(!propError.empty());
-    /* Next propError */
-    std::vector<float> nextPropError(input.size());
-    for(int out = 0; static_cast<size_t>(out) < output.size(); out++){
-        nextPropError.at(out) = output.at(out) == 0 ? 0 : propError.at(out);
+    const int length = (numOut - 1) * stride + windowSize;
+    for(int blockBegin = 0; blockBegin < length; blockBegin += windowSize){
+        const int blockEnd = std::min(length, blockBegin + windowSize);
+        std::copy_n(srcVal + blockBegin * numLane, numLane, prefixVal + blockBegin * numLane);
+        if constexpr(WITH_INDEX){
+            std::copy_n(srcIndex + blockBegin * numLane, numLane, prefixIndex + blockBegin * numLane);
+        }
+        for(int i = blockBegin + 1; i < blockEnd; i++){
+            const float* prev = prefixVal + (i - 1) * numLane;
+            const float* cur = srcVal + i * numLane;
+            float* dst = prefixVal + i * numLane;
+            for(int lane = 0; lane < numLane; lane++){
+                dst[lane] = prev[lane] <= cur[lane] ? cur[lane] : prev[lane];
+            }
+            if constexpr(WITH_INDEX){
+                const int32_t* prevIndex = prefixIndex + (i - 1) * numLane;
+                const int32_t* curIndex = srcIndex + i * numLane;
+                int32_t* dstIndex = prefixIndex + i * numLane;
+                for(int lane = 0; lane < numLane; lane++){
+                    dstIndex[lane] = prev[lane] <= cur[lane] ? curIndex[lane] : prevIndex[lane];
+                }
+            }
+        }
+        std::copy_n(srcVal + (blockEnd - 1) * numLane, numLane, suffixVal + (blockEnd - 1) * numLane);
+        if constexpr(WITH_INDEX){
+            std::copy_n(srcIndex + (blockEnd - 1) * numLane, numLane, suffixIndex + (blockEnd - 1) * numLane);
+        }
+        for(int i = blockEnd - 2; blockBegin <= i; i--){
+            const float* next = suffixVal + (i + 1) * numLane;
+            const float* cur = srcVal + i * numLane;
+            float* dst = suffixVal + i * numLane;
+            if constexpr(WITH_INDEX){
+                const int32_t* nextIndex = suffixIndex + (i + 1) * numLane;
+                const int32_t* curIndex = srcIndex + i * numLane;
+                int32_t* dstIndex = suffixIndex + i * numLane;
+                for(int lane = 0; lane < numLane; lane++){
+                    dstIndex[lane] = cur[lane] <= next[lane] ? nextIndex[lane] : curIndex[lane];
+                }
+            }
+            for(int lane = 0; lane < numLane; lane++){
+                dst[lane] = cur[lane] <= next[lane] ? next[lane] : cur[lane];
+            }
+        }
     }
-    return nextPropError;
+    for(int k = 0; k < numOut; k++){
+        const int x = k * stride;
+        const float* suffix = suffixVal + x * numLane;
+        const float* prefix = prefixVal + (x + windowSize - 1) * numLane;
+        float* dst = dstVal + k * numLane;
+        if(x % windowSize == 0){
+            // 窓がブロックと一致する
+            std::copy_n(suffix, numLane, dst);
+            if constexpr(WITH_INDEX){
+                std::copy_n(suffixIndex + x * numLane, numLane, dstIndex + k * numLane);
+            }
+            continue;
+        }
+        if constexpr(WITH_INDEX){
+            const int32_t* suffixIdx = suffixIndex + x * numLane;
+            const int32_t* prefixIdx = prefixIndex + (x + windowSize - 1) * numLane;
+            int32_t* dstIdx = dstIndex + k * numLane;
+            for(int lane = 0; lane < numLane; lane++){
+                dstIdx[lane] = suffix[lane] <= prefix[lane] ? prefixIdx[lane] : suffixIdx[lane];
+            }
+        }
+        for(int lane = 0; lane < numLane; lane++){
+            dst[lane] = suffix[lane] <= prefix[lane] ? prefix[lane] : suffix[lane];
+        }
+    }
+}
 }
 
 /* ======================
     PoolingLayer
    ======================*/
+PoolingLayer::PoolingLayer(int zeroPad, int windowSize, int stride) :
+    zeroPad(zeroPad), windowSize(windowSize), stride(stride)
+{
+    assert(0 < stride);
+}
+
 void PoolingLayer::calcOutputSize()
 {
-    outputSize = DataSize(inputSize.first + 2*zeroPad - windowSize + 1,
-                        inputSize.second + 2*zeroPad - windowSize + 1);
+    outputSize = DataSize((inputSize.first + 2*zeroPad - windowSize) / stride + 1,
+                        (inputSize.second + 2*zeroPad - windowSize) / stride + 1);
     numOutputChannel = numInputChannel;
 }
 
-std::vector<float> PoolingLayer::apply(const std::vector<float>& input) const
+void PoolingLayer::forward(const float* input, float* output) const
+{
+    forwardArgmax(input, output, nullptr);
+}
+
+void PoolingLayer::forwardArgmax(const float* input, float* output, int32_t* argmax) const
 {
     assert(windowSize <= inputSize.first + 2 * zeroPad);
     assert(windowSize <= inputSize.second + 2 * zeroPad);
-    assert(input.size() == static_cast<size_t>(inputSize.first * inputSize.second) * numInputChannel);
-    std::vector<float> output(outputSize.first * outputSize.second * numOutputChannel);
+    if(useSeparable()){
+        forwardSeparable(input, output, argmax);
+        return;
+    }
+    const int numInPixel = inputSize.first * inputSize.second;
+    const int numOutPixel = outputSize.first * outputSize.second;
     for(int channel = 0; channel < numInputChannel; channel++){
+        const float* in = input + channel * numInPixel;
         for(int outY = 0; outY < outputSize.second; outY++){
+            const int y0 = outY * stride;
             for(int outX = 0; outX < outputSize.first; outX++){
+                const int x0 = outX * stride;
                 float maxVal = 0;
-                int numWinYLoop = std::min(windowSize, inputSize.second + zeroPad - outY);
-                for(int winY = std::max(0, zeroPad - outY); winY < numWinYLoop; winY++){
-                    int numWinXLoop = std::min(windowSize, inputSize.first + zeroPad - outX);
-                    for(int winX = std::max(0, zeroPad - outX); winX < numWinXLoop; winX++){
-                        auto inVal = getValFromVecMap(input, winX - zeroPad + outX, winY - zeroPad + outY, 
-                                        inputSize.first, inputSize.second, channel);
+                int maxIndex = -1;
+                int numWinYLoop = std::min(windowSize, inputSize.second + zeroPad - y0);
+                for(int winY = std::max(0, zeroPad - y0); winY < numWinYLoop; winY++){
+                    const int rowIndex = (winY - zeroPad + y0) * inputSize.first - zeroPad + x0;
+                    int numWinXLoop = std::min(windowSize, inputSize.first + zeroPad - x0);
+                    for(int winX = std::max(0, zeroPad - x0); winX < numWinXLoop; winX++){
+                        auto inVal = in[rowIndex + winX];
                         if(maxVal <= inVal){
                             maxVal = inVal;
+                            maxIndex = rowIndex + winX;
                         }
                     }
                 }
-                setValToVecMap(output, outX, outY, outputSize.first, outputSize.second,
-                                channel, maxVal);
+                const int out = channel * numOutPixel + outY * outputSize.first + outX;
+                output[out] = maxVal;
+                if(argmax != nullptr){
+                    argmax[out] = maxIndex < 0 ? -1 : channel * numInPixel + maxIndex;
+                }
             }
         }
     }
-    return output;
 }
 
-std::vector<float> PoolingLayer::updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate)
+bool PoolingLayer::useSeparable() const
 {
-    assert(!propError.empty());
-    assert(numInputChannel == numOutputChannel);
-    /* Next propError */
-    std::vector<float> nextPropError(input.size());
+    // 窓が重ならなければ、走査しても各入力を1度しか見ない
+    return SEPARABLE_MIN_WINDOW_SIZE <= windowSize && stride < windowSize;
+}
+
+void PoolingLayer::forwardSeparable(const float* input, float* output, int32_t* argmax) const
+{
+    if(argmax == nullptr){
+        forwardSeparableImpl<false>(input, output, nullptr);
+    }else{
+        forwardSeparableImpl<true>(input, output, argmax);
+    }
+}
+
+template<bool WITH_INDEX>
+void PoolingLayer::forwardSeparableImpl(const float* input, float* output, int32_t* argmax) const
+{
+    const int width = inputSize.first;
+    const int height = inputSize.second;
+    const int outWidth = outputSize.first;
+    const int outHeight = outputSize.second;
+    const int paddedWidth = width + 2 * zeroPad;
+    const int paddedHeight = height + 2 * zeroPad;
+    const float lowest = -std::numeric_limits<float>::infinity();
+
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    auto allocateIndex = [&](size_t size){
+        return WITH_INDEX ? reinterpret_cast<int32_t*>(scope.allocate(size)) : nullptr;
+    };
+    // 行方向の最大値(上下にゼロパディングの行を付けて paddedHeight x outWidth)
+    const size_t rowMaxSize = static_cast<size_t>(paddedHeight) * outWidth;
+    float* rowMax = scope.allocate(rowMaxSize);
+    int32_t* rowMaxIndex = allocateIndex(rowMaxSize);
+    // 1行分の入力と、累積の作業領域(列方向の方が大きい)
+    const size_t workSize = std::max(static_cast<size_t>(paddedWidth), rowMaxSize);
+    float* line = scope.allocate(paddedWidth);
+    int32_t* lineIndex = allocateIndex(paddedWidth);
+    float* prefix = scope.allocate(workSize);
+    int32_t* prefixIndex = allocateIndex(workSize);
+    float* suffix = scope.allocate(workSize);
+    int32_t* suffixIndex = allocateIndex(workSize);
+
+    // ゼロパディングの部分は最大値にならないようにする
+    std::fill(line, line + paddedWidth, lowest);
+    std::fill(rowMax, rowMax + rowMaxSize, lowest);
+    if constexpr(WITH_INDEX){
+        std::fill(lineIndex, lineIndex + paddedWidth, -1);
+        std::fill(rowMaxIndex, rowMaxIndex + rowMaxSize, -1);
+    }
+
     for(int channel = 0; channel < numInputChannel; channel++){
-        for(int outY = 0; outY < outputSize.second; outY++){
-            for(int outX = 0; outX < outputSize.first; outX++){
-                auto outVal = getValFromVecMap(output, outX, outY,
-                                outputSize.first, outputSize.second, channel);
-                int numWinYLoop = std::min(windowSize, inputSize.second + zeroPad - outY);
-                for(int winY = std::max(0, zeroPad - outY); winY < numWinYLoop; winY++){
-                    int numWinXLoop = std::min(windowSize, inputSize.first + zeroPad - outX);
-                    for(int winX = std::max(0, zeroPad - outX); winX < numWinXLoop; winX++){
-                        auto inVal = getValFromVecMap(input, winX - zeroPad + outX, winY - zeroPad + outY,
-                                        inputSize.first, inputSize.second, channel);
-                        if(inVal == outVal){
-                            auto pe = getValFromVecMap(propError, outX, outY,
-                                        outputSize.first, outputSize.second, channel); 
-                            addValToVecMap(nextPropError, winX - zeroPad + outX, winY - zeroPad + outY,
-                                        inputSize.first, inputSize.second, channel, pe);
-                        }
-                    }
+        const int channelOffset = channel * width * height;
+        /* Row */
+        for(int y = 0; y < height; y++){
+            std::copy_n(input + channelOffset + y * width, width, line + zeroPad);
+            if constexpr(WITH_INDEX){
+                for(int x = 0; x < width; x++){
+                    lineIndex[zeroPad + x] = channelOffset + y * width + x;
                 }
             }
+            const size_t rowOffset = static_cast<size_t>(zeroPad + y) * outWidth;
+            slidingMax<WITH_INDEX>(line, lineIndex, 1, windowSize, stride, outWidth,
+                                   prefix, prefixIndex, suffix, suffixIndex,
+                                   rowMax + rowOffset, WITH_INDEX ? rowMaxIndex + rowOffset : nullptr);
+        }
+
+        /* Column */
+        // 出力の1行をレーンとして、列方向をまとめて求める
+        const int outOffset = channel * outWidth * outHeight;
+        slidingMax<WITH_INDEX>(rowMax, rowMaxIndex, outWidth, windowSize, stride, outHeight,
+                               prefix, prefixIndex, suffix, suffixIndex,
+                               output + outOffset, WITH_INDEX ? argmax + outOffset : nullptr);
+        // 窓内がすべて負なら、0を出力する
+        for(int out = outOffset; out < outOffset + outWidth * outHeight; out++){
+            if constexpr(WITH_INDEX){
+                argmax[out] = output[out] < 0 ? -1 : argmax[out];
+            }
+            output[out] = output[out] < 0 ? 0 : output[out];
         }
     }
+}
 
-    return nextPropError;
+double PoolingLayer::getForwardFlop() const
+{
+    if(useSeparable()){
+        // 行と列について、それぞれ累積2回と窓ごとの比較1回
+        return 3.0 * numInputChannel * (inputSize.second * outputSize.first
+                                        + outputSize.first * outputSize.second);
+    }
+    return static_cast<double>(getOutputDataSize()) * windowSize * windowSize;
+}
+
+double PoolingLayer::getBackwardFlop() const
+{
+    // argmaxの位置に書き戻すだけ
+    return static_cast<double>(getOutputDataSize());
+}
+
+void PoolingLayer::backwardArgmax(const int32_t* argmax, const float* propError,
+                float* nextPropError) const
+{
+    assert(numInputChannel == numOutputChannel);
+    std::fill(nextPropError, nextPropError + getInputDataSize(), 0.0F);
+    const int outDataSize = getOutputDataSize();
+    for(int out = 0; out < outDataSize; out++){
+        if(0 <= argmax[out]){
+            // strideが窓より小さいと窓が重なるので、足し込む
+            nextPropError[argmax[out]] += propError[out];
+        }
+    }
+}
+
+void PoolingLayer::backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard)
+{
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    const size_t outDataSize = getOutputDataSize();
+    float* maxVal = scope.allocate(outDataSize);
+    auto argmax = reinterpret_cast<int32_t*>(scope.allocate(outDataSize));
+    forwardArgmax(input, maxVal, argmax);
+    backwardArgmax(argmax, propError, nextPropError);
+}
+
+size_t PoolingLayer::getWorkspaceSize(int batchSize) const
+{
+    // forward: (分離して求める場合)行方向の最大値, 1行分の入力, 累積2つ分. それぞれ値と位置
+    size_t forwardSize = 0;
+    if(useSeparable()){
+        const size_t paddedWidth = inputSize.first + 2 * zeroPad;
+        const size_t rowMaxSize = (inputSize.second + 2 * zeroPad) * static_cast<size_t>(outputSize.first);
+        forwardSize = 2 * (Workspace::getAlignedSize(rowMaxSize)
+                           + Workspace::getAlignedSize(paddedWidth)
+                           + 2 * Workspace::getAlignedSize(std::max(paddedWidth, rowMaxSize)));
+    }
+    // backward: maxの値とargmax(1サンプルずつ処理する)と、forwardArgmaxの作業領域
+    return 2 * Workspace::getAlignedSize(getOutputDataSize()) + forwardSize;
 }
 
 /* ======================
@@ -452,6 +1400,7 @@ FullConnectLayer::FullConnectLayer(DataSize size) : bias(0)
 {
     outputSize = size;
     numOutputChannel = 1;
+    resizeGradShards(gradShards, 1);
 }
 
 void FullConnectLayer::calcOutputSize()
@@ -459,115 +1408,253 @@ void FullConnectLayer::calcOutputSize()
     /* Do nothing */
 }
 
-std::vector<float> FullConnectLayer::apply(const std::vector<float>& input) const
+bool FullConnectLayer::checkShape() const
+{
+    if(!Layer::checkShape()){
+        return false;
+    }
+    if(outputSize.second != 1){
+        std::cerr << "FullConnect layer: output height must be 1" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void FullConnectLayer::forward(const float* input, float* output) const
 {
-    assert(input.size() == static_cast<size_t>(inputSize.first * inputSize.second * numInputChannel));
-    std::vector<float> output(outputSize.first * outputSize.second);
+    const int inDataSize = getInputDataSize();
     assert(outputSize.second == 1);
     assert(numOutputChannel == 1);
 
-    for(int out = 0; out < outputSize.first * outputSize.second; out++){
-        float sumVal = 0;
-        for(int channel = 0; channel < numInputChannel; channel++){
-            for(int in = 0; in < inputSize.first * inputSize.second; in++){
-                auto w = getValFromVecMap(weight, in, out, inputSize.first * inputSize.second, 1, channel);
-                auto inVal = getValFromVecMap(input, in, 0, inputSize.first * inputSize.second, 1, channel);
-                sumVal += w * inVal;
-            }
+    // weightは(out x in)のrow-majorで、inは全チャネルを通した添字
+    const int outDataSize = getOutputDataSize();
+    if(halfWeight.empty()){
+        sgemv(outDataSize, inDataSize, getWeightData(), inDataSize, input, output);
+    }else{
+        hgemv(getHalfType(weightType), outDataSize, inDataSize, halfWeight.getData(), inDataSize,
+              input, output);
+    }
+    for(int out = 0; out < outDataSize; out++){
+        output[out] += bias;
+    }
+}
+
+double FullConnectLayer::getForwardFlop() const
+{
+    return 2.0 * getInputDataSize() * getOutputDataSize();
+}
+
+double FullConnectLayer::getBackwardFlop() const
+{
+    return 2 * getForwardFlop();
+}
+
+double FullConnectLayer::getForwardByte() const
+{
+    const double weightSize = static_cast<double>(getInputDataSize()) * getOutputDataSize();
+    return Layer::getForwardByte() + getTensorTypeSize(weightType) * weightSize;
+}
+
+double FullConnectLayer::getBackwardByte() const
+{
+    // 重みを読み、シャードの勾配を読み書きする
+    const double weightSize = static_cast<double>(getInputDataSize()) * getOutputDataSize();
+    return Layer::getBackwardByte() + sizeof(float) * 3 * weightSize;
+}
+
+void FullConnectLayer::forwardBatch(const float* input, float* output, int batchSize) const
+{
+    if(batchSize == 1){
+        forward(input, output);
+        return;
+    }
+    const int inDataSize = getInputDataSize();
+    const int outDataSize = getOutputDataSize();
+    assert(outputSize.second == 1);
+    assert(numOutputChannel == 1);
+
+    // output(sample x out) = input(sample x in) * weight^T
+    // 重みの数行をキャッシュに載せたまま全サンプルに使い、重みを読むのはバッチで1回にする
+    const size_t outputDataSize = static_cast<size_t>(outDataSize) * batchSize;
+    if(halfWeight.empty()){
+        sgemvBatch(outDataSize, inDataSize, getWeightData(), inDataSize,
+                   batchSize, input, inDataSize, output, outDataSize);
+    }else{
+        // 重みを数行ずつfloatに戻し、その行の出力だけを求める
+        WorkspaceScope scope(Workspace::getThreadLocal());
+        const int blockRows = std::clamp(static_cast<int>(HALF_WEIGHT_BLOCK_SIZE / inDataSize), 1, outDataSize);
+        float* block = scope.allocate(static_cast<size_t>(blockRows) * inDataSize);
+        for(int row = 0; row < outDataSize; row += blockRows){
+            const int numRow = std::min(blockRows, outDataSize - row);
+            fromHalf(getHalfType(weightType), numRow * inDataSize,
+                     halfWeight.getData() + static_cast<size_t>(row) * inDataSize, block);
+            sgemvBatch(numRow, inDataSize, block, inDataSize,
+                       batchSize, input, inDataSize, output + row, outDataSize);
         }
-        output[out] = sumVal + bias;
     }
-    return output;
+    for(size_t i = 0; i < outputDataSize; i++){
+        output[i] += bias;
+    }
+}
+
+void FullConnectLayer::quantize(float inputMaxAbs)
+{
+    quantizedWeight = QuantizedWeight(getWeightData(), getOutputDataSize(), getInputDataSize(),
+                                      getQuantizeScale(inputMaxAbs));
+}
+
+void FullConnectLayer::forwardQuantized(const float* input, float* output) const
+{
+    if(!isQuantized()){
+        forward(input, output);
+        return;
+    }
+    const int inDataSize = getInputDataSize();
+    const int outDataSize = getOutputDataSize();
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    auto qInput = reinterpret_cast<int8_t*>(
+        scope.allocate((inDataSize + sizeof(float) - 1) / sizeof(float)));
+    auto acc = reinterpret_cast<int32_t*>(scope.allocate(outDataSize));
+    ::quantize(input, inDataSize, quantizedWeight.getInputScale(), qInput);
+    quantizedWeight.apply(qInput, acc, output, 1);
+    for(int out = 0; out < outDataSize; out++){
+        output[out] += bias;
+    }
 }
 
-void FullConnectLayer::initWeight()
+void FullConnectLayer::initWeight(uint32_t seed)
 {
+    quantizedWeight = QuantizedWeight();
+    mappedWeight = MappedTensor();
     weight.resize(inputSize.first * inputSize.second
                 * outputSize.first * outputSize.second * numInputChannel);
-    std::random_device seedGen;
-    std::mt19937 mt(seedGen());
+    std::mt19937 mt(seed);
     std::uniform_real_distribution<double> rd(-1.0,1.0);
     for(auto& elem : weight){
         elem = rd(mt);
     }
     bias = rd(mt);
+    updateHalfWeight();
+    resetOptimizerState();
 }
 
-std::vector<float> FullConnectLayer::updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate)
+size_t FullConnectLayer::getWorkspaceSize(int batchSize) const
 {
-    assert(!propError.empty());
-    std::shared_lock<std::shared_mutex> lkWeight(mtxWeight);
+    // backward: dEdw
+    // (forwardBatchで16bitの重みを戻す領域は、これより大きくならない)
+    return Workspace::getAlignedSize(static_cast<size_t>(getInputDataSize()) * getOutputDataSize());
+}
+
+void FullConnectLayer::backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard)
+{
+    backwardBatch(input, output, propError, nextPropError, 1, reduceRate, shard);
+}
+
+void FullConnectLayer::backwardBatch(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                int batchSize, double reduceRate, int shard)
+{
+    assert(0 < batchSize);
+    const int inDataSize = getInputDataSize();
+    const int outDataSize = getOutputDataSize();
+    // Hogwildではロックを取らない
+    std::shared_lock<std::shared_mutex> lkWeight(mtxWeight, std::defer_lock);
+    std::shared_lock<std::shared_mutex> lkBias(mtxBias, std::defer_lock);
+    if(!hogwild){
+        lkWeight.lock();
+        lkBias.lock();
+    }
+    WorkspaceScope scope(Workspace::getThreadLocal());
     /* Update weight */
-    std::vector<float> dEdw(input.size() * output.size());
-    for(int out = 0; static_cast<size_t>(out) < output.size(); out++){
-        for(int in = 0; static_cast<size_t>(in) < input.size(); in++){
-            setValToVecMap(dEdw, in, out, input.size(), 1, 0, propError.at(out) * input.at(in));
+    // dEdw(out x in) = propError^T(out x sample) * input(sample x in)
+    const size_t weightSize = static_cast<size_t>(inDataSize) * outDataSize;
+    float* dEdw = scope.allocate(weightSize);
+    std::fill(dEdw, dEdw + weightSize, 0.0F);
+    if(batchSize == 1){
+        for(int out = 0; out < outDataSize; out++){
+            saxpy(inDataSize, propError[out], input, dEdw + out * inDataSize);
         }
+    }else{
+        sgemm(true, false, outDataSize, inDataSize, batchSize,
+              propError, outDataSize, input, inDataSize,
+              dEdw, inDataSize);
     }
     if(verbose) {
         std::cout << "FC layer dEdw:" << std::endl;
-        printVector(dEdw);
+        printVector(dEdw, weightSize);
     }
 
     if(verbose) {
         std::cout << "FC layer before weight:" << std::endl;
-        printVector(weight);
-    }
-    std::lock_guard<std::mutex> lkDiffWeight(mtxDiffWeight);
-    std::lock_guard<std::mutex> lkDiffBias(mtxDiffBias);
-    if(diffWeight.empty()) {
-        diffWeight.resize(weight.size());
-        diffBias = 0;
-    }
-    for(int i = 0; static_cast<size_t>(i) < input.size() * output.size(); i++){
-        diffWeight.at(i) -= reduceRate * GAMMA * dEdw.at(i);
-        diffWeight.at(i) -= LAMBDA * reduceRate * GAMMA * weight.at(i);
+        printVector(getWeightData(), weightSize);
     }
 
     /* Update bias */
-    std::shared_lock<std::shared_mutex> lkBias(mtxBias);
     if(verbose) {
         std::cout << "FC layer before bias: " << bias << std::endl;
     }
     float dEdb = 0;
-    for(const auto elem : propError){
-        dEdb += elem;
+    for(int i = 0; i < outDataSize * batchSize; i++){
+        dEdb += propError[i];
     }
-    diffBias -= reduceRate * GAMMA * dEdb;
-    diffBias -= LAMBDA * reduceRate * GAMMA * bias;
-    if(verbose) {
+    if(!hogwild){
+        assert(0 <= shard && static_cast<size_t>(shard) < gradShards.size());
+        auto& grad = *gradShards[shard];
+        std::lock_guard<std::mutex> lkGrad(grad.mtx);
+        accumulateGradient(grad, dEdw, weightSize, &dEdb, 1, batchSize, reduceRate);
+    }
+    if(verbose && !hogwild) {
         std::cout << "FC layer after weight:" << std::endl;
-        printVector(weight);
+        printVector(getWeightData(), weightSize);
         std::cout << "FC layer after bias: " << bias << std::endl;
     }
 
 
     /* Next propError */
-    std::vector<float> nextPropError(input.size());
-    for(int out = 0; static_cast<size_t>(out) < output.size(); out++){
-        for(int in = 0; static_cast<size_t>(in) < input.size(); in++){
-            nextPropError.at(in) += propError.at(out) * getValFromVecMap(weight, in, out, input.size(), 1, 0);
-        }
+    // nextPropError(sample x in) = propError(sample x out) * weight
+    std::fill(nextPropError, nextPropError + static_cast<size_t>(inDataSize) * batchSize, 0.0F);
+    if(batchSize == 1){
+        sgemvTrans(outDataSize, inDataSize, getWeightData(), inDataSize, propError, nextPropError);
+    }else{
+        sgemm(false, false, batchSize, inDataSize, outDataSize,
+              propError, outDataSize, getWeightData(), inDataSize,
+              nextPropError, inDataSize);
     }
 
-    return nextPropError;
+    // 誤差を伝えた後で、直接重みを更新する(ロックを取る場合と同じく、更新前の重みで誤差を伝える)
+    // 誤差が来なかった出力の行には書き込まない
+    if(hogwild){
+        weightState.stepTouchedRows(optimizer, weight.data(), dEdw, weightSize, inDataSize,
+                                    reduceRate, batchSize * reduceRate);
+        biasState.stepTouchedRows(optimizer, &bias, &dEdb, 1, 1, reduceRate, batchSize * reduceRate);
+        if(verbose) {
+            std::cout << "FC layer after weight:" << std::endl;
+            printVector(getWeightData(), weightSize);
+            std::cout << "FC layer after bias: " << bias << std::endl;
+        }
+    }
 }
 
 void FullConnectLayer::saveWeight(std::ofstream& ofs) const
 {
-    ofs << weight.size() << std::endl;
-    for(auto w : weight){
-        ofs << w << std::endl;
+    const size_t weightSize = static_cast<size_t>(getInputDataSize()) * getOutputDataSize();
+    const float* w = getWeightData();
+    // 読み込んだ時に元の値に戻るだけの桁数で書く
+    ofs << std::setprecision(std::numeric_limits<float>::max_digits10);
+    ofs << weightSize << '\n';
+    for(size_t i = 0; i < weightSize; i++){
+        ofs << w[i] << '\n';
     }
-    ofs << bias << std::endl;
+    ofs << bias << '\n';
 }
 
 void FullConnectLayer::loadWeight(std::ifstream& ifs)
 {
     std::string buf;
+    quantizedWeight = QuantizedWeight();
+    mappedWeight = MappedTensor();
     if(std::getline(ifs, buf)){
         weight.resize(std::stoi(buf));
     }else{
@@ -589,28 +1676,166 @@ void FullConnectLayer::loadWeight(std::ifstream& ifs)
         std::cerr << "failed to load bias" << std::endl;
         return;
     }
+    updateHalfWeight();
+    resetOptimizerState();
 }
 
-void FullConnectLayer::flush()
+std::vector<TensorView> FullConnectLayer::getTensors() const
+{
+    // 重み, バイアス, (int8の重み, 行ごとのスケール, 入力のスケール), (16bitの重み)
+    const size_t weightSize = static_cast<size_t>(getInputDataSize()) * getOutputDataSize();
+    std::vector<TensorView> tensors = {TensorView{getWeightData(), weightSize}, TensorView{&bias, 1}};
+    if(isQuantized()){
+        auto quantized = quantizedWeight.getTensors();
+        tensors.insert(std::end(tensors), std::begin(quantized), std::end(quantized));
+    }
+    if(!halfWeight.empty()){
+        tensors.emplace_back(halfWeight.getTensor());
+    }
+    return tensors;
+}
+
+bool FullConnectLayer::setTensors(const std::vector<MappedTensor>& tensors)
 {
+    const size_t weightSize = static_cast<size_t>(getInputDataSize()) * getOutputDataSize();
+    if(tensors.size() < 2
+        || tensors.at(0).type != TensorType::FLOAT32 || tensors.at(0).size != weightSize
+        || tensors.at(1).type != TensorType::FLOAT32 || tensors.at(1).size != 1){
+        std::cerr << "invalid tensors for full connect layer" << std::endl;
+        return false;
+    }
+    size_t next = 2;
+    QuantizedWeight quantized;
+    if(next < tensors.size() && tensors.at(next).type == TensorType::INT8){
+        if(tensors.size() < next + 3
+            || !quantized.setTensors(tensors.at(next), tensors.at(next + 1), tensors.at(next + 2),
+                                     getOutputDataSize(), getInputDataSize())){
+            return false;
+        }
+        next += 3;
+    }
+    HalfWeight half;
+    if(next < tensors.size()){
+        if(!half.setTensor(tensors.at(next), weightSize)){
+            return false;
+        }
+        next++;
+    }
+    if(next != tensors.size()){
+        std::cerr << "invalid tensors for full connect layer" << std::endl;
+        return false;
+    }
     std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
     std::lock_guard<std::shared_mutex> lkBias(mtxBias);
-    std::lock_guard<std::mutex> lkDiffWeight(mtxDiffWeight);
-    std::lock_guard<std::mutex> lkDiffBias(mtxDiffBias);
-    if(!diffWeight.empty()) {
-        for(int i = 0; static_cast<size_t>(i) < weight.size(); i++) {
-            weight.at(i) += diffWeight.at(i);
-            assert(std::isfinite(weight.at(i)));
-        }
+    mappedWeight = tensors.at(0);
+    weight.clear();
+    bias = *tensors.at(1).get<float>();
+    quantizedWeight = std::move(quantized);
+    resetOptimizerState();
+    // 16bitの重みがあればその型にし、なければ今の型のまま丸め直す
+    if(half.empty()){
+        updateHalfWeight();
+    }else{
+        weightType = half.getType();
+        halfWeight = std::move(half);
+    }
+    return true;
+}
+
+void FullConnectLayer::setWeightType(TensorType type)
+{
+    assert(type == TensorType::FLOAT32 || isHalfTensorType(type));
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    weightType = type;
+    updateHalfWeight();
+}
+
+void FullConnectLayer::updateHalfWeight()
+{
+    if(weightType == TensorType::FLOAT32){
+        halfWeight = HalfWeight();
+        return;
+    }
+    const size_t weightSize = static_cast<size_t>(getInputDataSize()) * getOutputDataSize();
+    halfWeight.assign(getWeightData(), weightSize, weightType);
+}
+
+void FullConnectLayer::detachWeight()
+{
+    if(mappedWeight.data == nullptr){
+        return;
+    }
+    weight.assign(mappedWeight.get<float>(), mappedWeight.get<float>() + mappedWeight.size);
+    mappedWeight = MappedTensor();
+}
 
-        bias += diffBias;
+void FullConnectLayer::reduceGradientSlice(int slice, int numSlice)
+{
+    reduceGradShardsSlice(gradShards, slice, numSlice);
+}
+
+void FullConnectLayer::flush()
+{
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    reduceGradShards(gradShards);
+    auto& grad = *gradShards.front();
+    std::lock_guard<std::mutex> lkGrad(grad.mtx);
+    if(!grad.weight.empty()) {
+        detachWeight();
+        quantizedWeight = QuantizedWeight();
+        assert(grad.weight.size() == weight.size() && grad.bias.size() == 1);
+        // 最適化手法の1ステップ(L2正則化込み)を、パラメータごとに1回のループで行う
+        weightState.step(optimizer, weight.data(), grad.weight.data(), weight.size(), 1.0F, grad.decayScale);
+        biasState.step(optimizer, &bias, grad.bias.data(), 1, 1.0F, grad.decayScale);
         assert(std::isfinite(bias));
+        updateHalfWeight();
+
+        grad.weight.clear();
+        grad.bias.clear();
+        grad.decayScale = 0;
+    }
+}
+
+void FullConnectLayer::setNumShard(int numShard)
+{
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    resizeGradShards(gradShards, numShard);
+}
+
+void FullConnectLayer::setHogwild(bool mode)
+{
+    assert(!mode || weightType == TensorType::FLOAT32);
+    flush();
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    hogwild = mode;
+    if(hogwild){
+        // 直接書き換えるので、mmap上の重みはコピーし、量子化した重みは破棄する
+        detachWeight();
+        quantizedWeight = QuantizedWeight();
+    }
+}
 
-        diffWeight.clear();
-        diffBias = 0;
+void FullConnectLayer::setOptimizer(const OptimizerConfig& config)
+{
+    flush();
+    std::lock_guard<std::shared_mutex> lkWeight(mtxWeight);
+    std::lock_guard<std::shared_mutex> lkBias(mtxBias);
+    const bool typeChanged = config.type != optimizer.type;
+    optimizer = config;
+    if(typeChanged){
+        resetOptimizerState();
     }
 }
 
+void FullConnectLayer::resetOptimizerState()
+{
+    weightState.reset(optimizer, static_cast<size_t>(getInputDataSize()) * getOutputDataSize());
+    biasState.reset(optimizer, 1);
+}
+
 
 /* ======================
     SoftmaxLayer
@@ -624,44 +1849,75 @@ void SoftmaxLayer::calcOutputSize()
 {
     outputSize = inputSize;
     numOutputChannel = numInputChannel;
-    assert(numInputChannel == 1);
-    assert(numOutputChannel == 1);
 }
 
-std::vector<float> SoftmaxLayer::apply(const std::vector<float>& input) const
+bool SoftmaxLayer::checkShape() const
 {
-    assert(input.size() == static_cast<size_t>(inputSize.first * inputSize.second * numInputChannel));
+    if(!Layer::checkShape()){
+        return false;
+    }
+    if(numInputChannel != 1){
+        std::cerr << "Softmax layer: input must have 1 channel" << std::endl;
+        return false;
+    }
+    if(!split.empty() && static_cast<size_t>(getInputDataSize())
+        != std::accumulate(std::begin(split), std::end(split), 0UL)){
+        std::cerr << "Softmax layer: sum of split must be the input size" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void SoftmaxLayer::forward(const float* input, float* output) const
+{
+    const int dataSize = getInputDataSize();
     assert(split.empty() ||
-        input.size()
+        static_cast<size_t>(dataSize)
             == std::accumulate(std::begin(split), std::end(split), 0UL));
 
-    auto output = input;
+    std::copy(input, input + dataSize, output);
     if(split.empty()) {
-        softmax(std::begin(output), std::end(output));
+        softmax(output, output + dataSize);
     } else {
-        auto leftItr = std::begin(output);
-        auto rightItr = leftItr;
+        auto left = output;
+        auto right = left;
         for(auto sp : split) {
-            leftItr = rightItr;
-            std::advance(rightItr, sp);
-            softmax(leftItr, rightItr);
+            left = right;
+            right += sp;
+            softmax(left, right);
         }
-        assert(rightItr == std::end(output));
+        assert(right == output + dataSize);
     }
-    return output;
 }
 
-std::vector<float> SoftmaxLayer::updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate)
+double SoftmaxLayer::getForwardFlop() const
 {
-    assert(!propError.empty());
-    assert(input.size() == output.size());
+    // max, exp, 和, 割り算
+    return 4.0 * getInputDataSize();
+}
+
+double SoftmaxLayer::getBackwardFlop() const
+{
+    // 区間内のすべての組について積和
+    double flop = 0;
+    if(split.empty()){
+        flop = 2.0 * getInputDataSize() * getInputDataSize();
+    }else{
+        for(auto sp : split){
+            flop += 2.0 * sp * sp;
+        }
+    }
+    return flop;
+}
+
+void SoftmaxLayer::backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard)
+{
+    const uint32_t dataSize = getInputDataSize();
     /* Next propError */
-    std::vector<float> nextPropError(input.size());
     if(split.empty()) {
-        updateWeightHelper(0, input.size(), output, propError,
+        updateWeightHelper(0, dataSize, output, propError,
             nextPropError);
     } else {
         uint32_t beginIdx = 0;
@@ -672,39 +1928,35 @@ std::vector<float> SoftmaxLayer::updateWeight(const std::vector<float>& input,
             updateWeightHelper(beginIdx, endIdx, output, propError,
                 nextPropError);
         }
-        assert(endIdx == input.size());
+        assert(endIdx == dataSize);
     }
-    return nextPropError;
 }
 
 void SoftmaxLayer::updateWeightHelper(uint32_t beginIdx, uint32_t endIdx,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                std::vector<float>& nextPropError) const
+                const float* output, const float* propError,
+                float* nextPropError) const
 {
     for(auto in = beginIdx; in < endIdx; in++){
-        nextPropError.at(in) = propError.at(in);
+        nextPropError[in] = propError[in];
         for(auto out = beginIdx; out < endIdx; out++){
-            nextPropError.at(in) -= propError.at(out) * output.at(out);
+            nextPropError[in] -= propError[out] * output[out];
         }
-        nextPropError.at(in) *= output.at(in);
+        nextPropError[in] *= output[in];
     }
 }
 
-void SoftmaxLayer::softmax(
-        std::vector<float>::iterator leftItr,
-        std::vector<float>::iterator rightItr) const
+void SoftmaxLayer::softmax(float* left, float* right) const
 {
-    assert(2 <= std::distance(leftItr, rightItr));
+    assert(2 <= std::distance(left, right));
     float expSum = 0;
 
-    auto max = *std::max_element(leftItr, rightItr);
-    for(auto itr = leftItr; itr != rightItr; itr++){
+    auto max = *std::max_element(left, right);
+    for(auto itr = left; itr != right; itr++){
         assert(*itr - max <= 0.0);
         expSum += exp(*itr - max);
     }
 
-    for(auto itr = leftItr; itr != rightItr; itr++){
+    for(auto itr = left; itr != right; itr++){
         *itr = exp(*itr - max) / expSum;
         assert(std::isfinite(*itr));
     }
@@ -717,39 +1969,34 @@ void SigmoidLayer::calcOutputSize()
 {
     outputSize = inputSize;
     numOutputChannel = numInputChannel;
-    assert(numInputChannel == 1);
-    assert(numOutputChannel == 1);
 }
 
-std::vector<float> SigmoidLayer::apply(const std::vector<float>& input) const
+void SigmoidLayer::forward(const float* input, float* output) const
 {
-    assert(input.size() == static_cast<size_t>(inputSize.first * inputSize.second * numInputChannel));
-    return sigmoid(input);
+    for(int i = 0; i < getInputDataSize(); i++){
+        output[i] = 1 / (1 + exp(-input[i]));
+    }
 }
 
-std::vector<float> SigmoidLayer::updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate)
+double SigmoidLayer::getForwardFlop() const
 {
-    assert(!propError.empty());
-    /* Next propError */
-    std::vector<float> nextPropError(input.size());
-    for(int out = 0; static_cast<size_t>(out) < output.size(); out++){
-        nextPropError.at(out) = propError.at(out)
-                                * output.at(out) * (1 - output.at(out));
-    }
-    return nextPropError;
+    return 3.0 * getInputDataSize();
 }
 
-std::vector<float> SigmoidLayer::sigmoid(const std::vector<float>& input) const
+double SigmoidLayer::getBackwardFlop() const
 {
-    auto output = input;
+    return 3.0 * getInputDataSize();
+}
 
-    for(auto& elem : output){
-        elem = 1 / (1 + exp(-elem));
+void SigmoidLayer::backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard)
+{
+    /* Next propError */
+    for(int out = 0; out < getOutputDataSize(); out++){
+        nextPropError[out] = propError[out]
+                                * output[out] * (1 - output[out]);
     }
-    return output;
 }
 
 /* ======================
@@ -763,43 +2010,55 @@ void StandardizeLayer::calcOutputSize()
 {
     outputSize = inputSize;
     numOutputChannel = numInputChannel;
-    assert(numInputChannel % numBatch == 0);
 }
 
-std::vector<float> StandardizeLayer::apply(const std::vector<float>& input) const
+bool StandardizeLayer::checkShape() const
 {
-    assert(input.size() == static_cast<size_t>(inputSize.first * inputSize.second * numInputChannel));
-    auto output = input;
-    auto leftItr = std::begin(output);
-    auto rightItr = std::begin(output);
-    advance(rightItr, numBatch * inputSize.first * inputSize.second);
-    for(int i = 0; i < numInputChannel/numBatch; i++) {
-        standardize(leftItr, rightItr);
-        leftItr = rightItr;
-        advance(rightItr, numBatch * inputSize.first * inputSize.second);
+    if(!Layer::checkShape()){
+        return false;
     }
-    assert(leftItr == std::end(output));
-    return output;
+    if(numBatch <= 0 || numInputChannel % numBatch != 0){
+        std::cerr << "Standardize layer: channels must be a multiple of the batch count" << std::endl;
+        return false;
+    }
+    return true;
 }
 
-std::vector<float> StandardizeLayer::updateWeight(const std::vector<float>& input,
-                const std::vector<float>& output,
-                const std::vector<float>& propError,
-                double reduceRate)
+void StandardizeLayer::forward(const float* input, float* output) const
 {
-    assert(!propError.empty());
-    assert(propError.size() == input.size());
-    assert(propError.size() == output.size());
+    const int dataSize = getInputDataSize();
+    const int segmentSize = numBatch * inputSize.first * inputSize.second;
+    std::copy(input, input + dataSize, output);
+    for(auto left = output; left != output + dataSize; left += segmentSize) {
+        standardize(left, left + segmentSize);
+    }
+}
+
+double StandardizeLayer::getForwardFlop() const
+{
+    // 平均、分散、正規化
+    return 6.0 * getInputDataSize();
+}
+
+double StandardizeLayer::getBackwardFlop() const
+{
+    // 平均、分散、割り算
+    return 6.0 * getInputDataSize();
+}
+
+void StandardizeLayer::backward(const float* input, const float* output,
+                const float* propError, float* nextPropError,
+                double reduceRate, int shard)
+{
+    const int dataSize = getInputDataSize();
     /* Next propError */
-    std::vector<float> nextPropError;
-    nextPropError = propError;
-
-    auto leftItr = std::begin(nextPropError);
-    auto rightItr = std::begin(nextPropError);
-    advance(rightItr, numBatch * inputSize.first * inputSize.second);
-    auto inputLeftItr = std::begin(input);
-    auto inputRightItr = std::begin(input);
-    advance(inputRightItr, numBatch * inputSize.first * inputSize.second);
+    std::copy(propError, propError + dataSize, nextPropError);
+
+    const int segmentSize = numBatch * inputSize.first * inputSize.second;
+    auto leftItr = nextPropError;
+    auto rightItr = leftItr + segmentSize;
+    auto inputLeftItr = input;
+    auto inputRightItr = inputLeftItr + segmentSize;
     for(int i = 0; i < numInputChannel/numBatch; i++) {
         auto stddev = getStddev(inputLeftItr, inputRightItr,
                         getMean(inputLeftItr, inputRightItr));
@@ -808,17 +2067,15 @@ std::vector<float> StandardizeLayer::updateWeight(const std::vector<float>& inpu
             assert(std::isfinite(*itr));
         }
         leftItr = rightItr;
-        advance(rightItr, numBatch * inputSize.first * inputSize.second);
+        rightItr += segmentSize;
         inputLeftItr = inputRightItr;
-        advance(inputRightItr, numBatch * inputSize.first * inputSize.second);
+        inputRightItr += segmentSize;
     }
-    assert(leftItr == std::end(nextPropError));
-    assert(inputLeftItr == std::end(input));
-    return nextPropError;
+    assert(leftItr == nextPropError + dataSize);
+    assert(inputLeftItr == input + dataSize);
 }
 
-void StandardizeLayer::standardize(std::vector<float>::iterator leftItr,
-        std::vector<float>::iterator rightItr) const
+void StandardizeLayer::standardize(float* leftItr, float* rightItr) const
 {
     auto mean = getMean(leftItr, rightItr);
     auto stddev = getStddev(leftItr, rightItr, mean);
@@ -828,28 +2085,25 @@ void StandardizeLayer::standardize(std::vector<float>::iterator leftItr,
     }
 }
 
-float StandardizeLayer::getMean(
-        std::vector<float>::const_iterator leftItr,
-        std::vector<float>::const_iterator rightItr) const
+float StandardizeLayer::getMean(const float* leftItr, const float* rightItr) const
 {
     float mean = 0;
     for(auto itr = leftItr; itr != rightItr; itr++) {
         mean += *itr;
     }
-    return mean / distance(leftItr, rightItr);
+    return mean / std::distance(leftItr, rightItr);
 }
 
-float StandardizeLayer::getStddev(
-        std::vector<float>::const_iterator leftItr,
-        std::vector<float>::const_iterator rightItr, float mean) const
+float StandardizeLayer::getStddev(const float* leftItr, const float* rightItr,
+        float mean) const
 {
-    assert(distance(leftItr, rightItr) > 1);
+    assert(std::distance(leftItr, rightItr) > 1);
     float stddev = 0;
     for(auto itr = leftItr; itr != rightItr; itr++) {
         stddev += (*itr - mean) * (*itr - mean);
     }
     assert(stddev >= 0);
     return stddev <= 1e-10 ?
-        1e-10 : sqrt(stddev / (distance(leftItr, rightItr) - 1));
+        1e-10 : sqrt(stddev / (std::distance(leftItr, rightItr) - 1));
 }
 
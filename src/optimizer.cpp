@@ -0,0 +1,122 @@
+#include "optimizer.h"
+#include "simd.h"
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+/* ======================
+    Optimizer
+   ======================*/
+bool checkOptimizerConfig(const OptimizerConfig& config)
+{
+    if(!(0 < config.learningRate) || !(0 <= config.weightDecay)){
+        std::cerr << "ERROR: learning rate must be positive and weight decay must not be negative" << std::endl;
+        return false;
+    }
+    if(config.type == OptimizerType::MOMENTUM && !(0 <= config.momentum && config.momentum < 1)){
+        std::cerr << "ERROR: momentum must be in [0, 1)" << std::endl;
+        return false;
+    }
+    if(config.type == OptimizerType::ADAM
+        && !(0 <= config.beta1 && config.beta1 < 1 && 0 <= config.beta2 && config.beta2 < 1
+             && 0 < config.epsilon)){
+        std::cerr << "ERROR: beta1 and beta2 must be in [0, 1) and epsilon must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* ======================
+    OptimizerState
+   ======================*/
+size_t OptimizerState::getNumStateVector(OptimizerType type)
+{
+    switch(type) {
+    case OptimizerType::MOMENTUM:
+        return 1;
+    case OptimizerType::ADAM:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+void OptimizerState::reset(const OptimizerConfig& config, size_t size)
+{
+    const size_t numVector = getNumStateVector(config.type);
+    first.assign(0 < numVector ? size : 0, 0.0F);
+    second.assign(1 < numVector ? size : 0, 0.0F);
+    numStep = 0;
+}
+
+OptimizerStepParam OptimizerState::beginStep(const OptimizerConfig& config, size_t size,
+                                             float gradScale, float decayScale)
+{
+    const size_t numVector = getNumStateVector(config.type);
+    if(first.size() != (0 < numVector ? size : 0) || second.size() != (1 < numVector ? size : 0)){
+        reset(config, size);
+    }
+    OptimizerStepParam p = {};
+    p.lr = config.learningRate;
+    p.gradScale = gradScale;
+    p.decay = config.weightDecay * decayScale;
+    switch(config.type) {
+    case OptimizerType::MOMENTUM:
+        p.momentum = config.momentum;
+        break;
+    case OptimizerType::ADAM:
+    {
+        // m / (1 - beta1^t) / (sqrt(v / (1 - beta2^t)) + epsilon)を、
+        // 要素ごとの割り算を増やさずに求めるため、補正をlrとepsilonに移す
+        const double t = static_cast<double>(++numStep);
+        const double correction1 = 1.0 - std::pow(static_cast<double>(config.beta1), t);
+        const double correction2 = std::sqrt(1.0 - std::pow(static_cast<double>(config.beta2), t));
+        p.lr = static_cast<float>(config.learningRate * correction2 / correction1);
+        p.beta1 = config.beta1;
+        p.beta2 = config.beta2;
+        p.epsilon = static_cast<float>(config.epsilon * correction2);
+        break;
+    }
+    default:
+        break;
+    }
+    return p;
+}
+
+void OptimizerState::stepRange(const OptimizerConfig& config, const OptimizerStepParam& p,
+                               float* param, const float* grad, size_t offset, size_t n)
+{
+    switch(config.type) {
+    case OptimizerType::MOMENTUM:
+        momentumStep(static_cast<int>(n), p, grad + offset, first.data() + offset, param + offset);
+        break;
+    case OptimizerType::ADAM:
+        adamStep(static_cast<int>(n), p, grad + offset, first.data() + offset, second.data() + offset,
+                 param + offset);
+        break;
+    default:
+        sgdStep(static_cast<int>(n), p, grad + offset, param + offset);
+        break;
+    }
+}
+
+void OptimizerState::step(const OptimizerConfig& config, float* param, const float* grad, size_t size,
+                          float gradScale, float decayScale)
+{
+    const OptimizerStepParam p = beginStep(config, size, gradScale, decayScale);
+    stepRange(config, p, param, grad, 0, size);
+}
+
+void OptimizerState::stepTouchedRows(const OptimizerConfig& config, float* param, const float* grad,
+                                     size_t size, size_t rowSize, float gradScale, float decayScale)
+{
+    assert(0 < rowSize && size % rowSize == 0);
+    const OptimizerStepParam p = beginStep(config, size, gradScale, decayScale);
+    for(size_t offset = 0; offset < size; offset += rowSize){
+        const float* row = grad + offset;
+        if(std::any_of(row, row + rowSize, [](float g){return g != 0;})){
+            stepRange(config, p, param, grad, offset, rowSize);
+        }
+    }
+}
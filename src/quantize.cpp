@@ -0,0 +1,118 @@
+#include "quantize.h"
+#include "simd.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+/* ======================
+    Int8 quantization
+   ======================*/
+float getQuantizeScale(float maxAbs)
+{
+    // すべて0なら、スケールは何でもよい
+    return 0 < maxAbs ? maxAbs / QUANTIZE_MAX : 1.0F;
+}
+
+void quantize(const float* x, int n, float scale, int8_t* q)
+{
+    s8quantize(n, 1.0F / scale, x, q);
+}
+
+void im2rowS8(const int8_t* input, int width, int height, int numChannel,
+              int windowSize, int zeroPad, int stride, int outY, int8_t* rows)
+{
+    const int outWidth = (width + 2 * zeroPad - windowSize) / stride + 1;
+    const int rowSize = numChannel * windowSize * windowSize;
+    const int y0 = outY * stride - zeroPad;
+    for(int outX = 0; outX < outWidth; outX++){
+        const int x0 = outX * stride - zeroPad;
+        int8_t* dst = rows + outX * rowSize;
+        // 窓が入力に収まるx座標の範囲 [beginX, endX)
+        const int beginX = std::max(0, -x0);
+        const int endX = std::min(windowSize, width - x0);
+        for(int ch = 0; ch < numChannel; ch++){
+            for(int winY = 0; winY < windowSize; winY++, dst += windowSize){
+                const int y = y0 + winY;
+                if(y < 0 || height <= y || endX <= beginX){
+                    std::fill(dst, dst + windowSize, 0);
+                    continue;
+                }
+                const int8_t* src = input + (ch * height + y) * width + x0;
+                std::fill(dst, dst + beginX, 0);
+                std::copy(src + beginX, src + endX, dst + beginX);
+                std::fill(dst + endX, dst + windowSize, 0);
+            }
+        }
+    }
+}
+
+/* ======================
+    QuantizedWeight
+   ======================*/
+QuantizedWeight::QuantizedWeight(const float* weight, int rows, int cols, float inputScale)
+    : rows(rows), cols(cols), data(static_cast<size_t>(rows) * cols), scale(rows),
+      inputScale(inputScale)
+{
+    assert(0 < rows && 0 < cols && 0 < inputScale);
+    for(int row = 0; row < rows; row++){
+        const float* src = weight + static_cast<size_t>(row) * cols;
+        float maxAbs = 0;
+        for(int col = 0; col < cols; col++){
+            maxAbs = std::max(maxAbs, std::abs(src[col]));
+        }
+        scale[row] = getQuantizeScale(maxAbs);
+        quantize(src, cols, scale[row], data.data() + static_cast<size_t>(row) * cols);
+    }
+    calcRowSum();
+}
+
+std::vector<TensorView> QuantizedWeight::getTensors() const
+{
+    assert(!empty());
+    return {TensorView{getData(), static_cast<size_t>(rows) * cols, TensorType::INT8},
+            TensorView{scale.data(), scale.size()},
+            TensorView{&inputScale, 1}};
+}
+
+bool QuantizedWeight::setTensors(const MappedTensor& weight, const MappedTensor& scale,
+                                 const MappedTensor& inputScale, int rows, int cols)
+{
+    if(weight.type != TensorType::INT8 || weight.size != static_cast<size_t>(rows) * cols
+        || scale.type != TensorType::FLOAT32 || scale.size != static_cast<size_t>(rows)
+        || inputScale.type != TensorType::FLOAT32 || inputScale.size != 1
+        || !(0 < *inputScale.get<float>())){
+        std::cerr << "invalid quantized tensors" << std::endl;
+        return false;
+    }
+    this->rows = rows;
+    this->cols = cols;
+    data.clear();
+    mapped = weight;
+    this->scale.assign(scale.get<float>(), scale.get<float>() + rows);
+    this->inputScale = *inputScale.get<float>();
+    calcRowSum();
+    return true;
+}
+
+void QuantizedWeight::calcRowSum()
+{
+    const int8_t* q = getData();
+    rowSum.resize(rows);
+    for(int row = 0; row < rows; row++){
+        int32_t sumVal = 0;
+        for(int col = 0; col < cols; col++){
+            sumVal += q[static_cast<size_t>(row) * cols + col];
+        }
+        rowSum[row] = sumVal;
+    }
+}
+
+void QuantizedWeight::apply(const int8_t* x, int32_t* acc, float* y, int yStride) const
+{
+    assert(!empty());
+    s8gemv(rows, cols, getData(), cols, rowSum.data(), x, acc);
+    for(int row = 0; row < rows; row++){
+        y[row * yStride] = acc[row] * (scale[row] * inputScale);
+    }
+}
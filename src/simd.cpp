@@ -0,0 +1,1112 @@
+#include "simd.h"
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CNN_X86_SIMD
+#endif
+
+namespace {
+
+struct SimdKernels
+{
+    float (*dot)(int n, const float* x, const float* y);
+    void (*axpy)(int n, float alpha, const float* x, float* y);
+    void (*gemv)(int M, int N, const float* A, int lda, const float* x, float* y);
+    void (*gemvBatch)(int M, int N, const float* A, int lda, int numX, const float* X, int ldx,
+                      float* Y, int ldy);
+};
+
+/* ---- SCALAR ---- */
+float dotScalar(int n, const float* x, const float* y)
+{
+    float sumVal = 0;
+    for(int i = 0; i < n; i++){
+        sumVal += x[i] * y[i];
+    }
+    return sumVal;
+}
+
+void axpyScalar(int n, float alpha, const float* x, float* y)
+{
+    for(int i = 0; i < n; i++){
+        y[i] += alpha * x[i];
+    }
+}
+
+void gemvScalar(int M, int N, const float* A, int lda, const float* x, float* y)
+{
+    for(int m = 0; m < M; m++){
+        y[m] = dotScalar(N, A + m * lda, x);
+    }
+}
+
+void gemvBatchScalar(int M, int N, const float* A, int lda, int numX, const float* X, int ldx,
+                     float* Y, int ldy)
+{
+    for(int k = 0; k < numX; k++){
+        gemvScalar(M, N, A, lda, X + k * ldx, Y + k * ldy);
+    }
+}
+
+const SimdKernels scalarKernels = {dotScalar, axpyScalar, gemvScalar, gemvBatchScalar};
+
+using S8GemvKernel = void (*)(int M, int N, const int8_t* A, int lda, const int32_t* rowSum,
+                              const int8_t* x, int32_t* y);
+
+int32_t s8dotScalar(int n, const int8_t* x, const int8_t* y)
+{
+    int32_t sumVal = 0;
+    for(int i = 0; i < n; i++){
+        sumVal += static_cast<int32_t>(x[i]) * y[i];
+    }
+    return sumVal;
+}
+
+int32_t s8sum(int n, const int8_t* x)
+{
+    int32_t sumVal = 0;
+    for(int i = 0; i < n; i++){
+        sumVal += x[i];
+    }
+    return sumVal;
+}
+
+// VNNIで[0, i)を処理した後の、128ずらした分の補正と端数[i, N)の積和
+int32_t vnniTail(int N, int i, const int8_t* a, const int8_t* x, int32_t rowSum)
+{
+    return -128 * (rowSum - s8sum(N - i, a + i)) + s8dotScalar(N - i, a + i, x + i);
+}
+
+// x * invScaleを[-127, 127]に収め、最も近い整数に丸める
+// 範囲に収めた後に128.5を足すと正になるので、切り捨てれば丸めになる
+void s8quantizeScalar(int n, float invScale, const float* x, int8_t* q)
+{
+    for(int i = 0; i < n; i++){
+        float val = x[i] * invScale;
+        val = val < 127.0F ? val : 127.0F;
+        val = -127.0F < val ? val : -127.0F;
+        q[i] = static_cast<int8_t>(static_cast<int32_t>(val + 128.5F) - 128);
+    }
+}
+
+using S8QuantizeKernel = void (*)(int n, float invScale, const float* x, int8_t* q);
+
+struct OptimizerKernels
+{
+    void (*sgd)(int n, const OptimizerStepParam& p, const float* grad, float* param);
+    void (*momentum)(int n, const OptimizerStepParam& p, const float* grad, float* velocity, float* param);
+    void (*adam)(int n, const OptimizerStepParam& p, const float* grad, float* m, float* v, float* param);
+};
+
+void sgdStepScalar(int n, const OptimizerStepParam& p, const float* grad, float* param)
+{
+    for(int i = 0; i < n; i++){
+        const float g = p.gradScale * grad[i] + p.decay * param[i];
+        param[i] -= p.lr * g;
+    }
+}
+
+void momentumStepScalar(int n, const OptimizerStepParam& p, const float* grad, float* velocity, float* param)
+{
+    for(int i = 0; i < n; i++){
+        const float g = p.gradScale * grad[i] + p.decay * param[i];
+        velocity[i] = p.momentum * velocity[i] + g;
+        param[i] -= p.lr * velocity[i];
+    }
+}
+
+void adamStepScalar(int n, const OptimizerStepParam& p, const float* grad, float* m, float* v, float* param)
+{
+    for(int i = 0; i < n; i++){
+        const float g = p.gradScale * grad[i] + p.decay * param[i];
+        m[i] = p.beta1 * m[i] + (1.0F - p.beta1) * g;
+        v[i] = p.beta2 * v[i] + (1.0F - p.beta2) * g * g;
+        param[i] -= p.lr * m[i] / (std::sqrt(v[i]) + p.epsilon);
+    }
+}
+
+const OptimizerKernels optimizerScalarKernels = {sgdStepScalar, momentumStepScalar, adamStepScalar};
+
+uint32_t getFloatBits(float val)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    return bits;
+}
+
+float getFloatFromBits(uint32_t bits)
+{
+    float val;
+    std::memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+// 以下の16bitへの変換はすべて最近接偶数丸め
+// FP16で表せない大きさは無限大になり、NaNはquiet NaNのまま残す
+uint16_t floatToFp16(float val)
+{
+    uint32_t bits = getFloatBits(val);
+    const uint32_t sign = bits & 0x80000000U;
+    bits ^= sign;
+    uint32_t half;
+    if(bits >= (127 + 16) << 23){
+        // 2^16以上と無限大、NaN(65520以上2^16未満は下の丸めで無限大になる)
+        half = 0x7f800000U < bits ? 0x7e00 : 0x7c00;
+    }else if(bits < (127 - 14) << 23){
+        // FP16の非正規化数と0
+        // 仮数部の末尾がFP16の最下位の桁になるよう、定数を足して浮動小数点の加算で丸める
+        const uint32_t magic = ((127 - 15) + (23 - 10) + 1) << 23;
+        half = getFloatBits(getFloatFromBits(bits) + getFloatFromBits(magic)) - magic;
+    }else{
+        // 指数の下駄を付け替え、捨てる13bitで丸める
+        const uint32_t mantissaOdd = (bits >> 13) & 1;
+        bits += ((15 - 127) << 23) + 0xfff + mantissaOdd;
+        half = bits >> 13;
+    }
+    return static_cast<uint16_t>(half | (sign >> 16));
+}
+
+float fp16ToFloat(uint16_t half)
+{
+    const uint32_t expMask = 0x7c00 << 13;
+    uint32_t bits = (half & 0x7fff) << 13;
+    const uint32_t exp = bits & expMask;
+    bits += (127 - 15) << 23;
+    if(exp == expMask){
+        // 無限大とNaN
+        bits += (128 - 16) << 23;
+    }else if(exp == 0){
+        // 非正規化数は、指数を1つ上げてから暗黙の1の分を引く
+        const uint32_t magic = (127 - 14) << 23;
+        bits = getFloatBits(getFloatFromBits(bits + (1 << 23)) - getFloatFromBits(magic));
+    }
+    return getFloatFromBits(bits | (half & 0x8000) << 16);
+}
+
+uint16_t floatToBf16(float val)
+{
+    const uint32_t bits = getFloatBits(val);
+    if(std::isnan(val)){
+        return static_cast<uint16_t>((bits >> 16) | 0x40);
+    }
+    return static_cast<uint16_t>((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+// bfloat16はfloatの上位16bitなので、ずらすだけでよい
+float bf16ToFloat(uint16_t half)
+{
+    return getFloatFromBits(static_cast<uint32_t>(half) << 16);
+}
+
+template<HalfType TYPE>
+uint16_t floatToHalf(float val)
+{
+    return TYPE == HalfType::FP16 ? floatToFp16(val) : floatToBf16(val);
+}
+
+template<HalfType TYPE>
+float halfToFloat(uint16_t half)
+{
+    return TYPE == HalfType::FP16 ? fp16ToFloat(half) : bf16ToFloat(half);
+}
+
+struct HalfKernels
+{
+    void (*toHalf)(int n, const float* x, uint16_t* y);
+    void (*fromHalf)(int n, const uint16_t* x, float* y);
+    void (*gemv)(int M, int N, const uint16_t* A, int lda, const float* x, float* y);
+};
+
+template<HalfType TYPE>
+void toHalfScalar(int n, const float* x, uint16_t* y)
+{
+    for(int i = 0; i < n; i++){
+        y[i] = floatToHalf<TYPE>(x[i]);
+    }
+}
+
+template<HalfType TYPE>
+void fromHalfScalar(int n, const uint16_t* x, float* y)
+{
+    for(int i = 0; i < n; i++){
+        y[i] = halfToFloat<TYPE>(x[i]);
+    }
+}
+
+template<HalfType TYPE>
+void hgemvScalar(int M, int N, const uint16_t* A, int lda, const float* x, float* y)
+{
+    for(int m = 0; m < M; m++){
+        float sumVal = 0;
+        for(int i = 0; i < N; i++){
+            sumVal += halfToFloat<TYPE>(A[m * lda + i]) * x[i];
+        }
+        y[m] = sumVal;
+    }
+}
+
+template<HalfType TYPE>
+constexpr HalfKernels halfScalarKernels = {toHalfScalar<TYPE>, fromHalfScalar<TYPE>, hgemvScalar<TYPE>};
+
+void s8gemvScalar(int M, int N, const int8_t* A, int lda, const int32_t* rowSum,
+                  const int8_t* x, int32_t* y)
+{
+    for(int m = 0; m < M; m++){
+        y[m] = s8dotScalar(N, A + m * lda, x);
+    }
+}
+
+#ifdef CNN_X86_SIMD
+/* ---- AVX2 ---- */
+__attribute__((target("avx2,fma")))
+inline float hsum256(__m256 v)
+{
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma")))
+float dotAvx2(int n, const float* x, const float* y)
+{
+    // 加算の依存関係を切るため、アキュムレータを4本使う
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 32 <= n; i += 32){
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 16), _mm256_loadu_ps(y + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 24), _mm256_loadu_ps(y + i + 24), acc3);
+    }
+    for(; i + 8 <= n; i += 8){
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+    }
+    float sumVal = hsum256(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for(; i < n; i++){
+        sumVal += x[i] * y[i];
+    }
+    return sumVal;
+}
+
+__attribute__((target("avx2,fma")))
+void axpyAvx2(int n, float alpha, const float* x, float* y)
+{
+    const __m256 a = _mm256_set1_ps(alpha);
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for(; i < n; i++){
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void gemvAvx2(int M, int N, const float* A, int lda, const float* x, float* y)
+{
+    // 4行ずつまとめて、xの読み込みを使い回す
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const float* a0 = A + m * lda;
+        const float* a1 = a0 + lda;
+        const float* a2 = a1 + lda;
+        const float* a3 = a2 + lda;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        int i = 0;
+        for(; i + 8 <= N; i += 8){
+            const __m256 xv = _mm256_loadu_ps(x + i);
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + i), xv, acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + i), xv, acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + i), xv, acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + i), xv, acc3);
+        }
+        float s0 = hsum256(acc0), s1 = hsum256(acc1), s2 = hsum256(acc2), s3 = hsum256(acc3);
+        for(; i < N; i++){
+            s0 += a0[i] * x[i];
+            s1 += a1[i] * x[i];
+            s2 += a2[i] * x[i];
+            s3 += a3[i] * x[i];
+        }
+        y[m] = s0;
+        y[m + 1] = s1;
+        y[m + 2] = s2;
+        y[m + 3] = s3;
+    }
+    for(; m < M; m++){
+        y[m] = dotAvx2(N, A + m * lda, x);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void gemvBatchAvx2(int M, int N, const float* A, int lda, int numX, const float* X, int ldx,
+                   float* Y, int ldy)
+{
+    // Aの4行 x xの2本を1タイルにし、Aの4行がL1にある間にすべてのxを処理する
+    // 和を取る順序はgemvAvx2と同じ
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const float* a0 = A + m * lda;
+        const float* a1 = a0 + lda;
+        const float* a2 = a1 + lda;
+        const float* a3 = a2 + lda;
+        int k = 0;
+        for(; k + 2 <= numX; k += 2){
+            const float* x0 = X + k * ldx;
+            const float* x1 = x0 + ldx;
+            __m256 acc00 = _mm256_setzero_ps(), acc01 = _mm256_setzero_ps();
+            __m256 acc10 = _mm256_setzero_ps(), acc11 = _mm256_setzero_ps();
+            __m256 acc20 = _mm256_setzero_ps(), acc21 = _mm256_setzero_ps();
+            __m256 acc30 = _mm256_setzero_ps(), acc31 = _mm256_setzero_ps();
+            int i = 0;
+            for(; i + 8 <= N; i += 8){
+                const __m256 xv0 = _mm256_loadu_ps(x0 + i);
+                const __m256 xv1 = _mm256_loadu_ps(x1 + i);
+                const __m256 av0 = _mm256_loadu_ps(a0 + i);
+                const __m256 av1 = _mm256_loadu_ps(a1 + i);
+                const __m256 av2 = _mm256_loadu_ps(a2 + i);
+                const __m256 av3 = _mm256_loadu_ps(a3 + i);
+                acc00 = _mm256_fmadd_ps(av0, xv0, acc00);
+                acc01 = _mm256_fmadd_ps(av0, xv1, acc01);
+                acc10 = _mm256_fmadd_ps(av1, xv0, acc10);
+                acc11 = _mm256_fmadd_ps(av1, xv1, acc11);
+                acc20 = _mm256_fmadd_ps(av2, xv0, acc20);
+                acc21 = _mm256_fmadd_ps(av2, xv1, acc21);
+                acc30 = _mm256_fmadd_ps(av3, xv0, acc30);
+                acc31 = _mm256_fmadd_ps(av3, xv1, acc31);
+            }
+            float s00 = hsum256(acc00), s01 = hsum256(acc01);
+            float s10 = hsum256(acc10), s11 = hsum256(acc11);
+            float s20 = hsum256(acc20), s21 = hsum256(acc21);
+            float s30 = hsum256(acc30), s31 = hsum256(acc31);
+            for(; i < N; i++){
+                s00 += a0[i] * x0[i];
+                s01 += a0[i] * x1[i];
+                s10 += a1[i] * x0[i];
+                s11 += a1[i] * x1[i];
+                s20 += a2[i] * x0[i];
+                s21 += a2[i] * x1[i];
+                s30 += a3[i] * x0[i];
+                s31 += a3[i] * x1[i];
+            }
+            float* y0 = Y + k * ldy + m;
+            float* y1 = y0 + ldy;
+            y0[0] = s00;
+            y0[1] = s10;
+            y0[2] = s20;
+            y0[3] = s30;
+            y1[0] = s01;
+            y1[1] = s11;
+            y1[2] = s21;
+            y1[3] = s31;
+        }
+        for(; k < numX; k++){
+            gemvAvx2(4, N, a0, lda, X + k * ldx, Y + k * ldy + m);
+        }
+    }
+    for(int k = 0; k < numX; k++){
+        gemvAvx2(M - m, N, A + m * lda, lda, X + k * ldx, Y + k * ldy + m);
+    }
+}
+
+const SimdKernels avx2Kernels = {dotAvx2, axpyAvx2, gemvAvx2, gemvBatchAvx2};
+
+__attribute__((target("avx2")))
+inline int32_t hsum256i(__m256i v)
+{
+    __m128i lo = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(lo);
+}
+
+// 16個のint8を読み込み、int16に広げる
+__attribute__((target("avx2")))
+inline __m256i loadS8AsS16(const int8_t* x)
+{
+    return _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x)));
+}
+
+// VNNIがない場合は、16bitに広げてから積を取り、隣り合う2つずつint32に足す
+// (_mm256_maddubs_epi16は255 * 127 * 2が16bitで飽和するので使わない)
+__attribute__((target("avx2")))
+void s8gemvAvx2(int M, int N, const int8_t* A, int lda, const int32_t* rowSum,
+                const int8_t* x, int32_t* y)
+{
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const int8_t* a0 = A + m * lda;
+        const int8_t* a1 = a0 + lda;
+        const int8_t* a2 = a1 + lda;
+        const int8_t* a3 = a2 + lda;
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        __m256i acc2 = _mm256_setzero_si256();
+        __m256i acc3 = _mm256_setzero_si256();
+        int i = 0;
+        for(; i + 16 <= N; i += 16){
+            const __m256i xv = loadS8AsS16(x + i);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(loadS8AsS16(a0 + i), xv));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(loadS8AsS16(a1 + i), xv));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(loadS8AsS16(a2 + i), xv));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(loadS8AsS16(a3 + i), xv));
+        }
+        y[m] = hsum256i(acc0) + s8dotScalar(N - i, a0 + i, x + i);
+        y[m + 1] = hsum256i(acc1) + s8dotScalar(N - i, a1 + i, x + i);
+        y[m + 2] = hsum256i(acc2) + s8dotScalar(N - i, a2 + i, x + i);
+        y[m + 3] = hsum256i(acc3) + s8dotScalar(N - i, a3 + i, x + i);
+    }
+    s8gemvScalar(M - m, N, A + m * lda, lda, rowSum, x, y + m);
+}
+
+// VNNIの積和(dpbusd)は符号なし x 符号付きなので、xに128を足して符号なしにし、
+// 最後に128 * rowSumを引いて戻す
+__attribute__((target("avx2")))
+inline __m256i quantizeAvx2(__m256 x, __m256 invScale)
+{
+    __m256 val = _mm256_mul_ps(x, invScale);
+    val = _mm256_min_ps(val, _mm256_set1_ps(127.0F));
+    val = _mm256_max_ps(val, _mm256_set1_ps(-127.0F));
+    val = _mm256_add_ps(val, _mm256_set1_ps(128.5F));
+    return _mm256_sub_epi32(_mm256_cvttps_epi32(val), _mm256_set1_epi32(128));
+}
+
+__attribute__((target("avx2")))
+void s8quantizeAvx2(int n, float invScale, const float* x, int8_t* q)
+{
+    const __m256 invScaleVec = _mm256_set1_ps(invScale);
+    // packsはレーンごとに詰めるので、最後に32bit単位で並べ直す
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for(; i + 32 <= n; i += 32){
+        const __m256i q0 = quantizeAvx2(_mm256_loadu_ps(x + i), invScaleVec);
+        const __m256i q1 = quantizeAvx2(_mm256_loadu_ps(x + i + 8), invScaleVec);
+        const __m256i q2 = quantizeAvx2(_mm256_loadu_ps(x + i + 16), invScaleVec);
+        const __m256i q3 = quantizeAvx2(_mm256_loadu_ps(x + i + 24), invScaleVec);
+        const __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(q0, q1),
+                                                  _mm256_packs_epi32(q2, q3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(q + i),
+                            _mm256_permutevar8x32_epi32(packed, order));
+    }
+    s8quantizeScalar(n - i, invScale, x + i, q + i);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline __m128i floatToBf16Avx2(__m256 x)
+{
+    const __m256i bits = _mm256_castps_si256(x);
+    const __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    __m256i half = _mm256_srli_epi32(
+        _mm256_add_epi32(_mm256_add_epi32(bits, _mm256_set1_epi32(0x7fff)), lsb), 16);
+    const __m256i nan = _mm256_or_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(0x40));
+    half = _mm256_blendv_epi8(half, nan, _mm256_castps_si256(_mm256_cmp_ps(x, x, _CMP_UNORD_Q)));
+    // packusはレーンごとに詰めるので、前半の2つの64bitを並べ直す
+    half = _mm256_permute4x64_epi64(_mm256_packus_epi32(half, half), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_castsi256_si128(half);
+}
+
+template<HalfType TYPE>
+__attribute__((target("avx2,fma,f16c")))
+inline __m128i floatToHalfAvx2(__m256 x)
+{
+    if constexpr(TYPE == HalfType::FP16){
+        return _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT);
+    }else{
+        return floatToBf16Avx2(x);
+    }
+}
+
+// 8個の16bit浮動小数点を読み込み、floatに広げる
+template<HalfType TYPE>
+__attribute__((target("avx2,fma,f16c")))
+inline __m256 loadHalfAvx2(const uint16_t* x)
+{
+    const __m128i half = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x));
+    if constexpr(TYPE == HalfType::FP16){
+        return _mm256_cvtph_ps(half);
+    }else{
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(half), 16));
+    }
+}
+
+template<HalfType TYPE>
+__attribute__((target("avx2,fma,f16c")))
+void toHalfAvx2(int n, const float* x, uint16_t* y)
+{
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i),
+                         floatToHalfAvx2<TYPE>(_mm256_loadu_ps(x + i)));
+    }
+    toHalfScalar<TYPE>(n - i, x + i, y + i);
+}
+
+template<HalfType TYPE>
+__attribute__((target("avx2,fma,f16c")))
+void fromHalfAvx2(int n, const uint16_t* x, float* y)
+{
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        _mm256_storeu_ps(y + i, loadHalfAvx2<TYPE>(x + i));
+    }
+    fromHalfScalar<TYPE>(n - i, x + i, y + i);
+}
+
+template<HalfType TYPE>
+__attribute__((target("avx2,fma,f16c")))
+float hdotAvx2(int n, const uint16_t* a, const float* x)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        acc = _mm256_fmadd_ps(loadHalfAvx2<TYPE>(a + i), _mm256_loadu_ps(x + i), acc);
+    }
+    float sumVal = hsum256(acc);
+    for(; i < n; i++){
+        sumVal += halfToFloat<TYPE>(a[i]) * x[i];
+    }
+    return sumVal;
+}
+
+// gemvAvx2と同じく4行ずつまとめる。重みは読みながらfloatに戻す
+template<HalfType TYPE>
+__attribute__((target("avx2,fma,f16c")))
+void hgemvAvx2(int M, int N, const uint16_t* A, int lda, const float* x, float* y)
+{
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const uint16_t* a0 = A + m * lda;
+        const uint16_t* a1 = a0 + lda;
+        const uint16_t* a2 = a1 + lda;
+        const uint16_t* a3 = a2 + lda;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        int i = 0;
+        for(; i + 8 <= N; i += 8){
+            const __m256 xv = _mm256_loadu_ps(x + i);
+            acc0 = _mm256_fmadd_ps(loadHalfAvx2<TYPE>(a0 + i), xv, acc0);
+            acc1 = _mm256_fmadd_ps(loadHalfAvx2<TYPE>(a1 + i), xv, acc1);
+            acc2 = _mm256_fmadd_ps(loadHalfAvx2<TYPE>(a2 + i), xv, acc2);
+            acc3 = _mm256_fmadd_ps(loadHalfAvx2<TYPE>(a3 + i), xv, acc3);
+        }
+        float s0 = hsum256(acc0), s1 = hsum256(acc1), s2 = hsum256(acc2), s3 = hsum256(acc3);
+        for(; i < N; i++){
+            s0 += halfToFloat<TYPE>(a0[i]) * x[i];
+            s1 += halfToFloat<TYPE>(a1[i]) * x[i];
+            s2 += halfToFloat<TYPE>(a2[i]) * x[i];
+            s3 += halfToFloat<TYPE>(a3[i]) * x[i];
+        }
+        y[m] = s0;
+        y[m + 1] = s1;
+        y[m + 2] = s2;
+        y[m + 3] = s3;
+    }
+    for(; m < M; m++){
+        y[m] = hdotAvx2<TYPE>(N, A + m * lda, x);
+    }
+}
+
+template<HalfType TYPE>
+constexpr HalfKernels halfAvx2Kernels = {toHalfAvx2<TYPE>, fromHalfAvx2<TYPE>, hgemvAvx2<TYPE>};
+
+__attribute__((target("avx2,fma")))
+inline __m256 loadGradAvx2(const OptimizerStepParam& p, const float* grad, __m256 param)
+{
+    return _mm256_fmadd_ps(_mm256_set1_ps(p.gradScale), _mm256_loadu_ps(grad),
+                           _mm256_mul_ps(_mm256_set1_ps(p.decay), param));
+}
+
+__attribute__((target("avx2,fma")))
+void sgdStepAvx2(int n, const OptimizerStepParam& p, const float* grad, float* param)
+{
+    const __m256 negLr = _mm256_set1_ps(-p.lr);
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        const __m256 w = _mm256_loadu_ps(param + i);
+        _mm256_storeu_ps(param + i, _mm256_fmadd_ps(negLr, loadGradAvx2(p, grad + i, w), w));
+    }
+    sgdStepScalar(n - i, p, grad + i, param + i);
+}
+
+__attribute__((target("avx2,fma")))
+void momentumStepAvx2(int n, const OptimizerStepParam& p, const float* grad, float* velocity, float* param)
+{
+    const __m256 negLr = _mm256_set1_ps(-p.lr);
+    const __m256 momentum = _mm256_set1_ps(p.momentum);
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        const __m256 w = _mm256_loadu_ps(param + i);
+        const __m256 vel = _mm256_fmadd_ps(momentum, _mm256_loadu_ps(velocity + i),
+                                           loadGradAvx2(p, grad + i, w));
+        _mm256_storeu_ps(velocity + i, vel);
+        _mm256_storeu_ps(param + i, _mm256_fmadd_ps(negLr, vel, w));
+    }
+    momentumStepScalar(n - i, p, grad + i, velocity + i, param + i);
+}
+
+__attribute__((target("avx2,fma")))
+void adamStepAvx2(int n, const OptimizerStepParam& p, const float* grad, float* m, float* v, float* param)
+{
+    const __m256 negLr = _mm256_set1_ps(-p.lr);
+    const __m256 beta1 = _mm256_set1_ps(p.beta1);
+    const __m256 beta2 = _mm256_set1_ps(p.beta2);
+    const __m256 oneMinusBeta1 = _mm256_set1_ps(1.0F - p.beta1);
+    const __m256 oneMinusBeta2 = _mm256_set1_ps(1.0F - p.beta2);
+    const __m256 epsilon = _mm256_set1_ps(p.epsilon);
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        const __m256 w = _mm256_loadu_ps(param + i);
+        const __m256 g = loadGradAvx2(p, grad + i, w);
+        const __m256 mVec = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), _mm256_mul_ps(oneMinusBeta1, g));
+        const __m256 vVec = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(v + i),
+                                            _mm256_mul_ps(oneMinusBeta2, _mm256_mul_ps(g, g)));
+        _mm256_storeu_ps(m + i, mVec);
+        _mm256_storeu_ps(v + i, vVec);
+        const __m256 update = _mm256_div_ps(mVec, _mm256_add_ps(_mm256_sqrt_ps(vVec), epsilon));
+        _mm256_storeu_ps(param + i, _mm256_fmadd_ps(negLr, update, w));
+    }
+    adamStepScalar(n - i, p, grad + i, m + i, v + i, param + i);
+}
+
+const OptimizerKernels optimizerAvx2Kernels = {sgdStepAvx2, momentumStepAvx2, adamStepAvx2};
+
+__attribute__((target("avx2,avxvnni")))
+void s8gemvAvxVnni(int M, int N, const int8_t* A, int lda, const int32_t* rowSum,
+                   const int8_t* x, int32_t* y)
+{
+    const __m256i bias = _mm256_set1_epi8(static_cast<char>(0x80));
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const int8_t* a0 = A + m * lda;
+        const int8_t* a1 = a0 + lda;
+        const int8_t* a2 = a1 + lda;
+        const int8_t* a3 = a2 + lda;
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        __m256i acc2 = _mm256_setzero_si256();
+        __m256i acc3 = _mm256_setzero_si256();
+        int i = 0;
+        for(; i + 32 <= N; i += 32){
+            const __m256i xv = _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)), bias);
+            acc0 = _mm256_dpbusd_avx_epi32(acc0, xv, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a0 + i)));
+            acc1 = _mm256_dpbusd_avx_epi32(acc1, xv, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a1 + i)));
+            acc2 = _mm256_dpbusd_avx_epi32(acc2, xv, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a2 + i)));
+            acc3 = _mm256_dpbusd_avx_epi32(acc3, xv, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a3 + i)));
+        }
+        // 端数の分は128を足していないので、rowSumの補正から除く
+        y[m] = hsum256i(acc0) + vnniTail(N, i, a0, x, rowSum[m]);
+        y[m + 1] = hsum256i(acc1) + vnniTail(N, i, a1, x, rowSum[m + 1]);
+        y[m + 2] = hsum256i(acc2) + vnniTail(N, i, a2, x, rowSum[m + 2]);
+        y[m + 3] = hsum256i(acc3) + vnniTail(N, i, a3, x, rowSum[m + 3]);
+    }
+    s8gemvScalar(M - m, N, A + m * lda, lda, rowSum, x, y + m);
+}
+
+/* ---- AVX-512 ---- */
+__attribute__((target("avx512f")))
+float dotAvx512(int n, const float* x, const float* y)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps();
+    __m512 acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for(; i + 64 <= n; i += 64){
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 32), _mm512_loadu_ps(y + i + 32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 48), _mm512_loadu_ps(y + i + 48), acc3);
+    }
+    for(; i + 16 <= n; i += 16){
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+    }
+    // 端数はマスク付きで読み込む
+    if(i < n){
+        const __mmask16 mask = (1U << (n - i)) - 1;
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i),
+                               _mm512_maskz_loadu_ps(mask, y + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+__attribute__((target("avx512f")))
+void axpyAvx512(int n, float alpha, const float* x, float* y)
+{
+    const __m512 a = _mm512_set1_ps(alpha);
+    int i = 0;
+    for(; i + 16 <= n; i += 16){
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    if(i < n){
+        const __mmask16 mask = (1U << (n - i)) - 1;
+        const __m512 yv = _mm512_maskz_loadu_ps(mask, y + i);
+        _mm512_mask_storeu_ps(y + i, mask,
+                              _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(mask, x + i), yv));
+    }
+}
+
+__attribute__((target("avx512f")))
+void gemvAvx512(int M, int N, const float* A, int lda, const float* x, float* y)
+{
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const float* a0 = A + m * lda;
+        const float* a1 = a0 + lda;
+        const float* a2 = a1 + lda;
+        const float* a3 = a2 + lda;
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        __m512 acc2 = _mm512_setzero_ps();
+        __m512 acc3 = _mm512_setzero_ps();
+        for(int i = 0; i < N; i += 16){
+            const __mmask16 mask = N - i < 16 ? (1U << (N - i)) - 1 : 0xFFFF;
+            const __m512 xv = _mm512_maskz_loadu_ps(mask, x + i);
+            acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a0 + i), xv, acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a1 + i), xv, acc1);
+            acc2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a2 + i), xv, acc2);
+            acc3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a3 + i), xv, acc3);
+        }
+        y[m] = _mm512_reduce_add_ps(acc0);
+        y[m + 1] = _mm512_reduce_add_ps(acc1);
+        y[m + 2] = _mm512_reduce_add_ps(acc2);
+        y[m + 3] = _mm512_reduce_add_ps(acc3);
+    }
+    for(; m < M; m++){
+        y[m] = dotAvx512(N, A + m * lda, x);
+    }
+}
+
+__attribute__((target("avx512f")))
+void gemvBatchAvx512(int M, int N, const float* A, int lda, int numX, const float* X, int ldx,
+                     float* Y, int ldy)
+{
+    // gemvBatchAvx2と同じく、Aの4行 x xの2本を1タイルにする
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const float* a0 = A + m * lda;
+        const float* a1 = a0 + lda;
+        const float* a2 = a1 + lda;
+        const float* a3 = a2 + lda;
+        int k = 0;
+        for(; k + 2 <= numX; k += 2){
+            const float* x0 = X + k * ldx;
+            const float* x1 = x0 + ldx;
+            __m512 acc00 = _mm512_setzero_ps(), acc01 = _mm512_setzero_ps();
+            __m512 acc10 = _mm512_setzero_ps(), acc11 = _mm512_setzero_ps();
+            __m512 acc20 = _mm512_setzero_ps(), acc21 = _mm512_setzero_ps();
+            __m512 acc30 = _mm512_setzero_ps(), acc31 = _mm512_setzero_ps();
+            for(int i = 0; i < N; i += 16){
+                const __mmask16 mask = N - i < 16 ? (1U << (N - i)) - 1 : 0xFFFF;
+                const __m512 xv0 = _mm512_maskz_loadu_ps(mask, x0 + i);
+                const __m512 xv1 = _mm512_maskz_loadu_ps(mask, x1 + i);
+                const __m512 av0 = _mm512_maskz_loadu_ps(mask, a0 + i);
+                const __m512 av1 = _mm512_maskz_loadu_ps(mask, a1 + i);
+                const __m512 av2 = _mm512_maskz_loadu_ps(mask, a2 + i);
+                const __m512 av3 = _mm512_maskz_loadu_ps(mask, a3 + i);
+                acc00 = _mm512_fmadd_ps(av0, xv0, acc00);
+                acc01 = _mm512_fmadd_ps(av0, xv1, acc01);
+                acc10 = _mm512_fmadd_ps(av1, xv0, acc10);
+                acc11 = _mm512_fmadd_ps(av1, xv1, acc11);
+                acc20 = _mm512_fmadd_ps(av2, xv0, acc20);
+                acc21 = _mm512_fmadd_ps(av2, xv1, acc21);
+                acc30 = _mm512_fmadd_ps(av3, xv0, acc30);
+                acc31 = _mm512_fmadd_ps(av3, xv1, acc31);
+            }
+            float* y0 = Y + k * ldy + m;
+            float* y1 = y0 + ldy;
+            y0[0] = _mm512_reduce_add_ps(acc00);
+            y0[1] = _mm512_reduce_add_ps(acc10);
+            y0[2] = _mm512_reduce_add_ps(acc20);
+            y0[3] = _mm512_reduce_add_ps(acc30);
+            y1[0] = _mm512_reduce_add_ps(acc01);
+            y1[1] = _mm512_reduce_add_ps(acc11);
+            y1[2] = _mm512_reduce_add_ps(acc21);
+            y1[3] = _mm512_reduce_add_ps(acc31);
+        }
+        for(; k < numX; k++){
+            gemvAvx512(4, N, a0, lda, X + k * ldx, Y + k * ldy + m);
+        }
+    }
+    for(int k = 0; k < numX; k++){
+        gemvAvx512(M - m, N, A + m * lda, lda, X + k * ldx, Y + k * ldy + m);
+    }
+}
+
+const SimdKernels avx512Kernels = {dotAvx512, axpyAvx512, gemvAvx512, gemvBatchAvx512};
+
+__attribute__((target("avx512f,avx512vnni")))
+void s8gemvAvx512Vnni(int M, int N, const int8_t* A, int lda, const int32_t* rowSum,
+                      const int8_t* x, int32_t* y)
+{
+    const __m512i bias = _mm512_set1_epi8(static_cast<char>(0x80));
+    int m = 0;
+    for(; m + 4 <= M; m += 4){
+        const int8_t* a0 = A + m * lda;
+        const int8_t* a1 = a0 + lda;
+        const int8_t* a2 = a1 + lda;
+        const int8_t* a3 = a2 + lda;
+        __m512i acc0 = _mm512_setzero_si512();
+        __m512i acc1 = _mm512_setzero_si512();
+        __m512i acc2 = _mm512_setzero_si512();
+        __m512i acc3 = _mm512_setzero_si512();
+        int i = 0;
+        for(; i + 64 <= N; i += 64){
+            const __m512i xv = _mm512_xor_si512(_mm512_loadu_si512(x + i), bias);
+            acc0 = _mm512_dpbusd_epi32(acc0, xv, _mm512_loadu_si512(a0 + i));
+            acc1 = _mm512_dpbusd_epi32(acc1, xv, _mm512_loadu_si512(a1 + i));
+            acc2 = _mm512_dpbusd_epi32(acc2, xv, _mm512_loadu_si512(a2 + i));
+            acc3 = _mm512_dpbusd_epi32(acc3, xv, _mm512_loadu_si512(a3 + i));
+        }
+        y[m] = _mm512_reduce_add_epi32(acc0) + vnniTail(N, i, a0, x, rowSum[m]);
+        y[m + 1] = _mm512_reduce_add_epi32(acc1) + vnniTail(N, i, a1, x, rowSum[m + 1]);
+        y[m + 2] = _mm512_reduce_add_epi32(acc2) + vnniTail(N, i, a2, x, rowSum[m + 2]);
+        y[m + 3] = _mm512_reduce_add_epi32(acc3) + vnniTail(N, i, a3, x, rowSum[m + 3]);
+    }
+    s8gemvScalar(M - m, N, A + m * lda, lda, rowSum, x, y + m);
+}
+#endif
+
+const SimdKernels& getKernels(SimdLevel level)
+{
+    switch(level) {
+#ifdef CNN_X86_SIMD
+    case SimdLevel::AVX512:
+        return avx512Kernels;
+    case SimdLevel::AVX2:
+        return avx2Kernels;
+#endif
+    default:
+        return scalarKernels;
+    }
+}
+
+#ifdef CNN_X86_SIMD
+bool supportsAvx512Vnni()
+{
+    __builtin_cpu_init();
+    static const bool supported = __builtin_cpu_supports("avx512vnni");
+    return supported;
+}
+
+bool supportsF16c()
+{
+    __builtin_cpu_init();
+    static const bool supported = __builtin_cpu_supports("f16c");
+    return supported;
+}
+
+bool supportsAvxVnni()
+{
+    __builtin_cpu_init();
+    static const bool supported = __builtin_cpu_supports("avxvnni");
+    return supported;
+}
+#endif
+
+S8GemvKernel getS8GemvKernel(SimdLevel level)
+{
+    switch(level) {
+#ifdef CNN_X86_SIMD
+    case SimdLevel::AVX512:
+        if(supportsAvx512Vnni()){
+            return s8gemvAvx512Vnni;
+        }
+        [[fallthrough]];
+    case SimdLevel::AVX2:
+        return supportsAvxVnni() ? s8gemvAvxVnni : s8gemvAvx2;
+#endif
+    default:
+        return s8gemvScalar;
+    }
+}
+
+S8QuantizeKernel getS8QuantizeKernel(SimdLevel level)
+{
+    // AVX-512にしてもメモリ律速で変わらないので、AVX2と共通
+#ifdef CNN_X86_SIMD
+    if(level != SimdLevel::SCALAR){
+        return s8quantizeAvx2;
+    }
+#endif
+    return s8quantizeScalar;
+}
+
+// 16bitの重みが効くのは重みがキャッシュに収まらない層で、そこではメモリ律速になるので
+// AVX-512でもAVX2と共通
+const HalfKernels& getHalfKernels(SimdLevel level, HalfType type)
+{
+#ifdef CNN_X86_SIMD
+    if(level != SimdLevel::SCALAR && supportsF16c()){
+        return type == HalfType::FP16 ? halfAvx2Kernels<HalfType::FP16> : halfAvx2Kernels<HalfType::BF16>;
+    }
+#endif
+    return type == HalfType::FP16 ? halfScalarKernels<HalfType::FP16> : halfScalarKernels<HalfType::BF16>;
+}
+
+// パラメータと状態を読み書きするだけのメモリ律速な処理なので、AVX-512でもAVX2と共通
+const OptimizerKernels& getOptimizerKernels(SimdLevel level)
+{
+#ifdef CNN_X86_SIMD
+    if(level != SimdLevel::SCALAR){
+        return optimizerAvx2Kernels;
+    }
+#endif
+    return optimizerScalarKernels;
+}
+
+SimdLevel detectSimdLevel()
+{
+#ifdef CNN_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        return SimdLevel::AVX512;
+    }
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        return SimdLevel::AVX2;
+    }
+#endif
+    return SimdLevel::SCALAR;
+}
+
+// 最初に使う時に、CPUに合わせて選ぶ
+std::atomic<SimdLevel>& currentLevel()
+{
+    static std::atomic<SimdLevel> level(getSupportedSimdLevel());
+    return level;
+}
+
+const SimdKernels& currentKernels()
+{
+    return getKernels(currentLevel().load(std::memory_order_relaxed));
+}
+
+}
+
+SimdLevel getSupportedSimdLevel()
+{
+    static const SimdLevel supported = detectSimdLevel();
+    return supported;
+}
+
+SimdLevel getSimdLevel()
+{
+    return currentLevel().load();
+}
+
+bool setSimdLevel(SimdLevel level)
+{
+    if(static_cast<int>(getSupportedSimdLevel()) < static_cast<int>(level)){
+        return false;
+    }
+    currentLevel().store(level);
+    return true;
+}
+
+float sdot(int n, const float* x, const float* y)
+{
+    assert(0 <= n);
+    return currentKernels().dot(n, x, y);
+}
+
+void saxpy(int n, float alpha, const float* x, float* y)
+{
+    assert(0 <= n);
+    currentKernels().axpy(n, alpha, x, y);
+}
+
+void sgemv(int M, int N, const float* A, int lda, const float* x, float* y)
+{
+    assert(0 <= M && 0 <= N);
+    currentKernels().gemv(M, N, A, lda, x, y);
+}
+
+void sgemvBatch(int M, int N, const float* A, int lda, int numX, const float* X, int ldx,
+                float* Y, int ldy)
+{
+    assert(0 <= M && 0 <= N && 0 <= numX);
+    currentKernels().gemvBatch(M, N, A, lda, numX, X, ldx, Y, ldy);
+}
+
+void sgemvTrans(int M, int N, const float* A, int lda, const float* x, float* y)
+{
+    assert(0 <= M && 0 <= N);
+    const auto& kernels = currentKernels();
+    for(int m = 0; m < M; m++){
+        kernels.axpy(N, x[m], A + m * lda, y);
+    }
+}
+
+void s8gemv(int M, int N, const int8_t* A, int lda, const int32_t* rowSum,
+            const int8_t* x, int32_t* y)
+{
+    assert(0 <= M && 0 <= N);
+    getS8GemvKernel(currentLevel().load(std::memory_order_relaxed))(M, N, A, lda, rowSum, x, y);
+}
+
+void s8quantize(int n, float invScale, const float* x, int8_t* q)
+{
+    assert(0 <= n);
+    getS8QuantizeKernel(currentLevel().load(std::memory_order_relaxed))(n, invScale, x, q);
+}
+
+void toHalf(HalfType type, int n, const float* x, uint16_t* y)
+{
+    assert(0 <= n);
+    getHalfKernels(currentLevel().load(std::memory_order_relaxed), type).toHalf(n, x, y);
+}
+
+void fromHalf(HalfType type, int n, const uint16_t* x, float* y)
+{
+    assert(0 <= n);
+    getHalfKernels(currentLevel().load(std::memory_order_relaxed), type).fromHalf(n, x, y);
+}
+
+void hgemv(HalfType type, int M, int N, const uint16_t* A, int lda, const float* x, float* y)
+{
+    assert(0 <= M && 0 <= N);
+    getHalfKernels(currentLevel().load(std::memory_order_relaxed), type).gemv(M, N, A, lda, x, y);
+}
+
+void sgdStep(int n, const OptimizerStepParam& p, const float* grad, float* param)
+{
+    assert(0 <= n);
+    getOptimizerKernels(currentLevel().load(std::memory_order_relaxed)).sgd(n, p, grad, param);
+}
+
+void momentumStep(int n, const OptimizerStepParam& p, const float* grad, float* velocity, float* param)
+{
+    assert(0 <= n);
+    getOptimizerKernels(currentLevel().load(std::memory_order_relaxed)).momentum(n, p, grad, velocity, param);
+}
+
+void adamStep(int n, const OptimizerStepParam& p, const float* grad, float* m, float* v, float* param)
+{
+    assert(0 <= n);
+    getOptimizerKernels(currentLevel().load(std::memory_order_relaxed)).adam(n, p, grad, m, v, param);
+}
+
+bool hasVnni()
+{
+#ifdef CNN_X86_SIMD
+    const SimdLevel level = getSupportedSimdLevel();
+    return (level == SimdLevel::AVX512 && supportsAvx512Vnni())
+        || (level != SimdLevel::SCALAR && supportsAvxVnni());
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,74 @@
+#include "thread_pool.h"
+#include <cassert>
+
+/* ======================
+    ThreadPool
+   ======================*/
+ThreadPool::ThreadPool(int numThread)
+    : job(nullptr), numTask(0), nextTask(0), numRunning(0), generation(0), stop(false)
+{
+    assert(0 < numThread);
+    workers.reserve(numThread);
+    for(int i = 0; i < numThread; i++){
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stop = true;
+    }
+    cvStart.notify_all();
+    for(auto& worker : workers){
+        worker.join();
+    }
+}
+
+void ThreadPool::parallelFor(int numTask, const std::function<void(int, int)>& func)
+{
+    if(numTask <= 0){
+        return;
+    }
+    std::unique_lock<std::mutex> lk(mtx);
+    assert(numRunning == 0);
+    job = &func;
+    this->numTask = numTask;
+    nextTask = 0;
+    numRunning = workers.size();
+    generation++;
+    cvStart.notify_all();
+    cvDone.wait(lk, [this]{return numRunning == 0;});
+    job = nullptr;
+}
+
+void ThreadPool::workerLoop(int workerId)
+{
+    uint64_t seenGeneration = 0;
+    while(true){
+        const std::function<void(int, int)>* currentJob;
+        int currentNumTask;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            cvStart.wait(lk, [&]{return stop || generation != seenGeneration;});
+            if(stop){
+                return;
+            }
+            seenGeneration = generation;
+            currentJob = job;
+            currentNumTask = numTask;
+        }
+
+        // タスクは早い者勝ちで取っていく
+        for(int task = nextTask++; task < currentNumTask; task = nextTask++){
+            (*currentJob)(task, workerId);
+        }
+
+        std::lock_guard<std::mutex> lk(mtx);
+        numRunning--;
+        if(numRunning == 0){
+            cvDone.notify_one();
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#include "weight_file.h"
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* ======================
+    MappedFile
+   ======================*/
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0){
+        std::cerr << "failed to open file " << filename << std::endl;
+        return nullptr;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        std::cerr << "failed to stat file " << filename << std::endl;
+        close(fd);
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // mmapした領域はfdを閉じても有効
+    close(fd);
+    if(addr == MAP_FAILED){
+        std::cerr << "failed to mmap file " << filename << std::endl;
+        return nullptr;
+    }
+    return std::shared_ptr<const MappedFile>(
+        new MappedFile(static_cast<const char*>(addr), st.st_size));
+}
+
+MappedFile::~MappedFile()
+{
+    munmap(const_cast<char*>(addr), length);
+}
+
+/* ======================
+    Tensor
+   ======================*/
+size_t getTensorTypeSize(TensorType type)
+{
+    switch(type) {
+    case TensorType::FLOAT32:
+        return sizeof(float);
+    case TensorType::INT8:
+        return sizeof(int8_t);
+    case TensorType::FLOAT16:
+    case TensorType::BFLOAT16:
+        return sizeof(uint16_t);
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,394 @@
+#include "winograd.h"
+#include "gemm.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+// F(m x m, 3 x 3)の変換行列
+// Y = A^T [(G g G^T) ∘ (B^T d B)] A
+template<int M>
+struct WinogradMatrix;
+
+template<>
+struct WinogradMatrix<2>
+{
+    static constexpr int ALPHA = 4;
+    static constexpr float BT[4][4] = {
+        {1,  0, -1,  0},
+        {0,  1,  1,  0},
+        {0, -1,  1,  0},
+        {0,  1,  0, -1}};
+    static constexpr float G[4][3] = {
+        {1.0F,  0.0F, 0.0F},
+        {0.5F,  0.5F, 0.5F},
+        {0.5F, -0.5F, 0.5F},
+        {0.0F,  0.0F, 1.0F}};
+    static constexpr float AT[2][4] = {
+        {1, 1,  1,  0},
+        {0, 1, -1, -1}};
+};
+
+// 補間点は 0, ±1, ±2, ∞
+template<>
+struct WinogradMatrix<4>
+{
+    static constexpr int ALPHA = 6;
+    static constexpr float BT[6][6] = {
+        {4,  0, -5,  0, 1, 0},
+        {0, -4, -4,  1, 1, 0},
+        {0,  4, -4, -1, 1, 0},
+        {0, -2, -1,  2, 1, 0},
+        {0,  2, -1, -2, 1, 0},
+        {0,  4,  0, -5, 0, 1}};
+    static constexpr float G[6][3] = {
+        { 1.0F / 4,  0.0F,       0.0F},
+        {-1.0F / 6, -1.0F / 6,  -1.0F / 6},
+        {-1.0F / 6,  1.0F / 6,  -1.0F / 6},
+        { 1.0F / 24, 1.0F / 12,  1.0F / 6},
+        { 1.0F / 24, -1.0F / 12, 1.0F / 6},
+        { 0.0F,      0.0F,       1.0F}};
+    static constexpr float AT[4][6] = {
+        {1, 1,  1, 1,  1, 0},
+        {0, 1, -1, 2, -2, 0},
+        {0, 1,  1, 4,  4, 0},
+        {0, 1, -1, 8, -8, 1}};
+};
+
+// c(R x C) = a(R x K) * b(K x C)
+template<int R, int K, int C>
+inline void matMul(const float (&a)[R][K], const float (&b)[K][C], float (&c)[R][C])
+{
+    for(int i = 0; i < R; i++){
+        for(int j = 0; j < C; j++){
+            float sumVal = 0;
+            for(int k = 0; k < K; k++){
+                sumVal += a[i][k] * b[k][j];
+            }
+            c[i][j] = sumVal;
+        }
+    }
+}
+
+// c(R x C) = a(R x K) * b(C x K)^T
+template<int R, int K, int C>
+inline void matMulTransB(const float (&a)[R][K], const float (&b)[C][K], float (&c)[R][C])
+{
+    for(int i = 0; i < R; i++){
+        for(int j = 0; j < C; j++){
+            float sumVal = 0;
+            for(int k = 0; k < K; k++){
+                sumVal += a[i][k] * b[j][k];
+            }
+            c[i][j] = sumVal;
+        }
+    }
+}
+
+// c(R x C) = a(K x R)^T * b(K x C)
+template<int R, int K, int C>
+inline void matMulTransA(const float (&a)[K][R], const float (&b)[K][C], float (&c)[R][C])
+{
+    for(int i = 0; i < R; i++){
+        for(int j = 0; j < C; j++){
+            float sumVal = 0;
+            for(int k = 0; k < K; k++){
+                sumVal += a[k][i] * b[k][j];
+            }
+            c[i][j] = sumVal;
+        }
+    }
+}
+
+// 画像(numChannel x height x width)をy0, x0を左上とするS x Sのタイルに切り出す
+// 画像の外は0とする
+template<int S>
+inline void loadTile(const float* src, int width, int height, int y0, int x0, float (&tile)[S][S])
+{
+    if(0 <= y0 && y0 + S <= height && 0 <= x0 && x0 + S <= width){
+        for(int i = 0; i < S; i++){
+            std::copy_n(src + (y0 + i) * width + x0, S, tile[i]);
+        }
+        return;
+    }
+    for(int i = 0; i < S; i++){
+        const int y = y0 + i;
+        for(int j = 0; j < S; j++){
+            const int x = x0 + j;
+            tile[i][j] = (0 <= y && y < height && 0 <= x && x < width) ? src[y * width + x] : 0;
+        }
+    }
+}
+
+// タイルの画素位置xiごとの行列に散らして書く
+// dst[xi * xiStride]がタイルの(xi / ALPHA, xi % ALPHA)の値になる
+template<int ALPHA>
+inline void storeTile(const float (&tile)[ALPHA][ALPHA], float* dst, size_t xiStride)
+{
+    for(int i = 0; i < ALPHA; i++){
+        for(int j = 0; j < ALPHA; j++){
+            dst[(i * ALPHA + j) * xiStride] = tile[i][j];
+        }
+    }
+}
+
+template<int ALPHA>
+inline void gatherTile(const float* src, size_t xiStride, float (&tile)[ALPHA][ALPHA])
+{
+    for(int i = 0; i < ALPHA; i++){
+        for(int j = 0; j < ALPHA; j++){
+            tile[i][j] = src[(i * ALPHA + j) * xiStride];
+        }
+    }
+}
+
+// 出力(outWidth x outHeight)をM x Mのタイルで覆う時の分け方
+template<int M>
+struct TileGrid
+{
+    TileGrid(int width, int height, int zeroPad, int batchSize) :
+        outWidth(width + 2 * zeroPad - WINOGRAD_WINDOW_SIZE + 1),
+        outHeight(height + 2 * zeroPad - WINOGRAD_WINDOW_SIZE + 1),
+        tilesX((outWidth + M - 1) / M), tilesY((outHeight + M - 1) / M),
+        numTile(tilesX * tilesY * batchSize){}
+    int outWidth;
+    int outHeight;
+    int tilesX;
+    int tilesY;
+    int numTile;
+};
+
+// 重み(numOutChannel x numInChannel x 3 x 3)を変換し、U(alpha^2 x numOutChannel x numInChannel)に書く
+template<int M>
+void transformWeight(const float* weight, int numInChannel, int numOutChannel, float* U)
+{
+    using W = WinogradMatrix<M>;
+    constexpr int ALPHA = W::ALPHA;
+    const size_t xiStride = static_cast<size_t>(numOutChannel) * numInChannel;
+    for(int outCh = 0; outCh < numOutChannel; outCh++){
+        for(int inCh = 0; inCh < numInChannel; inCh++){
+            float g[3][3];
+            std::copy_n(weight + (outCh * numInChannel + inCh) * 9, 9, &g[0][0]);
+            float tmp[ALPHA][3], u[ALPHA][ALPHA];
+            matMul(W::G, g, tmp);
+            matMulTransB(tmp, W::G, u);
+            storeTile(u, U + outCh * numInChannel + inCh, xiStride);
+        }
+    }
+}
+
+// 入力をタイルに切り出して変換し、V(alpha^2 x numChannel x numTile)に書く
+template<int M>
+void transformInput(const float* input, int width, int height, int numChannel, int zeroPad,
+                    const TileGrid<M>& grid, int batchSize, float* V)
+{
+    using W = WinogradMatrix<M>;
+    constexpr int ALPHA = W::ALPHA;
+    const size_t xiStride = static_cast<size_t>(numChannel) * grid.numTile;
+    for(int n = 0; n < batchSize; n++){
+        for(int ch = 0; ch < numChannel; ch++){
+            const float* src = input + (static_cast<size_t>(n) * numChannel + ch) * width * height;
+            float* dst = V + static_cast<size_t>(ch) * grid.numTile + n * grid.tilesX * grid.tilesY;
+            for(int ty = 0; ty < grid.tilesY; ty++){
+                for(int tx = 0; tx < grid.tilesX; tx++){
+                    float d[ALPHA][ALPHA], tmp[ALPHA][ALPHA], v[ALPHA][ALPHA];
+                    loadTile(src, width, height, ty * M - zeroPad, tx * M - zeroPad, d);
+                    matMul(W::BT, d, tmp);
+                    matMulTransB(tmp, W::BT, v);
+                    storeTile(v, dst + ty * grid.tilesX + tx, xiStride);
+                }
+            }
+        }
+    }
+}
+
+// タイルごとの要素積の和(alpha^2 x numChannel x numTile)を逆変換し、出力に書く
+// 出力の外にはみ出す部分は捨てる
+template<int M>
+void transformOutput(const float* Mat, int numChannel, const TileGrid<M>& grid,
+                     int batchSize, float* output)
+{
+    using W = WinogradMatrix<M>;
+    constexpr int ALPHA = W::ALPHA;
+    const size_t xiStride = static_cast<size_t>(numChannel) * grid.numTile;
+    for(int n = 0; n < batchSize; n++){
+        for(int ch = 0; ch < numChannel; ch++){
+            const float* src = Mat + static_cast<size_t>(ch) * grid.numTile + n * grid.tilesX * grid.tilesY;
+            float* dst = output + (static_cast<size_t>(n) * numChannel + ch) * grid.outWidth * grid.outHeight;
+            for(int ty = 0; ty < grid.tilesY; ty++){
+                for(int tx = 0; tx < grid.tilesX; tx++){
+                    float m[ALPHA][ALPHA], tmp[M][ALPHA], y[M][M];
+                    gatherTile(src + ty * grid.tilesX + tx, xiStride, m);
+                    matMul(W::AT, m, tmp);
+                    matMulTransB(tmp, W::AT, y);
+                    const int numRow = std::min(M, grid.outHeight - ty * M);
+                    const int numCol = std::min(M, grid.outWidth - tx * M);
+                    for(int i = 0; i < numRow; i++){
+                        std::copy_n(y[i], numCol, dst + (ty * M + i) * grid.outWidth + tx * M);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// propErrorをM x Mのタイルに切り出してA E A^Tに変換し、E(alpha^2 x numChannel x numTile)に書く
+template<int M>
+void transformError(const float* propError, int numChannel, const TileGrid<M>& grid,
+                    int batchSize, float* E)
+{
+    using W = WinogradMatrix<M>;
+    constexpr int ALPHA = W::ALPHA;
+    const size_t xiStride = static_cast<size_t>(numChannel) * grid.numTile;
+    for(int n = 0; n < batchSize; n++){
+        for(int ch = 0; ch < numChannel; ch++){
+            const float* src = propError + (static_cast<size_t>(n) * numChannel + ch) * grid.outWidth * grid.outHeight;
+            float* dst = E + static_cast<size_t>(ch) * grid.numTile + n * grid.tilesX * grid.tilesY;
+            for(int ty = 0; ty < grid.tilesY; ty++){
+                for(int tx = 0; tx < grid.tilesX; tx++){
+                    float e[M][M], tmp[ALPHA][M], eHat[ALPHA][ALPHA];
+                    loadTile(src, grid.outWidth, grid.outHeight, ty * M, tx * M, e);
+                    matMulTransA(W::AT, e, tmp);
+                    matMul(tmp, W::AT, eHat);
+                    storeTile(eHat, dst + ty * grid.tilesX + tx, xiStride);
+                }
+            }
+        }
+    }
+}
+
+template<int M>
+size_t getWorkspaceSize(int width, int height, int numInChannel, int numOutChannel,
+                        int zeroPad, int batchSize)
+{
+    constexpr size_t ALPHA2 = WinogradMatrix<M>::ALPHA * WinogradMatrix<M>::ALPHA;
+    const TileGrid<M> grid(width, height, zeroPad, batchSize);
+    // 重み、入力、出力(勾配では重み、入力、propError)の変換結果
+    return Workspace::getAlignedSize(ALPHA2 * numOutChannel * numInChannel)
+        + Workspace::getAlignedSize(ALPHA2 * numInChannel * grid.numTile)
+        + Workspace::getAlignedSize(ALPHA2 * numOutChannel * grid.numTile);
+}
+
+template<int M>
+void convolution(const float* input, int width, int height, int numInChannel,
+                 const float* weight, int numOutChannel, int zeroPad, float* output, int batchSize)
+{
+    constexpr int ALPHA2 = WinogradMatrix<M>::ALPHA * WinogradMatrix<M>::ALPHA;
+    const TileGrid<M> grid(width, height, zeroPad, batchSize);
+    const size_t uSize = static_cast<size_t>(numOutChannel) * numInChannel;
+    const size_t vSize = static_cast<size_t>(numInChannel) * grid.numTile;
+    const size_t mSize = static_cast<size_t>(numOutChannel) * grid.numTile;
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    float* U = scope.allocate(ALPHA2 * uSize);
+    float* V = scope.allocate(ALPHA2 * vSize);
+    float* Mat = scope.allocate(ALPHA2 * mSize);
+    transformWeight<M>(weight, numInChannel, numOutChannel, U);
+    transformInput<M>(input, width, height, numInChannel, zeroPad, grid, batchSize, V);
+
+    // 画素位置ごとに M(outCh x tile) = U(outCh x inCh) * V(inCh x tile)
+    std::fill(Mat, Mat + ALPHA2 * mSize, 0.0F);
+    for(int xi = 0; xi < ALPHA2; xi++){
+        sgemm(false, false, numOutChannel, grid.numTile, numInChannel,
+              U + xi * uSize, numInChannel, V + xi * vSize, grid.numTile,
+              Mat + xi * mSize, grid.numTile);
+    }
+    transformOutput<M>(Mat, numOutChannel, grid, batchSize, output);
+}
+
+template<int M>
+void weightGradient(const float* input, int width, int height, int numInChannel,
+                    const float* propError, int numOutChannel, int zeroPad, float* dEdw, int batchSize)
+{
+    using W = WinogradMatrix<M>;
+    constexpr int ALPHA = W::ALPHA;
+    constexpr int ALPHA2 = ALPHA * ALPHA;
+    const TileGrid<M> grid(width, height, zeroPad, batchSize);
+    const size_t zSize = static_cast<size_t>(numOutChannel) * numInChannel;
+    const size_t vSize = static_cast<size_t>(numInChannel) * grid.numTile;
+    const size_t eSize = static_cast<size_t>(numOutChannel) * grid.numTile;
+    WorkspaceScope scope(Workspace::getThreadLocal());
+    float* Z = scope.allocate(ALPHA2 * zSize);
+    float* V = scope.allocate(ALPHA2 * vSize);
+    float* E = scope.allocate(ALPHA2 * eSize);
+    transformInput<M>(input, width, height, numInChannel, zeroPad, grid, batchSize, V);
+    transformError<M>(propError, numOutChannel, grid, batchSize, E);
+
+    // 画素位置ごとに、全タイルについての和 Z(outCh x inCh) = E(outCh x tile) * V(inCh x tile)^T
+    std::fill(Z, Z + ALPHA2 * zSize, 0.0F);
+    for(int xi = 0; xi < ALPHA2; xi++){
+        sgemm(false, true, numOutChannel, numInChannel, grid.numTile,
+              E + xi * eSize, grid.numTile, V + xi * vSize, grid.numTile,
+              Z + xi * zSize, numInChannel);
+    }
+
+    // G^T Z Gで重みの形に戻す
+    for(int outCh = 0; outCh < numOutChannel; outCh++){
+        for(int inCh = 0; inCh < numInChannel; inCh++){
+            float z[ALPHA][ALPHA], tmp[3][ALPHA], dw[3][3];
+            gatherTile(Z + outCh * numInChannel + inCh, zSize, z);
+            matMulTransA(W::G, z, tmp);
+            matMul(tmp, W::G, dw);
+            float* dst = dEdw + (outCh * numInChannel + inCh) * 9;
+            for(int i = 0; i < 9; i++){
+                dst[i] += dw[i / 3][i % 3];
+            }
+        }
+    }
+}
+
+}
+
+void winogradConvolution(int tileSize, const float* input, int width, int height,
+                         int numInChannel, const float* weight, int numOutChannel,
+                         int zeroPad, float* output, int batchSize)
+{
+    assert(0 <= zeroPad && 0 < batchSize);
+    assert(WINOGRAD_WINDOW_SIZE <= width + 2 * zeroPad);
+    assert(WINOGRAD_WINDOW_SIZE <= height + 2 * zeroPad);
+    switch(tileSize) {
+    case 2:
+        convolution<2>(input, width, height, numInChannel, weight, numOutChannel,
+                       zeroPad, output, batchSize);
+        break;
+    case 4:
+        convolution<4>(input, width, height, numInChannel, weight, numOutChannel,
+                       zeroPad, output, batchSize);
+        break;
+    default:
+        assert(false);
+    }
+}
+
+void winogradWeightGradient(int tileSize, const float* input, int width, int height,
+                            int numInChannel, const float* propError, int numOutChannel,
+                            int zeroPad, float* dEdw, int batchSize)
+{
+    assert(0 <= zeroPad && 0 < batchSize);
+    switch(tileSize) {
+    case 2:
+        weightGradient<2>(input, width, height, numInChannel, propError, numOutChannel,
+                          zeroPad, dEdw, batchSize);
+        break;
+    case 4:
+        weightGradient<4>(input, width, height, numInChannel, propError, numOutChannel,
+                          zeroPad, dEdw, batchSize);
+        break;
+    default:
+        assert(false);
+    }
+}
+
+size_t getWinogradWorkspaceSize(int tileSize, int width, int height, int numInChannel,
+                                int numOutChannel, int zeroPad, int batchSize)
+{
+    switch(tileSize) {
+    case 2:
+        return getWorkspaceSize<2>(width, height, numInChannel, numOutChannel, zeroPad, batchSize);
+    case 4:
+        return getWorkspaceSize<4>(width, height, numInChannel, numOutChannel, zeroPad, batchSize);
+    default:
+        assert(false);
+        return 0;
+    }
+}
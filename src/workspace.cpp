@@ -0,0 +1,64 @@
+#include "workspace.h"
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+
+/* ======================
+    Workspace
+   ======================*/
+Workspace::Workspace()
+    : base(nullptr), capacity(0), offset(0), peak(0)
+{
+}
+
+void Workspace::reserve(size_t size)
+{
+    assert(offset == 0);
+    if(size <= capacity){
+        return;
+    }
+    // 先頭を64バイト境界に揃えるため、その分多めに確保する
+    buffer.clear();
+    buffer.shrink_to_fit();
+    buffer.resize(size + ALIGNMENT);
+    auto addr = reinterpret_cast<uintptr_t>(buffer.data());
+    const uintptr_t alignBytes = ALIGNMENT * sizeof(float);
+    base = reinterpret_cast<float*>((addr + alignBytes - 1) / alignBytes * alignBytes);
+    capacity = size;
+}
+
+float* Workspace::allocate(size_t size)
+{
+    const size_t alignedSize = getAlignedSize(size);
+    float* ptr;
+    if(offset + alignedSize <= capacity){
+        ptr = base + offset;
+    }else{
+        overflow.emplace_back(offset, std::vector<float>(alignedSize + ALIGNMENT));
+        auto addr = reinterpret_cast<uintptr_t>(overflow.back().second.data());
+        const uintptr_t alignBytes = ALIGNMENT * sizeof(float);
+        ptr = reinterpret_cast<float*>((addr + alignBytes - 1) / alignBytes * alignBytes);
+    }
+    offset += alignedSize;
+    peak = std::max(peak, offset);
+    return ptr;
+}
+
+void Workspace::release(size_t marker)
+{
+    assert(marker <= offset);
+    offset = marker;
+    while(!overflow.empty() && marker <= overflow.back().first){
+        overflow.pop_back();
+    }
+    // すべて解放されたら、最大使用量が収まるように確保し直す
+    if(offset == 0 && capacity < peak){
+        reserve(peak);
+    }
+}
+
+Workspace& Workspace::getThreadLocal()
+{
+    thread_local Workspace ws;
+    return ws;
+}
@@ -0,0 +1,8 @@
+#include <gtest/gtest.h>
+#include "cnn.h"
+#include <vector>
+
+class DeepNetworkTest : public ::testing::Test
+{
+};
+
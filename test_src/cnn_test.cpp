@@ -0,0 +1,901 @@
+#include "cnn_test.h"
+#include "inference_executor.h"
+#include "workspace.h"
+#include <random>
+#include <thread>
+#include <new>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// 計測中のスレッドでのヒープ確保の回数を数える
+thread_local bool countingAllocation = false;
+thread_local int numAllocation = 0;
+
+class AllocationCounter
+{
+public:
+    AllocationCounter(){numAllocation = 0; countingAllocation = true;}
+    ~AllocationCounter(){countingAllocation = false;}
+    int count() const{return numAllocation;}
+};
+}
+
+void* operator new(std::size_t size)
+{
+    if(countingAllocation){
+        numAllocation++;
+    }
+    if(void* ptr = std::malloc(size == 0 ? 1 : size)){
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace {
+// 重みの初期値はseedで固定し、テストの結果を再現させる
+void buildNetwork(DeepNetwork& net, uint32_t seed = 1)
+{
+    net.setSeed(seed);
+    net.setInputInfo(DataSize(6, 6), 2);
+    net.addLayer(std::make_shared<ConvolutionLayer>(1, 3, 3));
+    net.addLayer(std::make_shared<ReLULayer>());
+    net.addLayer(std::make_shared<PoolingLayer>(0, 2));
+    net.addLayer(std::make_shared<FullConnectLayer>(DataSize(4, 1)));
+    net.addLayer(std::make_shared<SoftmaxLayer>());
+}
+
+std::vector<float> randomVector(size_t size, std::mt19937& mt)
+{
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> vec(size);
+    for(auto& elem : vec){
+        elem = rd(mt);
+    }
+    return vec;
+}
+
+// 全結合層だけのネットワークに、乱数で作った線形な対応を学習させる
+constexpr int LINEAR_TASK_INPUT_SIZE = 32;
+constexpr int LINEAR_TASK_OUTPUT_SIZE = 4;
+
+void buildLinearTaskNetwork(DeepNetwork& net)
+{
+    net.setSeed(1);
+    net.setInputInfo(DataSize(LINEAR_TASK_INPUT_SIZE, 1), 1);
+    net.addLayer(std::make_shared<FullConnectLayer>(DataSize(64, 1)));
+    net.addLayer(std::make_shared<SigmoidLayer>());
+    net.addLayer(std::make_shared<FullConnectLayer>(DataSize(LINEAR_TASK_OUTPUT_SIZE, 1)));
+    net.addLayer(std::make_shared<SigmoidLayer>());
+}
+
+// 正解は、乱数の行列と入力の積の符号に応じて0.9か0.1にする
+void makeLinearTask(int numSample, std::mt19937& mt, std::vector<std::vector<float>>& inputs,
+                    std::vector<std::vector<float>>& correctOutputs)
+{
+    auto teacher = randomVector(LINEAR_TASK_INPUT_SIZE * LINEAR_TASK_OUTPUT_SIZE, mt);
+    for(int i = 0; i < numSample; i++){
+        inputs.emplace_back(randomVector(LINEAR_TASK_INPUT_SIZE, mt));
+        correctOutputs.emplace_back(LINEAR_TASK_OUTPUT_SIZE);
+        for(int out = 0; out < LINEAR_TASK_OUTPUT_SIZE; out++){
+            float sum = 0;
+            for(int in = 0; in < LINEAR_TASK_INPUT_SIZE; in++){
+                sum += teacher.at(out * LINEAR_TASK_INPUT_SIZE + in) * inputs.back().at(in);
+            }
+            correctOutputs.back().at(out) = 0 < sum ? 0.9 : 0.1;
+        }
+    }
+}
+
+// サンプルあたりの二乗誤差
+float calcMeanSquaredError(DeepNetwork& net, const std::vector<std::vector<float>>& inputs,
+                          const std::vector<std::vector<float>>& correctOutputs)
+{
+    float error = 0;
+    for(size_t i = 0; i < inputs.size(); i++){
+        const auto& output = net.infer(inputs.at(i));
+        for(size_t out = 0; out < output.size(); out++){
+            error += (output.at(out) - correctOutputs.at(i).at(out))
+                   * (output.at(out) - correctOutputs.at(i).at(out));
+        }
+    }
+    return error / inputs.size();
+}
+
+// conv -> ReLUを重ね、途中にconv -> ReLU -> poolの融合を含むネットワーク
+constexpr int CHECKPOINT_NUM_LAYER = 14;
+
+void buildCheckpointNetwork(DeepNetwork& net)
+{
+    net.setSeed(1);
+    net.setInputInfo(DataSize(12, 12), 2);
+    for(int i = 0; i < 3; i++){
+        net.addLayer(std::make_shared<ConvolutionLayer>(1, 3, 4));
+        net.addLayer(std::make_shared<ReLULayer>());
+    }
+    for(int i = 0; i < 2; i++){
+        net.addLayer(std::make_shared<ConvolutionLayer>(1, 3, 4));
+        net.addLayer(std::make_shared<ReLULayer>());
+        net.addLayer(std::make_shared<PoolingLayer>(0, 2, 2));
+    }
+    net.addLayer(std::make_shared<FullConnectLayer>(DataSize(4, 1)));
+    net.addLayer(std::make_shared<SigmoidLayer>());
+}
+
+const std::vector<float> CHECKPOINT_TASK_CORRECT_OUTPUT = {0, 1, 0, 1};
+
+// 4サンプルと、その先頭2つを並べたバッチ
+void makeCheckpointTask(std::mt19937& mt, std::vector<std::vector<float>>& inputs,
+                        std::vector<float>& batchInput, std::vector<float>& batchCorrectOutput)
+{
+    for(int i = 0; i < 4; i++){
+        inputs.emplace_back(randomVector(12 * 12 * 2, mt));
+    }
+    batchInput = inputs.at(0);
+    batchInput.insert(batchInput.end(), inputs.at(1).begin(), inputs.at(1).end());
+    batchCorrectOutput = CHECKPOINT_TASK_CORRECT_OUTPUT;
+    batchCorrectOutput.insert(batchCorrectOutput.end(), CHECKPOINT_TASK_CORRECT_OUTPUT.begin(),
+                              CHECKPOINT_TASK_CORRECT_OUTPUT.end());
+}
+
+// 1サンプルずつ学習した後、バッチで2回学習する
+// 作業領域が足りていれば、別のスレッドで一度確保した後はヒープ確保をしない
+void trainCheckpointTask(DeepNetwork& net, const std::vector<std::vector<float>>& inputs,
+                         const std::vector<float>& batchInput, const std::vector<float>& batchCorrectOutput)
+{
+    std::thread([&](){
+        for(const auto& input : inputs){
+            net.backPropagate(input, CHECKPOINT_TASK_CORRECT_OUTPUT);
+        }
+        net.backPropagateBatch(batchInput, batchCorrectOutput, 2);
+        AllocationCounter counter;
+        net.backPropagateBatch(batchInput, batchCorrectOutput, 2);
+        EXPECT_EQ(0, counter.count());
+    }).join();
+}
+}
+
+TEST_F(DeepNetworkTest, feedInputBatch_matches_feedInput)
+{
+    constexpr int BATCH_SIZE = 4;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net;
+    buildNetwork(net);
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE * BATCH_SIZE, mt);
+
+    auto batchOutputs = net.feedInputBatch(input, BATCH_SIZE);
+    for(int n = 0; n < BATCH_SIZE; n++){
+        std::vector<float> sample(std::begin(input) + n * INPUT_SIZE,
+                                  std::begin(input) + (n + 1) * INPUT_SIZE);
+        auto outputs = net.feedInput(sample);
+        ASSERT_EQ(outputs.size(), batchOutputs.size());
+        const auto& last = outputs.back();
+        for(size_t i = 0; i < last.size(); i++){
+            EXPECT_NEAR(last.at(i), batchOutputs.back().at(n * last.size() + i), 1e-5);
+        }
+    }
+}
+
+TEST_F(DeepNetworkTest, feedInput_uses_compiled_algorithm)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net;
+    net.setSeed(1);
+    net.setInputInfo(DataSize(6, 6), 2);
+    auto conv = std::make_shared<ConvolutionLayer>(1, 3, 3, 1, ConvAlgorithm::GEMM);
+    net.addLayer(conv);
+    net.addLayer(std::make_shared<ReLULayer>());
+    ASSERT_TRUE(net.compile());
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE, mt);
+    const auto gemmOutput = net.feedInput(input).at(1);
+
+    // 計算方法はcompileで実行計画に固めるので、compileし直すまでは変わらない
+    conv->setAlgorithm(ConvAlgorithm::FFT);
+    EXPECT_EQ(gemmOutput, net.feedInput(input).at(1));
+    ASSERT_TRUE(net.compile());
+    const auto fftOutput = net.feedInput(input).at(1);
+    EXPECT_EQ(conv->apply(input), fftOutput);
+    ASSERT_EQ(gemmOutput.size(), fftOutput.size());
+    for(size_t i = 0; i < gemmOutput.size(); i++){
+        EXPECT_NEAR(gemmOutput.at(i), fftOutput.at(i), 1e-4);
+    }
+
+    // Hogwildでは計算方法が変わるので、compileし直す
+    ASSERT_TRUE(net.setUpdateMode(UpdateMode::HOGWILD));
+    EXPECT_FALSE(net.isCompiled());
+}
+
+TEST_F(DeepNetworkTest, backPropagateBatch_reduces_error)
+{
+    constexpr int BATCH_SIZE = 4;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net(BATCH_SIZE);
+    buildNetwork(net);
+    net.setLossFunction(LossFunction::CRS_ENT);
+    // 初期値の重みでは出力が大きく、既定の学習率だと1ステップで行き過ぎることがある
+    OptimizerConfig config;
+    config.learningRate = 0.001F;
+    ASSERT_TRUE(net.setOptimizer(config));
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE * BATCH_SIZE, mt);
+    std::vector<float> correctOutput(4 * BATCH_SIZE);
+    for(int n = 0; n < BATCH_SIZE; n++){
+        correctOutput.at(n * 4 + n % 4) = 1;
+    }
+
+    // 最小化しているクロスエントロピーそのもので比べる
+    auto calcError = [&](){
+        auto output = net.feedInputBatch(input, BATCH_SIZE).back();
+        float error = 0;
+        for(size_t i = 0; i < output.size(); i++){
+            error -= correctOutput.at(i) * std::log(std::max(output.at(i), 1e-30F));
+        }
+        return error;
+    };
+    auto before = calcError();
+    for(int i = 0; i < 10; i++){
+        net.backPropagateBatch(input, correctOutput, BATCH_SIZE);
+    }
+    EXPECT_LT(calcError(), before);
+}
+
+TEST_F(DeepNetworkTest, backPropagateParallel_matches_sequential)
+{
+    constexpr int NUM_SAMPLE = 12;
+    constexpr int MINIBATCH_SIZE = 5;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork parallelNet(MINIBATCH_SIZE), sequentialNet(MINIBATCH_SIZE);
+    buildNetwork(parallelNet);
+    buildNetwork(sequentialNet);
+    parallelNet.saveWeight("parallel_test_weight");
+    sequentialNet.loadWeight("parallel_test_weight");
+    parallelNet.setNumThread(4);
+
+    std::mt19937 mt(1);
+    std::vector<std::vector<float>> inputs, correctOutputs;
+    for(int i = 0; i < NUM_SAMPLE; i++){
+        inputs.emplace_back(randomVector(INPUT_SIZE, mt));
+        correctOutputs.emplace_back(4);
+        correctOutputs.back().at(i % 4) = 1;
+    }
+
+    parallelNet.backPropagateParallel(inputs, correctOutputs);
+    for(int i = 0; i < NUM_SAMPLE; i++){
+        sequentialNet.backPropagate(inputs.at(i), correctOutputs.at(i));
+    }
+    parallelNet.flush();
+    sequentialNet.flush();
+
+    for(const auto& input : inputs){
+        auto expected = sequentialNet.feedInput(input).back();
+        auto actual = parallelNet.feedInput(input).back();
+        for(size_t i = 0; i < expected.size(); i++){
+            EXPECT_NEAR(expected.at(i), actual.at(i), 1e-3);
+        }
+    }
+}
+
+TEST_F(DeepNetworkTest, hogwild_single_thread_matches_minibatch)
+{
+    // 1スレッドなら、ミニバッチの大きさ1で毎回flushするのと同じ更新になる
+    // (Hogwildは誤差の来ない行を減衰させないが、softmaxの誤差はすべての行に届く)
+    constexpr int NUM_SAMPLE = 12;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork hogwildNet, minibatchNet;
+    buildNetwork(hogwildNet);
+    buildNetwork(minibatchNet);
+    ASSERT_TRUE(minibatchNet.saveWeightBinary("hogwild_test_weight"));
+    ASSERT_TRUE(hogwildNet.setUpdateMode(UpdateMode::HOGWILD));
+    // HOGWILDでもmmapした重みを書き換えずに学習できる
+    ASSERT_TRUE(hogwildNet.loadWeightBinary("hogwild_test_weight"));
+    EXPECT_FALSE(hogwildNet.setWeightType(TensorType::BFLOAT16));
+
+    std::mt19937 mt(1);
+    std::vector<std::vector<float>> inputs, correctOutputs;
+    for(int i = 0; i < NUM_SAMPLE; i++){
+        inputs.emplace_back(randomVector(INPUT_SIZE, mt));
+        correctOutputs.emplace_back(4);
+        correctOutputs.back().at(i % 4) = 1;
+    }
+    for(int i = 0; i < NUM_SAMPLE; i++){
+        hogwildNet.backPropagate(inputs.at(i), correctOutputs.at(i));
+        minibatchNet.backPropagate(inputs.at(i), correctOutputs.at(i));
+    }
+
+    for(const auto& input : inputs){
+        auto expected = minibatchNet.feedInput(input).back();
+        auto actual = hogwildNet.feedInput(input).back();
+        for(size_t i = 0; i < expected.size(); i++){
+            EXPECT_NEAR(expected.at(i), actual.at(i), 1e-5);
+        }
+    }
+}
+
+TEST_F(DeepNetworkTest, hogwild_converges_like_minibatch)
+{
+    constexpr int NUM_SAMPLE = 256;
+    constexpr int NUM_EPOCH = 20;
+    constexpr int NUM_THREAD = 4;
+    DeepNetwork hogwildNet(8), minibatchNet(8);
+    buildLinearTaskNetwork(hogwildNet);
+    buildLinearTaskNetwork(minibatchNet);
+    ASSERT_TRUE(minibatchNet.saveWeightBinary("hogwild_test_weight"));
+    ASSERT_TRUE(hogwildNet.loadWeightBinary("hogwild_test_weight"));
+    ASSERT_TRUE(hogwildNet.setUpdateMode(UpdateMode::HOGWILD));
+    hogwildNet.setNumThread(NUM_THREAD);
+    minibatchNet.setNumThread(NUM_THREAD);
+
+    std::mt19937 mt(1);
+    std::vector<std::vector<float>> inputs, correctOutputs;
+    makeLinearTask(NUM_SAMPLE, mt, inputs, correctOutputs);
+
+    const float initialError = calcMeanSquaredError(minibatchNet, inputs, correctOutputs);
+    for(int epoch = 0; epoch < NUM_EPOCH; epoch++){
+        hogwildNet.backPropagateParallel(inputs, correctOutputs);
+        minibatchNet.backPropagateParallel(inputs, correctOutputs);
+    }
+    const float hogwildError = calcMeanSquaredError(hogwildNet, inputs, correctOutputs);
+    const float minibatchError = calcMeanSquaredError(minibatchNet, inputs, correctOutputs);
+    EXPECT_LT(minibatchError, initialError * 0.5);
+    // 更新の衝突があっても、ロックを取る場合と同程度まで収束する
+    EXPECT_LT(hogwildError, initialError * 0.5);
+    EXPECT_LT(hogwildError, minibatchError * 1.5);
+}
+
+TEST_F(DeepNetworkTest, momentum_and_adam_converge_faster_than_sgd)
+{
+    constexpr int NUM_SAMPLE = 256;
+    constexpr int NUM_EPOCH = 5;
+    DeepNetwork sgdNet(8), momentumNet(8), adamNet(8);
+    buildLinearTaskNetwork(sgdNet);
+    buildLinearTaskNetwork(momentumNet);
+    buildLinearTaskNetwork(adamNet);
+    ASSERT_TRUE(sgdNet.saveWeightBinary("optimizer_test_weight"));
+    ASSERT_TRUE(momentumNet.loadWeightBinary("optimizer_test_weight"));
+    ASSERT_TRUE(adamNet.loadWeightBinary("optimizer_test_weight"));
+
+    OptimizerConfig config;
+    config.type = OptimizerType::MOMENTUM;
+    config.momentum = 1.0F;
+    EXPECT_FALSE(momentumNet.setOptimizer(config));
+    config.momentum = 0.9F;
+    ASSERT_TRUE(momentumNet.setOptimizer(config));
+    config.type = OptimizerType::ADAM;
+    config.learningRate = 0.01F;
+    ASSERT_TRUE(adamNet.setOptimizer(config));
+    EXPECT_EQ(OptimizerType::ADAM, adamNet.getOptimizer().type);
+
+    std::mt19937 mt(1);
+    std::vector<std::vector<float>> inputs, correctOutputs;
+    makeLinearTask(NUM_SAMPLE, mt, inputs, correctOutputs);
+
+    const float initialError = calcMeanSquaredError(sgdNet, inputs, correctOutputs);
+    for(int epoch = 0; epoch < NUM_EPOCH; epoch++){
+        for(int i = 0; i < NUM_SAMPLE; i++){
+            for(auto net : {&sgdNet, &momentumNet, &adamNet}){
+                net->backPropagate(inputs.at(i), correctOutputs.at(i));
+            }
+        }
+    }
+    const float sgdError = calcMeanSquaredError(sgdNet, inputs, correctOutputs);
+    const float momentumError = calcMeanSquaredError(momentumNet, inputs, correctOutputs);
+    const float adamError = calcMeanSquaredError(adamNet, inputs, correctOutputs);
+    EXPECT_LT(sgdError, initialError);
+    // 同じエポック数で、SGDの半分以下まで誤差が下がる
+    EXPECT_LT(momentumError, sgdError * 0.5);
+    EXPECT_LT(adamError, sgdError * 0.5);
+}
+
+TEST_F(DeepNetworkTest, infer_matches_feedInput_without_allocation)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net;
+    buildNetwork(net);
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE, mt);
+
+    auto expected = net.feedInput(input).back();
+    // 1回目で作業領域が確保される
+    net.infer(input);
+
+    {
+        AllocationCounter counter;
+        net.feedInput(input);
+        EXPECT_LT(0, counter.count());
+    }
+    AllocationCounter counter;
+    const auto& output = net.infer(input);
+    EXPECT_EQ(0, counter.count());
+
+    ASSERT_EQ(expected.size(), output.size());
+    for(size_t i = 0; i < expected.size(); i++){
+        EXPECT_EQ(expected.at(i), output.at(i));
+    }
+}
+
+TEST_F(DeepNetworkTest, inferBatch_matches_infer_without_allocation)
+{
+    constexpr int BATCH_SIZE = 5;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net;
+    buildNetwork(net);
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE * BATCH_SIZE, mt);
+    const int outputSize = net.getOutputDataSize();
+    std::vector<float> output(outputSize * BATCH_SIZE);
+    // 1回目で作業領域が確保される
+    net.inferBatch(input.data(), BATCH_SIZE, output.data());
+    {
+        AllocationCounter counter;
+        net.inferBatch(input.data(), BATCH_SIZE, output.data());
+        EXPECT_EQ(0, counter.count());
+    }
+
+    for(int n = 0; n < BATCH_SIZE; n++){
+        std::vector<float> sample(std::begin(input) + n * INPUT_SIZE,
+                                  std::begin(input) + (n + 1) * INPUT_SIZE);
+        const auto& expected = net.infer(sample);
+        for(int i = 0; i < outputSize; i++){
+            EXPECT_NEAR(expected.at(i), output.at(n * outputSize + i), 1e-5);
+        }
+    }
+}
+
+TEST_F(DeepNetworkTest, backPropagate_without_allocation)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net(2);
+    buildNetwork(net);
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE, mt);
+    std::vector<float> correctOutput = {0, 1, 0, 0};
+
+    // 1ミニバッチ分回せば、作業領域と勾配の蓄積先が確保される
+    net.backPropagate(input, correctOutput);
+    net.backPropagate(input, correctOutput);
+
+    AllocationCounter counter;
+    net.backPropagate(input, correctOutput);
+    net.backPropagate(input, correctOutput);
+    EXPECT_EQ(0, counter.count());
+}
+
+TEST_F(DeepNetworkTest, checkpoint_matches_full_storage)
+{
+    DeepNetwork fullNet(2), checkpointNet(2), shortNet(2);
+    buildCheckpointNetwork(fullNet);
+    buildCheckpointNetwork(checkpointNet);
+    buildCheckpointNetwork(shortNet);
+    ASSERT_TRUE(fullNet.saveWeightBinary("checkpoint_test_weight"));
+    ASSERT_TRUE(checkpointNet.loadWeightBinary("checkpoint_test_weight"));
+    ASSERT_TRUE(shortNet.loadWeightBinary("checkpoint_test_weight"));
+    EXPECT_FALSE(checkpointNet.setCheckpointMode(true, -1));
+    ASSERT_TRUE(checkpointNet.setCheckpointMode(true));
+    ASSERT_TRUE(checkpointNet.getCheckpointMode());
+    // 1ステップずつ区切る(すべてのステップの出力が区間の境目になる)
+    ASSERT_TRUE(shortNet.setCheckpointMode(true, 1));
+    for(auto net : {&fullNet, &checkpointNet, &shortNet}){
+        ASSERT_TRUE(net->compile());
+    }
+    // 保持する出力が減るので、作業領域が小さくなる
+    EXPECT_LT(checkpointNet.getTrainWorkspaceSize(2), fullNet.getTrainWorkspaceSize(2));
+
+    std::mt19937 mt(1);
+    std::vector<std::vector<float>> inputs;
+    std::vector<float> batchInput, batchCorrectOutput;
+    makeCheckpointTask(mt, inputs, batchInput, batchCorrectOutput);
+    for(auto net : {&fullNet, &checkpointNet, &shortNet}){
+        trainCheckpointTask(*net, inputs, batchInput, batchCorrectOutput);
+    }
+
+    // 同じ計算をやり直すだけなので、重みの更新は一致する
+    for(const auto& input : inputs){
+        auto expected = fullNet.feedInput(input).back();
+        auto actual = checkpointNet.feedInput(input).back();
+        auto shortActual = shortNet.feedInput(input).back();
+        ASSERT_EQ(expected.size(), actual.size());
+        for(size_t i = 0; i < expected.size(); i++){
+            EXPECT_FLOAT_EQ(expected.at(i), actual.at(i));
+            EXPECT_FLOAT_EQ(expected.at(i), shortActual.at(i));
+        }
+    }
+
+    // やり直した順伝播は、順伝播の回数に数えず別に記録する
+    shortNet.setProfileMode(true);
+    shortNet.backPropagate(inputs.at(0), CHECKPOINT_TASK_CORRECT_OUTPUT);
+    const auto profiles = shortNet.getProfile();
+    for(size_t i = 0; i < profiles.size(); i++){
+        EXPECT_EQ(1U, profiles.at(i).numForward);
+        EXPECT_EQ(1U, profiles.at(i).numBackward);
+    }
+    // 最後の区間以外はやり直す
+    EXPECT_EQ(1U, profiles.front().numRecompute);
+    EXPECT_EQ(0U, profiles.back().numRecompute);
+}
+
+TEST_F(DeepNetworkTest, checkpoint_with_half_activation_matches_full_storage)
+{
+    // 16bitの出力と組み合わせると、区間の入力も丸めて保持する
+    DeepNetwork fullNet(2), halfNet(2);
+    buildCheckpointNetwork(fullNet);
+    buildCheckpointNetwork(halfNet);
+    ASSERT_TRUE(halfNet.setActivationType(TensorType::FLOAT16));
+    ASSERT_TRUE(halfNet.setCheckpointMode(true));
+
+    std::mt19937 mt(1);
+    std::vector<std::vector<float>> inputs;
+    std::vector<float> batchInput, batchCorrectOutput;
+    makeCheckpointTask(mt, inputs, batchInput, batchCorrectOutput);
+    for(auto net : {&fullNet, &halfNet}){
+        trainCheckpointTask(*net, inputs, batchInput, batchCorrectOutput);
+    }
+
+    // 保持した出力の丸め(FLOAT16は相対2^-11)は、ステップごとに各層の逆伝播を通して重みに積もる
+    ASSERT_EQ(static_cast<size_t>(CHECKPOINT_NUM_LAYER), fullNet.getProfile().size());
+    const int numStep = inputs.size() + 2;
+    const float tolerance = numStep * CHECKPOINT_NUM_LAYER * std::ldexp(1.0F, -11);
+    for(const auto& input : inputs){
+        auto expected = fullNet.feedInput(input).back();
+        auto actual = halfNet.feedInput(input).back();
+        ASSERT_EQ(expected.size(), actual.size());
+        for(size_t i = 0; i < expected.size(); i++){
+            EXPECT_NEAR(expected.at(i), actual.at(i), tolerance);
+        }
+    }
+}
+
+TEST_F(DeepNetworkTest, backPropagate_fused_matches_layerwise)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net, refNet;
+    buildNetwork(net);
+    refNet.setInputInfo(DataSize(6, 6), 2);
+    std::vector<std::shared_ptr<Layer>> refLayers = {
+        std::make_shared<ConvolutionLayer>(1, 3, 3),
+        std::make_shared<ReLULayer>(),
+        std::make_shared<PoolingLayer>(0, 2),
+        std::make_shared<FullConnectLayer>(DataSize(4, 1)),
+        std::make_shared<SoftmaxLayer>()
+    };
+    for(const auto& layer : refLayers){
+        refNet.addLayer(layer);
+    }
+    // 保存時に丸められるので、両方とも読み込んだ重みを使う
+    net.saveWeight("fused_test_weight");
+    net.loadWeight("fused_test_weight");
+    refNet.loadWeight("fused_test_weight");
+
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE, mt);
+    std::vector<float> correctOutput = {0, 1, 0, 0};
+    net.backPropagate(input, correctOutput);
+
+    // 融合せずに1層ずつ逆伝播する
+    auto outputs = refNet.feedInput(input);
+    std::vector<float> propError(correctOutput.size());
+    for(size_t i = 0; i < propError.size(); i++){
+        propError.at(i) = outputs.back().at(i) - correctOutput.at(i);
+    }
+    for(int i = refLayers.size() - 1; 0 <= i; i--){
+        propError = refLayers.at(i)->updateWeight(outputs.at(i), outputs.at(i + 1), propError);
+    }
+    refNet.flush();
+
+    auto output = net.feedInput(input).back();
+    auto refOutput = refNet.feedInput(input).back();
+    for(size_t i = 0; i < output.size(); i++){
+        EXPECT_EQ(refOutput.at(i), output.at(i));
+    }
+}
+
+TEST_F(DeepNetworkTest, fused_step_does_not_store_conv_output)
+{
+    constexpr int BATCH_SIZE = 2;
+    DeepNetwork net(BATCH_SIZE);
+    net.setInputInfo(DataSize(6, 6), 2);
+    std::vector<std::shared_ptr<Layer>> layers = {
+        std::make_shared<ConvolutionLayer>(1, 3, 3),
+        std::make_shared<ReLULayer>(),
+        std::make_shared<PoolingLayer>(0, 2),
+        std::make_shared<FullConnectLayer>(DataSize(4, 1)),
+        std::make_shared<SoftmaxLayer>()
+    };
+    for(const auto& layer : layers){
+        net.addLayer(layer);
+    }
+    ASSERT_TRUE(net.compile());
+
+    // 畳み込みの出力以外の各層の出力、poolのargmax、誤差2つ分、各層の一時領域
+    size_t activationSize = 0;
+    size_t maxDataSize = net.getInputDataSize();
+    size_t layerWorkspaceSize = 0;
+    for(size_t i = 0; i < layers.size(); i++){
+        const size_t outputSize = layers.at(i)->getOutputDataSize();
+        if(i != 0){
+            activationSize += outputSize;
+        }
+        maxDataSize = std::max(maxDataSize, outputSize);
+        layerWorkspaceSize = std::max(layerWorkspaceSize, layers.at(i)->getWorkspaceSize(BATCH_SIZE));
+    }
+    const size_t expected = Workspace::getAlignedSize(activationSize * BATCH_SIZE)
+        + Workspace::getAlignedSize(layers.at(2)->getOutputDataSize() * BATCH_SIZE)
+        + 2 * Workspace::getAlignedSize(maxDataSize * BATCH_SIZE)
+        + layerWorkspaceSize;
+    EXPECT_EQ(expected, net.getTrainWorkspaceSize(BATCH_SIZE));
+}
+
+TEST_F(DeepNetworkTest, saveWeightBinary_and_loadWeightBinary)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net, loadedNet;
+    buildNetwork(net);
+    buildNetwork(loadedNet);
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE, mt);
+    std::vector<float> correctOutput = {0, 1, 0, 0};
+
+    ASSERT_TRUE(net.saveWeightBinary("binary_test_weight"));
+    ASSERT_TRUE(loadedNet.loadWeightBinary("binary_test_weight"));
+    // 値は丸められずに読み込まれる
+    auto expected = net.feedInput(input).back();
+    auto output = loadedNet.feedInput(input).back();
+    for(size_t i = 0; i < expected.size(); i++){
+        EXPECT_EQ(expected.at(i), output.at(i));
+    }
+
+    // ファイル上の重みを参照している層も学習できる
+    net.backPropagate(input, correctOutput);
+    loadedNet.backPropagate(input, correctOutput);
+    expected = net.feedInput(input).back();
+    output = loadedNet.feedInput(input).back();
+    for(size_t i = 0; i < expected.size(); i++){
+        EXPECT_EQ(expected.at(i), output.at(i));
+    }
+
+    // 形の合わないネットワークには読み込めない
+    DeepNetwork otherNet;
+    otherNet.setInputInfo(DataSize(6, 6), 2);
+    otherNet.addLayer(std::make_shared<ConvolutionLayer>(1, 3, 2));
+    EXPECT_FALSE(otherNet.loadWeightBinary("binary_test_weight"));
+}
+
+TEST_F(DeepNetworkTest, executors_share_loaded_weights)
+{
+    constexpr int NUM_EXECUTOR = 4;
+    constexpr int BATCH_SIZE = 3;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net;
+    buildNetwork(net);
+    ASSERT_TRUE(net.saveWeightBinary("shared_test_weight"));
+
+    // 重みは1回だけ読み込み、executorで共有する
+    auto model = std::make_shared<DeepNetwork>();
+    buildNetwork(*model);
+    ASSERT_TRUE(model->loadWeightBinary("shared_test_weight"));
+    ASSERT_TRUE(model->compile());
+    std::shared_ptr<const DeepNetwork> sharedModel = model;
+    model.reset();
+    std::vector<std::unique_ptr<InferenceExecutor>> executors;
+    for(int i = 0; i < NUM_EXECUTOR; i++){
+        executors.emplace_back(std::make_unique<InferenceExecutor>(sharedModel));
+    }
+    EXPECT_EQ(NUM_EXECUTOR + 1, sharedModel.use_count());
+
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE * BATCH_SIZE * NUM_EXECUTOR, mt);
+    const int outputSize = net.getOutputDataSize();
+    std::vector<float> output(outputSize * BATCH_SIZE * NUM_EXECUTOR);
+    std::vector<float> batchOutput(output.size());
+    std::vector<int> numAllocations(NUM_EXECUTOR);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < NUM_EXECUTOR; t++){
+        threads.emplace_back([&, t](){
+            auto& executor = *executors.at(t);
+            const float* threadInput = input.data() + t * BATCH_SIZE * INPUT_SIZE;
+            std::vector<float> sample(INPUT_SIZE);
+            // 1回目で層の作業領域が確保される
+            std::copy(threadInput, threadInput + INPUT_SIZE, std::begin(sample));
+            executor.infer(sample);
+            AllocationCounter counter;
+            for(int n = 0; n < BATCH_SIZE; n++){
+                std::copy(threadInput + n * INPUT_SIZE, threadInput + (n + 1) * INPUT_SIZE, std::begin(sample));
+                const auto& result = executor.infer(sample);
+                std::copy(std::begin(result), std::end(result),
+                          std::begin(output) + (t * BATCH_SIZE + n) * outputSize);
+            }
+            numAllocations.at(t) = counter.count();
+            executor.inferBatch(threadInput, BATCH_SIZE, batchOutput.data() + t * BATCH_SIZE * outputSize);
+        });
+    }
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    for(int n = 0; n < BATCH_SIZE * NUM_EXECUTOR; n++){
+        std::vector<float> sample(std::begin(input) + n * INPUT_SIZE,
+                                  std::begin(input) + (n + 1) * INPUT_SIZE);
+        const auto& expected = net.infer(sample);
+        for(int i = 0; i < outputSize; i++){
+            EXPECT_EQ(expected.at(i), output.at(n * outputSize + i));
+            EXPECT_NEAR(expected.at(i), batchOutput.at(n * outputSize + i), 1e-5);
+        }
+    }
+    for(int numAllocation : numAllocations){
+        EXPECT_EQ(0, numAllocation);
+    }
+}
+
+TEST_F(DeepNetworkTest, quantize_and_infer_int8)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net, loadedNet;
+    buildNetwork(net);
+    buildNetwork(loadedNet);
+    std::mt19937 mt(1);
+    std::vector<std::vector<float>> calibrationInputs;
+    for(int i = 0; i < 8; i++){
+        calibrationInputs.emplace_back(randomVector(INPUT_SIZE, mt));
+    }
+    // 誤差が丸めの分に収まるのは、キャリブレーションで調べた範囲の入力だけ
+    // (範囲を超えた活性は飽和する)ので、キャリブレーションに含めた入力で確かめる
+    const auto input = calibrationInputs.back();
+    const auto expected = net.infer(input);
+
+    ASSERT_TRUE(net.quantize(calibrationInputs));
+    EXPECT_EQ(InferenceMode::INT8, net.getInferenceMode());
+    const auto output = net.infer(input);
+    ASSERT_EQ(expected.size(), output.size());
+    for(size_t i = 0; i < output.size(); i++){
+        EXPECT_NEAR(expected.at(i), output.at(i), 0.05);
+    }
+    EXPECT_EQ(std::max_element(expected.begin(), expected.end()) - expected.begin(),
+              std::max_element(output.begin(), output.end()) - output.begin());
+
+    // 量子化した重みも保存され、読み込んだネットワークはINT8モードで同じ値を返す
+    ASSERT_TRUE(net.saveWeightBinary("quantized_test_weight"));
+    ASSERT_TRUE(loadedNet.loadWeightBinary("quantized_test_weight"));
+    EXPECT_EQ(InferenceMode::INT8, loadedNet.getInferenceMode());
+    EXPECT_EQ(output, loadedNet.infer(input));
+
+    net.setInferenceMode(InferenceMode::FLOAT32);
+    EXPECT_EQ(expected, net.infer(input));
+}
+
+TEST_F(DeepNetworkTest, half_precision_weight_and_activation)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net(2), halfNet(2), loadedNet;
+    buildNetwork(net);
+    buildNetwork(halfNet);
+    buildNetwork(loadedNet);
+    ASSERT_TRUE(net.saveWeightBinary("half_test_weight"));
+    ASSERT_TRUE(halfNet.loadWeightBinary("half_test_weight"));
+    EXPECT_FALSE(halfNet.setActivationType(TensorType::INT8));
+    ASSERT_TRUE(halfNet.setWeightType(TensorType::FLOAT16));
+    ASSERT_TRUE(halfNet.setActivationType(TensorType::BFLOAT16));
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE, mt);
+    std::vector<float> correctOutput = {0, 1, 0, 0};
+
+    // 16bitの丸めの誤差は、学習を進めても小さいまま
+    for(int i = 0; i < 10; i++){
+        net.backPropagate(input, correctOutput);
+        halfNet.backPropagate(input, correctOutput);
+    }
+    const auto expected = net.infer(input);
+    const auto output = halfNet.infer(input);
+    for(size_t i = 0; i < expected.size(); i++){
+        EXPECT_NEAR(expected.at(i), output.at(i), 0.01);
+    }
+
+    // 16bitで保持していても、学習中にヒープ確保をしない
+    {
+        AllocationCounter counter;
+        halfNet.backPropagate(input, correctOutput);
+        halfNet.backPropagate(input, correctOutput);
+        EXPECT_EQ(0, counter.count());
+    }
+
+    // 16bitの重みも保存され、読み込んだネットワークは同じ重みで推論する
+    ASSERT_TRUE(halfNet.saveWeightBinary("half_test_weight"));
+    ASSERT_TRUE(loadedNet.loadWeightBinary("half_test_weight"));
+    EXPECT_EQ(halfNet.infer(input), loadedNet.infer(input));
+    ASSERT_TRUE(halfNet.setWeightType(TensorType::FLOAT32));
+    EXPECT_NE(halfNet.infer(input), loadedNet.infer(input));
+}
+
+TEST_F(DeepNetworkTest, compile_checks_shapes)
+{
+    DeepNetwork net;
+    buildNetwork(net);
+    EXPECT_TRUE(net.compile());
+    EXPECT_TRUE(net.isCompiled());
+
+    // 層を追加したり入力を変えたりすると、compileし直しになる
+    net.addLayer(std::make_shared<SigmoidLayer>());
+    EXPECT_FALSE(net.isCompiled());
+    EXPECT_TRUE(net.compile());
+    // 追加済みの層の形は入力に追従しないので、compileで捕まえる
+    net.setInputInfo(DataSize(8, 8), 2);
+    EXPECT_FALSE(net.compile());
+
+    // 入力より大きな窓
+    DeepNetwork largeWindowNet;
+    largeWindowNet.setInputInfo(DataSize(4, 4), 1);
+    largeWindowNet.addLayer(std::make_shared<ConvolutionLayer>(0, 5, 2));
+    EXPECT_FALSE(largeWindowNet.compile());
+
+    // softmaxの入力は1チャネル
+    DeepNetwork softmaxNet;
+    softmaxNet.setInputInfo(DataSize(4, 4), 2);
+    softmaxNet.addLayer(std::make_shared<SoftmaxLayer>());
+    EXPECT_FALSE(softmaxNet.compile());
+
+    // sigmoidは要素ごとなので、チャネル数を問わない
+    DeepNetwork sigmoidNet;
+    sigmoidNet.setInputInfo(DataSize(4, 4), 2);
+    sigmoidNet.addLayer(std::make_shared<ConvolutionLayer>(1, 3, 3));
+    sigmoidNet.addLayer(std::make_shared<SigmoidLayer>());
+    EXPECT_TRUE(sigmoidNet.compile());
+    std::mt19937 mt(1);
+    const auto input = randomVector(4 * 4 * 2, mt);
+    const auto output = sigmoidNet.infer(input);
+    ASSERT_EQ(static_cast<size_t>(4 * 4 * 3), output.size());
+    for(auto elem : output){
+        EXPECT_TRUE(0 < elem && elem < 1);
+    }
+
+    DeepNetwork emptyNet;
+    EXPECT_FALSE(emptyNet.compile());
+}
+
+TEST_F(DeepNetworkTest, profile_counts_calls)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net(2);
+    buildNetwork(net);
+    std::mt19937 mt(1);
+    auto input = randomVector(INPUT_SIZE, mt);
+    std::vector<float> correctOutput = {0, 1, 0, 0};
+
+    // 無効な間は記録しない
+    net.backPropagate(input, correctOutput);
+    for(const auto& profile : net.getProfile()){
+        EXPECT_EQ(0U, profile.numForward);
+        EXPECT_EQ(0U, profile.numBackward);
+    }
+
+    net.setProfileMode(true);
+    net.backPropagate(input, correctOutput);
+    net.infer(input);
+    auto profiles = net.getProfile();
+    ASSERT_EQ(5U, profiles.size());
+    EXPECT_EQ("Convolution", profiles.front().typeName);
+    for(const auto& profile : profiles){
+        EXPECT_EQ(2U, profile.numForward);
+        EXPECT_EQ(1U, profile.numBackward);
+        EXPECT_EQ(1U, profile.numFlush);
+        EXPECT_LT(0, profile.forwardFlop);
+        EXPECT_LT(0, profile.backwardByte);
+    }
+    EXPECT_LT(0, profiles.front().forwardTime);
+
+    net.resetProfile();
+    for(const auto& profile : net.getProfile()){
+        EXPECT_EQ(0U, profile.numForward);
+        EXPECT_EQ(0, profile.flushTime);
+    }
+}
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+#include "gemm.h"
+#include <vector>
+#include <random>
+#include <tuple>
+
+namespace {
+float getElem(const std::vector<float>& mat, bool trans, int ld, int row, int col)
+{
+    return trans ? mat[col * ld + row] : mat[row * ld + col];
+}
+}
+
+TEST(GemmTest, sgemm_matches_naive)
+{
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    // タイルやブロックの大きさで割り切れない形を選ぶ
+    constexpr int M = 37;
+    constexpr int N = 53;
+    constexpr int K = 300;
+    for(bool transA : {false, true}){
+        for(bool transB : {false, true}){
+            std::vector<float> A(M * K), B(K * N), C(M * N);
+            for(auto& elem : A){
+                elem = rd(mt);
+            }
+            for(auto& elem : B){
+                elem = rd(mt);
+            }
+            for(auto& elem : C){
+                elem = rd(mt);
+            }
+            const int lda = transA ? M : K;
+            const int ldb = transB ? K : N;
+            auto expected = C;
+            for(int i = 0; i < M; i++){
+                for(int j = 0; j < N; j++){
+                    float sumVal = 0;
+                    for(int p = 0; p < K; p++){
+                        sumVal += getElem(A, transA, lda, i, p) * getElem(B, transB, ldb, p, j);
+                    }
+                    expected[i * N + j] += sumVal;
+                }
+            }
+
+            sgemm(transA, transB, M, N, K, A.data(), lda, B.data(), ldb, C.data(), N);
+            for(int i = 0; i < M * N; i++){
+                EXPECT_NEAR(expected[i], C[i], 1e-4);
+            }
+        }
+    }
+}
+
+TEST(GemmTest, col2im_is_adjoint_of_im2col)
+{
+    // <im2col(x), y> == <x, col2im(y)>
+    constexpr int WIDTH = 6;
+    constexpr int HEIGHT = 5;
+    constexpr int NUM_CHANNEL = 2;
+    constexpr int WINDOW_SIZE = 3;
+    constexpr int ZERO_PAD = 1;
+    std::mt19937 mt(2);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    for(int stride : {1, 2, 3}){
+        const int outWidth = (WIDTH + 2 * ZERO_PAD - WINDOW_SIZE) / stride + 1;
+        const int outHeight = (HEIGHT + 2 * ZERO_PAD - WINDOW_SIZE) / stride + 1;
+        const int colSize = NUM_CHANNEL * WINDOW_SIZE * WINDOW_SIZE * outWidth * outHeight;
+        std::vector<float> x(WIDTH * HEIGHT * NUM_CHANNEL), y(colSize);
+        for(auto& elem : x){
+            elem = rd(mt);
+        }
+        for(auto& elem : y){
+            elem = rd(mt);
+        }
+
+        std::vector<float> col(colSize);
+        im2col(x.data(), WIDTH, HEIGHT, NUM_CHANNEL, WINDOW_SIZE, ZERO_PAD, stride, col.data());
+        std::vector<float> img(x.size());
+        col2im(y.data(), WIDTH, HEIGHT, NUM_CHANNEL, WINDOW_SIZE, ZERO_PAD, stride, img.data());
+
+        double lhs = 0, rhs = 0;
+        for(int i = 0; i < colSize; i++){
+            lhs += col[i] * y[i];
+        }
+        for(size_t i = 0; i < x.size(); i++){
+            rhs += x[i] * img[i];
+        }
+        EXPECT_NEAR(lhs, rhs, 1e-4);
+    }
+}
+
+TEST(GemmTest, im2col_on_input_smaller_than_window)
+{
+    // 入力が窓より小さいと、窓の位置によっては入力の範囲に収まる出力がない
+    constexpr int NUM_CHANNEL = 2;
+    constexpr int WINDOW_SIZE = 5;
+    constexpr int ZERO_PAD = 2;
+    std::mt19937 mt(2);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    for(auto [width, height, stride] : {std::tuple(1, 1, 1), std::tuple(2, 1, 1), std::tuple(1, 3, 2)}){
+        const int outWidth = (width + 2 * ZERO_PAD - WINDOW_SIZE) / stride + 1;
+        const int outHeight = (height + 2 * ZERO_PAD - WINDOW_SIZE) / stride + 1;
+        const int outArea = outWidth * outHeight;
+        const int colSize = NUM_CHANNEL * WINDOW_SIZE * WINDOW_SIZE * outArea;
+        std::vector<float> x(width * height * NUM_CHANNEL), y(colSize);
+        for(auto& elem : x){
+            elem = rd(mt);
+        }
+        for(auto& elem : y){
+            elem = rd(mt);
+        }
+
+        std::vector<float> col(colSize, -1.0F);
+        im2col(x.data(), width, height, NUM_CHANNEL, WINDOW_SIZE, ZERO_PAD, stride, col.data());
+        for(int ch = 0; ch < NUM_CHANNEL; ch++){
+            for(int winY = 0; winY < WINDOW_SIZE; winY++){
+                for(int winX = 0; winX < WINDOW_SIZE; winX++){
+                    for(int outY = 0; outY < outHeight; outY++){
+                        for(int outX = 0; outX < outWidth; outX++){
+                            const int inX = outX * stride + winX - ZERO_PAD;
+                            const int inY = outY * stride + winY - ZERO_PAD;
+                            const bool inside = 0 <= inX && inX < width && 0 <= inY && inY < height;
+                            const float expected = inside ? x[(ch * height + inY) * width + inX] : 0.0F;
+                            EXPECT_EQ(expected, col[((ch * WINDOW_SIZE + winY) * WINDOW_SIZE + winX) * outArea
+                                                    + outY * outWidth + outX]);
+                        }
+                    }
+                }
+            }
+        }
+
+        std::vector<float> img(x.size());
+        col2im(y.data(), width, height, NUM_CHANNEL, WINDOW_SIZE, ZERO_PAD, stride, img.data());
+        double lhs = 0, rhs = 0;
+        for(int i = 0; i < colSize; i++){
+            lhs += col[i] * y[i];
+        }
+        for(size_t i = 0; i < x.size(); i++){
+            rhs += x[i] * img[i];
+        }
+        EXPECT_NEAR(lhs, rhs, 1e-4);
+    }
+}
@@ -0,0 +1,152 @@
+#include <gtest/gtest.h>
+#include "inference_server.h"
+#include <vector>
+#include <thread>
+#include <future>
+#include <random>
+
+namespace {
+void buildNetwork(DeepNetwork& net)
+{
+    net.setInputInfo(DataSize(6, 6), 2);
+    net.addLayer(std::make_shared<ConvolutionLayer>(1, 3, 3));
+    net.addLayer(std::make_shared<ReLULayer>());
+    net.addLayer(std::make_shared<PoolingLayer>(0, 2));
+    net.addLayer(std::make_shared<FullConnectLayer>(DataSize(16, 1)));
+    net.addLayer(std::make_shared<SigmoidLayer>());
+    net.addLayer(std::make_shared<FullConnectLayer>(DataSize(4, 1)));
+    net.addLayer(std::make_shared<SoftmaxLayer>());
+}
+}
+
+TEST(InferenceServerTest, submit_matches_infer)
+{
+    constexpr int NUM_CLIENT = 4;
+    constexpr int NUM_REQUEST = 50;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net;
+    buildNetwork(net);
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<std::vector<float>> inputs(NUM_CLIENT * NUM_REQUEST, std::vector<float>(INPUT_SIZE));
+    std::vector<std::vector<float>> expected;
+    for(auto& input : inputs){
+        for(auto& elem : input){
+            elem = rd(mt);
+        }
+        expected.emplace_back(net.infer(input));
+    }
+
+    std::vector<std::vector<float>> outputs(inputs.size());
+    {
+        InferenceServer server(net, 8, std::chrono::microseconds(500));
+        std::vector<std::thread> clients;
+        for(int c = 0; c < NUM_CLIENT; c++){
+            clients.emplace_back([&, c](){
+                // 半分ずつまとめて投げてから受け取る
+                std::vector<std::future<std::vector<float>>> futures;
+                for(int i = c * NUM_REQUEST; i < (c + 1) * NUM_REQUEST; i++){
+                    futures.emplace_back(server.submit(inputs.at(i)));
+                    if(futures.size() == NUM_REQUEST / 2){
+                        for(size_t j = 0; j < futures.size(); j++){
+                            outputs.at(i + 1 - futures.size() + j) = futures.at(j).get();
+                        }
+                        futures.clear();
+                    }
+                }
+            });
+        }
+        for(auto& client : clients){
+            client.join();
+        }
+        EXPECT_EQ(static_cast<uint64_t>(inputs.size()), server.getNumRequest());
+        EXPECT_LT(server.getNumBatch(), server.getNumRequest());
+    }
+
+    for(size_t i = 0; i < inputs.size(); i++){
+        ASSERT_EQ(expected.at(i).size(), outputs.at(i).size());
+        for(size_t j = 0; j < expected.at(i).size(); j++){
+            EXPECT_NEAR(expected.at(i).at(j), outputs.at(i).at(j), 1e-5);
+        }
+    }
+}
+
+TEST(InferenceServerTest, batch_is_bounded_by_size_and_delay)
+{
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    DeepNetwork net;
+    buildNetwork(net);
+    std::vector<float> input(INPUT_SIZE, 0.5);
+    {
+        // 待ち時間が十分長ければ、maxBatchSize個ずつまとまる
+        InferenceServer server(net, 8, std::chrono::seconds(10));
+        std::vector<std::future<std::vector<float>>> futures;
+        for(int i = 0; i < 16; i++){
+            futures.emplace_back(server.submit(input));
+        }
+        for(auto& future : futures){
+            future.get();
+        }
+        EXPECT_EQ(2u, server.getNumBatch());
+    }
+    {
+        // 溜まらなくても、maxDelayが過ぎれば処理する
+        InferenceServer server(net, 8, std::chrono::milliseconds(1));
+        auto future = server.submit(input);
+        EXPECT_EQ(std::future_status::ready, future.wait_for(std::chrono::seconds(5)));
+        EXPECT_EQ(1u, server.getNumBatch());
+    }
+    {
+        // 止める時は、溜まっている要求を待たずに処理する
+        std::future<std::vector<float>> future;
+        {
+            InferenceServer server(net, 8, std::chrono::seconds(10));
+            future = server.submit(input);
+        }
+        EXPECT_EQ(std::future_status::ready, future.wait_for(std::chrono::seconds(0)));
+    }
+}
+
+TEST(InferenceServerTest, workers_share_model)
+{
+    constexpr int NUM_CLIENT = 4;
+    constexpr int NUM_REQUEST = 20;
+    constexpr int INPUT_SIZE = 6 * 6 * 2;
+    auto model = std::make_shared<DeepNetwork>();
+    buildNetwork(*model);
+    ASSERT_TRUE(model->compile());
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<std::vector<float>> inputs(NUM_CLIENT * NUM_REQUEST, std::vector<float>(INPUT_SIZE));
+    std::vector<std::vector<float>> expected;
+    for(auto& input : inputs){
+        for(auto& elem : input){
+            elem = rd(mt);
+        }
+        expected.emplace_back(model->infer(input));
+    }
+
+    std::vector<std::vector<float>> outputs(inputs.size());
+    {
+        InferenceServer server(model, 3, 4, std::chrono::microseconds(200));
+        std::vector<std::thread> clients;
+        for(int c = 0; c < NUM_CLIENT; c++){
+            clients.emplace_back([&, c](){
+                for(int i = c * NUM_REQUEST; i < (c + 1) * NUM_REQUEST; i++){
+                    outputs.at(i) = server.submit(inputs.at(i)).get();
+                }
+            });
+        }
+        for(auto& client : clients){
+            client.join();
+        }
+        EXPECT_EQ(static_cast<uint64_t>(inputs.size()), server.getNumRequest());
+    }
+
+    for(size_t i = 0; i < inputs.size(); i++){
+        ASSERT_EQ(expected.at(i).size(), outputs.at(i).size());
+        for(size_t j = 0; j < expected.at(i).size(); j++){
+            EXPECT_NEAR(expected.at(i).at(j), outputs.at(i).at(j), 1e-5);
+        }
+    }
+}
@@ -4,6 +4,8 @@
 #include <algorithm>
 #include <numeric>
 #include <cmath>
+#include <random>
+#include <tuple>
 
 TEST_F(ConvolutionLayerTest, apply_and_updateWeight_nozeropad)
 {
@@ -102,6 +104,629 @@ TEST_F(ConvolutionLayerTest, save_and_load)
     EXPECT_NEAR(copiedBias.at(0), getBias(cl)->at(0), 0.0001);
 }
 
+namespace {
+// 従来のスカラーループによる畳み込み
+std::vector<float> directConvolution(const std::vector<float>& input,
+        const std::vector<float>& weight, const std::vector<float>& bias,
+        DataSize inSize, int numInCh, int numOutCh, int zeroPad, int windowSize)
+{
+    DataSize outSize(inSize.first + 2 * zeroPad - windowSize + 1,
+                     inSize.second + 2 * zeroPad - windowSize + 1);
+    std::vector<float> output(outSize.first * outSize.second * numOutCh);
+    for(int outCh = 0; outCh < numOutCh; outCh++){
+        for(int inCh = 0; inCh < numInCh; inCh++){
+            for(int outY = 0; outY < outSize.second; outY++){
+                for(int outX = 0; outX < outSize.first; outX++){
+                    float convVal = 0;
+                    int numWinYLoop = std::min(windowSize, inSize.second + zeroPad - outY);
+                    for(int winY = std::max(0, zeroPad - outY); winY < numWinYLoop; winY++){
+                        int numWinXLoop = std::min(windowSize, inSize.first + zeroPad - outX);
+                        for(int winX = std::max(0, zeroPad - outX); winX < numWinXLoop; winX++){
+                            auto w = weight[winX + winY * windowSize
+                                        + windowSize * windowSize * (inCh + numInCh * outCh)];
+                            auto inVal = input[winX - zeroPad + outX
+                                        + (winY - zeroPad + outY) * inSize.first
+                                        + inSize.first * inSize.second * inCh];
+                            convVal += w * inVal;
+                        }
+                    }
+                    output[outX + outY * outSize.first
+                        + outSize.first * outSize.second * outCh] += convVal;
+                }
+            }
+        }
+        for(int out = 0; out < outSize.first * outSize.second; out++){
+            output[out + outSize.first * outSize.second * outCh] += bias[outCh];
+        }
+    }
+    return output;
+}
+}
+
+TEST_F(ConvolutionLayerTest, apply_matches_direct)
+{
+    const DataSize inSize(7, 5);
+    constexpr int NUM_IN_CH = 3;
+    constexpr int NUM_OUT_CH = 5;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    for(auto [zeroPad, windowSize] : {std::pair(0, 2), std::pair(1, 3), std::pair(2, 5)}){
+        ConvolutionLayer cl(zeroPad, windowSize, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+        cl.setInputInfo(inSize, NUM_IN_CH);
+        cl.calcOutputSize();
+        cl.initWeight();
+
+        auto output = cl.apply(input);
+        auto expected = directConvolution(input, *getWeight(cl), *getBias(cl),
+                            inSize, NUM_IN_CH, NUM_OUT_CH, zeroPad, windowSize);
+        ASSERT_EQ(expected.size(), output.size());
+        for(size_t i = 0; i < output.size(); i++){
+            EXPECT_EQ(expected.at(i), output.at(i));
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, apply_matches_direct_on_tiny_input)
+{
+    constexpr int NUM_IN_CH = 2;
+    constexpr int NUM_OUT_CH = 3;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+
+    for(const auto& inSize : {DataSize(1, 1), DataSize(2, 1), DataSize(1, 3)}){
+        std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH);
+        for(auto& elem : input){
+            elem = rd(mt);
+        }
+        ConvolutionLayer cl(2, 5, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+        cl.setInputInfo(inSize, NUM_IN_CH);
+        cl.calcOutputSize();
+        cl.initWeight();
+
+        auto output = cl.apply(input);
+        auto expected = directConvolution(input, *getWeight(cl), *getBias(cl),
+                            inSize, NUM_IN_CH, NUM_OUT_CH, 2, 5);
+        ASSERT_EQ(expected.size(), output.size());
+        for(size_t i = 0; i < output.size(); i++){
+            EXPECT_NEAR(expected.at(i), output.at(i), 1e-5);
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, updateWeight_matches_direct)
+{
+    const DataSize inSize(6, 5);
+    constexpr int NUM_IN_CH = 2;
+    constexpr int NUM_OUT_CH = 3;
+    constexpr int ZERO_PAD = 1;
+    constexpr int WINDOW_SIZE = 3;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    ConvolutionLayer cl(ZERO_PAD, WINDOW_SIZE, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+    cl.setInputInfo(inSize, NUM_IN_CH);
+    cl.calcOutputSize();
+    cl.initWeight();
+    auto output = cl.apply(input);
+    std::vector<float> propError(output.size());
+    for(auto& elem : propError){
+        elem = rd(mt);
+    }
+    const auto weight = *getWeight(cl);
+    const DataSize outSize = cl.getOutputSize();
+
+    // 従来のスカラーループによる逆伝播
+    std::vector<float> dEdw(weight.size());
+    std::vector<float> expectedPropError(input.size());
+    for(int outCh = 0; outCh < NUM_OUT_CH; outCh++){
+        for(int inCh = 0; inCh < NUM_IN_CH; inCh++){
+            for(int outY = 0; outY < outSize.second; outY++){
+                for(int outX = 0; outX < outSize.first; outX++){
+                    auto pe = propError[outX + outY * outSize.first
+                                + outSize.first * outSize.second * outCh];
+                    for(int winY = 0; winY < WINDOW_SIZE; winY++){
+                        for(int winX = 0; winX < WINDOW_SIZE; winX++){
+                            int inX = winX - ZERO_PAD + outX;
+                            int inY = winY - ZERO_PAD + outY;
+                            if(inX < 0 || inSize.first <= inX || inY < 0 || inSize.second <= inY){
+                                continue;
+                            }
+                            int inIdx = inX + inY * inSize.first + inSize.first * inSize.second * inCh;
+                            int wIdx = winX + winY * WINDOW_SIZE
+                                        + WINDOW_SIZE * WINDOW_SIZE * (inCh + NUM_IN_CH * outCh);
+                            dEdw[wIdx] += pe * input[inIdx];
+                            expectedPropError[inIdx] += pe * weight[wIdx];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    auto nextPropError = cl.updateWeight(input, output, propError);
+    cl.flush();
+    // デフォルトはSGD
+    const OptimizerConfig config;
+    ASSERT_EQ(expectedPropError.size(), nextPropError.size());
+    for(size_t i = 0; i < nextPropError.size(); i++){
+        EXPECT_NEAR(expectedPropError.at(i), nextPropError.at(i), 1e-5);
+    }
+    for(size_t i = 0; i < weight.size(); i++){
+        float expected = weight.at(i) - config.learningRate * (dEdw.at(i) + config.weightDecay * weight.at(i));
+        EXPECT_NEAR(expected, getWeight(cl)->at(i), 1e-5);
+    }
+}
+
+TEST_F(ConvolutionLayerTest, batch_matches_per_sample)
+{
+    constexpr int BATCH_SIZE = 3;
+    ConvolutionLayer batchLayer(1, 3, 2), sampleLayer(1, 3, 2);
+    for(auto cl : {&batchLayer, &sampleLayer}){
+        cl->setInputInfo(DataSize(5, 4), 2);
+        cl->calcOutputSize();
+        cl->initWeight();
+    }
+    *getWeight(sampleLayer) = *getWeight(batchLayer);
+    *getBias(sampleLayer) = *getBias(batchLayer);
+
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    const int inDataSize = batchLayer.getInputDataSize();
+    const int outDataSize = batchLayer.getOutputDataSize();
+    std::vector<float> input(inDataSize * BATCH_SIZE);
+    std::vector<float> propError(outDataSize * BATCH_SIZE);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+    for(auto& elem : propError){
+        elem = rd(mt);
+    }
+
+    auto output = batchLayer.applyBatch(input, BATCH_SIZE);
+    auto nextPropError = batchLayer.updateWeightBatch(input, output, propError, BATCH_SIZE);
+    ASSERT_EQ(static_cast<size_t>(outDataSize * BATCH_SIZE), output.size());
+    ASSERT_EQ(input.size(), nextPropError.size());
+    for(int n = 0; n < BATCH_SIZE; n++){
+        std::vector<float> sampleInput(std::begin(input) + n * inDataSize,
+                                       std::begin(input) + (n + 1) * inDataSize);
+        std::vector<float> samplePropError(std::begin(propError) + n * outDataSize,
+                                           std::begin(propError) + (n + 1) * outDataSize);
+        auto sampleOutput = sampleLayer.apply(sampleInput);
+        auto sampleNextPropError = sampleLayer.updateWeight(sampleInput, sampleOutput, samplePropError);
+        for(int i = 0; i < outDataSize; i++){
+            EXPECT_EQ(sampleOutput.at(i), output.at(n * outDataSize + i));
+        }
+        for(int i = 0; i < inDataSize; i++){
+            EXPECT_NEAR(sampleNextPropError.at(i), nextPropError.at(n * inDataSize + i), 1e-5);
+        }
+    }
+
+    batchLayer.flush();
+    sampleLayer.flush();
+    for(size_t i = 0; i < getWeight(batchLayer)->size(); i++){
+        EXPECT_NEAR(getWeight(sampleLayer)->at(i), getWeight(batchLayer)->at(i), 1e-5);
+    }
+    for(size_t i = 0; i < getBias(batchLayer)->size(); i++){
+        EXPECT_NEAR(getBias(sampleLayer)->at(i), getBias(batchLayer)->at(i), 1e-5);
+    }
+}
+
+TEST_F(ConvolutionLayerTest, winograd_matches_gemm)
+{
+    // タイルの大きさで割り切れない出力にする
+    const DataSize inSize(11, 9);
+    constexpr int NUM_IN_CH = 3;
+    constexpr int NUM_OUT_CH = 4;
+    constexpr int BATCH_SIZE = 2;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH * BATCH_SIZE);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    // winograd.hに書いた誤差に余裕を持たせた許容値
+    for(auto [algorithm, tolerance] : {std::pair(ConvAlgorithm::WINOGRAD_2X2, 1e-5),
+                                       std::pair(ConvAlgorithm::WINOGRAD_4X4, 1e-4)}){
+        for(int zeroPad : {0, 1, 2}){
+            ConvolutionLayer gemmLayer(zeroPad, 3, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+            ConvolutionLayer winogradLayer(zeroPad, 3, NUM_OUT_CH, 1, algorithm);
+            for(auto cl : {&gemmLayer, &winogradLayer}){
+                cl->setInputInfo(inSize, NUM_IN_CH);
+                cl->calcOutputSize();
+                cl->initWeight();
+            }
+            *getWeight(winogradLayer) = *getWeight(gemmLayer);
+            *getBias(winogradLayer) = *getBias(gemmLayer);
+
+            auto expected = gemmLayer.applyBatch(input, BATCH_SIZE);
+            auto output = winogradLayer.applyBatch(input, BATCH_SIZE);
+            ASSERT_EQ(expected.size(), output.size());
+            for(size_t i = 0; i < output.size(); i++){
+                EXPECT_NEAR(expected.at(i), output.at(i), tolerance * (1 + std::abs(expected.at(i))));
+            }
+
+            std::vector<float> propError(output.size());
+            for(auto& elem : propError){
+                elem = rd(mt);
+            }
+            auto expectedPropError = gemmLayer.updateWeightBatch(input, expected, propError, BATCH_SIZE);
+            auto nextPropError = winogradLayer.updateWeightBatch(input, output, propError, BATCH_SIZE);
+            ASSERT_EQ(expectedPropError.size(), nextPropError.size());
+            for(size_t i = 0; i < nextPropError.size(); i++){
+                EXPECT_NEAR(expectedPropError.at(i), nextPropError.at(i),
+                            tolerance * (1 + std::abs(expectedPropError.at(i))));
+            }
+            gemmLayer.flush();
+            winogradLayer.flush();
+            for(size_t i = 0; i < getWeight(gemmLayer)->size(); i++){
+                EXPECT_NEAR(getWeight(gemmLayer)->at(i), getWeight(winogradLayer)->at(i), tolerance);
+            }
+            for(size_t i = 0; i < getBias(gemmLayer)->size(); i++){
+                EXPECT_NEAR(getBias(gemmLayer)->at(i), getBias(winogradLayer)->at(i), tolerance);
+            }
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, fft_matches_gemm)
+{
+    const DataSize inSize(20, 17);
+    constexpr int NUM_IN_CH = 2;
+    constexpr int NUM_OUT_CH = 3;
+    constexpr int BATCH_SIZE = 2;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH * BATCH_SIZE);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    for(auto [zeroPad, windowSize] : {std::pair(0, 5), std::pair(5, 11), std::pair(2, 3)}){
+        ConvolutionLayer gemmLayer(zeroPad, windowSize, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+        ConvolutionLayer fftLayer(zeroPad, windowSize, NUM_OUT_CH, 1, ConvAlgorithm::FFT);
+        for(auto cl : {&gemmLayer, &fftLayer}){
+            cl->setInputInfo(inSize, NUM_IN_CH);
+            cl->calcOutputSize();
+            cl->initWeight();
+        }
+        *getWeight(fftLayer) = *getWeight(gemmLayer);
+        *getBias(fftLayer) = *getBias(gemmLayer);
+
+        // 2回目は、flushで重みが変わった後に重みのスペクトルが作り直されることを確かめる
+        for(int itr = 0; itr < 2; itr++){
+            auto expected = gemmLayer.applyBatch(input, BATCH_SIZE);
+            auto output = fftLayer.applyBatch(input, BATCH_SIZE);
+            ASSERT_EQ(expected.size(), output.size());
+            for(size_t i = 0; i < output.size(); i++){
+                EXPECT_NEAR(expected.at(i), output.at(i), 1e-4 * (1 + std::abs(expected.at(i))));
+            }
+
+            std::vector<float> propError(output.size());
+            for(auto& elem : propError){
+                elem = rd(mt);
+            }
+            auto expectedPropError = gemmLayer.updateWeightBatch(input, expected, propError, BATCH_SIZE);
+            auto nextPropError = fftLayer.updateWeightBatch(input, output, propError, BATCH_SIZE);
+            ASSERT_EQ(expectedPropError.size(), nextPropError.size());
+            for(size_t i = 0; i < nextPropError.size(); i++){
+                EXPECT_NEAR(expectedPropError.at(i), nextPropError.at(i),
+                            1e-4 * (1 + std::abs(expectedPropError.at(i))));
+            }
+            gemmLayer.flush();
+            fftLayer.flush();
+            for(size_t i = 0; i < getWeight(gemmLayer)->size(); i++){
+                EXPECT_NEAR(getWeight(gemmLayer)->at(i), getWeight(fftLayer)->at(i), 1e-4);
+            }
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, fft_with_hogwild_matches_gemm)
+{
+    // HogwildのあいだはGEMMで計算し、止めた後は更新された重みのスペクトルを作り直す
+    const DataSize inSize(12, 10);
+    constexpr int NUM_IN_CH = 2;
+    constexpr int NUM_OUT_CH = 3;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    ConvolutionLayer gemmLayer(2, 5, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+    ConvolutionLayer fftLayer(2, 5, NUM_OUT_CH, 1, ConvAlgorithm::FFT);
+    for(auto cl : {&gemmLayer, &fftLayer}){
+        cl->setInputInfo(inSize, NUM_IN_CH);
+        cl->calcOutputSize();
+        cl->initWeight();
+    }
+    *getWeight(fftLayer) = *getWeight(gemmLayer);
+    *getBias(fftLayer) = *getBias(gemmLayer);
+    // Hogwildにする前にスペクトルを作っておく
+    fftLayer.apply(input);
+
+    gemmLayer.setHogwild(true);
+    fftLayer.setHogwild(true);
+    for(int itr = 0; itr < 2; itr++){
+        auto expected = gemmLayer.apply(input);
+        auto output = fftLayer.apply(input);
+        std::vector<float> propError(output.size());
+        for(auto& elem : propError){
+            elem = rd(mt);
+        }
+        gemmLayer.updateWeight(input, expected, propError);
+        fftLayer.updateWeight(input, output, propError);
+    }
+    gemmLayer.setHogwild(false);
+    fftLayer.setHogwild(false);
+    for(size_t i = 0; i < getWeight(gemmLayer)->size(); i++){
+        EXPECT_EQ(getWeight(gemmLayer)->at(i), getWeight(fftLayer)->at(i));
+    }
+
+    auto expected = gemmLayer.apply(input);
+    auto output = fftLayer.apply(input);
+    ASSERT_EQ(expected.size(), output.size());
+    for(size_t i = 0; i < output.size(); i++){
+        EXPECT_NEAR(expected.at(i), output.at(i), 1e-4 * (1 + std::abs(expected.at(i))));
+    }
+}
+
+TEST_F(ConvolutionLayerTest, direct_matches_gemm)
+{
+    const DataSize inSize(9, 7);
+    constexpr int NUM_IN_CH = 3;
+    constexpr int NUM_OUT_CH = 2;
+    constexpr int BATCH_SIZE = 2;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH * BATCH_SIZE);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    // 特殊化したカーネルと、汎用のカーネルの両方を通す
+    for(auto [zeroPad, windowSize] : {std::pair(0, 1), std::pair(1, 3), std::pair(2, 5),
+                                      std::pair(2, 3), std::pair(1, 4)}){
+        ConvolutionLayer gemmLayer(zeroPad, windowSize, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+        ConvolutionLayer directLayer(zeroPad, windowSize, NUM_OUT_CH, 1, ConvAlgorithm::DIRECT);
+        for(auto cl : {&gemmLayer, &directLayer}){
+            cl->setInputInfo(inSize, NUM_IN_CH);
+            cl->calcOutputSize();
+            cl->initWeight();
+        }
+        *getWeight(directLayer) = *getWeight(gemmLayer);
+        *getBias(directLayer) = *getBias(gemmLayer);
+
+        auto expected = gemmLayer.applyBatch(input, BATCH_SIZE);
+        auto output = directLayer.applyBatch(input, BATCH_SIZE);
+        ASSERT_EQ(expected.size(), output.size());
+        for(size_t i = 0; i < output.size(); i++){
+            EXPECT_NEAR(expected.at(i), output.at(i), 1e-5);
+        }
+
+        std::vector<float> propError(output.size());
+        for(auto& elem : propError){
+            elem = rd(mt);
+        }
+        auto expectedPropError = gemmLayer.updateWeightBatch(input, expected, propError, BATCH_SIZE);
+        auto nextPropError = directLayer.updateWeightBatch(input, output, propError, BATCH_SIZE);
+        ASSERT_EQ(expectedPropError.size(), nextPropError.size());
+        for(size_t i = 0; i < nextPropError.size(); i++){
+            EXPECT_NEAR(expectedPropError.at(i), nextPropError.at(i), 1e-5);
+        }
+        gemmLayer.flush();
+        directLayer.flush();
+        for(size_t i = 0; i < getWeight(gemmLayer)->size(); i++){
+            EXPECT_NEAR(getWeight(gemmLayer)->at(i), getWeight(directLayer)->at(i), 1e-5);
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, direct_matches_gemm_on_input_narrower_than_window)
+{
+    constexpr int NUM_IN_CH = 2;
+    constexpr int NUM_OUT_CH = 2;
+    constexpr int BATCH_SIZE = 2;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+
+    // 3x3/pad0は、逆伝播で幅1の誤差に窓3の畳み込みをかける
+    struct Case { DataSize inSize; int zeroPad; int windowSize; ConvAlgorithm algorithm; };
+    for(const auto& c : {Case{DataSize(2, 2), 2, 5, ConvAlgorithm::AUTO},
+                         Case{DataSize(3, 3), 2, 5, ConvAlgorithm::AUTO},
+                         Case{DataSize(1, 4), 1, 3, ConvAlgorithm::DIRECT},
+                         Case{DataSize(3, 4), 0, 3, ConvAlgorithm::DIRECT}}){
+        ConvolutionLayer gemmLayer(c.zeroPad, c.windowSize, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+        ConvolutionLayer directLayer(c.zeroPad, c.windowSize, NUM_OUT_CH, 1, c.algorithm);
+        for(auto cl : {&gemmLayer, &directLayer}){
+            cl->setInputInfo(c.inSize, NUM_IN_CH);
+            cl->calcOutputSize();
+            cl->initWeight();
+        }
+        *getWeight(directLayer) = *getWeight(gemmLayer);
+        *getBias(directLayer) = *getBias(gemmLayer);
+
+        std::vector<float> input(c.inSize.first * c.inSize.second * NUM_IN_CH * BATCH_SIZE);
+        for(auto& elem : input){
+            elem = rd(mt);
+        }
+        auto expected = gemmLayer.applyBatch(input, BATCH_SIZE);
+        auto output = directLayer.applyBatch(input, BATCH_SIZE);
+        ASSERT_EQ(expected.size(), output.size());
+        for(size_t i = 0; i < output.size(); i++){
+            EXPECT_NEAR(expected.at(i), output.at(i), 1e-5);
+        }
+
+        std::vector<float> propError(output.size());
+        for(auto& elem : propError){
+            elem = rd(mt);
+        }
+        auto expectedPropError = gemmLayer.updateWeightBatch(input, expected, propError, BATCH_SIZE);
+        auto nextPropError = directLayer.updateWeightBatch(input, output, propError, BATCH_SIZE);
+        ASSERT_EQ(expectedPropError.size(), nextPropError.size());
+        for(size_t i = 0; i < nextPropError.size(); i++){
+            EXPECT_NEAR(expectedPropError.at(i), nextPropError.at(i), 1e-5);
+        }
+        gemmLayer.flush();
+        directLayer.flush();
+        for(size_t i = 0; i < getWeight(gemmLayer)->size(); i++){
+            EXPECT_NEAR(getWeight(gemmLayer)->at(i), getWeight(directLayer)->at(i), 1e-5);
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, stride_matches_subsampled_output)
+{
+    // strideで間引いた畳み込みは、stride 1の出力を間引いたものと一致する
+    // 逆伝播は、間引いた位置以外の誤差を0にしたstride 1の逆伝播と一致する
+    constexpr int STRIDE = 2;
+    const DataSize inSize(8, 7);
+    constexpr int NUM_IN_CH = 2;
+    constexpr int NUM_OUT_CH = 3;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    for(auto [zeroPad, windowSize] : {std::pair(1, 3), std::pair(0, 2)}){
+        ConvolutionLayer strided(zeroPad, windowSize, NUM_OUT_CH, STRIDE);
+        ConvolutionLayer dense(zeroPad, windowSize, NUM_OUT_CH, 1, ConvAlgorithm::GEMM);
+        for(auto cl : {&strided, &dense}){
+            cl->setInputInfo(inSize, NUM_IN_CH);
+            cl->calcOutputSize();
+            cl->initWeight();
+        }
+        *getWeight(strided) = *getWeight(dense);
+        *getBias(strided) = *getBias(dense);
+        const DataSize outSize = strided.getOutputSize();
+        const DataSize denseSize = dense.getOutputSize();
+        EXPECT_EQ((denseSize.first - 1) / STRIDE + 1, outSize.first);
+        EXPECT_EQ((denseSize.second - 1) / STRIDE + 1, outSize.second);
+
+        auto output = strided.apply(input);
+        auto denseOutput = dense.apply(input);
+        std::vector<float> propError(output.size());
+        std::vector<float> densePropError(denseOutput.size());
+        for(int ch = 0; ch < NUM_OUT_CH; ch++){
+            for(int y = 0; y < outSize.second; y++){
+                for(int x = 0; x < outSize.first; x++){
+                    const int idx = (ch * outSize.second + y) * outSize.first + x;
+                    const int denseIdx = (ch * denseSize.second + y * STRIDE) * denseSize.first + x * STRIDE;
+                    EXPECT_NEAR(denseOutput.at(denseIdx), output.at(idx), 1e-5);
+                    propError.at(idx) = rd(mt);
+                    densePropError.at(denseIdx) = propError.at(idx);
+                }
+            }
+        }
+
+        auto nextPropError = strided.updateWeight(input, output, propError);
+        auto denseNextPropError = dense.updateWeight(input, denseOutput, densePropError);
+        for(size_t i = 0; i < nextPropError.size(); i++){
+            EXPECT_NEAR(denseNextPropError.at(i), nextPropError.at(i), 1e-5);
+        }
+        strided.flush();
+        dense.flush();
+        for(size_t i = 0; i < getWeight(dense)->size(); i++){
+            EXPECT_NEAR(getWeight(dense)->at(i), getWeight(strided)->at(i), 1e-5);
+        }
+        for(size_t i = 0; i < getBias(dense)->size(); i++){
+            EXPECT_NEAR(getBias(dense)->at(i), getBias(strided)->at(i), 1e-5);
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, forwardQuantized_matches_forward)
+{
+    const DataSize inSize(9, 8);
+    constexpr int NUM_IN_CH = 3;
+    constexpr int NUM_OUT_CH = 4;
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(inSize.first * inSize.second * NUM_IN_CH);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    for(auto [zeroPad, windowSize, stride] : {std::tuple(1, 3, 1), std::tuple(2, 5, 2),
+                                              std::tuple(0, 1, 1)}){
+        ConvolutionLayer cl(zeroPad, windowSize, NUM_OUT_CH, stride);
+        cl.setInputInfo(inSize, NUM_IN_CH);
+        cl.calcOutputSize();
+        cl.initWeight();
+        cl.quantize(1.0F);
+        ASSERT_TRUE(cl.isQuantized());
+
+        auto expected = cl.apply(input);
+        std::vector<float> output(cl.getOutputDataSize());
+        cl.forwardQuantized(input.data(), output.data());
+        // 積和の項数に比例して丸めの誤差が積もる
+        const float tolerance = 0.01 * windowSize * windowSize * NUM_IN_CH;
+        for(size_t i = 0; i < output.size(); i++){
+            EXPECT_NEAR(expected.at(i), output.at(i), tolerance);
+        }
+    }
+}
+
+TEST_F(ConvolutionLayerTest, forwardReLUPool_matches_separate_layers)
+{
+    // 複数のバンドに分かれる大きさにする
+    // (畳み込みのstride, poolのzeroPad, windowSize, stride)
+    for(auto [convStride, poolZeroPad, poolWindowSize, poolStride] :
+            {std::tuple(1, 1, 3, 1), std::tuple(1, 0, 2, 2), std::tuple(2, 1, 3, 2)}){
+        ConvolutionLayer cl(1, 3, 4, convStride);
+        ReLULayer rl;
+        PoolingLayer pl(poolZeroPad, poolWindowSize, poolStride);
+        cl.setInputInfo(DataSize(40, 37), 8);
+        cl.calcOutputSize();
+        cl.initWeight();
+        rl.setInputInfo(cl.getOutputSize(), cl.getNumOutputChannel());
+        rl.calcOutputSize();
+        pl.setInputInfo(rl.getOutputSize(), rl.getNumOutputChannel());
+        pl.calcOutputSize();
+
+        std::mt19937 mt(1);
+        std::uniform_real_distribution<float> rd(-1.0, 1.0);
+        std::vector<float> input(cl.getInputDataSize());
+        for(auto& elem : input){
+            elem = rd(mt);
+        }
+
+        auto rlOutput = rl.apply(cl.apply(input));
+        auto plOutput = pl.apply(rlOutput);
+        std::vector<float> fusedRlOutput(rlOutput.size());
+        std::vector<float> fusedOutput(plOutput.size());
+        std::vector<int32_t> fusedArgmax(plOutput.size());
+        cl.forwardReLUPool(input.data(), pl, fusedOutput.data(), fusedRlOutput.data(),
+                           fusedArgmax.data());
+        for(size_t i = 0; i < rlOutput.size(); i++){
+            EXPECT_EQ(rlOutput.at(i), fusedRlOutput.at(i));
+        }
+        std::vector<int32_t> argmax(plOutput.size());
+        std::vector<float> separateOutput(plOutput.size());
+        pl.forwardArgmax(rlOutput.data(), separateOutput.data(), argmax.data());
+        for(size_t i = 0; i < plOutput.size(); i++){
+            EXPECT_EQ(plOutput.at(i), fusedOutput.at(i));
+            // 最大値が0の窓は、ReLUで切られた要素を選ぶかどうかが異なる
+            if(0 < plOutput.at(i)){
+                EXPECT_EQ(argmax.at(i), fusedArgmax.at(i));
+            }
+        }
+    }
+}
+
 TEST_F(ReLULayerTest, apply)
 {
     ReLULayer rl;
@@ -210,7 +835,127 @@ TEST_F(PoolingLayerTest, updateWeight)
     EXPECT_EQ(input.size(), nextPropError.size());
     EXPECT_FLOAT_EQ(0.1, nextPropError.at(0));
     EXPECT_FLOAT_EQ(0, nextPropError.at(1));
-    EXPECT_FLOAT_EQ(0.3, nextPropError.at(6));
+    EXPECT_FLOAT_EQ(0.2, nextPropError.at(5));
+    // 窓内がすべて0なので、最後の要素にだけ誤差を戻す
+    EXPECT_FLOAT_EQ(0, nextPropError.at(6));
+    EXPECT_FLOAT_EQ(0.3, nextPropError.at(7));
+}
+
+TEST_F(PoolingLayerTest, backwardArgmax_matches_backward)
+{
+    // 値の重複が多い入力で、記録したargmaxを使う逆伝播と求め直す逆伝播が一致する
+    PoolingLayer pl(1, 3);
+    pl.setInputInfo(DataSize(6, 5), 2);
+    pl.calcOutputSize();
+    std::mt19937 mt(1);
+    std::uniform_int_distribution<int> rd(-2, 2);
+    std::vector<float> input(pl.getInputDataSize());
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+    std::vector<float> propError(pl.getOutputDataSize());
+    for(auto& elem : propError){
+        elem = rd(mt);
+    }
+
+    std::vector<float> output(pl.getOutputDataSize());
+    std::vector<int32_t> argmax(pl.getOutputDataSize());
+    pl.forwardArgmax(input.data(), output.data(), argmax.data());
+    EXPECT_EQ(pl.apply(input), output);
+    for(size_t i = 0; i < output.size(); i++){
+        if(argmax.at(i) < 0){
+            EXPECT_EQ(0, output.at(i));
+        }else{
+            EXPECT_EQ(input.at(argmax.at(i)), output.at(i));
+        }
+    }
+
+    std::vector<float> nextPropError(input.size());
+    pl.backwardArgmax(argmax.data(), propError.data(), nextPropError.data());
+    EXPECT_EQ(pl.updateWeight(input, output, propError), nextPropError);
+}
+
+TEST_F(PoolingLayerTest, separable_matches_scan)
+{
+    // 行と列に分けて求めた最大値とその位置が、窓を走査した結果と一致する
+    const DataSize inSize(13, 11);
+    constexpr int NUM_CHANNEL = 2;
+    std::mt19937 mt(1);
+    // 値が重複するように整数にする
+    std::uniform_int_distribution<int> rd(-3, 3);
+    std::vector<float> input(inSize.first * inSize.second * NUM_CHANNEL);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    for(auto [zeroPad, windowSize, stride] : {std::tuple(0, 3, 1), std::tuple(1, 3, 1),
+            std::tuple(2, 5, 1), std::tuple(3, 7, 2), std::tuple(1, 4, 3), std::tuple(0, 9, 1)}){
+        PoolingLayer pl(zeroPad, windowSize, stride);
+        pl.setInputInfo(inSize, NUM_CHANNEL);
+        pl.calcOutputSize();
+        const DataSize outSize = pl.getOutputSize();
+        std::vector<float> output(pl.getOutputDataSize());
+        std::vector<int32_t> argmax(pl.getOutputDataSize());
+        pl.forwardArgmax(input.data(), output.data(), argmax.data());
+
+        for(int ch = 0; ch < NUM_CHANNEL; ch++){
+            for(int outY = 0; outY < outSize.second; outY++){
+                for(int outX = 0; outX < outSize.first; outX++){
+                    float maxVal = 0;
+                    int maxIndex = -1;
+                    for(int y = outY * stride - zeroPad; y < outY * stride - zeroPad + windowSize; y++){
+                        for(int x = outX * stride - zeroPad; x < outX * stride - zeroPad + windowSize; x++){
+                            if(y < 0 || inSize.second <= y || x < 0 || inSize.first <= x){
+                                continue;
+                            }
+                            const int index = (ch * inSize.second + y) * inSize.first + x;
+                            if(maxVal <= input.at(index)){
+                                maxVal = input.at(index);
+                                maxIndex = index;
+                            }
+                        }
+                    }
+                    const int out = (ch * outSize.second + outY) * outSize.first + outX;
+                    EXPECT_EQ(maxVal, output.at(out));
+                    EXPECT_EQ(maxIndex, argmax.at(out));
+                }
+            }
+        }
+    }
+}
+
+TEST_F(PoolingLayerTest, apply_and_updateWeight_with_stride)
+{
+    // 窓が重ならないので、入力の大きさが縦横それぞれ半分になる
+    PoolingLayer pl(0, 2, 2);
+    std::vector<float> input = {
+        1, 2, 0, 0, 5,
+        3, 0, 0, 4, 0,
+        0, 0, 6, 0, 0,
+        0, 7, 0, 0, 0,
+        8, 0, 0, 0, 9};
+    pl.setInputInfo(DataSize(5, 5), 1);
+    pl.calcOutputSize();
+    EXPECT_EQ(DataSize(2, 2), pl.getOutputSize());
+
+    auto output = pl.apply(input);
+    ASSERT_EQ(4UL, output.size());
+    EXPECT_EQ(3, output.at(0));
+    EXPECT_EQ(4, output.at(1));
+    EXPECT_EQ(7, output.at(2));
+    EXPECT_EQ(6, output.at(3));
+
+    std::vector<float> propError = {0.1, 0.2, 0.3, 0.4};
+    auto nextPropError = pl.updateWeight(input, output, propError);
+    ASSERT_EQ(input.size(), nextPropError.size());
+    std::vector<float> expected(input.size());
+    expected.at(5) = 0.1;
+    expected.at(8) = 0.2;
+    expected.at(16) = 0.3;
+    expected.at(12) = 0.4;
+    for(size_t i = 0; i < expected.size(); i++){
+        EXPECT_FLOAT_EQ(expected.at(i), nextPropError.at(i));
+    }
 }
 
 TEST_F(FullConnectLayerTest, apply_and_updateWeight)
@@ -273,6 +1018,101 @@ TEST_F(FullConnectLayerTest, save_and_load)
     EXPECT_NEAR(copiedBias, *getBias(fl), 0.0001);
 }
 
+TEST_F(FullConnectLayerTest, batch_matches_per_sample)
+{
+    constexpr int BATCH_SIZE = 3;
+    FullConnectLayer batchLayer(DataSize(5, 1)), sampleLayer(DataSize(5, 1));
+    for(auto fl : {&batchLayer, &sampleLayer}){
+        fl->setInputInfo(DataSize(3, 2), 2);
+        fl->calcOutputSize();
+        fl->initWeight();
+    }
+    *getWeight(sampleLayer) = *getWeight(batchLayer);
+    *getBias(sampleLayer) = *getBias(batchLayer);
+
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    const int inDataSize = batchLayer.getInputDataSize();
+    const int outDataSize = batchLayer.getOutputDataSize();
+    std::vector<float> input(inDataSize * BATCH_SIZE);
+    std::vector<float> propError(outDataSize * BATCH_SIZE);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+    for(auto& elem : propError){
+        elem = rd(mt);
+    }
+
+    auto output = batchLayer.applyBatch(input, BATCH_SIZE);
+    auto nextPropError = batchLayer.updateWeightBatch(input, output, propError, BATCH_SIZE);
+    ASSERT_EQ(static_cast<size_t>(outDataSize * BATCH_SIZE), output.size());
+    ASSERT_EQ(input.size(), nextPropError.size());
+    for(int n = 0; n < BATCH_SIZE; n++){
+        std::vector<float> sampleInput(std::begin(input) + n * inDataSize,
+                                       std::begin(input) + (n + 1) * inDataSize);
+        std::vector<float> samplePropError(std::begin(propError) + n * outDataSize,
+                                           std::begin(propError) + (n + 1) * outDataSize);
+        auto sampleOutput = sampleLayer.apply(sampleInput);
+        auto sampleNextPropError = sampleLayer.updateWeight(sampleInput, sampleOutput, samplePropError);
+        for(int i = 0; i < outDataSize; i++){
+            EXPECT_NEAR(sampleOutput.at(i), output.at(n * outDataSize + i), 1e-5);
+        }
+        for(int i = 0; i < inDataSize; i++){
+            EXPECT_NEAR(sampleNextPropError.at(i), nextPropError.at(n * inDataSize + i), 1e-5);
+        }
+    }
+
+    batchLayer.flush();
+    sampleLayer.flush();
+    for(size_t i = 0; i < getWeight(batchLayer)->size(); i++){
+        EXPECT_NEAR(getWeight(sampleLayer)->at(i), getWeight(batchLayer)->at(i), 1e-5);
+    }
+    EXPECT_NEAR(*getBias(sampleLayer), *getBias(batchLayer), 1e-5);
+}
+
+TEST_F(FullConnectLayerTest, reduceGradientSlice_matches_flush)
+{
+    // シャード0を空にしておき、足し先が先頭以外になる場合も通す
+    constexpr int NUM_SHARD = 5;
+    constexpr int NUM_SLICE = 3;
+    FullConnectLayer slicedLayer(DataSize(7, 1)), treeLayer(DataSize(7, 1));
+    for(auto fl : {&slicedLayer, &treeLayer}){
+        fl->setInputInfo(DataSize(4, 3), 2);
+        fl->calcOutputSize();
+        fl->initWeight();
+        fl->setNumShard(NUM_SHARD);
+    }
+    *getWeight(treeLayer) = *getWeight(slicedLayer);
+    *getBias(treeLayer) = *getBias(slicedLayer);
+
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    for(int itr = 0; itr < 2; itr++){
+        for(int shard = 1; shard < NUM_SHARD; shard++){
+            std::vector<float> input(slicedLayer.getInputDataSize());
+            std::vector<float> propError(slicedLayer.getOutputDataSize());
+            for(auto& elem : input){
+                elem = rd(mt);
+            }
+            for(auto& elem : propError){
+                elem = rd(mt);
+            }
+            auto output = slicedLayer.apply(input);
+            slicedLayer.updateWeight(input, output, propError, 0.5, shard);
+            treeLayer.updateWeight(input, output, propError, 0.5, shard);
+        }
+        for(int slice = 0; slice < NUM_SLICE; slice++){
+            slicedLayer.reduceGradientSlice(slice, NUM_SLICE);
+        }
+        slicedLayer.flush();
+        treeLayer.flush();
+        for(size_t i = 0; i < getWeight(treeLayer)->size(); i++){
+            EXPECT_NEAR(getWeight(treeLayer)->at(i), getWeight(slicedLayer)->at(i), 1e-5);
+        }
+        EXPECT_NEAR(*getBias(treeLayer), *getBias(slicedLayer), 1e-5);
+    }
+}
+
 TEST_F(SoftmaxLayerTest, apply_and_updateWeight)
 {
     SoftmaxLayer sml;
@@ -444,6 +1284,149 @@ TEST_F(ConvolutionLayerTest, Conv_Relu_Pool_Conv_Relu)
     }
 }
 
+TEST_F(FullConnectLayerTest, forwardQuantized_matches_forward)
+{
+    // int8の誤差は、重みと入力の丸め(それぞれ最大値の1/254)の分
+    FullConnectLayer fl(DataSize(10, 1));
+    fl.setInputInfo(DataSize(7, 5), 3);
+    fl.calcOutputSize();
+    fl.initWeight();
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(fl.getInputDataSize());
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+
+    EXPECT_FALSE(fl.isQuantized());
+    fl.quantize(1.0F);
+    EXPECT_TRUE(fl.isQuantized());
+    auto expected = fl.apply(input);
+    std::vector<float> output(fl.getOutputDataSize());
+    fl.forwardQuantized(input.data(), output.data());
+    // 積和の項数に比例して丸めの誤差が積もる
+    const float tolerance = 0.002 * fl.getInputDataSize();
+    for(size_t i = 0; i < output.size(); i++){
+        EXPECT_NEAR(expected.at(i), output.at(i), tolerance);
+    }
+
+    // 重みを更新すると量子化を破棄する
+    fl.updateWeight(input, expected, expected);
+    fl.flush();
+    EXPECT_FALSE(fl.isQuantized());
+}
+
+TEST_F(FullConnectLayerTest, halfWeight_keeps_master_weight)
+{
+    FullConnectLayer fl(DataSize(10, 1)), reference(DataSize(10, 1));
+    for(auto layer : {&fl, &reference}){
+        layer->setInputInfo(DataSize(7, 5), 3);
+        layer->calcOutputSize();
+        layer->initWeight();
+    }
+    *getWeight(reference) = *getWeight(fl);
+    *getBias(reference) = *getBias(fl);
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> input(fl.getInputDataSize() * 3);
+    for(auto& elem : input){
+        elem = rd(mt);
+    }
+    const std::vector<float> sample(input.begin(), input.begin() + fl.getInputDataSize());
+
+    // FP16の重みの相対誤差は2^-11以下
+    fl.setWeightType(TensorType::FLOAT16);
+    EXPECT_EQ(TensorType::FLOAT16, fl.getWeightType());
+    auto expected = reference.applyBatch(input, 3);
+    auto output = fl.applyBatch(input, 3);
+    auto single = fl.apply(sample);
+    for(size_t i = 0; i < output.size(); i++){
+        EXPECT_NEAR(expected.at(i), output.at(i), 0.02);
+    }
+    for(size_t i = 0; i < single.size(); i++){
+        EXPECT_NEAR(output.at(i), single.at(i), 1e-4);
+    }
+
+    // 16bitでは表せない小さな更新も、floatの重みには蓄積される
+    std::vector<float> propError(fl.getOutputDataSize(), 1e-4F);
+    for(int i = 0; i < 3; i++){
+        fl.updateWeight(sample, single, propError);
+        fl.flush();
+        reference.updateWeight(sample, single, propError);
+        reference.flush();
+    }
+    EXPECT_EQ(*getWeight(reference), *getWeight(fl));
+    EXPECT_EQ(TensorType::FLOAT16, fl.getWeightType());
+
+    fl.setWeightType(TensorType::FLOAT32);
+    EXPECT_EQ(reference.apply(sample), fl.apply(sample));
+}
+
+TEST_F(FullConnectLayerTest, optimizer_keeps_state_between_flushes)
+{
+    FullConnectLayer momentumLayer(DataSize(3, 1)), adamLayer(DataSize(3, 1));
+    for(auto layer : {&momentumLayer, &adamLayer}){
+        layer->setInputInfo(DataSize(4, 1), 1);
+        layer->calcOutputSize();
+        layer->initWeight();
+    }
+    *getWeight(adamLayer) = *getWeight(momentumLayer);
+    OptimizerConfig config;
+    config.weightDecay = 0;
+    config.type = OptimizerType::MOMENTUM;
+    momentumLayer.setOptimizer(config);
+    config.type = OptimizerType::ADAM;
+    config.learningRate = 0.01F;
+    adamLayer.setOptimizer(config);
+
+    const std::vector<float> input = {1.0F, -2.0F, 0.5F, 0.0F};
+    const std::vector<float> propError = {0.1F, -0.3F, 0.2F};
+    const auto weight = *getWeight(momentumLayer);
+    const auto output = momentumLayer.apply(input);
+    for(int i = 0; i < 2; i++){
+        momentumLayer.updateWeight(input, output, propError);
+        momentumLayer.flush();
+        adamLayer.updateWeight(input, output, propError);
+        adamLayer.flush();
+    }
+    for(int out = 0; out < 3; out++){
+        for(int in = 0; in < 4; in++){
+            const size_t idx = out * 4 + in;
+            const float dEdw = propError.at(out) * input.at(in);
+            // 速度はg, 1.9gと増えるので、2回で2.9g進む
+            EXPECT_NEAR(weight.at(idx) - 0.02F * 2.9F * dEdw, getWeight(momentumLayer)->at(idx), 1e-5);
+            // 勾配が一定ならバイアス補正後のm / sqrt(v)は符号だけになり、1回にlrずつ進む
+            const float sign = dEdw == 0 ? 0 : (0 < dEdw ? 1 : -1);
+            EXPECT_NEAR(weight.at(idx) - 2 * 0.01F * sign, getWeight(adamLayer)->at(idx), 1e-5);
+        }
+    }
+}
+
+TEST_F(FullConnectLayerTest, hogwild_skips_rows_without_gradient)
+{
+    // 誤差が0の出力の行は、L2正則化の減衰も含めて書き換えない
+    FullConnectLayer fl(DataSize(3, 1));
+    fl.setInputInfo(DataSize(4, 1), 1);
+    fl.calcOutputSize();
+    fl.initWeight(1);
+    fl.setHogwild(true);
+
+    const std::vector<float> input = {1.0F, -2.0F, 0.5F, 0.0F};
+    const std::vector<float> propError = {0.1F, 0.0F, 0.2F};
+    const auto weight = *getWeight(fl);
+    const OptimizerConfig config;
+    fl.updateWeight(input, fl.apply(input), propError);
+    for(int out = 0; out < 3; out++){
+        for(int in = 0; in < 4; in++){
+            const size_t idx = out * 4 + in;
+            const float expected = propError.at(out) == 0 ? weight.at(idx)
+                : weight.at(idx) - config.learningRate
+                    * (propError.at(out) * input.at(in) + config.weightDecay * weight.at(idx));
+            EXPECT_NEAR(expected, getWeight(fl)->at(idx), 1e-6);
+        }
+    }
+}
+
 TEST_F(FullConnectLayerTest, FullConnect_and_Softmax)
 {
     FullConnectLayer fl(DataSize(9, 1));
@@ -0,0 +1,318 @@
+#include <gtest/gtest.h>
+#include "simd.h"
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+TEST(SimdTest, kernels_match_naive)
+{
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    // ベクトル長で割り切れない形を選ぶ
+    constexpr int M = 7;
+    constexpr int N = 203;
+    std::vector<float> A(M * N), x(N), v(M), y0(N);
+    for(auto vec : {&A, &x, &v, &y0}){
+        for(auto& elem : *vec){
+            elem = rd(mt);
+        }
+    }
+
+    const auto original = getSimdLevel();
+    for(auto level : {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}){
+        if(!setSimdLevel(level)){
+            continue;
+        }
+        for(int n : {0, 1, 15, 17, N}){
+            float expected = 0;
+            for(int i = 0; i < n; i++){
+                expected += A[i] * x[i];
+            }
+            EXPECT_NEAR(expected, sdot(n, A.data(), x.data()), 1e-4);
+
+            auto y = y0;
+            saxpy(n, 0.5F, x.data(), y.data());
+            for(int i = 0; i < N; i++){
+                EXPECT_FLOAT_EQ(i < n ? y0[i] + 0.5F * x[i] : y0[i], y[i]);
+            }
+        }
+
+        std::vector<float> gemvOut(M);
+        sgemv(M, N, A.data(), N, x.data(), gemvOut.data());
+        auto gemvTransOut = y0;
+        sgemvTrans(M, N, A.data(), N, v.data(), gemvTransOut.data());
+        for(int m = 0; m < M; m++){
+            float expected = 0;
+            for(int i = 0; i < N; i++){
+                expected += A[m * N + i] * x[i];
+            }
+            EXPECT_NEAR(expected, gemvOut[m], 1e-4);
+        }
+        for(int i = 0; i < N; i++){
+            float expected = y0[i];
+            for(int m = 0; m < M; m++){
+                expected += A[m * N + i] * v[m];
+            }
+            EXPECT_NEAR(expected, gemvTransOut[i], 1e-4);
+        }
+    }
+    setSimdLevel(original);
+}
+
+TEST(SimdTest, sgemvBatch_matches_sgemv)
+{
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    // 4行、2本のタイルで割り切れない形を選ぶ
+    constexpr int M = 7;
+    constexpr int N = 203;
+    constexpr int NUM_X = 5;
+    constexpr int LDX = N + 3;
+    constexpr int LDY = M + 2;
+    std::vector<float> A(M * N), X(NUM_X * LDX);
+    for(auto vec : {&A, &X}){
+        for(auto& elem : *vec){
+            elem = rd(mt);
+        }
+    }
+
+    const auto original = getSimdLevel();
+    for(auto level : {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}){
+        if(!setSimdLevel(level)){
+            continue;
+        }
+        std::vector<float> Y(NUM_X * LDY, -1.0F);
+        sgemvBatch(M, N, A.data(), N, NUM_X, X.data(), LDX, Y.data(), LDY);
+        for(int k = 0; k < NUM_X; k++){
+            std::vector<float> expected(M);
+            sgemv(M, N, A.data(), N, X.data() + k * LDX, expected.data());
+            for(int m = 0; m < M; m++){
+                // 和を取る順序が同じなので、丸めの差しか出ない
+                EXPECT_FLOAT_EQ(expected[m], Y[k * LDY + m]);
+            }
+            // 行の間の余白には書かない
+            for(int m = M; m < LDY; m++){
+                EXPECT_EQ(-1.0F, Y[k * LDY + m]);
+            }
+        }
+    }
+    setSimdLevel(original);
+}
+
+TEST(SimdTest, s8gemv_matches_naive)
+{
+    std::mt19937 mt(1);
+    std::uniform_int_distribution<int> rd(-127, 127);
+    // VNNIの64個単位、AVX2の16個単位で割り切れない形を選ぶ
+    constexpr int M = 7;
+    constexpr int N = 203;
+    std::vector<int8_t> A(M * N), x(N);
+    for(auto vec : {&A, &x}){
+        for(auto& elem : *vec){
+            elem = rd(mt);
+        }
+    }
+    // 飽和しやすい端の値も入れる
+    A[0] = x[0] = -127;
+    A[1] = 127;
+    x[1] = -128;
+    std::vector<int32_t> rowSum(M), expected(M);
+    for(int m = 0; m < M; m++){
+        for(int i = 0; i < N; i++){
+            rowSum[m] += A[m * N + i];
+            expected[m] += A[m * N + i] * x[i];
+        }
+    }
+
+    const auto original = getSimdLevel();
+    for(auto level : {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}){
+        if(!setSimdLevel(level)){
+            continue;
+        }
+        std::vector<int32_t> y(M);
+        s8gemv(M, N, A.data(), N, rowSum.data(), x.data(), y.data());
+        EXPECT_EQ(expected, y);
+    }
+    setSimdLevel(original);
+}
+
+TEST(SimdTest, s8quantize_rounds_and_clamps)
+{
+    // 32個単位で割り切れない長さにして、端数も確かめる
+    std::vector<float> x;
+    std::vector<int8_t> expected;
+    for(int i = -140; i <= 140; i++){
+        x.push_back(i + 0.3F);
+        expected.push_back(static_cast<int8_t>(std::max(-127, std::min(127, i))));
+        x.push_back(i - 0.3F);
+        expected.push_back(static_cast<int8_t>(std::max(-127, std::min(127, i))));
+    }
+
+    const auto original = getSimdLevel();
+    for(auto level : {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}){
+        if(!setSimdLevel(level)){
+            continue;
+        }
+        // x / 2を、invScale = 2で戻して量子化する
+        std::vector<float> halfX(x.size());
+        std::transform(x.begin(), x.end(), halfX.begin(), [](float val){return val / 2;});
+        std::vector<int8_t> q(x.size());
+        s8quantize(static_cast<int>(x.size()), 2.0F, halfX.data(), q.data());
+        EXPECT_EQ(expected, q);
+    }
+    setSimdLevel(original);
+}
+
+TEST(SimdTest, half_conversion_matches_scalar)
+{
+    // 16bitのすべての値について、floatに戻して丸め直すと元に戻る
+    std::vector<uint16_t> allHalf(1 << 16);
+    for(size_t i = 0; i < allHalf.size(); i++){
+        allHalf[i] = static_cast<uint16_t>(i);
+    }
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    std::vector<float> x(1003);
+    for(auto& elem : x){
+        elem = rd(mt) * std::pow(2.0F, static_cast<int>(rd(mt) * 30));
+    }
+    // 偶数への丸めと、FP16の範囲の端
+    x[0] = 1.0F + std::pow(2.0F, -11);
+    x[1] = 1.0F + 3 * std::pow(2.0F, -11);
+    x[2] = 65519.0F;
+    x[3] = 65520.0F;
+    x[4] = std::pow(2.0F, -25);
+
+    const auto original = getSimdLevel();
+    for(auto type : {HalfType::FP16, HalfType::BF16}){
+        setSimdLevel(SimdLevel::SCALAR);
+        std::vector<float> expectedFloat(allHalf.size());
+        fromHalf(type, allHalf.size(), allHalf.data(), expectedFloat.data());
+        std::vector<uint16_t> expectedHalf(x.size());
+        toHalf(type, x.size(), x.data(), expectedHalf.data());
+        if(type == HalfType::FP16){
+            EXPECT_EQ(0x3c00, expectedHalf[0]);
+            EXPECT_EQ(0x3c02, expectedHalf[1]);
+            EXPECT_EQ(0x7bff, expectedHalf[2]);
+            EXPECT_EQ(0x7c00, expectedHalf[3]);
+            EXPECT_EQ(0x0000, expectedHalf[4]);
+        }
+
+        for(auto level : {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}){
+            if(!setSimdLevel(level)){
+                continue;
+            }
+            std::vector<float> converted(allHalf.size());
+            fromHalf(type, allHalf.size(), allHalf.data(), converted.data());
+            std::vector<uint16_t> roundTrip(allHalf.size());
+            toHalf(type, converted.size(), converted.data(), roundTrip.data());
+            for(size_t i = 0; i < allHalf.size(); i++){
+                if(std::isnan(expectedFloat[i])){
+                    EXPECT_TRUE(std::isnan(converted[i]));
+                    continue;
+                }
+                EXPECT_EQ(expectedFloat[i], converted[i]);
+                EXPECT_EQ(allHalf[i], roundTrip[i]);
+            }
+
+            std::vector<uint16_t> half(x.size());
+            toHalf(type, x.size(), x.data(), half.data());
+            EXPECT_EQ(expectedHalf, half);
+        }
+    }
+    setSimdLevel(original);
+}
+
+TEST(SimdTest, hgemv_matches_naive)
+{
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    constexpr int M = 7;
+    constexpr int N = 203;
+    std::vector<float> A(M * N), x(N);
+    for(auto vec : {&A, &x}){
+        for(auto& elem : *vec){
+            elem = rd(mt);
+        }
+    }
+
+    const auto original = getSimdLevel();
+    for(auto type : {HalfType::FP16, HalfType::BF16}){
+        // 丸めた重みをfloatに戻したものとの積が期待値
+        std::vector<uint16_t> halfA(M * N);
+        toHalf(type, halfA.size(), A.data(), halfA.data());
+        std::vector<float> roundedA(M * N);
+        fromHalf(type, halfA.size(), halfA.data(), roundedA.data());
+        std::vector<float> expected(M);
+        for(int m = 0; m < M; m++){
+            for(int i = 0; i < N; i++){
+                expected[m] += roundedA[m * N + i] * x[i];
+            }
+        }
+        for(auto level : {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}){
+            if(!setSimdLevel(level)){
+                continue;
+            }
+            std::vector<float> y(M);
+            hgemv(type, M, N, halfA.data(), N, x.data(), y.data());
+            for(int m = 0; m < M; m++){
+                EXPECT_NEAR(expected[m], y[m], 1e-4);
+            }
+        }
+    }
+    setSimdLevel(original);
+}
+
+TEST(SimdTest, optimizer_steps_match_naive)
+{
+    std::mt19937 mt(1);
+    std::uniform_real_distribution<float> rd(-1.0, 1.0);
+    constexpr int N = 203;
+    std::vector<float> grad(N), param0(N), first0(N), second0(N);
+    for(auto vec : {&grad, &param0, &first0}){
+        for(auto& elem : *vec){
+            elem = rd(mt);
+        }
+    }
+    for(auto& elem : second0){
+        elem = std::abs(rd(mt));
+    }
+    OptimizerStepParam p = {};
+    p.lr = 0.1F;
+    p.gradScale = 0.5F;
+    p.decay = 0.01F;
+    p.momentum = 0.9F;
+    p.beta1 = 0.8F;
+    p.beta2 = 0.99F;
+    p.epsilon = 1e-3F;
+
+    const auto original = getSimdLevel();
+    for(auto level : {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512}){
+        if(!setSimdLevel(level)){
+            continue;
+        }
+        auto sgdParam = param0;
+        sgdStep(N, p, grad.data(), sgdParam.data());
+        auto momentumParam = param0;
+        auto velocity = first0;
+        momentumStep(N, p, grad.data(), velocity.data(), momentumParam.data());
+        auto adamParam = param0;
+        auto m = first0;
+        auto v = second0;
+        adamStep(N, p, grad.data(), m.data(), v.data(), adamParam.data());
+        for(int i = 0; i < N; i++){
+            const float g = p.gradScale * grad[i] + p.decay * param0[i];
+            EXPECT_NEAR(param0[i] - p.lr * g, sgdParam[i], 1e-6);
+            const float expectedVelocity = p.momentum * first0[i] + g;
+            EXPECT_NEAR(expectedVelocity, velocity[i], 1e-6);
+            EXPECT_NEAR(param0[i] - p.lr * expectedVelocity, momentumParam[i], 1e-6);
+            const float expectedM = p.beta1 * first0[i] + (1 - p.beta1) * g;
+            const float expectedV = p.beta2 * second0[i] + (1 - p.beta2) * g * g;
+            EXPECT_NEAR(expectedM, m[i], 1e-6);
+            EXPECT_NEAR(expectedV, v[i], 1e-6);
+            EXPECT_NEAR(param0[i] - p.lr * expectedM / (std::sqrt(expectedV) + p.epsilon), adamParam[i], 1e-5);
+        }
+    }
+    setSimdLevel(original);
+}
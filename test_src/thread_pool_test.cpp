@@ -0,0 +1,25 @@
+#include <gtest/gtest.h>
+#include "thread_pool.h"
+#include <vector>
+#include <atomic>
+
+TEST(ThreadPoolTest, parallelFor_runs_each_task_once)
+{
+    constexpr int NUM_THREAD = 4;
+    constexpr int NUM_TASK = 1000;
+    ThreadPool pool(NUM_THREAD);
+    std::vector<std::atomic<int>> counts(NUM_TASK);
+    std::atomic<bool> invalidWorker(false);
+    for(int itr = 0; itr < 3; itr++){
+        pool.parallelFor(NUM_TASK, [&](int task, int worker){
+            counts.at(task)++;
+            if(worker < 0 || NUM_THREAD <= worker){
+                invalidWorker = true;
+            }
+        });
+    }
+    for(const auto& count : counts){
+        EXPECT_EQ(3, count);
+    }
+    EXPECT_FALSE(invalidWorker);
+}